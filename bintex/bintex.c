@@ -26,6 +26,7 @@
 
 #include "bintex.h"
 #include <string.h>
+#include <stdlib.h>
 
 
 #define IS_WHITESPACE(VAL)  ((VAL==' ')||(VAL=='\r')||(VAL=='\n')||(VAL=='\t'))
@@ -155,44 +156,542 @@ int bintex_iter_sq(unsigned char **string, ot_queue* msg, int size) {
 }
 
 int bintex_ss(unsigned char *string, unsigned char* stream_out, int size) {
-    ot_queue local;
-    
-    q_init(&local, stream_out, size);
-    
-    while (1) {
-        int test;
-        
-        test    = bintex_iter_sq(&string, &local, size);
-        size   -= test;
-        if (test < 0) break;
-        
-#       ifdef DEBUG_ON
-        {
-            int i;
-            uint8_t* s;
-            fprintf(stdout, "Data written to queue\n");
-            
-            for (s=(local.putcursor-test), i=0; s<local.putcursor; s++, i++) {
-                if ((i & 3) == 0) {
-                    fprintf(stdout, "%04X: ", (uint16_t)s);
-                }
-                fprintf(stdout, "%02X ", *s);
-                if ((i & 3) == 3) {
-                    fputc('\n', stdout);
+    return bintex_parse((const char*)string, (int)strlen((const char*)string), stream_out, size, NULL);
+}
+
+
+
+
+/** Reentrant parser <BR>
+  * =======================================================================<BR>
+  * Same grammar and same output as the stream parser above, but all the
+  * state is held in a cursor owned by the caller: characters are fetched
+  * inline from the input span, and every output byte is bounds-checked.
+  */
+
+typedef struct {
+    const char*     text;
+    const char*     cursor;
+    const char*     end;
+    uint8_t*        out;
+    uint8_t*        putcursor;
+    uint8_t*        outend;
+    int             error;
+    int             errpos;
+} bt_cursor;
+
+
+// Next character, -1 at the end of the span (or at a null character)
+static inline int bt_getc(bt_cursor* c) {
+    if (c->cursor < c->end) {
+        int next = (unsigned char)*c->cursor++;
+        if (next != 0)
+            return next;
+    }
+    return -1;
+}
+
+static inline int bt_pos(bt_cursor* c) {
+    return (int)(c->cursor - c->text);
+}
+
+static void bt_fail(bt_cursor* c, int error, int pos) {
+    if (c->error == BINTEX_OK) {
+        c->error    = error;
+        c->errpos   = pos;
+    }
+}
+
+static inline void bt_put(bt_cursor* c, uint8_t byte) {
+    if (c->putcursor < c->outend)
+        *c->putcursor++ = byte;
+    else
+        bt_fail(c, BINTEX_ERR_OVERFLOW, bt_pos(c));
+}
+
+static inline int bt_hexval(int input) {
+    switch (input) {
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return input - '0';
+        case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+            return input - ('a' - 10);
+        case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+            return input - ('A' - 10);
+    }
+    return 0;   // invalid characters are converted to 0
+}
+
+
+// Buffers one number token, up to whitespace or a block end. *closed is set
+// when the token ends a block (or the input).
+static int bt_token(bt_cursor* c, char* buf, int limit, int* closed) {
+    int digits = 0;
+    *closed = 0;
+
+    while (digits < limit) {
+        int next = bt_getc(c);
+
+        buf[digits] = (char)next;
+        switch (next) {
+            case -1:
+            case ')':
+            case ']':   *closed = 1;
+                        return digits;
+            case ' ':
+            case '\r':
+            case '\n':
+            case '\t':  return digits;
+        }
+        digits++;
+    }
+    buf[digits] = 0;
+    return digits;
+}
+
+
+static void bt_comment(bt_cursor* c) {
+    int next;
+    do {
+        next = bt_getc(c);
+    } while ((next >= 0) && (next != '\n'));
+}
+
+
+static void bt_ascii(bt_cursor* c) {
+    int start = bt_pos(c) - 1;
+
+    while (c->error == BINTEX_OK) {
+        int next = bt_getc(c);
+
+        switch (next) {
+            case -1:    bt_fail(c, BINTEX_ERR_UNTERMINATED, start);
+                        return;
+            case '"':   return;
+            case '\\':
+                switch (bt_getc(c)) {
+                    case 'a':   next = '\a';    break;
+                    case '\\':  next = '\\';    break;
+                    case 'b':   next = '\b';    break;
+                    case 'r':   next = '\r';    break;
+                    case '"':   next = '\"';    break;
+                    case 'f':   next = '\f';    break;
+                    case 't':   next = '\t';    break;
+                    case 'n':   next = '\n';    break;
+                    case '0':   next = '\0';    break;
+                    case '\'':  next = '\'';    break;
+                    case 'v':   next = '\v';    break;
+                    case '?':   next = '\?';    break;
+                    // unknown escapes output the backslash, as bintex_ss()
                 }
-            } 
-    
-            if ((i & 3) != 0) {
-                fputc('\n', stdout);
+                break;
+        }
+        bt_put(c, (uint8_t)next);
+    }
+}
+
+
+static int bt_hexnum(bt_cursor* c) {
+    char    buf[33];
+    int     closed;
+    int     i       = 0;
+    int     digits  = bt_token(c, buf, 32, &closed);
+
+    if (digits & 1) {
+        bt_put(c, (uint8_t)bt_hexval(buf[i++]));
+    }
+    while (i < digits) {
+        int byte    = bt_hexval(buf[i++]) << 4;
+        byte       |= bt_hexval(buf[i++]);
+        bt_put(c, (uint8_t)byte);
+    }
+    return closed;
+}
+
+
+static void bt_binnum(bt_cursor* c) {
+    char    buf[33];
+    int     closed;
+    int     i       = 0;
+    int     digits  = bt_token(c, buf, 32, &closed);
+    int     shift   = (digits & 7);
+    uint8_t byte    = 0;
+
+    do {
+        while (shift > 0) {
+            shift--;
+            byte |= (buf[i++] & 1) << shift;    // '0' = 48, '1' = 49
+        }
+        if (i != 0) {
+            bt_put(c, byte);
+        }
+        shift   = 8;
+        byte    = 0;
+    }
+    while (i < digits);
+}
+
+
+static int bt_decnum(bt_cursor* c) {
+    char    buf[16];
+    int     closed;
+    int     sign    = 1;
+    int     force_u = 0;
+    int     number  = 0;
+    int     i       = 0;
+    int     size    = 0;
+    int     digits  = bt_token(c, buf, 15, &closed);
+
+    if (buf[i] == '-') {
+        i++;
+        sign = -1;
+    }
+
+    while (i < digits) {
+        if ((buf[i] >= '0') && (buf[i] <= '9')) {
+            number *= 10;
+            number += (buf[i++] - '0');
+        }
+        else {
+            force_u = (buf[i] == 'u');
+            i      += force_u;
+
+            if (buf[i] == 'c')      size = 1;
+            else if (buf[i] == 's') size = 2;
+            else if (buf[i] == 'l') size = 3;
+            break;
+        }
+    }
+
+    if (size == 0) {
+        static const int bound[] = {128, 256, 32768, 65536, 0, 0};
+        int j;
+        int max = number - (sign < 0);
+
+        for (j=force_u, size=1;  ; j+=2, size++) {
+            if ((bound[j]==0) || (bound[j]>=max)) break;
+        }
+    }
+
+    number *= sign;
+
+    switch (size & 3) {
+        case 0:
+        case 1: bt_put(c, (uint8_t)number);
+                break;
+
+        case 2: bt_put(c, (uint8_t)(number >> 8));
+                bt_put(c, (uint8_t)number);
+                break;
+
+        case 3: bt_put(c, (uint8_t)(number >> 24));
+                bt_put(c, (uint8_t)(number >> 16));
+                bt_put(c, (uint8_t)(number >> 8));
+                bt_put(c, (uint8_t)number);
+                break;
+    }
+    return closed;
+}
+
+
+int bintex_parse(const char* text, int length, unsigned char* stream_out, int size, bintex_status* status) {
+    bt_cursor c;
+
+    c.text      = text;
+    c.cursor    = text;
+    c.end       = text + ((length > 0) ? length : 0);
+    c.out       = stream_out;
+    c.putcursor = stream_out;
+    c.outend    = stream_out + ((size > 0) ? size : 0);
+    c.error     = BINTEX_OK;
+    c.errpos    = 0;
+
+    while (c.error == BINTEX_OK) {
+        int next = bt_getc(&c);
+
+        switch (next) {
+            case '\n':  // Bypass whitespace,
+            case '\r':
+            case '\t':
+            case ' ':
+            case '0':   // and leading 0's (in case person uses "0x")
+                continue;
+
+            case '#':   bt_comment(&c);                         continue;
+            case '"':   bt_ascii(&c);                           continue;
+            case 'b':   bt_binnum(&c);                          continue;
+            case 'x':   bt_hexnum(&c);                          continue;
+            case 'd':   bt_decnum(&c);                          continue;
+            case '[':   while (!bt_hexnum(&c) && !c.error) {}   continue;
+            case '(':   while (!bt_decnum(&c) && !c.error) {}   continue;
+
+            case ';':   // end of statement
+            case -1:    break;
+
+            default:    bt_fail(&c, BINTEX_ERR_SYNTAX, bt_pos(&c) - 1);
+                        break;
+        }
+        break;
+    }
+
+    if (status != NULL) {
+        status->error   = c.error;
+        status->offset  = (c.error == BINTEX_OK) ? bt_pos(&c) : c.errpos;
+    }
+    return (int)(c.putcursor - c.out);
+}
+
+
+
+
+/** Encoder <BR>
+  * =======================================================================<BR>
+  */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Character classes: 0 = binary, 1 = printable, else the escape letter
+static const char bt_enc_class[256] = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   't', 'n', 0,   0,   'r', 0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    1,   1,   '"', 1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   '\\',1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   0
+};
+
+static const char bt_hexdigit[] = "0123456789ABCDEF";
+
+
+int bintex_encode_size(int length) {
+    // worst case is the decimal block: "255u " per byte
+    return (5 * length) + 16;
+}
+
+
+// 8 bytes -> 16 hex characters
+static inline char* bt_enc_hex8(char* out, const unsigned char* in) {
+#if defined(__SSE2__)
+    __m128i v   = _mm_loadl_epi64((const __m128i*)in);
+    __m128i mask= _mm_set1_epi8(0x0F);
+    __m128i hi  = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo  = _mm_and_si128(v, mask);
+    __m128i x   = _mm_unpacklo_epi8(hi, lo);
+    __m128i af  = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(9)), _mm_set1_epi8('A'-'0'-10));
+    x           = _mm_add_epi8(_mm_add_epi8(x, _mm_set1_epi8('0')), af);
+    _mm_storeu_si128((__m128i*)out, x);
+#else
+    int i;
+    for (i=0; i<8; i++) {
+        out[2*i]    = bt_hexdigit[in[i] >> 4];
+        out[2*i+1]  = bt_hexdigit[in[i] & 15];
+    }
+#endif
+    return out + 16;
+}
+
+
+static char* bt_enc_hexblock(char* out, const unsigned char* in, int length) {
+    *out++ = '[';
+    while (length >= 8) {
+        out     = bt_enc_hex8(out, in);
+        in     += 8;
+        length -= 8;
+        *out++  = ' ';
+    }
+    while (length-- > 0) {
+        *out++  = bt_hexdigit[*in >> 4];
+        *out++  = bt_hexdigit[*in++ & 15];
+    }
+    if (out[-1] == ' ')
+        out--;
+    *out++ = ']';
+    return out;
+}
+
+
+static char* bt_enc_decblock(char* out, const unsigned char* in, int length) {
+    *out++ = '(';
+    while (length-- > 0) {
+        int byte = *in++;
+        if (byte >= 100)    *out++ = '0' + (byte / 100);
+        if (byte >= 10)     *out++ = '0' + (byte / 10) % 10;
+        *out++ = '0' + (byte % 10);
+        if (byte >= 128)    *out++ = 'u';   // else it would be a 16 bit number
+        *out++ = ' ';
+    }
+    out[-1] = ')';
+    return out;
+}
+
+
+static char* bt_enc_string(char* out, const unsigned char* in, int length) {
+    *out++ = '"';
+    while (length-- > 0) {
+        char c = bt_enc_class[*in];
+        if (c == 1) {
+            *out++ = *in;
+        }
+        else {
+            *out++ = '\\';
+            *out++ = c;
+        }
+        in++;
+    }
+    *out++ = '"';
+    return out;
+}
+
+
+int bintex_encode(const unsigned char* data, int length, char* text_out, int size, int flags) {
+    char*   out     = text_out;
+    int     start   = 0;    // start of the pending binary part
+    int     i       = 0;
+
+    if (size < bintex_encode_size(length)) {
+        return BINTEX_ERR_OVERFLOW;
+    }
+
+    while (i < length) {
+        int run = 0;
+
+        while (((i+run) < length) && bt_enc_class[data[i+run]]) {
+            run++;
+        }
+
+        if (run < BINTEX_ASCII_MIN) {
+            i += run + 1;   // short text stays in the binary part
+            continue;
+        }
+
+        if (i > start) {
+            if (out != text_out)
+                *out++ = ' ';
+            out = (flags & BINTEX_ENCODE_DECIMAL) ? \
+                    bt_enc_decblock(out, data+start, i-start) : \
+                    bt_enc_hexblock(out, data+start, i-start);
+        }
+        if (out != text_out)
+            *out++ = ' ';
+        out     = bt_enc_string(out, data+i, run);
+        i      += run;
+        start   = i;
+    }
+
+    if (length > start) {
+        if (out != text_out)
+            *out++ = ' ';
+        out = (flags & BINTEX_ENCODE_DECIMAL) ? \
+                bt_enc_decblock(out, data+start, length-start) : \
+                bt_enc_hexblock(out, data+start, length-start);
+    }
+
+    *out = 0;
+    return (int)(out - text_out);
+}
+
+
+
+
+// Throughput benchmark: build with -DBINTEX_BENCH
+// Parses a large generated document with the reentrant parser and with the
+// stream parser, and checks that both outputs are the same. Then encodes
+// mixed binary/text payloads and checks that they decode back unchanged.
+#ifdef BINTEX_BENCH
+#include <time.h>
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    static const char* tokens[] = {
+        "[0346 83c6 35 2b89 28a860f3] ", "(84 13 -93s 25026ul) ", "d-5930 ",
+        "x9933AABBCCDDEEFF ", "\"Blah blah\\n\" ", "b10110011 ", "# comment\n",
+        "[00112233445566778899aabbccddeeff 00112233445566778899aabbccddeeff] "
+    };
+    int             target  = (argc > 1) ? atoi(argv[1]) << 20 : (8 << 20);
+    char*           doc     = malloc(target + 128);
+    unsigned char*  out1    = malloc(target);
+    unsigned char*  out2    = malloc(target);
+    unsigned char*  cursor;
+    bintex_status   status;
+    ot_queue        q;
+    int             len     = 0;
+    int             n1, n2, i;
+    double          t;
+
+    srand(1);
+    while (len < target) {
+        const char* tok = tokens[rand() % 8];
+        int         l   = strlen(tok);
+        memcpy(doc+len, tok, l);
+        len += l;
+    }
+    doc[len] = 0;
+
+    t   = bench_now();
+    n1  = bintex_parse(doc, len, out1, target, &status);
+    t   = bench_now() - t;
+    printf("bintex_parse   : %d chars -> %d bytes, %.1f MB/s (status %d @ %d)\n",
+           len, n1, len / t / 1e6, status.error, status.offset);
+
+    cursor = (unsigned char*)doc;
+    q_init(&q, out2, 0xFFFF);
+    q.back = out2 + target;
+    t   = bench_now();
+    while (bintex_iter_sq(&cursor, &q, target) >= 0) { }
+    t   = bench_now() - t;
+    n2  = q.putcursor - q.front;
+    printf("stream parser  : %d chars -> %d bytes, %.1f MB/s\n", len, n2, len / t / 1e6);
+
+    for (i=0; (i<n1) && (i<n2) && (out1[i]==out2[i]); i++) { }
+    printf("outputs %s\n", ((n1 == n2) && (i == n1)) ? "identical" : "DIFFER");
+
+    // Encoder round trip, on payloads mixing binary and text
+    {
+        static const char   words[] = "temperature=21.5 \"ok\" C:\\otcom\n\t";
+        int                 plen    = target / 4;
+        char*               text    = malloc(bintex_encode_size(plen));
+        int                 flags;
+
+        for (i=0; i<plen; ) {
+            if (rand() & 1) {
+                int l = rand() % (sizeof(words)-1);
+                while ((l-- > 0) && (i < plen))
+                    out1[i++] = words[l];
+            }
+            else {
+                out1[i++] = (unsigned char)rand();
             }
-            
-            fputc('\n', stdout);
         }
-#       endif
+
+        for (flags=0; flags<=BINTEX_ENCODE_DECIMAL; flags++) {
+            t   = bench_now();
+            n1  = bintex_encode(out1, plen, text, bintex_encode_size(plen), flags);
+            t   = bench_now() - t;
+            printf("bintex_encode%s: %d bytes -> %d chars, %.1f MB/s\n",
+                   flags ? " (dec)" : "      ", plen, n1, plen / t / 1e6);
+
+            n2  = bintex_parse(text, n1, out2, target, &status);
+            for (i=0; (i<plen) && (i<n2) && (out1[i]==out2[i]); i++) { }
+            printf("round trip %s\n", ((n2 == plen) && (i == plen)) ? "identical" : "DIFFER");
+        }
+        free(text);
     }
-    
-    return (local.putcursor - local.front);
+
+    free(doc);
+    free(out1);
+    free(out2);
+    return 0;
 }
+#endif
 
 
 
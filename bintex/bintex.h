@@ -153,12 +153,46 @@ int bintex_fs(FILE* file, unsigned char* stream_out, int size);
   * @ingroup BinTex
   * @sa bintex_fs()
   *
-  * @note bintex_ss() will increment the string pointer (*string)
+  * @note bintex_ss() is a wrapper of bintex_parse(), it is reentrant
   */
 int bintex_ss(unsigned char* string, unsigned char* stream_out, int size);
 
 
 
+/** @typedef bintex_status
+  * Result of bintex_parse(). On error, offset is the position of the
+  * offending character in the input, else it is the number of characters
+  * consumed (parsing also stops at the end of a statement, ';').
+  */
+#define BINTEX_OK               0
+#define BINTEX_ERR_SYNTAX       -2
+#define BINTEX_ERR_UNTERMINATED -4
+#define BINTEX_ERR_OVERFLOW     -5
+
+typedef struct {
+    int     error;
+    int     offset;
+} bintex_status;
+
+
+
+/** @brief  Reentrant parse of a Bintex span, outputting binary to stream
+  * @param  text        (const char*) input text, need not be null-terminated
+  * @param  length      (int) number of characters in text
+  * @param  stream_out  (unsigned char*) byte-wise, binary output stream
+  * @param  size        (int) allocation limit of stream_out
+  * @param  status      (bintex_status*) error code and offset, may be NULL
+  * @retval (int)       number of bytes output to stream (up to the error, if any)
+  * @ingroup BinTex
+  * @sa bintex_ss()
+  *
+  * bintex_parse() uses no global state and never writes past size, so it can
+  * be called from several threads at once. Output is the same as bintex_ss().
+  */
+int bintex_parse(const char* text, int length, unsigned char* stream_out, int size, bintex_status* status);
+
+
+
 /** @brief  Iteratively parses a Bintex File, outputting to persistent Queue
   * @param  file        (FILE*) input file, nominally encoded as UTF-8
   * @param  msg         (Queue*) output Queue of binary datastream
@@ -191,6 +225,31 @@ int bintex_iter_sq(unsigned char** string, ot_queue* msg, int size);
 
 
 
+/** @brief  Encode binary data as canonical BinTex text
+  * @param  data        (const unsigned char*) binary input
+  * @param  length      (int) number of bytes in data
+  * @param  text_out    (char*) output text, null-terminated
+  * @param  size        (int) allocation of text_out, at least bintex_encode_size()
+  * @param  flags       (int) BINTEX_ENCODE_x options, 0 for the default
+  * @retval (int)       number of characters output (without the null), or
+  *                     BINTEX_ERR_OVERFLOW if size is below bintex_encode_size()
+  * @ingroup BinTex
+  *
+  * Runs of at least BINTEX_ASCII_MIN printable characters are written as
+  * quoted strings, everything else as hex blocks of 8-byte groups:
+  * [0011223344556677 8899AABB] "text\n" [00]
+  * With BINTEX_ENCODE_DECIMAL, the binary parts are written as a decimal
+  * block instead: (0 17 34 200u). The output parses back to the same bytes
+  * with bintex_parse() / bintex_ss().
+  */
+#define BINTEX_ASCII_MIN        4
+#define BINTEX_ENCODE_DECIMAL   1
+
+int bintex_encode(const unsigned char* data, int length, char* text_out, int size, int flags);
+int bintex_encode_size(int length);
+
+
+
 // Input Parser Tester
 #ifdef DEBUG_ON
 int main(int argc, char** argv);
@@ -4,6 +4,7 @@ INCLUDEPATH += . ./bintex/
 unix:DESTDIR = ../bin
 QT += qt3support network
 linux-g++:LIBS += -lusb
+LIBS += -lz
 windows:CONFIG += console
 
 # Version make rules
@@ -0,0 +1,286 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_autobaud.cpp
+/// @brief          Baud rate detection
+//
+/// =========================================================================
+
+#include "otc_main.h"
+#include "otc_serial.h"
+#include "otc_mpipe.h"
+#include "otc_autobaud.h"
+
+
+// Rates after the current one, most used first
+static const int otcAutobaudRates[] = {
+    115200, 921600, 460800, 230400, 57600, 38400, 19200, 9600,
+    1000000, 2000000, 3000000, 1500000
+};
+
+
+otcAutobaud::otcAutobaud()
+{
+    m_running       = FALSE;
+    m_index         = 0;
+    m_previous      = 0;
+    m_fill          = -1;
+    m_best          = 0;
+    m_bestFrames    = 0;
+    m_bestSyncs     = 0;
+    m_runs          = 0;
+    m_result        = 0;
+    m_frames        = 0;
+    m_tried         = 0;
+    m_stopped       = FALSE;
+    m_time          = 0;
+}
+
+/** @brief  Starts a detection, stepped by the device treatment thread
+  * @param  current (int) rate of the link, tried first and set back if no rate is found
+  * @retval (bool)  FALSE if a detection is already running
+  */
+bool otcAutobaud::start(int current)
+{
+    m_mutex.lock();
+    if (m_running)
+    {
+        m_mutex.unlock();
+        return FALSE;
+    }
+
+    m_rates.clear();
+    m_rates.append(current);
+    for (unsigned int i=0; i<sizeof(otcAutobaudRates)/sizeof(otcAutobaudRates[0]); i++)
+    {
+        if ((otcAutobaudRates[i] != current) && otc_serial::validBaudrate(otcAutobaudRates[i]))
+            m_rates.append(otcAutobaudRates[i]);
+    }
+
+    m_previous      = current;
+    m_index         = 0;
+    m_fill          = -1;
+    m_best          = 0;
+    m_bestFrames    = 0;
+    m_bestSyncs     = 0;
+    m_tried         = 0;
+    m_stopped       = FALSE;
+    m_clock.start();
+    m_running       = TRUE;
+    m_mutex.unlock();
+
+    otcConfig::logText("Looking for the baud rate of the device...");
+    return TRUE;
+}
+
+/** @brief  Ends a detection, when the rate is set or the link closed meanwhile
+  * @param  rate    (int) rate the link is left at
+  *
+  * The device treatment thread ends it at its next step. Can be called from
+  * any thread.
+  */
+void otcAutobaud::stop(int rate)
+{
+    m_mutex.lock();
+    if (m_running)
+    {
+        m_index     = m_rates.count();
+        m_previous  = rate;
+        m_stopped   = TRUE;
+    }
+    m_mutex.unlock();
+}
+
+/** @brief  Scores a sample: sync words of whole records, and good CRC records
+  * @param  data    (const unsigned char*) bytes read
+  * @param  len     (int) number of bytes
+  * @param  syncs   (int&) sync words starting a record which fits in the sample
+  * @retval (int)   records with a good CRC
+  */
+int otcAutobaud::score(const unsigned char* data, int len, int& syncs)
+{
+    int frames = 0;
+
+    syncs = 0;
+
+    for (int i=0; i+1 < len; )
+    {
+        if ((data[i] != OTC_MPIPE_SYNC_BYTE_0) || (data[i+1] != OTC_MPIPE_SYNC_BYTE_1))
+        {
+            i++;
+            continue;
+        }
+
+        // A record cut by the end of the sample is not counted
+        if (len - i < OTC_MPIPE_HEADER_SIZE)
+            break;
+
+        // Or a false sync: the next one may start a whole record
+        int end = i + OTC_MPIPE_HEADER_SIZE + (((int)data[i+4] << 8) | data[i+5]);
+        if (end > len)
+        {
+            i += 2;
+            continue;
+        }
+
+        // CRC of everything after the CRC field
+        unsigned short crc = 0xFFFF;
+        for (int c = i+4; c < end; c++)
+            crc = (crc << 8) ^ crcLut[((crc >> 8) & 0xff) ^ data[c]];
+
+        syncs++;
+        if (crc == (((unsigned short)data[i+2] << 8) | data[i+3]))
+        {
+            frames++;
+            i = end;
+        }
+        else
+            i += 2;
+    }
+
+    return frames;
+}
+
+/** @brief  Samples the current rate, or goes to the next one
+  * @param  device  (otcCommunicationLinkDevice&) link, read instead of the data parser
+  * @retval (bool)  TRUE once the detection is done (at this step)
+  *
+  * Does not wait for the bytes: the caller does, as for the data parser.
+  */
+bool otcAutobaud::step(otcCommunicationLinkDevice& device)
+{
+    if (!m_running)
+        return FALSE;
+
+    m_mutex.lock();
+    bool over = (m_index >= m_rates.count()) || (m_clock.elapsed() >= OTC_AUTOBAUD_TIMEOUT) || !device.isOpen();
+    int  rate = over ? 0 : m_rates[m_index];
+    m_mutex.unlock();
+
+    if (over)
+    {
+        finish(device);
+        return TRUE;
+    }
+
+    // Next rate: the bytes read at the previous one are dropped
+    if (m_fill < 0)
+    {
+        if (!device.changeBaudRate(rate))
+        {
+            m_mutex.lock();
+            m_index++;
+            m_mutex.unlock();
+            return FALSE;
+        }
+        device.flush();
+        m_fill = 0;
+        m_sample.start();
+    }
+
+    int read = device.readBlock(m_buffer + m_fill, OTC_AUTOBAUD_BYTES - m_fill);
+    if (read > 0)
+        m_fill += read;
+
+    if ((m_fill < OTC_AUTOBAUD_BYTES) && (m_sample.elapsed() < OTC_AUTOBAUD_SAMPLE))
+        return FALSE;
+
+    int syncs;
+    int frames = score(m_buffer, m_fill, syncs);
+
+    m_mutex.lock();
+    m_tried++;
+    if (frames > m_bestFrames)
+    {
+        m_best          = rate;
+        m_bestFrames    = frames;
+        m_bestSyncs     = syncs;
+    }
+
+    // Locked: no need to try the others
+    if ((frames >= OTC_AUTOBAUD_LOCK) && (2 * frames >= syncs))
+        m_index = m_rates.count();
+    else
+        m_index++;
+    m_fill = -1;
+    m_mutex.unlock();
+
+    return FALSE;
+}
+
+// Sets the best rate found, or the previous one
+void otcAutobaud::finish(otcCommunicationLinkDevice& device)
+{
+    m_mutex.lock();
+    m_result    = ((m_bestFrames > 0) && !m_stopped) ? m_best : 0;
+    m_frames    = m_bestFrames;
+    m_time      = m_clock.elapsed();
+    m_runs++;
+    bool stopped    = m_stopped;
+    int  previous   = m_previous;
+    m_mutex.unlock();
+
+    if (device.isOpen())
+    {
+        device.changeBaudRate(m_result ? m_result : previous);
+        device.flush();
+    }
+
+    if (stopped)
+        otcConfig::logText(QString("Baud rate detection stopped, %1 kept").arg(previous));
+    else if (m_result)
+        otcConfig::logText(QString("Baud rate of the device: %1 (%2 good frames of %3, %4 ms)")
+                                .arg(m_result).arg(m_bestFrames).arg(m_bestSyncs).arg(m_time));
+    else
+        otcConfig::logText(QString("<font color=red>**No frame from the device at any baud rate, %1 kept</font>")
+                                .arg(previous));
+
+    m_running = FALSE;
+}
+
+/** @brief  Rate found by the last detection
+  * @retval (int)   baud rate, 0 if none was found
+  */
+int otcAutobaud::result()
+{
+    m_mutex.lock();
+    int ret = m_result;
+    m_mutex.unlock();
+    return ret;
+}
+
+QString otcAutobaud::getStatus()
+{
+    QString ret;
+
+    m_mutex.lock();
+    if (m_running)
+        ret = QString("Autobaud: running, %1 of %2 rates tried.\n").arg(m_tried).arg(m_rates.count());
+    else if (m_runs == 0)
+        ret = QString("Autobaud: never run.\n");
+    else
+        ret = QString("Autobaud: %1 runs, last %2 (%3 good frames, %4 rates tried in %5 ms).\n")
+                    .arg(m_runs)
+                    .arg(m_result ? QString("found %1 baud").arg(m_result) : QString("found nothing"))
+                    .arg(m_frames).arg(m_tried).arg(m_time);
+    m_mutex.unlock();
+
+    return ret;
+}
@@ -0,0 +1,112 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_autobaud.h
+/// @brief          Baud rate detection
+///                 Finds the rate of a device from the frames it sends
+//
+/// =========================================================================
+///
+/// The rates are tried in order of likelihood: the current one, then the
+/// usual rates of the firmwares. At each rate the driver is flushed and the
+/// bytes of the device are sampled for OTC_AUTOBAUD_SAMPLE (or until
+/// OTC_AUTOBAUD_BYTES are read). The sample is scored like the MPIPE parser
+/// reads it: every 0xFF55 sync word starting a whole record, and the records
+/// among them with a good CRC. At a wrong rate the bytes are noise, a good
+/// CRC comes once in 65536 syncs.
+///
+/// A rate is locked at once when OTC_AUTOBAUD_LOCK records of the sample
+/// have a good CRC, and at least half of its syncs. Else every rate is tried
+/// (OTC_AUTOBAUD_TIMEOUT at most) and the one with most good records wins.
+/// When no rate gives one, the previous rate is set back. A rate set by hand,
+/// or a link closed, during the detection ends it (stop()).
+///
+/// The detection is stepped by the device treatment thread: the samples do
+/// not reach the parser, the socket clients nor the window, and the writes
+/// wait until it is done.
+///
+/// =========================================================================
+
+#ifndef __OTC_AUTOBAUD_H__
+#define __OTC_AUTOBAUD_H__
+
+#include <qstring.h>
+#include <qlist.h>
+#include <qmutex.h>
+#include <qelapsedtimer.h>
+
+
+/// Time the bytes are sampled at each rate (ms)
+#define OTC_AUTOBAUD_SAMPLE                 250
+
+/// Bytes sampled at each rate, the sample ends when full
+#define OTC_AUTOBAUD_BYTES                  4096
+
+/// Good CRC records locking a rate without trying the others
+#define OTC_AUTOBAUD_LOCK                   3
+
+/// Longest detection, the best rate so far is taken after it (ms)
+#define OTC_AUTOBAUD_TIMEOUT                5000
+
+
+class otcCommunicationLinkDevice;
+
+
+class otcAutobaud
+{
+public :
+    otcAutobaud();
+
+    bool                    start(int current);
+    void                    stop(int rate);
+    bool                    running()       {return m_running;}
+    bool                    step(otcCommunicationLinkDevice& device);
+    int                     result();
+    QString                 getStatus();
+
+    static int              score(const unsigned char* data, int len, int& syncs);
+
+protected :
+    QMutex                  m_mutex;
+    volatile bool           m_running;
+    QElapsedTimer           m_clock;
+    QElapsedTimer           m_sample;
+    QList<int>              m_rates;
+    int                     m_index;        ///< rate sampled
+    int                     m_previous;     ///< rate set back when none is found
+    unsigned char           m_buffer[OTC_AUTOBAUD_BYTES];
+    int                     m_fill;         ///< -1: rate not set yet
+    int                     m_best;
+    int                     m_bestFrames;
+    int                     m_bestSyncs;
+    int                     m_tried;        ///< rates sampled
+    bool                    m_stopped;      ///< by stop(), m_previous is kept
+
+    // Last detection
+    unsigned int            m_runs;
+    int                     m_result;       ///< 0: no rate found
+    int                     m_frames;
+    qint64                  m_time;
+
+    void                    finish(otcCommunicationLinkDevice& device);
+};
+
+
+#endif // __OTC_AUTOBAUD_H__
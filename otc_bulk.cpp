@@ -0,0 +1,317 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_bulk.cpp
+/// @brief          Bulk file reader
+//
+/// =========================================================================
+
+#include <string.h>
+#include <qfile.h>
+#include <qtextdocument.h>
+
+#include "otc_main.h"
+#include "otc_alp.h"
+#include "otc_serial.h"
+#include "otc_scheduler.h"
+#include "otc_bulk.h"
+
+#include "bintex.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//           BULK FILE READER               //
+//                                          //
+// ---------------------------------------- //
+
+otcBulkReader::otcBulkReader(otcCommunicationLinkDevice* device)
+{
+    m_device    = device;
+    m_block     = OTC_ALP_CMD_FILE_ISFB;
+    m_id        = 0;
+    m_start     = 0;
+    m_end       = OTC_BULK_FILE_MAX;
+    m_sized     = FALSE;
+    m_good      = 0;
+    m_next      = 0;
+    m_window    = OTC_BULK_WINDOW;
+    m_page      = OTC_BULK_PAGE;
+    m_requests  = 0;
+    m_retries   = 0;
+    m_errors    = 0;
+    m_received  = 0;
+    m_failed    = FALSE;
+    m_running   = FALSE;
+}
+
+otcBulkReader::~otcBulkReader()
+{
+}
+
+// File to read. A length of 0 reads up to the end of the file. Without
+// output file, the data is printed in the log as BinTex.
+void otcBulkReader::setFile(unsigned char block, unsigned char id, int offset, int length, const QString& output)
+{
+    m_block     = block;
+    m_id        = id;
+    m_start     = offset;
+    m_end       = (length > 0) ? (int)qMin((qint64)offset + length, (qint64)OTC_BULK_FILE_MAX) : OTC_BULK_FILE_MAX;
+    m_sized     = (length > 0);
+    m_output    = output;
+}
+
+void otcBulkReader::setWindow(int window, int page)
+{
+    m_window    = (window > 0) ? window : 1;
+    m_page      = ((page > 0) && (page <= OTC_BULK_PAGE)) ? page : OTC_BULK_PAGE;
+}
+
+QString otcBulkReader::name()
+{
+    QString block = "ISFB";
+
+    if (m_block == OTC_ALP_CMD_FILE_GFB)
+        block = "GFB";
+    else if (m_block == OTC_ALP_CMD_FILE_ISFSB)
+        block = "ISFSB";
+
+    return QString("%1 %2").arg(block).arg(m_id, 2, 16, QChar('0'));
+}
+
+void otcBulkReader::stopRunning()
+{
+    m_mutex.lock();
+    m_running = FALSE;
+    m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+// Sends one RD_DATA request. Must be called with m_mutex held.
+void otcBulkReader::request(otcBulkRequest& r)
+{
+    unsigned char       body[5];
+    otc_mpipe_builder   msg;
+
+    body[0] = m_id;
+    body[1] = (r.offset >> 8) & 0xFF;
+    body[2] = r.offset & 0xFF;
+    body[3] = (r.length >> 8) & 0xFF;
+    body[4] = r.length & 0xFF;
+
+    msg.build(OTC_ALP_ID_FILE_DATA, OTC_ALP_RESP_REQ | m_block | OTC_ALP_CMD_FILE_RD_DATA,
+              otc_mpipe_builder::nextSeq(), OTC_MPIPE_SYNC_WORD_CHUNK_NO, body, sizeof(body));
+
+    m_device->queueBlock(OTC_WRITE_SOURCE_BULK, OTC_WRITE_PRIO_BULK, (char*)msg.start(), msg.len());
+    r.sent = m_clock.nsecsElapsed() / 1000;
+    m_requests++;
+}
+
+// The file ends at end: requests beyond are forgotten. Must be called with
+// m_mutex held.
+void otcBulkReader::truncate(int end)
+{
+    m_end  = end;
+    m_next = m_end;
+    for (int j=m_pending.count()-1; j>=0; j--)
+    {
+        if (m_pending[j].offset >= m_end)
+            m_pending.removeAt(j);
+    }
+}
+
+// Requests without response in time are sent again. Must be called with
+// m_mutex held.
+void otcBulkReader::expire()
+{
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    for (int i=0; i<m_pending.count(); i++)
+    {
+        otcBulkRequest& r = m_pending[i];
+
+        if ((now - r.sent) <= (qint64)OTC_BULK_TIMEOUT * 1000)
+            continue;
+
+        if (r.retries >= OTC_BULK_RETRIES)
+        {
+            otcConfig::logText(QString("<font color=red>**Dump %1: no response at offset %2</font>")
+                                    .arg(name()).arg(r.offset));
+            m_failed  = TRUE;
+            m_running = FALSE;
+            return;
+        }
+
+        r.retries++;
+        m_retries++;
+        request(r);
+    }
+}
+
+void otcBulkReader::run()
+{
+    m_mutex.lock();
+    m_running   = TRUE;
+    m_failed    = FALSE;
+    m_next      = m_start;
+    m_good      = m_start;
+    m_received  = 0;
+    m_requests  = 0;
+    m_retries   = 0;
+    m_errors    = 0;
+    m_pending.clear();
+    m_data.fill(0, m_end - m_start);
+    m_clock.start();
+
+    while (m_running)
+    {
+        // Fill the window with the next pages
+        while ((m_pending.count() < m_window) && (m_next < m_end))
+        {
+            otcBulkRequest r;
+            r.offset    = m_next;
+            r.length    = ((m_end - m_next) < m_page) ? (m_end - m_next) : m_page;
+            r.retries   = 0;
+            request(r);
+            m_pending.append(r);
+            m_next     += r.length;
+        }
+
+        if (m_pending.isEmpty() && (m_next >= m_end))
+            break;
+
+        m_wait.wait(&m_mutex, OTC_BULK_POLL);
+        expire();
+    }
+
+    bool done = m_running && !m_failed;
+
+    m_running = FALSE;
+    m_pending.clear();
+    m_data.resize(m_end - m_start);
+    m_mutex.unlock();
+
+    if (done)
+        report(m_clock.nsecsElapsed() / 1000);
+    else if (!m_failed)
+        otcConfig::logText(QString("<font color=red>Dump %1 stopped</font>").arg(name()));
+}
+
+// Called by the MPIPE parser for every valid record from the device.
+// RTN_DATA body: file ID, offset (2), length (2), data.
+void otcBulkReader::received(unsigned char, unsigned char id, unsigned char cmd, const unsigned char* data, int len)
+{
+    if ((id != OTC_ALP_ID_FILE_DATA) || ((cmd & 0x30) != m_block) || (len < 1) || (data[0] != m_id))
+        return;
+
+    m_mutex.lock();
+
+    if ((cmd & 0x0F) == OTC_ALP_CMD_FILE_RTN_ERROR)
+    {
+        m_errors++;
+
+        // The error does not tell its offset. Without length, when the first
+        // request outstanding starts at or after the last page read, the file
+        // ends there. Else the requests concerned will time out and be sent
+        // again.
+        int first = m_next;
+        for (int i=0; i<m_pending.count(); i++)
+        {
+            if (m_pending[i].offset < first)
+                first = m_pending[i].offset;
+        }
+
+        if (!m_sized && !m_pending.isEmpty() && (first >= m_good))
+        {
+            if (first == m_start)
+            {
+                otcConfig::logText(QString("<font color=red>**Dump %1: error response at offset %2</font>")
+                                        .arg(name()).arg(first));
+                m_failed  = TRUE;
+                m_running = FALSE;
+            }
+            else
+                truncate(first);
+            m_wait.wakeOne();
+        }
+    }
+    else if (((cmd & 0x0F) == OTC_ALP_CMD_FILE_RTN_DATA) && (len >= 5))
+    {
+        int offset  = (data[1] << 8) | data[2];
+        int length  = (data[3] << 8) | data[4];
+
+        if (length > len - 5)
+            length = len - 5;
+
+        for (int i=0; i<m_pending.count(); i++)
+        {
+            otcBulkRequest r = m_pending[i];
+
+            if (r.offset != offset)
+                continue;
+
+            if (length > r.length)
+                length = r.length;
+
+            memcpy(m_data.data() + (offset - m_start), data + 5, length);
+            m_received += length;
+            m_pending.removeAt(i);
+
+            if (offset + length > m_good)
+                m_good = offset + length;
+
+            // Short or empty page: this is the end of the file
+            if (length < r.length)
+                truncate(offset + length);
+
+            m_wait.wakeOne();
+            break;
+        }
+    }
+
+    m_mutex.unlock();
+}
+
+void otcBulkReader::report(qint64 total)
+{
+    int     size    = m_data.size();
+    double  ms      = total / 1000.0;
+
+    otcConfig::logText(QString("Dump %1: %2 bytes from offset %3 in %4 ms (%5 kB/s), %6 requests, %7 retries, %8 errors")
+                            .arg(name()).arg(size).arg(m_start)
+                            .arg(ms, 0, 'f', 1)
+                            .arg((ms > 0) ? (size / ms) : 0.0, 0, 'f', 2)
+                            .arg(m_requests).arg(m_retries).arg(m_errors));
+
+    if (!m_output.isEmpty())
+    {
+        QFile f(m_output);
+        if (!f.open(QIODevice::WriteOnly) || (f.write(m_data) != size))
+            otcConfig::logText(QString("<font color=red>**Cannot write %1</font>").arg(m_output));
+        else
+            otcConfig::logText(QString("Dump %1 written to %2").arg(name()).arg(m_output));
+        return;
+    }
+
+    QByteArray text(bintex_encode_size(size), 0);
+    int n = bintex_encode((const unsigned char*)m_data.constData(), size, text.data(), text.size(), 0);
+    if (n >= 0)
+        otcConfig::logText(Qt::escape(QString::fromLatin1(text.constData(), n)));
+}
@@ -0,0 +1,132 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_bulk.h
+/// @brief          Bulk file reader
+///                 Dumps a device file with pipelined ALP file data reads
+//
+/// =========================================================================
+///
+/// The file is read in pages. Up to "window" RD_DATA requests are on the
+/// link at the same time, each for the next page not yet requested. A
+/// RTN_DATA response is matched on its file ID and offset, so responses can
+/// come back in any order. A request without response in time is sent again,
+/// and the dump fails when a page is still missing after the last retry.
+///
+/// When the length of the file is not given, the dump ends with the first
+/// response shorter than its page (an empty one included), or with the first
+/// RTN_ERROR once the pages before the requests outstanding are all read: a
+/// file whose size is a multiple of the page ends there. Requests beyond the
+/// end are forgotten.
+///
+/// =========================================================================
+
+#ifndef __OTC_BULK_H__
+#define __OTC_BULK_H__
+
+#include <qstring.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qlist.h>
+#include <qbytearray.h>
+#include <qelapsedtimer.h>
+#include <QWaitCondition>
+
+#include "otc_mpipe.h"
+
+
+class otcCommunicationLinkDevice;
+
+
+/// Bytes per request: the RTN_DATA header (5 bytes) and the page fit a record
+#define OTC_BULK_PAGE                       250
+
+/// Requests on the link at the same time
+#define OTC_BULK_WINDOW                     4
+
+/// Time after which a request is sent again (ms)
+#define OTC_BULK_TIMEOUT                    1000
+
+/// Number of times a request is sent again before the dump fails
+#define OTC_BULK_RETRIES                    3
+
+/// How often the reader checks for timeouts (ms)
+#define OTC_BULK_POLL                       20
+
+/// Largest file the 16 bit offsets of the ALP file commands can reach
+#define OTC_BULK_FILE_MAX                   0x10000
+
+
+class otcBulkRequest
+{
+public :
+    int                     offset;
+    int                     length;
+    int                     retries;
+    qint64                  sent;       ///< us
+};
+
+
+class otcBulkReader : public QThread, public otc_mpipe_listener
+{
+public :
+    otcBulkReader(otcCommunicationLinkDevice* device);
+    ~otcBulkReader();
+
+    void                    setFile(unsigned char block, unsigned char id, int offset, int length, const QString& output);
+    void                    setWindow(int window, int page);
+    QString                 name();
+
+    void                    run();
+    void                    stopRunning();
+    void                    received(unsigned char seq, unsigned char id, unsigned char cmd, const unsigned char* data, int len);
+
+protected :
+    otcCommunicationLinkDevice* m_device;
+    QMutex                  m_mutex;
+    QWaitCondition          m_wait;
+    QElapsedTimer           m_clock;
+    QList<otcBulkRequest>   m_pending;
+    QByteArray              m_data;
+    QString                 m_output;
+    unsigned char           m_block;
+    unsigned char           m_id;
+    int                     m_start;
+    int                     m_end;
+    bool                    m_sized;    ///< length given, else read up to the end
+    int                     m_good;     ///< end of the last page read
+    int                     m_next;
+    int                     m_window;
+    int                     m_page;
+    unsigned int            m_requests;
+    unsigned int            m_retries;
+    unsigned int            m_errors;
+    int                     m_received;
+    bool                    m_failed;
+    bool                    m_running;
+
+    void                    request(otcBulkRequest& r);
+    void                    expire();
+    void                    truncate(int end);
+    void                    report(qint64 total);
+};
+
+
+#endif // __OTC_BULK_H__
@@ -0,0 +1,386 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_capture.cpp
+/// @brief          Capture writer
+//
+/// =========================================================================
+
+#include <string.h>
+#include <zlib.h>
+#include <qdatetime.h>
+
+#include "otc_main.h"
+#include "otc_capture.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//           CAPTURE WRITER                 //
+//                                          //
+// ---------------------------------------- //
+
+QMutex  otcCaptureWriter::rotationMutex;
+qint64  otcCaptureWriter::maxSize   = OTC_CAPTURE_FILE_SIZE;
+int     otcCaptureWriter::maxAge    = OTC_CAPTURE_FILE_AGE;
+int     otcCaptureWriter::maxFiles  = OTC_CAPTURE_FILES;
+
+static void put32(char* p, quint32 v)
+{
+    for (int i=0; i<4; i++)
+        p[i] = (char)(v >> (8*i));
+}
+
+static void put64(char* p, quint64 v)
+{
+    for (int i=0; i<8; i++)
+        p[i] = (char)(v >> (8*i));
+}
+
+otcCaptureWriter::otcCaptureWriter()
+{
+    m_open          = FALSE;
+    m_running       = FALSE;
+    m_offset        = 0;
+    m_dropped       = 0;
+    m_failed        = 0;
+    m_fileNumber    = 0;
+    m_blocks        = 0;
+    m_raw           = 0;
+    m_compressed    = 0;
+}
+
+otcCaptureWriter::~otcCaptureWriter()
+{
+    close();
+}
+
+/** @brief  Sets the rotation of the capture files, from any thread
+  * @param  size    (qint64) bytes of a file, unchanged if <= 0
+  * @param  age     (int) seconds of a file, unchanged if <= 0
+  * @param  files   (int) files kept, unchanged if <= 0
+  */
+void otcCaptureWriter::setRotation(qint64 size, int age, int files)
+{
+    rotationMutex.lock();
+    if (size > 0)
+        maxSize = size;
+    if (age > 0)
+        maxAge = age;
+    if (files > 0)
+        maxFiles = files;
+    rotationMutex.unlock();
+}
+
+void otcCaptureWriter::rotation(qint64& size, int& age, int& files)
+{
+    rotationMutex.lock();
+    size    = maxSize;
+    age     = maxAge;
+    files   = maxFiles;
+    rotationMutex.unlock();
+}
+
+/** @brief  Starts a capture
+  * @param  base    (const QString&) file name, completed with the date and the file number
+  */
+bool otcCaptureWriter::open(const QString& base)
+{
+    close();
+
+    m_mutex.lock();
+    m_base          = base;
+    m_offset        = 0;
+    m_dropped       = 0;
+    m_failed        = 0;
+    m_fileNumber    = 0;
+    m_raw           = 0;
+    m_compressed    = 0;
+    m_files.clear();
+    m_queue.clear();
+    m_current.data  = QByteArray();
+    m_current.stamps = QByteArray();
+    m_open          = TRUE;
+    m_running       = TRUE;
+    m_mutex.unlock();
+
+    start();
+    return TRUE;
+}
+
+// Writes what is left, then closes the last file
+void otcCaptureWriter::close()
+{
+    m_mutex.lock();
+    if (!m_open)
+    {
+        m_mutex.unlock();
+        return;
+    }
+    m_open = FALSE;
+    seal();
+    m_running = FALSE;
+    m_wait.wakeAll();
+    m_mutex.unlock();
+
+    wait();
+}
+
+// Hands the current block to the capture thread. Must be called with
+// m_mutex held.
+void otcCaptureWriter::seal()
+{
+    if (m_current.data.isEmpty())
+        return;
+
+    if (m_queue.count() >= OTC_CAPTURE_QUEUE)
+        m_dropped++;
+    else
+        m_queue.enqueue(m_current);
+
+    m_current.data   = QByteArray();
+    m_current.stamps = QByteArray();
+    m_wait.wakeOne();
+}
+
+/** @brief  Adds bytes read from the device, from the reader thread
+  * @param  data    (const unsigned char*) bytes
+  * @param  len     (int) number of bytes, nothing is done if <= 0
+  * @param  first   (qint64) arrival of the first byte, ns since 1970
+  * @param  byteTime (int) ns from one byte to the next
+  *
+  * Only copies: compression and disk writes are done by the capture thread.
+  */
+void otcCaptureWriter::write(const unsigned char* data, int len, qint64 first, int byteTime)
+{
+    if (len <= 0)
+        return;
+
+    m_mutex.lock();
+    if (!m_open)
+    {
+        m_mutex.unlock();
+        return;
+    }
+
+    while (len > 0)
+    {
+        if (m_current.data.isEmpty())
+        {
+            m_current.offset    = m_offset;
+            m_current.stamp     = first / 1000000;
+            m_current.data.reserve(OTC_CAPTURE_BLOCK);
+        }
+
+        int n = OTC_CAPTURE_BLOCK - m_current.data.size();
+        if (n > len)
+            n = len;
+
+        char stamp[OTC_CAPTURE_STAMP_SIZE];
+        put32(stamp,     m_current.data.size());
+        put32(stamp + 4, byteTime);
+        put64(stamp + 8, first);
+        m_current.stamps.append(stamp, sizeof(stamp));
+
+        m_current.data.append((const char*)data, n);
+        m_offset   += n;
+        data       += n;
+        len        -= n;
+        first      += (qint64)n * byteTime;
+
+        if (m_current.data.size() >= OTC_CAPTURE_BLOCK)
+            seal();
+    }
+
+    m_mutex.unlock();
+}
+
+bool otcCaptureWriter::openFile()
+{
+    qint64  size;
+    int     age;
+    int     files;
+    char    header[OTC_CAPTURE_HEADER_SIZE];
+    QString name = QString("%1-%2.%3.otc")
+                        .arg(m_base)
+                        .arg(QDateTime::currentDateTime().toString("yyyyMMdd-hhmmss"))
+                        .arg(m_fileNumber, 4, 10, QChar('0'));
+
+    m_file.setFileName(name);
+    if (!m_file.open(QIODevice::WriteOnly))
+    {
+        otcConfig::logText(QString("<font color=red>**Cannot open capture file %1</font>").arg(name));
+        return FALSE;
+    }
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "OTCAP", 5);
+    header[6] = OTC_CAPTURE_VERSION & 0xFF;
+    header[7] = OTC_CAPTURE_VERSION >> 8;
+    put32(header + 8, m_fileNumber);
+    m_file.write(header, sizeof(header));
+
+    m_index.clear();
+    m_blocks = 0;
+    m_fileAge.start();
+    m_fileNumber++;
+
+    // Only the files of this capture are deleted
+    rotation(size, age, files);
+    m_files.append(name);
+    while (m_files.count() > files)
+        QFile::remove(m_files.takeFirst());
+
+    return TRUE;
+}
+
+// Appends the index, so that a reader can go straight to a block
+void otcCaptureWriter::closeFile()
+{
+    char trailer[OTC_CAPTURE_TRAILER_SIZE];
+
+    if (!m_file.isOpen())
+        return;
+
+    memcpy(trailer, "OTCI", 4);
+    put32(trailer + 4, m_blocks);
+    put64(trailer + 8, m_file.pos());
+
+    m_file.write(m_index);
+    m_file.write(trailer, sizeof(trailer));
+    m_file.close();
+}
+
+void otcCaptureWriter::writeBlock(const otcCaptureBlock& b)
+{
+    QByteArray  in      = b.data + b.stamps;
+    uLongf      clen    = compressBound(in.size());
+    QByteArray  out(OTC_CAPTURE_BLOCK_HEADER_SIZE + clen, 0);
+    char        entry[OTC_CAPTURE_INDEX_ENTRY_SIZE];
+    qint64      size;
+    int         age;
+    int         files;
+    int         res;
+
+    // openFile() tells why
+    if (!m_file.isOpen() && !openFile())
+    {
+        lost();
+        return;
+    }
+
+    res = compress2((Bytef*)out.data() + OTC_CAPTURE_BLOCK_HEADER_SIZE, &clen,
+                    (const Bytef*)in.constData(), in.size(), OTC_CAPTURE_LEVEL);
+    if (res != Z_OK)
+    {
+        otcConfig::logText(QString("<font color=red>**Capture block at offset %1 lost: zlib error %2</font>")
+                                .arg(b.offset).arg(res));
+        lost();
+        return;
+    }
+
+    memcpy(out.data(), "OTCB", 4);
+    put32(out.data() + 4,  b.data.size());
+    put32(out.data() + 8,  clen);
+    put32(out.data() + 12, crc32(0, (const Bytef*)b.data.constData(), b.data.size()));
+    put64(out.data() + 16, b.offset);
+    put64(out.data() + 24, b.stamp);
+    put32(out.data() + 32, b.stamps.size() / OTC_CAPTURE_STAMP_SIZE);
+    put32(out.data() + 36, 0);
+
+    put64(entry,      m_file.pos());
+    put64(entry + 8,  b.offset);
+    put64(entry + 16, b.stamp);
+
+    if (m_file.write(out.constData(), OTC_CAPTURE_BLOCK_HEADER_SIZE + clen) != (qint64)(OTC_CAPTURE_BLOCK_HEADER_SIZE + clen))
+    {
+        otcConfig::logText(QString("<font color=red>**Cannot write capture file %1</font>").arg(m_file.fileName()));
+        m_file.close();
+        lost();
+        return;
+    }
+
+    m_index.append(entry, sizeof(entry));
+    m_blocks++;
+
+    m_mutex.lock();
+    m_raw        += b.data.size();
+    m_compressed += OTC_CAPTURE_BLOCK_HEADER_SIZE + clen;
+    m_mutex.unlock();
+
+    rotation(size, age, files);
+    if ((m_file.pos() >= size) || (m_fileAge.elapsed() >= (qint64)age * 1000))
+        closeFile();
+}
+
+// Counts a block which could not be written
+void otcCaptureWriter::lost()
+{
+    m_mutex.lock();
+    m_failed++;
+    m_mutex.unlock();
+}
+
+void otcCaptureWriter::run()
+{
+    m_mutex.lock();
+
+    while (m_running || !m_queue.isEmpty())
+    {
+        if (m_queue.isEmpty())
+        {
+            m_wait.wait(&m_mutex, OTC_CAPTURE_FLUSH);
+
+            // Quiet link: the last bytes are not kept waiting
+            if (!m_current.data.isEmpty() &&
+                (QDateTime::currentMSecsSinceEpoch() - m_current.stamp >= OTC_CAPTURE_FLUSH))
+                seal();
+            continue;
+        }
+
+        otcCaptureBlock b = m_queue.dequeue();
+        m_mutex.unlock();
+        writeBlock(b);
+        m_mutex.lock();
+    }
+
+    m_mutex.unlock();
+    closeFile();
+}
+
+QString otcCaptureWriter::getStatus()
+{
+    QString ret;
+    qint64  size;
+    int     age;
+    int     files;
+
+    rotation(size, age, files);
+
+    m_mutex.lock();
+    ret = QString("Capture %1: %2 bytes read, %3 written in %4 bytes, %5 blocks dropped, %6 lost on errors, %7 files.\n")
+                .arg(m_open ? m_base : QString("off"))
+                .arg(m_offset).arg(m_raw).arg(m_compressed).arg(m_dropped).arg(m_failed).arg(m_fileNumber);
+    ret += QString("Rotation every %1 KB or %2 s, %3 files kept.\n")
+                .arg(size / 1024).arg(age).arg(files);
+    m_mutex.unlock();
+
+    return ret;
+}
@@ -0,0 +1,167 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_capture.h
+/// @brief          Capture writer
+///                 Compressed, rotating record of the bytes read from the device
+//
+/// =========================================================================
+///
+/// The reader thread only copies the bytes in the current block. Full
+/// blocks (or blocks older than the flush period) are compressed with zlib
+/// and written by the capture thread. When the queue of blocks waiting for
+/// the capture thread is full, the block is dropped and counted: the read
+/// path never waits for the disk.
+///
+/// A new file is started when the current one reaches the size or the age
+/// limit, and the oldest files of the session are deleted beyond the file
+/// limit. Every block is compressed on its own, so every file, and every
+/// block in it, can be decoded alone.
+///
+/// File format, all numbers little endian:
+///
+///   header    16 bytes    "OTCAP\0", version (u16), file number (u32), 0 (u32)
+///   blocks    40 bytes    "OTCB", raw length (u32), compressed length (u32),
+///                         CRC-32 of the raw data (u32), offset of the first
+///                         raw byte in the capture (u64), time of the first
+///                         raw byte (u64, ms since 1970), number of stamps
+///                         (u32), 0 (u32)
+///             followed by the zlib stream of the block: the raw data, then
+///             the stamps, 16 bytes each: offset in the block of the first
+///             byte of a read (u32), ns from one byte to the next (u32), time
+///             of that byte (u64, ns since 1970)
+///   index     24 bytes per block: file offset of the block (u64), raw offset
+///                         (u64), time (u64)
+///   trailer   16 bytes    "OTCI", number of blocks (u32), file offset of the
+///                         index (u64)
+///
+/// A file cut short has no index: its blocks can still be walked one by one
+/// from the header.
+///
+/// Version 1 files have 32 bytes block headers, without stamps: the time of
+/// a byte is the time of its block.
+///
+/// =========================================================================
+
+#ifndef __OTC_CAPTURE_H__
+#define __OTC_CAPTURE_H__
+
+#include <qstring.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qqueue.h>
+#include <qlist.h>
+#include <qfile.h>
+#include <qbytearray.h>
+#include <qelapsedtimer.h>
+#include <QWaitCondition>
+
+
+/// File layout
+#define OTC_CAPTURE_VERSION                 2
+#define OTC_CAPTURE_HEADER_SIZE             16
+#define OTC_CAPTURE_BLOCK_HEADER_SIZE       40
+#define OTC_CAPTURE_BLOCK_HEADER_SIZE_V1    32
+#define OTC_CAPTURE_STAMP_SIZE              16
+#define OTC_CAPTURE_INDEX_ENTRY_SIZE        24
+#define OTC_CAPTURE_TRAILER_SIZE            16
+
+/// Raw bytes per block
+#define OTC_CAPTURE_BLOCK                   0x10000
+
+/// A block is written after this time even if it is not full (ms)
+#define OTC_CAPTURE_FLUSH                   1000
+
+/// Blocks waiting for the capture thread, more are dropped
+#define OTC_CAPTURE_QUEUE                   64
+
+/// zlib level: speed matters more than size on long captures
+#define OTC_CAPTURE_LEVEL                   1
+
+/// Default rotation: file size (bytes), file age (s), files kept
+#define OTC_CAPTURE_FILE_SIZE               (64 * 1024 * 1024)
+#define OTC_CAPTURE_FILE_AGE                3600
+#define OTC_CAPTURE_FILES                   16
+
+
+class otcCaptureBlock
+{
+public :
+    QByteArray              data;
+    quint64                 offset;     ///< of the first byte in the capture
+    quint64                 stamp;      ///< ms since 1970 of the first byte
+    QByteArray              stamps;     ///< one entry per read, see the file format
+};
+
+
+class otcCaptureWriter : public QThread
+{
+public :
+    otcCaptureWriter();
+    ~otcCaptureWriter();
+
+    bool                    open(const QString& base);
+    void                    close();
+    bool                    isOpen()        {return m_open;}
+    void                    write(const unsigned char* data, int len, qint64 first, int byteTime);
+    QString                 getStatus();
+
+    static void             setRotation(qint64 size, int age, int files);
+    static void             rotation(qint64& size, int& age, int& files);
+
+    void                    run();
+
+protected :
+    /// Rotation, set with :CAP from the GUI, read by the capture thread
+    static QMutex           rotationMutex;
+    static qint64           maxSize;
+    static int              maxAge;
+    static int              maxFiles;
+
+    QMutex                  m_mutex;
+    QWaitCondition          m_wait;
+    bool                    m_open;
+    bool                    m_running;
+    QString                 m_base;
+    otcCaptureBlock         m_current;
+    QQueue<otcCaptureBlock> m_queue;
+    quint64                 m_offset;
+    unsigned int            m_dropped;
+    unsigned int            m_failed;   ///< blocks lost on a file or zlib error
+
+    // Capture thread only
+    QFile                   m_file;
+    quint32                 m_fileNumber;
+    QElapsedTimer           m_fileAge;
+    QList<QString>          m_files;
+    QByteArray              m_index;
+    quint32                 m_blocks;
+    qint64                  m_raw;
+    qint64                  m_compressed;
+
+    void                    seal();
+    bool                    openFile();
+    void                    closeFile();
+    void                    writeBlock(const otcCaptureBlock& b);
+    void                    lost();
+};
+
+
+#endif // __OTC_CAPTURE_H__
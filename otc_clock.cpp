@@ -0,0 +1,143 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_clock.cpp
+/// @brief          Receive clock
+//
+/// =========================================================================
+
+#ifndef WIN32
+#include <time.h>
+#else
+#include <windows.h>
+#endif
+
+#include <qmutex.h>
+
+#include "otc_clock.h"
+
+
+static QMutex   otcClockMutex;
+static qint64   otcClockOffset  = 0;    // ns, time of day - monotonic
+static qint64   otcClockSynced  = -1;   // monotonic time of the last measure
+
+
+/** @brief  Monotonic clock
+  * @retval (qint64) ns, from an unspecified start
+  */
+qint64 otcClockNow(void)
+{
+#ifndef WIN32
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+#else // WIN32
+
+    static LARGE_INTEGER    freq = {0};
+    LARGE_INTEGER           count;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+
+    return (count.QuadPart / freq.QuadPart) * 1000000000LL
+         + (count.QuadPart % freq.QuadPart) * 1000000000LL / freq.QuadPart;
+
+#endif // WIN32
+}
+
+// Time of day, ns since 1970
+static qint64 otcClockDay(void)
+{
+#ifndef WIN32
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+#else // WIN32
+
+    FILETIME    ft;
+    qint64      t;
+
+    // 100 ns since 1601
+    GetSystemTimeAsFileTime(&ft);
+    t = ((qint64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000LL) * 100;
+
+#endif // WIN32
+}
+
+// The time of day is read between two reads of the monotonic clock, the
+// tightest of three tries gives the offset. Must be called with
+// otcClockMutex held.
+static void otcClockSync(qint64 now)
+{
+    qint64 best = -1;
+
+    for (int i=0; i<3; i++)
+    {
+        qint64 before   = otcClockNow();
+        qint64 day      = otcClockDay();
+        qint64 after    = otcClockNow();
+
+        if ((best < 0) || (after - before < best))
+        {
+            best            = after - before;
+            otcClockOffset  = day - (before + (after - before) / 2);
+        }
+    }
+
+    otcClockSynced = now;
+}
+
+/** @brief  Maps a time of the monotonic clock to the time of day
+  * @param  monotonic   (qint64) ns, as given by otcClockNow()
+  * @retval (qint64)    ns since 1970
+  */
+qint64 otcClockRealtime(qint64 monotonic)
+{
+    qint64 now = otcClockNow();
+    qint64 ret;
+
+    otcClockMutex.lock();
+    if ((otcClockSynced < 0) || (now - otcClockSynced > (qint64)OTC_CLOCK_SYNC * 1000000))
+        otcClockSync(now);
+    ret = monotonic + otcClockOffset;
+    otcClockMutex.unlock();
+
+    return ret;
+}
+
+/** @brief  Time of a byte on the line
+  * @param  baud        (int) baud rate
+  * @retval (int)       ns, 0 if the rate is not known
+  */
+int otcClockByteTime(int baud)
+{
+    if (baud <= 0)
+        return 0;
+
+    return (int)((qint64)OTC_CLOCK_BYTE_BITS * 1000000000LL / baud);
+}
@@ -0,0 +1,72 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_clock.h
+/// @brief          Receive clock
+///                 Arrival time of the bytes read from the device
+//
+/// =========================================================================
+///
+/// Every read of the device is stamped with the monotonic clock
+/// (CLOCK_MONOTONIC, in ns) as soon as it returns: the last byte of the read
+/// arrived at most then. The bytes before it are placed back one byte time
+/// apart (10 bits at the baud rate made by the driver). A read never goes
+/// before the last byte of the previous one: when it would, its bytes are
+/// spread between the two reads.
+///
+/// The data parser keeps the time of every byte of its ring, so a frame
+/// gets the time of its first sync byte, whatever the reads and the batching
+/// did to it. That time goes to the frame store, the tracer, the capture
+/// files and the socket clients which ask for it.
+///
+/// The monotonic clock is mapped to the time of day (CLOCK_REALTIME) with an
+/// offset, measured again every OTC_CLOCK_SYNC: a step of the system clock
+/// shows within that time, the times already given are not changed.
+///
+/// =========================================================================
+
+#ifndef __OTC_CLOCK_H__
+#define __OTC_CLOCK_H__
+
+#include <qglobal.h>
+
+
+/// Time after which the offset to the time of day is measured again (ms)
+#define OTC_CLOCK_SYNC                      10000
+
+/// Bits of a byte on the line: start, 8 data, stop
+#define OTC_CLOCK_BYTE_BITS                 10
+
+
+/// Arrival of the bytes of one read
+class otcReadStamp
+{
+public :
+    qint64                  first;      ///< ns, monotonic clock: first byte
+    int                     byteTime;   ///< ns from one byte to the next
+};
+
+
+qint64  otcClockNow(void);
+qint64  otcClockRealtime(qint64 monotonic);
+int     otcClockByteTime(int baud);
+
+
+#endif // __OTC_CLOCK_H__
@@ -27,7 +27,12 @@
 #include "otc_window.h"
 #include "otc_mpipe.h"
 #include "otc_alp.h"
+#include "otc_capture.h"
+#include "otc_frames.h"
+#include "otc_hex.h"
 #include <qapplication.h>
+#include <qtextdocument.h>
+#include <string.h>
 
 #include "bintex.h"
 
@@ -40,6 +45,10 @@
   *
   */
 
+/// Compiled once, instead of for each parameter of each command
+static const QRegExp sub_delimiter("[,;]");
+static const QRegExp sub_nonspace("\\S");
+
 
 /** @brief  Parses a command string from supplied starting point until statement end
   * @param  cmd_string  (const QString&) The command string from OTcom user entry
@@ -55,7 +64,7 @@ int sub_parse_statement(const QString& cmd_string, QStringRef param[], int front
 
         // Use substring between parameter front edge and delimiter (back edge)
         // Whitespace is OK between parameter and delimiter
-        back_edge = cmd_string.indexOf(QRegExp("[,;]"), front_edge);
+        back_edge = cmd_string.indexOf(sub_delimiter, front_edge);
         if (back_edge < 0) {
             back_edge = cmd_string.length();
         }
@@ -64,7 +73,7 @@ int sub_parse_statement(const QString& cmd_string, QStringRef param[], int front
         // Bypass Whitespace after delimiter, before next front_edge
         // front_edge will take -1 if back_edge is EOL
         //next        = back_edge+1;
-        front_edge  = cmd_string.indexOf(QRegExp("\\S"), back_edge+1);
+        front_edge  = cmd_string.indexOf(sub_nonspace, back_edge+1);
         //front_edge  = next;
 
         // Break if Back Edge is EOL or ';'
@@ -98,13 +107,24 @@ otc_command::otc_command(const QString& mainarg,const QString& syntax,const QStr
 //             --------------               //
 //             :S                           //
 //             :V                           //
+//             :RA                          //
+//             :AW                          //
+//             :RUN                         //
+//             :DUMP                        //
+//             :JOB                         //
+//             :CAP                         //
+//             :FIND                        //
+//             :TRACE                       //
+//             :PROF                        //
+//             :RING                        //
 //                                          //
 // ---------------------------------------- //
 
 otc_command_internal::otc_command_internal( const QString& mainarg,
                                             otc_command_internal_id_t id,
-                                            const QString& help)
-                                            :otc_command(mainarg,"",help)
+                                            const QString& help,
+                                            const QString& syntax)
+                                            :otc_command(mainarg,syntax,help)
 {
     m_id = id;
 }
@@ -112,7 +132,7 @@ otc_command_internal::otc_command_internal( const QString& mainarg,
 
 
 otc_error_t otc_command_internal::exec(const QString& cmd_string,
-                                       otcCommunicationLinkDevice&,
+                                       otcCommunicationLinkDevice& device,
                                        otc_command_parser* parser)
 {
     switch (m_id)
@@ -128,6 +148,357 @@ otc_error_t otc_command_internal::exec(const QString& cmd_string,
             parser->toggle(m_id); 
             break;
 
+        case OTC_COMMAND_INTERNAL_ID_REASSEMBLY : {
+            // :RA [cap_kb] [timeout_ms], without argument only shows the settings
+            QString cap     = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString timeout = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            bool    ok      = TRUE;
+
+            if (!cap.isEmpty()) {
+                int kb = cap.toInt(&ok);
+                if (!ok || (kb < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                otc_mpipe_reassembler::memCap = kb * 1024;
+            }
+            if (!timeout.isEmpty()) {
+                int ms = timeout.toInt(&ok);
+                if (!ok || (ms < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                otc_mpipe_reassembler::timeout = ms;
+            }
+            otcConfig::logText(QString("Reassembly memory cap %1 KB, timeout %2 ms")
+                                    .arg(otc_mpipe_reassembler::memCap / 1024)
+                                    .arg(otc_mpipe_reassembler::timeout));
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_ACK_WINDOW : {
+            // :AW [window] [timeout_ms], window 0 disables the flow control
+            otcWriteScheduler* scheduler = otcConfig::mainWindow->writeScheduler();
+            QString window  = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString timeout = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            int     w       = scheduler->window();
+            int     ms      = scheduler->ackTimeout();
+            bool    ok      = TRUE;
+
+            if (!window.isEmpty()) {
+                w = window.toInt(&ok);
+                if (!ok || (w < 0)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            if (!timeout.isEmpty()) {
+                ms = timeout.toInt(&ok);
+                if (!ok || (ms < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            scheduler->setWindow(w, ms);
+
+            if (w == 0) {
+                otcConfig::logText("Chunk flow control off");
+            }
+            else {
+                otcConfig::logText(QString("Chunk flow control: %1 frames in flight, ACK timeout %2 ms")
+                                        .arg(w).arg(ms));
+            }
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_SCRIPT : {
+            // :RUN <file> [window] [timeout_ms], window 0 does not wait for responses
+            QString file    = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString window  = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            QString timeout = cmd_string.section(' ', 3, 3, QString::SectionSkipEmpty);
+            int     w       = OTC_SCRIPT_WINDOW;
+            int     ms      = OTC_SCRIPT_TIMEOUT;
+            bool    ok      = TRUE;
+
+            if (file.isEmpty()) {
+                return OTC_ERROR_SYNTAX;
+            }
+            if (file == "stop") {
+                otcConfig::mainWindow->stopScript();
+                break;
+            }
+            if (!window.isEmpty()) {
+                w = window.toInt(&ok);
+                if (!ok || (w < 0)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            if (!timeout.isEmpty()) {
+                ms = timeout.toInt(&ok);
+                if (!ok || (ms < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            otcConfig::mainWindow->runScript(file, w, ms, FALSE);
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_DUMP : {
+            // :DUMP <block> <id>[,off][,len] [outfile] [window], numbers in hex
+            QString     block   = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QStringList file    = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty).split(',');
+            QString     output  = cmd_string.section(' ', 3, 3, QString::SectionSkipEmpty);
+            QString     window  = cmd_string.section(' ', 4, 4, QString::SectionSkipEmpty);
+            unsigned char blk;
+            int         param[3] = {0, 0, 0};
+            int         w       = OTC_BULK_WINDOW;
+            bool        ok      = TRUE;
+
+            if (block == "stop") {
+                otcConfig::mainWindow->stopDump();
+                break;
+            }
+            if (block.startsWith("G")) {
+                blk = OTC_ALP_CMD_FILE_GFB;
+            }
+            else if (block.startsWith("ISFS") || block.startsWith("ISS")) {
+                blk = OTC_ALP_CMD_FILE_ISFSB;
+            }
+            else if (block.startsWith("ISF")) {
+                blk = OTC_ALP_CMD_FILE_ISFB;
+            }
+            else {
+                return OTC_ERROR_SYNTAX;
+            }
+
+            if ((file.count() > 3) || file[0].isEmpty()) {
+                return OTC_ERROR_SYNTAX;
+            }
+            for (int i=0; i<file.count(); i++) {
+                if (!file[i].isEmpty()) {
+                    param[i] = file[i].toInt(&ok, 16);
+                    if (!ok || (param[i] < 0)) {
+                        return OTC_ERROR_SYNTAX;
+                    }
+                }
+            }
+            if ((param[0] > 0xFF) || (param[1] >= OTC_BULK_FILE_MAX)
+            ||  (param[2] > OTC_BULK_FILE_MAX - param[1])) {
+                return OTC_ERROR_SYNTAX;
+            }
+            if (!window.isEmpty()) {
+                w = window.toInt(&ok);
+                if (!ok || (w < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            otcConfig::mainWindow->runDump(blk, param[0], param[1], param[2], output, w);
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_JOB : {
+            // :JOB add <interval_ms>[,jitter_ms] <command> | del <id>|all, without argument lists the jobs
+            otcJobScheduler*    jobs    = otcConfig::mainWindow->jobScheduler();
+            QString             action  = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString             param   = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            bool                ok      = TRUE;
+
+            if (action.isEmpty()) {
+                otcConfig::logText(jobs->getStatus());
+            }
+            else if (action == "add") {
+                QStringList             period  = param.split(',');
+                QString                 command = cmd_string.section(' ', 3, -1, QString::SectionSkipEmpty);
+                QList<otcWriteFrame>    frames;
+                int                     interval;
+                int                     jitter  = 0;
+                int                     lastseq;
+
+                if ((period.count() > 2) || command.isEmpty() || command.startsWith(":")) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                interval = period[0].toInt(&ok);
+                if (!ok || (interval < OTC_JOB_TICK)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                if (period.count() == 2) {
+                    jitter = period[1].toInt(&ok);
+                    if (!ok || (jitter < 0) || (jitter > interval)) {
+                        return OTC_ERROR_SYNTAX;
+                    }
+                }
+
+                // The command reports its own errors
+                if (parser->compile(command, frames, lastseq) != OTC_ERROR_NONE) {
+                    break;
+                }
+                if ((frames.count() != 1) || (frames[0].ackseq != -1)) {
+                    otcConfig::logText("<font color=red>**A job must be a command of a single record</font>");
+                    break;
+                }
+
+                int id = jobs->add(command, (const unsigned char*)frames[0].data.constData(),
+                                   frames[0].data.size(), interval, jitter);
+                if (id < 0) {
+                    otcConfig::logText("<font color=red>**Cannot add the job</font>");
+                }
+                else {
+                    otcConfig::logText(QString("Job %1: %2 every %3 ms").arg(id).arg(Qt::escape(command)).arg(interval));
+                }
+            }
+            else if (action == "del") {
+                if (param == "all") {
+                    jobs->clear();
+                    break;
+                }
+                int id = param.toInt(&ok);
+                if (!ok) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                if (!jobs->remove(id)) {
+                    otcConfig::logText(QString("No job %1").arg(id));
+                }
+            }
+            else {
+                return OTC_ERROR_SYNTAX;
+            }
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_CAPTURE : {
+            // :CAP [size_kb] [age_s] [files], rotation of the "Start Logging..." capture
+            QString size    = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString age     = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            QString files   = cmd_string.section(' ', 3, 3, QString::SectionSkipEmpty);
+            bool    ok      = TRUE;
+            int     kb      = 0;
+            int     s       = 0;
+            int     n       = 0;
+
+            if (!size.isEmpty()) {
+                kb = size.toInt(&ok);
+                if (!ok || (kb < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            if (!age.isEmpty()) {
+                s = age.toInt(&ok);
+                if (!ok || (s < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            if (!files.isEmpty()) {
+                n = files.toInt(&ok);
+                if (!ok || (n < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+            }
+            otcCaptureWriter::setRotation((qint64)kb * 1024, s, n);
+            otcConfig::logText(dStatus());
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_FIND : {
+            // :FIND [id=<id>] [cmd=<cmd>] [crc=ok|bad] [from=<time>] [to=<time>] [n=<count>] [data=<bintex>] | clear
+            otcFrameStore*  store   = otcConfig::mainWindow->frameStore();
+            QString         args    = cmd_string.section(' ', 1, -1, QString::SectionSkipEmpty);
+            otcFrameQuery   query;
+            QList<otcFrame> result;
+            QElapsedTimer   timer;
+            int             visited;
+
+            if (args.isEmpty()) {
+                otcConfig::logText(store->getStatus());
+                break;
+            }
+            if (args == "clear") {
+                store->clear();
+                otcConfig::logText(store->getStatus());
+                break;
+            }
+            if (!query.parse(args)) {
+                return OTC_ERROR_SYNTAX;
+            }
+
+            timer.start();
+            store->find(query, result, visited);
+            qint64 ms = timer.elapsed();
+
+            for (int i=0; i<result.count(); i++) {
+                otcConfig::logText(result[i].text());
+            }
+            otcConfig::logText(QString("%1 frames found (%2 checked) in %3 ms%4")
+                                    .arg(result.count()).arg(visited).arg(ms)
+                                    .arg((result.count() == query.limit) ? ", the newest ones" : ""));
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_TRACE : {
+            // :TRACE [on|off|clear|save <file>]
+            otcTracer*  tracer  = otcConfig::mainWindow->tracer();
+            QString     arg     = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString     file    = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+
+            if (arg == "on") {
+                tracer->setEnabled(TRUE);
+            }
+            else if (arg == "off") {
+                tracer->setEnabled(FALSE);
+            }
+            else if (arg == "clear") {
+                tracer->clear();
+            }
+            else if (arg == "save") {
+                if (file.isEmpty()) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                if (!tracer->save(file)) {
+                    otcConfig::logText("<font color=red>**Cannot write " + file + "</font>");
+                    break;
+                }
+                otcConfig::logText("Traces saved in " + file);
+                break;
+            }
+            else if (!arg.isEmpty()) {
+                return OTC_ERROR_SYNTAX;
+            }
+            otcConfig::logText(tracer->getStatus());
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_PROFILE : {
+            // :PROF [default|latency|throughput]
+            QString arg = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+
+            if (arg == "default") {
+                device.setProfile(OTC_SERIAL_PROFILE_DEFAULT);
+            }
+            else if (arg == "latency") {
+                device.setProfile(OTC_SERIAL_PROFILE_LATENCY);
+            }
+            else if (arg == "throughput") {
+                device.setProfile(OTC_SERIAL_PROFILE_THROUGHPUT);
+            }
+            else if (!arg.isEmpty()) {
+                return OTC_ERROR_SYNTAX;
+            }
+            otcConfig::logText(device.getStatus());
+        } break;
+
+        case OTC_COMMAND_INTERNAL_ID_RING : {
+            // :RING [size_kb] [max_kb]
+            otcDataParser*  parser  = otcConfig::mainWindow->dataParser();
+            QString         size    = cmd_string.section(' ', 1, 1, QString::SectionSkipEmpty);
+            QString         max     = cmd_string.section(' ', 2, 2, QString::SectionSkipEmpty);
+            bool            ok      = TRUE;
+
+            if (!size.isEmpty()) {
+                int kb = size.toInt(&ok);
+                if (!ok || (kb < 1)) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                int maxkb = max.isEmpty() ? kb : max.toInt(&ok);
+                if (!ok) {
+                    return OTC_ERROR_SYNTAX;
+                }
+                if (!parser->setCapacity((unsigned int)kb * 1024, (unsigned int)maxkb * 1024)) {
+                    otcConfig::logText(QString("<font color=red>**Cannot set the ring to %1 KB up to %2 KB: "
+                                               "sizes from %3 to %4 KB, the cap at least the size</font>")
+                                            .arg(kb).arg(maxkb).arg(OTC_RING_SIZE_MIN / 1024).arg(OTC_RING_SIZE_MAX / 1024));
+                    break;
+                }
+            }
+            otcConfig::logText(parser->getRingStatus());
+        } break;
+
         default : 
 	        return OTC_ERROR_UNKNOWN;
     }
@@ -154,20 +525,12 @@ otc_command_null::otc_command_null( const QString& mainarg,
 
 
 
-otc_error_t otc_command_null::exec(const QString& cmd_string,
-                                   otcCommunicationLinkDevice& device,
+otc_error_t otc_command_null::exec(const QString&,
+                                   otcCommunicationLinkDevice&,
                                    otc_command_parser* parser)
 {
-    // construct message with NULL body
-    otc_mpipe_builder msg(0);
-    msg.header(OTC_ALP_ID_NULL, m_cmd | parser->echo(), parser->seq());
-    msg.footer();
-
-    // write to serial
-    parser->log(m_log, msg.start(), msg.len());
-    device.writeBlock((char*)msg.start(), msg.len());
-
-	return OTC_ERROR_NONE;
+    // message with NULL body, always a single record
+    return parser->send(m_log, OTC_ALP_ID_NULL, m_cmd, QByteArray());
 }
 
 
@@ -226,22 +589,21 @@ otc_error_t otc_command_raw::alptemp(QString s)
 
 
 otc_error_t otc_command_raw::exec(const QString& cmd_string,
-                                  otcCommunicationLinkDevice& device,
+                                  otcCommunicationLinkDevice&,
                                   otc_command_parser* parser  )
 {
     int front_edge;
     QStringRef param[3];
 
     // Initialize message globals for new message
-    m_bodyptr   = m_body;
-    m_bodylen   = 0;
+    m_body.clear();
 
     param[0].clear();
     param[1].clear();
     param[2].clear();
 
     front_edge  = cmd_string.indexOf(QChar(' '));                   //go past command
-    front_edge  = cmd_string.indexOf(QRegExp("\\S"), front_edge);   //bypass trailing whitespace
+    front_edge  = cmd_string.indexOf(sub_nonspace, front_edge);       //bypass trailing whitespace
 
     /// There must be at least two parameters, and there are often three.
     /// The third parameter is the BinTex expression
@@ -256,45 +618,43 @@ otc_error_t otc_command_raw::exec(const QString& cmd_string,
     /// cannot be identified as valid hex.
     int hexval;
     bool ok = true;
+    unsigned char cmd;
     hexval  = param[0].toUtf8().toInt(&ok, 16);
     m_id    = (unsigned char)(hexval & 0xFF);
     hexval  = param[1].toUtf8().toInt(&ok, 16);
-    m_cmd  |= (unsigned char)(hexval & 0xFF);
+    cmd     = m_cmd | (unsigned char)(hexval & 0xFF);
 
     if (ok != true) {
         return OTC_ERROR_SYNTAX;
     }
 
     /// Now, the BinTex data input, the final [optional] parameter.
+    /// A BinTex expression never outputs more than 4 bytes per 2 characters
     if (param[2].length() != 0) {
-        int bytes_out;
-        bytes_out   = bintex_ss((unsigned char*)param[2].toUtf8().data(),
-                                m_bodyptr,
-                                256-m_bodylen);
-        m_bodyptr  += bytes_out;
-        m_bodylen  += bytes_out;
+        QByteArray      text = param[2].toUtf8();
+        bintex_status   status;
+        int             bytes_out;
+
+        m_body.resize(text.size()*2 + 4);
+        bytes_out   = bintex_parse(text.constData(), text.size(),
+                                   (unsigned char*)m_body.data(),
+                                   m_body.size(), &status);
+        m_body.resize(bytes_out);
+
+        if (status.error != BINTEX_OK) {
+            otcConfig::logText(QString("<font color=red>**BinTex error at character %1</font>").arg(status.offset));
+            return OTC_ERROR_SYNTAX;
+        }
     }
 
-    // we do not treat multipackets for now
-    if (m_bodylen > 255)
-        return OTC_ERROR_MSG_TOO_LONG;
-
-    // construct message with NULL body
-    otc_mpipe_builder msg((unsigned char)m_bodylen);
-    msg.header(m_id, m_cmd | parser->echo(), parser->seq());
-    msg.body(m_body);
-    msg.footer();
-
-    // write to serial
-    parser->log(m_log, msg.start(), msg.len());
-    device.writeBlock((char*)msg.start(), msg.len());
-
-    return OTC_ERROR_NONE;
+    // send as one record, or in chunks if the body is too long for one
+    return parser->send(m_log, m_id, cmd, m_body);
 }
 
 
 
 
+
 // ---------------------------------------- //
 //                                          //
 //          ALP FILE DATA READ              //
@@ -379,36 +739,36 @@ otc_error_t otc_command_file::filetemp(QString s)
 
 
 otc_error_t otc_command_file::exec(const QString& cmd_string,
-                                   otcCommunicationLinkDevice& device,
+                                   otcCommunicationLinkDevice&,
                                    otc_command_parser* parser)
 {
     int front_edge;
     int back_edge;
     QStringRef  block;
+    unsigned char cmd = m_cmd;
 
     // Initialize message globals for new message
-    m_bodyptr   = &m_body[0];
-    m_bodylen   = 0;
+    m_body.clear();
 
     /// Get file block identifier, then check it
     /// Valid: GFB, ISS/ISSB/ISFSB, ISF/ISFB
     front_edge  = cmd_string.indexOf(QChar(' '));                   //go past command
-    front_edge  = cmd_string.indexOf(QRegExp("\\S"), front_edge);   //bypass trailing whitespace
+    front_edge  = cmd_string.indexOf(sub_nonspace, front_edge);       //bypass trailing whitespace
     back_edge   = cmd_string.indexOf(QChar(' '), front_edge);       //go past block param
     block       = cmd_string.midRef(front_edge, (back_edge-front_edge));
-    front_edge  = cmd_string.indexOf(QRegExp("\\S"), back_edge+1);  //bypass trailing whitespace
+    front_edge  = cmd_string.indexOf(sub_nonspace, back_edge+1);      //bypass trailing whitespace
 
     if (block.length() == 0) {
         return OTC_ERROR_SYNTAX;
     }
     else if (block.startsWith("G")) {
-        m_cmd |= OTC_ALP_CMD_FILE_GFB;
+        cmd |= OTC_ALP_CMD_FILE_GFB;
     }
     else if (block.startsWith("ISFS") || block.startsWith("ISS")) {
-        m_cmd |= OTC_ALP_CMD_FILE_ISFSB;
+        cmd |= OTC_ALP_CMD_FILE_ISFSB;
     }
     else if (block.startsWith("ISF")) {
-        m_cmd |= OTC_ALP_CMD_FILE_ISFB;
+        cmd |= OTC_ALP_CMD_FILE_ISFB;
     }
     else {
         return OTC_ERROR_SYNTAX;
@@ -435,23 +795,20 @@ otc_error_t otc_command_file::exec(const QString& cmd_string,
         else {
             hexvalue = param[0].toUtf8().toInt(&ok, 16);
         }
-        *m_bodyptr++    = (unsigned char)(hexvalue & 0xFF);
-        m_bodylen      += 1;
+        m_body.append((char)(hexvalue & 0xFF));
 
 
         /// Data Offset: 2 bytes, default=0
         /// Data Length: 2 bytes, default=FFFF
         if (m_template != OTC_COMMAND_FILE_TEMPLATE_SHORT) {
-            m_bodylen += 4;
-
             if (param[1].length() == 0) {
                 hexvalue = 0;
             }
             else {
                 hexvalue = param[1].toUtf8().toInt(&ok, 16);
             }
-            *m_bodyptr++ = (unsigned char)((hexvalue / 256) & 0xFF);
-            *m_bodyptr++ = (unsigned char)(hexvalue & 0xFF);
+            m_body.append((char)((hexvalue / 256) & 0xFF));
+            m_body.append((char)(hexvalue & 0xFF));
 
             if (param[2].length() == 0) {
                 hexvalue = 0xFFFF;
@@ -459,19 +816,28 @@ otc_error_t otc_command_file::exec(const QString& cmd_string,
             else {
                 hexvalue = param[2].toUtf8().toInt(&ok, 16);
             }
-            *m_bodyptr++ = (unsigned char)((hexvalue / 256) & 0xFF);
-            *m_bodyptr++ = (unsigned char)(hexvalue & 0xFF);
+            m_body.append((char)((hexvalue / 256) & 0xFF));
+            m_body.append((char)(hexvalue & 0xFF));
 
 
             /// Now do the BinTex parsing of the write parameter
+            /// (never more than 4 bytes per 2 characters)
             if (m_template == OTC_COMMAND_FILE_TEMPLATE_WRITE) {
-                int bytes_out;
-                bytes_out   = bintex_ss((unsigned char*)param[3].toUtf8().data(),
-                                        m_bodyptr,
-                                        256-m_bodylen);
-                m_bodyptr  += bytes_out;
-                m_bodylen  += bytes_out;
-                ok         &= (bytes_out >= 0);
+                QByteArray      text    = param[3].toUtf8();
+                int             offset  = m_body.size();
+                bintex_status   status;
+                int             bytes_out;
+
+                m_body.resize(offset + text.size()*2 + 4);
+                bytes_out   = bintex_parse(text.constData(), text.size(),
+                                           (unsigned char*)m_body.data() + offset,
+                                           text.size()*2 + 4, &status);
+                m_body.resize(offset + bytes_out);
+
+                if (status.error != BINTEX_OK) {
+                    otcConfig::logText(QString("<font color=red>**BinTex error at character %1</font>").arg(status.offset));
+                    ok = false;
+                }
             }
         }
 
@@ -480,24 +846,15 @@ otc_error_t otc_command_file::exec(const QString& cmd_string,
             return OTC_ERROR_SYNTAX;
         }
 
-        /// Make sure body is not too long (no multipackets for now)
-        if (m_bodylen > 255) {
+        /// Make sure body is not too long, even for a chunked message
+        if (m_body.size() > OTC_MPIPE_MESSAGE_MAX) {
             return OTC_ERROR_MSG_TOO_LONG;
         }
     }
 
 
-    /// construct message with NULL body
-    otc_mpipe_builder msg((unsigned char)m_bodylen);
-    msg.header(OTC_ALP_ID_FILE_DATA, m_cmd | parser->echo(), parser->seq());
-    msg.body(&m_body[0]);
-    msg.footer();
-
-    /// write to serial
-    parser->log(m_log, msg.start(), msg.len());
-    device.writeBlock((char*)msg.start(), msg.len());
-
-	return OTC_ERROR_NONE;
+    /// send as one record, or in chunks if the body is too long for one
+    return parser->send(m_log, OTC_ALP_ID_FILE_DATA, cmd, m_body);
 }
 
 
@@ -514,16 +871,31 @@ otc_command_parser::otc_command_parser(QWidget* parent,otcCommunicationLinkDevic
 {
 	m_device = device;
 	m_commands.setAutoDelete(true);
-    m_cmdIndex = 0;
     m_verbose  = FALSE;
     m_echo_remote = FALSE;
     m_echo_local = FALSE;
+    m_capture  = NULL;
+    m_captureSeq = -1;
+    m_records  = 0;
+    m_recordedLen = 0;
+    m_templateHits = 0;
+    m_templatesCompiled = 0;
    
     // Internal otcom configuration commands
     add(new otc_command_internal(":S", OTC_COMMAND_INTERNAL_ID_STATUS,       "Shows the status of internal OTCOM data structures."));
     add(new otc_command_internal(":V", OTC_COMMAND_INTERNAL_ID_VERBOSE,      "Toggle command verbose mode."));
     add(new otc_command_internal(":ER", OTC_COMMAND_INTERNAL_ID_ECHO_REMOTE, "Toggle remote echo mode."));
     add(new otc_command_internal(":EL", OTC_COMMAND_INTERNAL_ID_ECHO_LOCAL,  "Toggle local echo mode."));
+    add(new otc_command_internal(":RA", OTC_COMMAND_INTERNAL_ID_REASSEMBLY,  "Show or set the chunk reassembly memory cap and timeout.", "[cap_kb] [timeout_ms]"));
+    add(new otc_command_internal(":AW", OTC_COMMAND_INTERNAL_ID_ACK_WINDOW,  "Show or set the ACK window of chunked transfers.", "[window] [timeout_ms]"));
+    add(new otc_command_internal(":RUN", OTC_COMMAND_INTERNAL_ID_SCRIPT,     "Run a command script, or stop the running one.", "<file>|stop [window] [timeout_ms]"));
+    add(new otc_command_internal(":DUMP", OTC_COMMAND_INTERNAL_ID_DUMP,      "Read a whole file with pipelined requests, or stop the running dump.", "<filetype>|stop <id>,[off],[len] [outfile] [window]"));
+    add(new otc_command_internal(":JOB", OTC_COMMAND_INTERNAL_ID_JOB,        "List the periodic jobs, add one or delete them.", "[add <interval_ms>[,jitter_ms] <command>|del <id>|all]"));
+    add(new otc_command_internal(":CAP", OTC_COMMAND_INTERNAL_ID_CAPTURE,    "Show or set the rotation of the capture files.", "[size_kb] [age_s] [files]"));
+    add(new otc_command_internal(":FIND", OTC_COMMAND_INTERNAL_ID_FIND,      "Search the received frames, or clear them.", "[id=<id>] [cmd=<cmd>] [crc=ok|bad] [from=<time>] [to=<time>] [n=<count>] [data=<bintex>]|clear"));
+    add(new otc_command_internal(":TRACE", OTC_COMMAND_INTERNAL_ID_TRACE,    "Trace the latency of the commands, show or save the traces.", "[on|off|clear|save <file>]"));
+    add(new otc_command_internal(":PROF", OTC_COMMAND_INTERNAL_ID_PROFILE,   "Show or set the read profile of the serial link.", "[default|latency|throughput]"));
+    add(new otc_command_internal(":RING", OTC_COMMAND_INTERNAL_ID_RING,      "Show or set the size of the read ring, and the bytes lost.", "[size_kb] [max_kb]"));
     
     // Null body commands
     add(new otc_command_null("OT",  OTC_ALP_RESP_NO , "Null command"));
@@ -567,6 +939,14 @@ otc_command_parser::otc_command_parser(QWidget* parent,otcCommunicationLinkDevic
 
 
 
+otc_command_parser::~otc_command_parser()
+{
+    qDeleteAll(m_templates);
+}
+
+
+
+
 void otc_command_parser::add(otc_command* command, bool fantomCommand)
 {
 	if (command)
@@ -602,7 +982,7 @@ void otc_command_parser::parse()
 
 
 
-void otc_command_parser::exec(const QString& command)
+otc_error_t otc_command_parser::exec(const QString& command)
 {
 	//For now, use simply "split" to create list of args
 	//Ideally we should do a better parsing, to manage args in ""
@@ -610,11 +990,24 @@ void otc_command_parser::exec(const QString& command)
     //QStringList argv    = QStringList::split(" ",command);
     int cmd_arg_length  = command.indexOf(QChar(' '), 0);
     QString cmd_arg     = command.left(cmd_arg_length);
+    otc_command* cmd_type = (cmd_arg.length() > 0) ? m_commands[cmd_arg] : NULL;
+
+    // Same command line as before: re-issue its frame
+    otc_command_template* t = m_templates.value(command, NULL);
+    if (t != NULL)
+    {
+        reissue(t);
+        return OTC_ERROR_NONE;
+    }
 
-    if (cmd_arg.length() > 0)
+    if (cmd_type != NULL)
 	{
-        otc_command* cmd_type   = m_commands[cmd_arg];
-        int res                 = cmd_type->exec(command, *m_device, this);
+        m_records = 0;
+        otc_error_t res = cmd_type->exec(command, *m_device, this);
+
+        // Single record commands are kept, internal ones give no record
+        if ((res == OTC_ERROR_NONE) && (m_records == 1))
+            learn(command);
 
 		switch(res)
 		{
@@ -635,13 +1028,64 @@ void otc_command_parser::exec(const QString& command)
                                    + "</font>");
                 break;
 		}
+        return res;
 	}
     else if (command == "")
 	{}
 	else
 	{
 		otcConfig::logText("<font color=red>**Command Unknown!</font>");
+        return OTC_ERROR_UNKNOWN;
 	}
+
+    return OTC_ERROR_NONE;
+}
+
+
+
+
+/** @brief  Tells if a command line may be run for a socket client
+  * @param  command (const QString&) command line, as received
+  * @retval (bool)  TRUE for :JOB and the ALP commands
+  *
+  * The other internal commands read or write local files (:RUN, :DUMP,
+  * :TRACE save, :CAP) or change the link, and the server listens on every
+  * interface. A job cannot run an internal command either.
+  */
+bool otc_command_parser::remoteAllowed(const QString& command)
+{
+    QString name = command.section(' ', 0, 0, QString::SectionSkipEmpty);
+
+    if (!name.startsWith(":"))
+        return TRUE;
+
+    return (name == ":JOB");
+}
+
+
+
+/** @brief  Encodes a command line without sending it
+  * @param  command (const QString&) command line, as typed at the prompt
+  * @param  frames  (QList<otcWriteFrame>&) the encoded records are appended here
+  * @param  lastseq (int&) MPIPE seq of the last record, which the response carries
+  *
+  * Internal commands are executed right away and give no frame.
+  */
+otc_error_t otc_command_parser::compile(const QString& command, QList<otcWriteFrame>& frames, int& lastseq)
+{
+    otc_error_t res;
+    int         records = m_records;
+
+    // Called from an internal command (:RUN, :JOB): the records compiled here
+    // must not make that command line a template
+    m_capture       = &frames;
+    m_captureSeq    = -1;
+    res             = exec(command);
+    m_capture       = NULL;
+    m_records       = records;
+    lastseq         = m_captureSeq;
+
+    return res;
 }
 
 
@@ -668,6 +1112,153 @@ void otc_command_parser::toggle(otc_command_internal_id_t id)
 
 
 
+/** @brief  Builds an ALP message and queues it for the device writer
+  * @param  str     (const QString&) log string, shown in verbose mode
+  * @param  id      (unsigned char) ALP ID
+  * @param  cmd     (unsigned char) ALP CMD
+  * @param  body    (const QByteArray&) ALP body, can be longer than a record
+  *
+  * A body which does not fit in one record is split in CHUNK_FIRST, CONTINUE
+  * and LAST records, each with its own sequence number. Chunks go to the bulk
+  * class of the scheduler, and are flow controlled when an ACK window is set.
+  */
+otc_error_t otc_command_parser::send(const QString& str, unsigned char id, unsigned char cmd, const QByteArray& body)
+{
+    const unsigned char*    data    = (const unsigned char*)body.constData();
+    int                     left    = body.size();
+    bool                    chunked = (left > OTC_MPIPE_RECORD_MAX);
+
+    if (left > OTC_MPIPE_MESSAGE_MAX)
+        return OTC_ERROR_MSG_TOO_LONG;
+
+    do
+    {
+        otc_mpipe_superstate_t  chunk;
+        int                     len = (left > OTC_MPIPE_RECORD_MAX) ? OTC_MPIPE_RECORD_MAX : left;
+        int                     seq = otc_mpipe_builder::nextSeq();
+
+        if (!chunked)
+            chunk = OTC_MPIPE_SYNC_WORD_CHUNK_NO;
+        else if (data == (const unsigned char*)body.constData())
+            chunk = OTC_MPIPE_SYNC_WORD_CHUNK_FIRST;
+        else if (len == left)
+            chunk = OTC_MPIPE_SYNC_WORD_CHUNK_LAST;
+        else
+            chunk = OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE;
+
+        otc_mpipe_builder msg;
+        msg.build(id, cmd | echo(), seq, chunk, data, len);
+
+        if (chunked)
+            output(str, msg.start(), msg.len(), OTC_WRITE_PRIO_BULK, seq & 0xFF);
+        else
+            output(str, msg.start(), msg.len(), OTC_WRITE_PRIO_INTERACTIVE, -1);
+
+        // Kept until the command is over, in case it becomes a template
+        if (m_records++ == 0)
+        {
+            memcpy(m_recorded, msg.start(), msg.len());
+            m_recordedLen = msg.len();
+            m_recordedLog = str;
+        }
+
+        data += len;
+        left -= len;
+    } while (left > 0);
+
+    if (chunked && (m_capture == NULL))
+        otcConfig::logText(QString("%1: %2 bytes sent in %3 chunks")
+                                .arg(str).arg(body.size())
+                                .arg((body.size() + OTC_MPIPE_RECORD_MAX - 1) / OTC_MPIPE_RECORD_MAX));
+
+    return OTC_ERROR_NONE;
+}
+
+
+
+
+/** @brief  Queues a complete frame for the device writer
+  * @param  str     (const QString&) log string, shown in verbose mode
+  * @param  frame   (unsigned char*) MPIPE frame
+  * @param  len     (int) frame length
+  * @param  prio    (otc_write_prio_t) scheduler class
+  * @param  ackseq  (int) seq acknowledging the frame, -1 if not flow controlled
+  *
+  * When compiling a script the frame is kept instead. A frame refused by the
+  * scheduler (too many bytes pending for the GUI) is not logged as sent.
+  */
+void otc_command_parser::output(const QString& str, unsigned char* frame, int len, otc_write_prio_t prio, int ackseq)
+{
+    if (m_capture != NULL) {
+        log(str, frame, len);
+
+        otcWriteFrame f;
+        f.stamp         = 0;
+        f.ackseq        = ackseq;
+        f.data          = QByteArray((const char*)frame, len);
+        m_capture->append(f);
+        m_captureSeq    = frame[6];
+    }
+    else if (m_device->queueBlock(OTC_WRITE_SOURCE_GUI, prio, (char*)frame, len, ackseq) > 0) {
+        log(str, frame, len);
+    }
+    else {
+        otcConfig::logText(QString("<font color=red>**Command seq %1 not sent: the write queue is full</font>")
+                                .arg(frame[6]));
+    }
+}
+
+
+
+
+/** @brief  Keeps the single record frame of the last command as a template
+  * @param  command (const QString&) command line, used as key
+  */
+void otc_command_parser::learn(const QString& command)
+{
+    if (m_templates.count() >= OTC_COMMAND_TEMPLATE_MAX)
+    {
+        qDeleteAll(m_templates);
+        m_templates.clear();
+    }
+
+    otc_command_template* t = new otc_command_template;
+    t->log = m_recordedLog;
+    t->frame.set(m_recorded, m_recordedLen);
+    m_templates.insert(command, t);
+    m_templatesCompiled++;
+}
+
+
+
+
+/** @brief  Sends a template again, with a new seq and the current echo flag
+  * @param  t   (otc_command_template*) template of the command line
+  *
+  * Only the seq and CMD bytes change, the CRC is patched rather than computed.
+  */
+void otc_command_parser::reissue(otc_command_template* t)
+{
+    unsigned char cmd = t->frame.read(OTC_MPIPE_TEMPLATE_SLOT_CMD);
+
+    t->frame.write(OTC_MPIPE_TEMPLATE_SLOT_SEQ, otc_mpipe_builder::nextSeq());
+    t->frame.write(OTC_MPIPE_TEMPLATE_SLOT_CMD, (cmd & ~OTC_ALP_RESP_ECHO) | echo());
+    output(t->log, t->frame.start(), t->frame.len(), OTC_WRITE_PRIO_INTERACTIVE, -1);
+    m_templateHits++;
+}
+
+
+
+
+QString otc_command_parser::getStatus()
+{
+    return QString("Command templates: %1 cached, %2 hits, %3 compiled.\n")
+                .arg(m_templates.count()).arg(m_templateHits).arg(m_templatesCompiled);
+}
+
+
+
+
 void otc_command_parser::log(const QString& str, unsigned char* buffer, unsigned short len)
 {
     if (m_verbose) 
@@ -676,10 +1267,7 @@ void otc_command_parser::log(const QString& str, unsigned char* buffer, unsigned
     if ((m_echo_local) && (buffer) && (len))
     {
         QString msg = QString("<font color=gray>[ %1 ]  [ SEND ]  [ ").arg(buffer[len-4] + 256 * buffer[len-3]);
-        for (int i = 0; i < len; i++)
-        {
-            msg += QString("%1 ").arg(QString("%1").arg(buffer[i],2,16).upper().replace(' ','0'));
-        }
+        otcHexAppend(msg, buffer, len);
         msg += " ]</font>";
         otcConfig::logText(msg);
     }
@@ -30,6 +30,7 @@
 #include <qstringlist.h>
 #include <q3textedit.h>
 #include <qmap.h>
+#include <qhash.h>
 #include <qmutex.h>
 #include <qlineedit.h>
 #include <q3dict.h>
@@ -37,6 +38,8 @@
 #include "otc_main.h"
 #include "otc_alp.h"
 #include "otc_serial.h"
+#include "otc_mpipe.h"
+#include "otc_scheduler.h"
 
 // ---------------------------------------- //
 //                                          //
@@ -78,13 +81,23 @@ typedef enum {
     OTC_COMMAND_INTERNAL_ID_VERBOSE,
     OTC_COMMAND_INTERNAL_ID_ECHO_REMOTE,
     OTC_COMMAND_INTERNAL_ID_ECHO_LOCAL,
+    OTC_COMMAND_INTERNAL_ID_REASSEMBLY,
+    OTC_COMMAND_INTERNAL_ID_ACK_WINDOW,
+    OTC_COMMAND_INTERNAL_ID_SCRIPT,
+    OTC_COMMAND_INTERNAL_ID_DUMP,
+    OTC_COMMAND_INTERNAL_ID_JOB,
+    OTC_COMMAND_INTERNAL_ID_CAPTURE,
+    OTC_COMMAND_INTERNAL_ID_FIND,
+    OTC_COMMAND_INTERNAL_ID_TRACE,
+    OTC_COMMAND_INTERNAL_ID_PROFILE,
+    OTC_COMMAND_INTERNAL_ID_RING,
     OTC_COMMAND_INTERNAL_ID_QTY
 } otc_command_internal_id_t;
 
 
 class otc_command_internal : public otc_command {
 public :
-    otc_command_internal(const QString& mainarg, otc_command_internal_id_t id, const QString& help);
+    otc_command_internal(const QString& mainarg, otc_command_internal_id_t id, const QString& help, const QString& syntax = "");
     virtual ~otc_command_internal() {;}
     otc_error_t exec(const QString& cmd_string, otcCommunicationLinkDevice& device, otc_command_parser* parser);
 private :
@@ -124,9 +137,7 @@ private :
     QString         m_log;
     unsigned char   m_id;
     unsigned char   m_cmd;
-    unsigned short  m_bodylen;
-    unsigned char   m_body[256];
-    unsigned char*  m_bodyptr;
+    QByteArray      m_body;
 };
 
 
@@ -153,13 +164,29 @@ private :
     otc_error_t                     filetemp(QString s);
     QString                         m_log;
     unsigned char                   m_cmd;
-    unsigned short                  m_bodylen;
-    unsigned char                   m_body[256];
-    unsigned char *                 m_bodyptr;
+    QByteArray                      m_body;
     otc_command_file_template_t     m_template;
 };
 
 
+// ---------------------------------------- //
+//                                          //
+//           COMMAND TEMPLATE               //
+//                                          //
+// ---------------------------------------- //
+
+/// Command lines remembered by the parser
+#define OTC_COMMAND_TEMPLATE_MAX            64
+
+/// A command line which gave a single record is encoded once. When the same
+/// line is entered again, only the seq and echo flag of its frame change.
+class otc_command_template {
+public :
+    QString                 log;
+    otc_mpipe_template      frame;
+};
+
+
 // ---------------------------------------- //
 //                                          //
 //           COMMAND PARSER                 //
@@ -175,13 +202,18 @@ class otc_command_parser : public QLineEdit {
 
 public :
 	otc_command_parser(QWidget* parent,otcCommunicationLinkDevice* device);
+	~otc_command_parser();
 
-	void                                exec(const QString& commandline);
+	otc_error_t                         exec(const QString& commandline);
+    otc_error_t                         compile(const QString& commandline, QList<otcWriteFrame>& frames, int& lastseq);
+    static bool                         remoteAllowed(const QString& commandline);
     void                                add(otc_command* command, bool fantomCommand = FALSE);
     void                                toggle(otc_command_internal_id_t id);
     void                                log(const QString& str, unsigned char* buffer, unsigned short len);
+    otc_error_t                         send(const QString& str, unsigned char id, unsigned char cmd, const QByteArray& body);
     otc_alp_resp_t                      echo(void) {return ((m_echo_remote) ? OTC_ALP_RESP_ECHO : OTC_ALP_RESP_NO);};
-    int                                 seq(void) {return (m_cmdIndex++);};
+    int                                 seq(void) {return otc_mpipe_builder::nextSeq();};
+    QString                             getStatus();
 
 protected :
 
@@ -189,10 +221,22 @@ protected :
 	QStringList			                m_visibleCommands;
 	QStringList			                m_commandMemory;
 	otcCommunicationLinkDevice*		    m_device;
-	int                                 m_cmdIndex;
     bool                                m_verbose;
     bool                                m_echo_remote;
     bool                                m_echo_local;
+    QList<otcWriteFrame>*               m_capture;
+    int                                 m_captureSeq;
+    QHash<QString,otc_command_template*> m_templates;
+    unsigned int                        m_templateHits;
+    unsigned int                        m_templatesCompiled;
+    int                                 m_records;
+    unsigned char                       m_recorded[OTC_MPIPE_FRAME_MAX];
+    int                                 m_recordedLen;
+    QString                             m_recordedLog;
+
+    void                                output(const QString& str, unsigned char* frame, int len, otc_write_prio_t prio, int ackseq);
+    void                                learn(const QString& command);
+    void                                reissue(otc_command_template* t);
 
 protected slots :
 
@@ -23,40 +23,47 @@
 //
 /// =========================================================================
 
-#include <stdio.h>
 #include "otc_main.h"
 #include "otc_serial.h"
+#include "otc_capture.h"
+#include "otc_clock.h"
 
-FILE* fdebug = NULL;
+// Capture of the bytes read from the device ("Start Logging...")
+static otcCaptureWriter* capture = NULL;
 
-void ddebug(unsigned char* buffer,int len)
+void ddebug(unsigned char* buffer,int len,const otcReadStamp& stamp)
 {
-    if(!fdebug)
+    if(!capture || !capture->isOpen() || len<=0)
         return;
 
-    fwrite(buffer,len,1,fdebug);
+    capture->write(buffer,len,otcClockRealtime(stamp.first),stamp.byteTime);
 }
 
 void dcl()
 {
-    if(!fdebug)
+    if(!capture)
         return;
-    fclose(fdebug);
-    fdebug = NULL;
+    capture->close();
 }
 
+// The writer is never deleted: the reader thread may be in ddebug()
 void dop()
 {
-    if(fdebug)
-        dcl();
-    fdebug = fopen("debug.bin","wb");
-    if(!fdebug)
-        return;
+    if(!capture)
+        capture = new otcCaptureWriter();
+    capture->open("debug");
 }
 
 bool dIsOpen()
 {
-    return (fdebug!=NULL);
+    return (capture!=NULL && capture->isOpen());
+}
+
+QString dStatus()
+{
+    if(!capture)
+        return "Capture off.\n";
+    return capture->getStatus();
 }
 
 void otcCommunicationLinkDevice::lock()
@@ -74,6 +81,45 @@ bool otcCommunicationLinkDevice::isOpen()
     return m_serialContext.hasComOpened();
 }
 
+// Closes a link whose device is gone. Caller must hold the device lock.
+void otcCommunicationLinkDevice::checkLost()
+{
+    if (m_serialContext.hasComOpened() && m_serialContext.lost())
+    {
+        m_serialContext.sclose();
+        m_lost = TRUE;
+    }
+}
+
+// Arrival of the len bytes of a read which just returned, see otc_clock.h.
+// Caller must hold the device lock.
+void otcCommunicationLinkDevice::stampRead(int len, otcReadStamp& stamp)
+{
+    qint64 now = otcClockNow();
+
+    stamp.byteTime = otcClockByteTime(m_serialContext.actualBaudrate());
+    stamp.first    = now - (qint64)(len - 1) * stamp.byteTime;
+
+    // After the last byte of the previous read
+    if (stamp.first <= m_lastByte)
+    {
+        stamp.byteTime = (int)((now - m_lastByte) / len);
+        stamp.first    = m_lastByte + stamp.byteTime;
+    }
+
+    m_lastByte = stamp.first + (qint64)(len - 1) * stamp.byteTime;
+}
+
+// Whether the link was lost since the last call
+bool otcCommunicationLinkDevice::takeLost()
+{
+    lock();
+    bool ret = m_lost;
+    m_lost = FALSE;
+    unlock();
+    return ret;
+}
+
 void otcCommunicationLinkDevice::flush() //used for autobauding
 {
     lock();
@@ -81,6 +127,71 @@ void otcCommunicationLinkDevice::flush() //used for autobauding
     unlock();
 }
 
+// Not under the device lock: the reads go on while the writes drain.
+bool otcCommunicationLinkDevice::drain()
+{
+    if (!isOpen()) return false;
+    return m_serialContext.drain();
+}
+
+// Not under the device lock either: the writes go on while the reader waits
+bool otcCommunicationLinkDevice::waitData(int timeout)
+{
+    if (!isOpen()) return false;
+    return m_serialContext.wait(timeout);
+}
+
+// Not under the device lock: the reader goes on while the writer waits
+bool otcCommunicationLinkDevice::waitWritable(int timeout)
+{
+    if (!isOpen()) return false;
+    return m_serialContext.waitWritable(timeout);
+}
+
+bool otcCommunicationLinkDevice::icount(otc_serial_icount& c)
+{
+    lock();
+    bool ret = m_serialContext.icount(c);
+    unlock();
+    return ret;
+}
+
+void otcCommunicationLinkDevice::setProfile(otc_serial_profile_t profile)
+{
+    lock();
+    m_serialContext.setProfile(profile);
+    unlock();
+}
+
+static const char* otcProfileName[OTC_SERIAL_PROFILE_QTY] = {
+    "default", "latency", "throughput"
+};
+
+QString otcCommunicationLinkDevice::getStatus()
+{
+    lock();
+
+    unsigned int reads  = m_serialContext.reads();
+    unsigned int writes = m_serialContext.writes();
+    int          low    = m_serialContext.lowLatency();
+    QString      ret    = QString("Serial %1: %2 baud (%3 on the line), profile %4, low latency %5")
+                                .arg(isOpen() ? "open" : "closed")
+                                .arg(otcConfig::argBaudRate).arg(m_serialContext.actualBaudrate())
+                                .arg(otcProfileName[m_serialContext.profile()])
+                                .arg((low < 0) ? "not supported" : (low ? "on" : "off"));
+
+    if (m_serialContext.profile() == OTC_SERIAL_PROFILE_THROUGHPUT)
+        ret += QString(", batch %1 bytes").arg(m_serialContext.batch());
+
+    ret += QString(".\n  %1 reads, %2 bytes per read, %3 writes, %4 bytes per write.\n")
+                .arg(reads).arg(reads ? (m_serialContext.readBytes() / reads) : 0)
+                .arg(writes).arg(writes ? (m_serialContext.writeBytes() / writes) : 0);
+
+    unlock();
+
+    return ret;
+}
+
 void otcCommunicationLinkDevice::dbgBreak()
 {
     lock();
@@ -96,6 +207,14 @@ bool otcCommunicationLinkDevice::changeBaudRate(int nBaud)
     return ret;
 }
 
+int otcCommunicationLinkDevice::actualBaudRate()
+{
+    lock();
+    int ret = m_serialContext.actualBaudrate();
+    unlock();
+    return ret;
+}
+
 bool otcCommunicationLinkDevice::changeFlowMode(OTC_FLOW_T mode)
 {
     lock();
@@ -178,70 +297,72 @@ void unXonXoffizeBuffer(char* buffer,unsigned int datalen,unsigned int& datalenA
 #define EP_IN   0x81
 #define EP_OUT  0x01
 
-int otcCommunicationLinkDevice::writeBlockXonXoff(unsigned char* buffer,unsigned int len)
+// The buffers are escaped into one, written whole: a short write cannot be
+// given back in bytes of the caller, so the driver is waited for under the
+// device lock. Caller must hold the device lock.
+int otcCommunicationLinkDevice::writeVectorXonXoff(const struct iovec* iov, int iovcnt)
 {
-    //It's ok to use a static. XonXoff is used only for serial and it's thread protected, only one
-    //can access this function at a time
-    static unsigned char tempBuffer[0x2000];
+    unsigned int len = 0;
 
-    unsigned int alreadyDone = 0;
-    unsigned int toWrite = 0;
-    unsigned int toParse = 0;
-    unsigned int writeOffset = 0;
+    m_escaped.resize(0);
 
-    int ret;
-
-    while(alreadyDone<len)
+    for (int v=0; v<iovcnt; v++)
     {
-        toParse = (len-alreadyDone>0x1000)?0x1000:(len-alreadyDone);
-        writeOffset = 0;
+        const unsigned char* buffer = (const unsigned char*)iov[v].iov_base;
+
+        len += iov[v].iov_len;
 
-        for(unsigned int i=0;i<toParse;i++)
+        for (unsigned int i=0; i<iov[v].iov_len; i++)
         {
-            switch(buffer[alreadyDone+i])
+            switch(buffer[i])
             {
                 case '\\':
-                    tempBuffer[i+writeOffset]='\\';
-                    tempBuffer[i+writeOffset+1]=RBNOTBSLASH;
-                    writeOffset++; //added one char
+                    m_escaped.append('\\');
+                    m_escaped.append((char)RBNOTBSLASH);
                 break;
                 case RBXON:
-                    tempBuffer[i+writeOffset]='\\';
-                    tempBuffer[i+writeOffset+1]=RBNOTXON;
-                    writeOffset++; //added one char
+                    m_escaped.append('\\');
+                    m_escaped.append((char)RBNOTXON);
                 break;
                 case RBXOFF :
-                    tempBuffer[i+writeOffset]='\\';
-                    tempBuffer[i+writeOffset+1]=RBNOTXOFF;
-                    writeOffset++; //added one char
+                    m_escaped.append('\\');
+                    m_escaped.append((char)RBNOTXOFF);
                 break;
                 default :
-                    tempBuffer[i+writeOffset]=buffer[alreadyDone+i];
+                    m_escaped.append((char)buffer[i]);
                 break;
             }
         }
+    }
+
+    struct iovec escaped;
+    int          left = 1;
 
-        toWrite = toParse + writeOffset;
+    escaped.iov_base = m_escaped.data();
+    escaped.iov_len  = m_escaped.size();
 
-        ret = m_serialContext.swrite((char*)tempBuffer,toWrite);
+    while(left>0)
+    {
+        int ret = m_serialContext.swritev(&escaped,1);
         if(ret<0)
             return ret;
 
-        if(ret<(int)toWrite) //problem
-            return alreadyDone;
+        left = otcIovecSkip(&escaped,left,ret);
 
-        alreadyDone += toParse;
+        if((left>0) && !m_serialContext.waitWritable(SERIALWAIT_TIMEOUT))
+            return -1;
     }
 
     return len;
 }
 
 
-int otcCommunicationLinkDevice::readBlock(unsigned char* buffer, unsigned int len)
+int otcCommunicationLinkDevice::readBlock(unsigned char* buffer, unsigned int len, otcReadStamp* stamp)
 {
     static bool     lastIsBackSlash = false;
 
-    int ret = 0;
+    int             ret = 0;
+    otcReadStamp    st;
 
     if(len==0)
         return 0;
@@ -266,43 +387,85 @@ int otcCommunicationLinkDevice::readBlock(unsigned char* buffer, unsigned int le
 
 			ret = m_serialContext.sread(buffer+(lastIsBackSlash?1:0),len);
 
-			if(ret<0)
+			if(ret<=0)
 				goto endOfRead;
 
-			ddebug(buffer+(lastIsBackSlash?1:0),ret);
-
 			unsigned int datalenAfter;
 			unXonXoffizeBuffer((char*)buffer,ret+(lastIsBackSlash?1:0),datalenAfter,lastIsBackSlash);
 			ret = datalenAfter;
+
+			// Stamped as the bytes given to the parser, the escapes removed
+			if(ret>0)
+			{
+				stampRead(ret,st);
+				ddebug(buffer,ret,st);
+			}
 		}
 		else
 		{
 			ret = m_serialContext.sread(buffer,len);
-			ddebug(buffer,ret);
+			if(ret>0)
+			{
+				stampRead(ret,st);
+				ddebug(buffer,ret,st);
+			}
 		}
     }
 
 endOfRead :
 
+    if(stamp && (ret>0))
+        *stamp = st;
+
+    checkLost();
     unlock();
     return ret;
 }
 
 int otcCommunicationLinkDevice::writeBlock(const char *buffer, unsigned int len)
 {
-    int ret = 0;
     lock();
+    int ret = writeBlockUnprotected(buffer,len);
+    unlock();
+    return ret;
+}
+
+// Caller must hold the device lock
+int otcCommunicationLinkDevice::writeBlockUnprotected(const char *buffer, unsigned int len)
+{
+    struct iovec v;
 
+    v.iov_base = (void*)buffer;
+    v.iov_len  = len;
+
+    return writeVectorUnprotected(&v,1);
+}
+
+// Gather write of several buffers, a short one when the driver is full (the
+// caller waits with waitWritable()). Caller must hold the device lock.
+int otcCommunicationLinkDevice::writeVectorUnprotected(const struct iovec* iov, int iovcnt)
+{
     if(!isOpen())
-        ret = 0;
+        return 0;
+
+    int ret;
+
+    if(otcConfig::argFlowMode == OTC_FLOW_XONXOFF)
+        ret = writeVectorXonXoff(iov,iovcnt);
     else
-    {
-        if(otcConfig::argFlowMode == OTC_FLOW_XONXOFF)
-            ret = writeBlockXonXoff((unsigned char*)buffer,len);
-        else
-            ret = m_serialContext.swrite(buffer,len);
-    }
-    unlock();
+        ret = m_serialContext.swritev(iov,iovcnt);
+
+    checkLost();
     return ret;
 }
 
+// Hand a complete frame to the write scheduler. Without scheduler (no writer
+// thread running) the frame is written right away.
+int otcCommunicationLinkDevice::queueBlock(int source, otc_write_prio_t prio, const char *buffer, unsigned int len, int ackseq)
+{
+    if(!m_scheduler)
+        return writeBlock(buffer,len);
+
+    return m_scheduler->enqueue(source,prio,buffer,len,ackseq) ? (int)len : 0;
+}
+
@@ -0,0 +1,870 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_frames.cpp
+/// @brief          Frame store
+//
+/// =========================================================================
+
+#include <string.h>
+#include <qdatetime.h>
+#include <qstringlist.h>
+#include <qdir.h>
+
+#include "otc_frames.h"
+#include "otc_clock.h"
+#include "otc_hex.h"
+#include "bintex.h"
+
+
+#define OTC_FRAMES_PAGE_MASK                (OTC_FRAMES_PAGE - 1)
+#define OTC_FRAMES_CHUNK_MASK               (OTC_FRAMES_CHUNK - 1)
+
+// Entries of a posting list copied at a time by a search
+#define OTC_FRAMES_POST_BLOCK               4096
+
+
+// ---------------------------------------- //
+//                                          //
+//              QUERY                       //
+//                                          //
+// ---------------------------------------- //
+
+otcFrameQuery::otcFrameQuery()
+{
+    id      = -1;
+    cmd     = -1;
+    crc     = -1;
+    from    = -1;
+    to      = -1;
+    limit   = OTC_FRAMES_LIMIT;
+}
+
+// ms since 1970, hh:mm:ss of today, or yyyy-MM-ddThh:mm:ss
+static bool parseTime(const QString& s, qint64& t)
+{
+    bool        ok;
+    QTime       tod;
+    QDateTime   d;
+
+    t = s.toLongLong(&ok);
+    if (ok)
+        return TRUE;
+
+    tod = QTime::fromString(s, "hh:mm:ss");
+    if (tod.isValid())
+    {
+        t = QDateTime(QDate::currentDate(), tod).toMSecsSinceEpoch();
+        return TRUE;
+    }
+
+    d = QDateTime::fromString(s, Qt::ISODate);
+    if (!d.isValid())
+        return FALSE;
+
+    t = d.toMSecsSinceEpoch();
+    return TRUE;
+}
+
+static bool parseByte(const QString& s, int& v)
+{
+    bool ok;
+
+    v = s.toInt(&ok, 16);
+    return ok && (v >= 0) && (v <= 0xFF);
+}
+
+/** @brief  Reads the criteria of a search
+  * @param  args    (const QString&) id=<id> cmd=<cmd> crc=ok|bad from=<time> to=<time>
+  *                 n=<limit> data=<bintex>, in any order, data last
+  * @retval (bool)  FALSE on a syntax error
+  */
+bool otcFrameQuery::parse(const QString& args)
+{
+    QStringList words = args.split(' ', QString::SkipEmptyParts);
+
+    for (int i=0; i<words.count(); i++)
+    {
+        QString key     = words[i].section('=', 0, 0);
+        QString value   = words[i].section('=', 1);
+        bool    ok      = TRUE;
+
+        if (key == "id")
+            ok = parseByte(value, id);
+        else if (key == "cmd")
+            ok = parseByte(value, cmd);
+        else if (key == "crc")
+        {
+            crc = (value == "ok") ? 1 : (value == "bad") ? 0 : -2;
+            ok  = (crc >= 0);
+        }
+        else if (key == "from")
+            ok = parseTime(value, from);
+        else if (key == "to")
+            ok = parseTime(value, to);
+        else if (key == "n")
+        {
+            limit   = value.toInt(&ok);
+            ok      = ok && (limit > 0);
+        }
+        else if (key == "data")
+        {
+            // BinTex, up to the end of the line
+            QByteArray      text = args.mid(args.indexOf("data=") + 5).trimmed().toUtf8();
+            unsigned char   buf[OTC_FRAMES_PATTERN_MAX];
+            bintex_status   status;
+            int             size;
+
+            size = bintex_parse(text.constData(), text.size(), buf, sizeof(buf), &status);
+            if ((status.error != BINTEX_OK) || (size <= 0))
+                return FALSE;
+
+            pattern = QByteArray((const char*)buf, size);
+            break;
+        }
+        else
+            ok = FALSE;
+
+        if (!ok)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/** @brief  Line of the log for a frame, as printed by the parser with its time
+  */
+QString otcFrame::text() const
+{
+    QString ret = crcok ? "<font color=blue>" : "<font color=red>";
+
+    ret += QString("%1  [ %2 ]  [ ")
+                .arg(QDateTime::fromMSecsSinceEpoch(time).toString("hh:mm:ss.zzz"))
+                .arg(seq);
+    otcHexAppend(ret, &id, 1);
+    otcHexAppend(ret, &cmd, 1);
+    ret += "]  [ ";
+    otcHexAppend(ret, (const unsigned char*)data.constData(), data.size());
+    ret += "]</font>";
+
+    return ret;
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//              STORE                       //
+//                                          //
+// ---------------------------------------- //
+
+int otcFrameStore::maxFrames    = OTC_FRAMES_MAX;
+int otcFrameStore::memChunks    = OTC_FRAMES_MEM_CHUNKS;
+int otcFrameStore::maxChunks    = OTC_FRAMES_MAX_CHUNKS;
+
+
+// First place of the pattern in the bytes, NULL if none
+static inline const unsigned char* search(const unsigned char* data, int len, const QByteArray& pattern)
+{
+#if defined(__GLIBC__)
+    return (const unsigned char*)memmem(data, len, pattern.constData(), pattern.size());
+#else
+    const unsigned char*    p       = data;
+    const unsigned char*    end     = data + len - pattern.size() + 1;
+    unsigned char           first   = (unsigned char)pattern[0];
+
+    while ((p < end) && ((p = (const unsigned char*)memchr(p, first, end - p)) != NULL))
+    {
+        if (memcmp(p, pattern.constData(), pattern.size()) == 0)
+            return p;
+        p++;
+    }
+    return NULL;
+#endif
+}
+
+
+otcFrameStore::otcFrameStore()
+{
+    m_spill     = NULL;
+    m_readers   = 0;
+    m_trim      = FALSE;
+    m_dropped   = 0;
+    m_slots     = 0;
+    m_next      = 0;
+    reset();
+}
+
+otcFrameStore::~otcFrameStore()
+{
+    reset();
+}
+
+void otcFrameStore::reset(void)
+{
+    for (int i=0; i<m_pages.count(); i++)
+        delete m_pages[i];
+    m_pages.clear();
+
+    for (int i=0; i<m_chunks.count(); i++)
+        freeChunk(m_chunks[i]);
+    m_chunks.clear();
+
+    // The file is removed with it
+    delete m_spill;
+    m_spill = NULL;
+    m_freeSlots.clear();
+    m_slots = 0;
+
+    for (int i=0; i<256; i++)
+    {
+        m_post[i].clear();
+        m_postFirst[i] = 0;
+    }
+
+    m_trim = FALSE;
+
+    // Numbering goes on at the next page
+    m_next          = (m_next + OTC_FRAMES_PAGE_MASK) & ~OTC_FRAMES_PAGE_MASK;
+    m_first         = m_next;
+    m_chunkFirst    = 0;
+    m_arenaEnd      = 0;
+    m_epoch         = QDateTime::currentMSecsSinceEpoch();
+    m_lastTime      = 0;
+    m_clock.start();
+}
+
+/** @brief  Removes all the frames
+  */
+void otcFrameStore::clear(void)
+{
+    m_mutex.lock();
+    while (m_readers > 0)
+        m_idle.wait(&m_mutex);
+    reset();
+    m_dropped = 0;
+    m_mutex.unlock();
+}
+
+/** @brief  Adds a frame, from the parser
+  * @param  seq     (unsigned char) MPIPE sequence number
+  * @param  id      (unsigned char) ALP id
+  * @param  cmd     (unsigned char) ALP cmd
+  * @param  data    (const unsigned char*) ALP body
+  * @param  len     (int) length of the body
+  * @param  crcok   (bool) CRC status
+  * @param  stamp   (qint64) arrival of the first byte of the frame (ns,
+  *                 monotonic clock, see otc_clock.h), -1 for now
+  * @retval (quint32) number of the frame
+  */
+quint32 otcFrameStore::append(unsigned char seq, unsigned char id, unsigned char cmd,
+                              const unsigned char* data, int len, bool crcok, qint64 stamp)
+{
+    otc_frames_page_t*  page;
+    int                 i;
+    qint64              now;
+    quint32             number;
+
+    m_mutex.lock();
+
+    // The time and the numbers must fit their columns: starts again after
+    // 49 days or 4G frames.
+    now = m_clock.elapsed();
+    if ((now > 0xFFFFFFFFLL) || (m_next == 0xFFFFFFFF))
+    {
+        while (m_readers > 0)
+            m_idle.wait(&m_mutex);
+        m_dropped += m_next - m_first;
+        reset();
+        now = 0;
+    }
+
+    // The times must not go back: a message is stamped with its first chunk
+    if (stamp >= 0)
+        now = qBound(m_lastTime, otcClockRealtime(stamp) / 1000000 - m_epoch, now);
+    m_lastTime = now;
+
+    // Columns. Nothing is dropped during a search: see trim().
+    if ((m_next & OTC_FRAMES_PAGE_MASK) == 0)
+    {
+        if (!m_pages.isEmpty() && ((qint64)(m_next - m_first) + OTC_FRAMES_PAGE > maxFrames))
+        {
+            if (m_readers == 0)
+                dropPage();
+            else
+                m_trim = TRUE;
+        }
+        m_pages.append(new otc_frames_page_t);
+    }
+
+    // Payload, in a new chunk when it does not fit the current one
+    if ((m_arenaEnd & OTC_FRAMES_CHUNK_MASK) + len > OTC_FRAMES_CHUNK)
+        m_arenaEnd = (m_arenaEnd | OTC_FRAMES_CHUNK_MASK) + 1;
+
+    if (len > 0)
+    {
+        int c = (int)((m_arenaEnd >> OTC_FRAMES_CHUNK_BITS) - m_chunkFirst);
+
+        if (c == m_chunks.count())
+        {
+            otc_frames_chunk_t chunk;
+
+            chunk.data = new unsigned char[OTC_FRAMES_CHUNK];
+            chunk.slot = -1;
+            m_chunks.append(chunk);
+
+            if (m_readers == 0)
+            {
+                while ((m_chunks.count() > maxChunks) && (m_pages.count() > 1))
+                    dropPage();
+                spill();
+            }
+            else
+                m_trim = TRUE;
+            c = m_chunks.count() - 1;
+        }
+
+        memcpy(m_chunks[c].data + (m_arenaEnd & OTC_FRAMES_CHUNK_MASK), data, len);
+    }
+
+    page                = m_pages.last();
+    i                   = m_next & OTC_FRAMES_PAGE_MASK;
+    page->time[i]       = (quint32)now;
+    page->offset[i]     = m_arenaEnd;
+    page->length[i]     = (quint16)len;
+    page->seq[i]        = seq;
+    page->id[i]         = id;
+    page->cmd[i]        = cmd;
+    page->flags[i]      = crcok ? OTC_FRAMES_FLAG_CRC_OK : 0;
+
+    m_post[id].append(m_next);
+    m_arenaEnd += len;
+    number = m_next++;
+
+    m_mutex.unlock();
+
+    return number;
+}
+
+// Drops the oldest page, with the chunks only it was using
+void otcFrameStore::dropPage(void)
+{
+    qint64 keep;
+
+    delete m_pages.takeFirst();
+    m_dropped  += qMin((quint32)OTC_FRAMES_PAGE, m_next - m_first);
+    m_first    += OTC_FRAMES_PAGE;
+    if (m_first > m_next)
+        m_first = m_next;
+
+    keep = (m_first < m_next) ? (qint64)m_pages[0]->offset[0] : m_arenaEnd;
+    while (!m_chunks.isEmpty() && (((m_chunkFirst + 1) << OTC_FRAMES_CHUNK_BITS) <= keep))
+    {
+        freeChunk(m_chunks[0]);
+        m_chunks.removeFirst();
+        m_chunkFirst++;
+    }
+
+    // The posting lists are compacted once half of them is dropped
+    for (int id=0; id<256; id++)
+    {
+        QVector<quint32>&   post    = m_post[id];
+        int&                first   = m_postFirst[id];
+
+        while ((first < post.size()) && (post[first] < m_first))
+            first++;
+
+        if (first > post.size() / 2)
+        {
+            post.remove(0, first);
+            first = 0;
+        }
+    }
+}
+
+// Limits held back during the searches, when the last one ends: the pages
+// append() would have dropped, then the chunks it would have spilled
+void otcFrameStore::trim(void)
+{
+    if (!m_trim)
+        return;
+    m_trim = FALSE;
+
+    while ((m_pages.count() > 1) &&
+           (((qint64)m_pages.count() * OTC_FRAMES_PAGE > maxFrames) || (m_chunks.count() > maxChunks)))
+    {
+        dropPage();
+    }
+    spill();
+}
+
+// Moves the oldest chunks in memory to the spill file, until memChunks are
+// left. The chunk being filled always stays.
+void otcFrameStore::spill(void)
+{
+    int inMemory = 0;
+
+    for (int i=0; i<m_chunks.count(); i++)
+    {
+        if (m_chunks[i].slot < 0)
+            inMemory++;
+    }
+
+    for (int i=0; (i < m_chunks.count() - 1) && (inMemory > memChunks); i++)
+    {
+        otc_frames_chunk_t& c = m_chunks[i];
+        int                 slot;
+
+        if (c.slot >= 0)
+            continue;
+
+        if (m_spill == NULL)
+        {
+            m_spill = new QTemporaryFile(QDir::tempPath() + "/otcom-frames");
+            if (!m_spill->open())
+            {
+                // Kept in memory, tried again with the next chunk
+                delete m_spill;
+                m_spill = NULL;
+                return;
+            }
+        }
+
+        slot = m_freeSlots.isEmpty() ? m_slots : m_freeSlots.first();
+        if (!m_spill->seek((qint64)slot << OTC_FRAMES_CHUNK_BITS) ||
+            (m_spill->write((const char*)c.data, OTC_FRAMES_CHUNK) != OTC_FRAMES_CHUNK) ||
+            !m_spill->flush())
+        {
+            return;
+        }
+
+        if (m_freeSlots.isEmpty())
+            m_slots++;
+        else
+            m_freeSlots.removeFirst();
+
+        delete[] c.data;
+        c.data = NULL;
+        c.slot = slot;
+        inMemory--;
+    }
+}
+
+void otcFrameStore::freeChunk(otc_frames_chunk_t& c)
+{
+    if (c.slot < 0)
+    {
+        delete[] c.data;
+    }
+    else
+    {
+        if (c.data != NULL)
+            m_spill->unmap(c.data);
+        m_freeSlots.append(c.slot);
+    }
+    c.data = NULL;
+}
+
+// Maps a spilled chunk, with the lock held
+unsigned char* otcFrameStore::map(int c)
+{
+    otc_frames_chunk_t& k = m_chunks[c];
+
+    if (k.data == NULL)
+        k.data = m_spill->map((qint64)k.slot << OTC_FRAMES_CHUNK_BITS, OTC_FRAMES_CHUNK);
+
+    return k.data;
+}
+
+// View of the store for a search. Until release(), the pages and chunks of
+// the view are neither dropped nor spilled, and the frames before v.next are
+// no longer written.
+void otcFrameStore::snapshot(otc_frames_view_t& v)
+{
+    m_mutex.lock();
+    m_readers++;
+    v.pages         = m_pages;
+    v.chunks        = m_chunks;
+    v.first         = m_first;
+    v.next          = m_next;
+    v.chunkFirst    = m_chunkFirst;
+    v.epoch         = m_epoch;
+    m_mutex.unlock();
+}
+
+void otcFrameStore::release(void)
+{
+    m_mutex.lock();
+    if (--m_readers == 0)
+    {
+        trim();
+        m_idle.wakeAll();
+    }
+    m_mutex.unlock();
+}
+
+// Payload at an offset of the arena, a spilled chunk is mapped on first use
+const unsigned char* otcFrameStore::payload(otc_frames_view_t& v, quint64 offset)
+{
+    int                 k = (int)((offset >> OTC_FRAMES_CHUNK_BITS) - v.chunkFirst);
+    otc_frames_chunk_t& c = v.chunks[k];
+
+    if (c.data == NULL)
+    {
+        // Same index in the store: nothing is dropped during a search
+        m_mutex.lock();
+        c.data = map(k);
+        m_mutex.unlock();
+        if (c.data == NULL)
+            return NULL;
+    }
+
+    return c.data + (offset & OTC_FRAMES_CHUNK_MASK);
+}
+
+// First frame at or after a time of the store
+quint32 otcFrameStore::bound(const otc_frames_view_t& v, qint64 time)
+{
+    quint32 lo = v.first;
+    quint32 hi = v.next;
+
+    while (lo < hi)
+    {
+        quint32 mid = lo + (hi - lo) / 2;
+
+        if ((qint64)v.pages[(mid - v.first) >> OTC_FRAMES_PAGE_BITS]->time[mid & OTC_FRAMES_PAGE_MASK] < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Frame of lo..hi-1 whose payload is at an offset of the arena (the last
+// one starting at or before it)
+quint32 otcFrameStore::frameAt(const otc_frames_view_t& v, quint64 offset, quint32 lo, quint32 hi)
+{
+    while (hi - lo > 1)
+    {
+        quint32 mid = lo + (hi - lo) / 2;
+
+        if (v.pages[(mid - v.first) >> OTC_FRAMES_PAGE_BITS]->offset[mid & OTC_FRAMES_PAGE_MASK] <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Search of a pattern in frames lo..hi-1, whatever their id. The payloads are
+// in the arena in the order of the frames: the pattern is searched in whole
+// chunks, from the newest, each place found giving its frame by bisection.
+void otcFrameStore::scan(otc_frames_view_t& v, const otcFrameQuery& q, quint32 lo, quint32 hi, QList<otcFrame>& result, int& visited)
+{
+    otcFrameQuery       columns = q;
+    otc_frames_page_t*  last    = v.pages[(hi - 1 - v.first) >> OTC_FRAMES_PAGE_BITS];
+    int                 i       = (hi - 1) & OTC_FRAMES_PAGE_MASK;
+    quint64             start   = v.pages[(lo - v.first) >> OTC_FRAMES_PAGE_BITS]->offset[lo & OTC_FRAMES_PAGE_MASK];
+    quint64             end     = last->offset[i] + last->length[i];
+    QVector<quint32>    found;
+
+    columns.pattern.clear();
+
+    for (qint64 k = (qint64)(end >> OTC_FRAMES_CHUNK_BITS);
+         (k >= (qint64)(start >> OTC_FRAMES_CHUNK_BITS)) && (result.count() < q.limit); k--)
+    {
+        quint64                 from    = qMax(start, (quint64)k << OTC_FRAMES_CHUNK_BITS);
+        quint64                 to      = qMin(end, (quint64)(k + 1) << OTC_FRAMES_CHUNK_BITS);
+        const unsigned char*    base;
+        const unsigned char*    p;
+
+        if (from >= to)
+            continue;
+        if ((base = payload(v, from)) == NULL)
+            continue;
+
+        found.clear();
+        p = base;
+        while ((p = search(p, (int)(base + (to - from) - p), q.pattern)) != NULL)
+        {
+            quint64             at      = from + (p - base);
+            quint32             n       = frameAt(v, at, lo, hi);
+            otc_frames_page_t*  page    = v.pages[(n - v.first) >> OTC_FRAMES_PAGE_BITS];
+            int                 j       = n & OTC_FRAMES_PAGE_MASK;
+            quint64             stop    = page->offset[j] + page->length[j];
+
+            // Not across two payloads, or in the gap at the end of a chunk
+            if (at + q.pattern.size() > stop)
+            {
+                p++;
+                continue;
+            }
+
+            visited++;
+            if (match(v, n, columns))
+                found.append(n);
+            p = base + (stop - from);
+        }
+
+        for (int f=found.size()-1; (f >= 0) && (result.count() < q.limit); f--)
+        {
+            result.prepend(otcFrame());
+            get(v, found[f], result.first());
+        }
+    }
+}
+
+bool otcFrameStore::match(otc_frames_view_t& v, quint32 n, const otcFrameQuery& q)
+{
+    otc_frames_page_t*      page    = v.pages[(n - v.first) >> OTC_FRAMES_PAGE_BITS];
+    int                     i       = n & OTC_FRAMES_PAGE_MASK;
+    const unsigned char*    data;
+
+    if ((q.cmd >= 0) && (page->cmd[i] != q.cmd))
+        return FALSE;
+    if ((q.crc >= 0) && ((page->flags[i] & OTC_FRAMES_FLAG_CRC_OK) != (q.crc ? OTC_FRAMES_FLAG_CRC_OK : 0)))
+        return FALSE;
+    if (q.pattern.isEmpty())
+        return TRUE;
+    if (page->length[i] < q.pattern.size())
+        return FALSE;
+
+    data = payload(v, page->offset[i]);
+    return (data != NULL) && (search(data, page->length[i], q.pattern) != NULL);
+}
+
+void otcFrameStore::get(otc_frames_view_t& v, quint32 n, otcFrame& f)
+{
+    otc_frames_page_t*      page    = v.pages[(n - v.first) >> OTC_FRAMES_PAGE_BITS];
+    int                     i       = n & OTC_FRAMES_PAGE_MASK;
+    const unsigned char*    data    = (page->length[i] > 0) ? payload(v, page->offset[i]) : NULL;
+
+    f.number    = n;
+    f.time      = v.epoch + page->time[i];
+    f.seq       = page->seq[i];
+    f.id        = page->id[i];
+    f.cmd       = page->cmd[i];
+    f.crcok     = (page->flags[i] & OTC_FRAMES_FLAG_CRC_OK) != 0;
+    f.data      = (data != NULL) ? QByteArray((const char*)data, page->length[i]) : QByteArray();
+}
+
+/** @brief  Reads a frame by its number
+  * @param  n       (quint32) number given by append()
+  * @param  f       (otcFrame&) the frame
+  * @retval (bool)  FALSE if the frame is no longer in the store
+  */
+bool otcFrameStore::frame(quint32 n, otcFrame& f)
+{
+    otc_frames_view_t   v;
+    bool                ret = FALSE;
+
+    snapshot(v);
+    if ((n - v.first) < (v.next - v.first))
+    {
+        get(v, n, f);
+        ret = TRUE;
+    }
+    release();
+
+    return ret;
+}
+
+/** @brief  Searches the frames
+  * @param  q       (const otcFrameQuery&) criteria
+  * @param  result  (QList<otcFrame>&) the newest q.limit frames found, oldest first
+  * @param  visited (int&) frames checked
+  * @retval (int)   number of frames in result
+  */
+int otcFrameStore::find(const otcFrameQuery& q, QList<otcFrame>& result, int& visited)
+{
+    otc_frames_view_t   v;
+    quint32             lo;
+    quint32             hi;
+
+    result.clear();
+    visited = 0;
+
+    snapshot(v);
+
+    lo = (q.from >= 0) ? bound(v, q.from - v.epoch)     : v.first;
+    hi = (q.to >= 0)   ? bound(v, q.to - v.epoch + 1)   : v.next;
+
+    if (q.id >= 0)
+    {
+        QVector<quint32>    block;
+        quint32             top = hi;
+
+        // The posting list grows with the frames: it is read by blocks,
+        // from the newest, each one copied with the lock held
+        while ((top > lo) && (result.count() < q.limit))
+        {
+            m_mutex.lock();
+            {
+                const QVector<quint32>& post    = m_post[q.id];
+                int                     first   = m_postFirst[q.id];
+                int                     k       = post.size();
+                int                     a       = first;
+
+                // Last entry before top
+                while (a < k)
+                {
+                    int mid = a + (k - a) / 2;
+
+                    if (post[mid] < top)
+                        a = mid + 1;
+                    else
+                        k = mid;
+                }
+
+                k = qMax(first, a - OTC_FRAMES_POST_BLOCK);
+                block.resize(a - k);
+                for (int j=0; j<block.size(); j++)
+                    block[j] = post[k + j];
+            }
+            m_mutex.unlock();
+
+            if (block.isEmpty())
+                break;
+
+            for (int k=block.size()-1; (k >= 0) && (block[k] >= lo) && (result.count() < q.limit); k--)
+            {
+                visited++;
+                if (match(v, block[k], q))
+                {
+                    result.prepend(otcFrame());
+                    get(v, block[k], result.first());
+                }
+            }
+            top = block[0];
+        }
+    }
+    else if (!q.pattern.isEmpty())
+    {
+        if (lo < hi)
+            scan(v, q, lo, hi, result, visited);
+    }
+    else
+    {
+        for (quint32 n=hi; (n > lo) && (result.count() < q.limit); )
+        {
+            n--;
+            visited++;
+            if (match(v, n, q))
+            {
+                result.prepend(otcFrame());
+                get(v, n, result.first());
+            }
+        }
+    }
+
+    release();
+
+    return result.count();
+}
+
+QString otcFrameStore::getStatus()
+{
+    QString ret;
+    int     inMemory = 0;
+
+    m_mutex.lock();
+
+    for (int i=0; i<m_chunks.count(); i++)
+    {
+        if (m_chunks[i].slot < 0)
+            inMemory++;
+    }
+
+    ret = QString("Frame store: %1 frames (%2 dropped), %3 KB of payload in %4 chunks, %5 in memory.\n")
+                .arg(m_next - m_first).arg(m_dropped)
+                .arg((m_arenaEnd - (m_chunkFirst << OTC_FRAMES_CHUNK_BITS)) / 1024)
+                .arg(m_chunks.count()).arg(inMemory);
+
+    m_mutex.unlock();
+
+    return ret;
+}
+
+
+
+#ifdef OTC_FRAMES_BENCH
+// Frame store benchmark: "otcom framebench" in a build made with OTC_FRAMES_BENCH.
+// Fills the store with 10 million frames, then times a few searches.
+#include <stdio.h>
+
+int GetTickCount(void);
+
+static void bench(otcFrameStore& store, const char* name, const QString& args)
+{
+    otcFrameQuery   q;
+    QList<otcFrame> result;
+    int             visited;
+    int             t;
+
+    q.parse(args);
+
+    t = GetTickCount();
+    store.find(q, result, visited);
+    t = GetTickCount() - t;
+
+    printf("%-28s: %d frames, %d visited, %d ms\n", name, result.count(), visited, t);
+}
+
+int otc_frames_bench(void) {
+    const int       frames  = 10000000;
+    otcFrameStore   store;
+    unsigned char   data[64];
+    unsigned int    r       = 1;
+    int             t;
+
+    otcFrameStore::maxFrames = frames + OTC_FRAMES_PAGE;
+
+    t = GetTickCount();
+    for (int n=0; n<frames; n++) {
+        r = r * 1103515245 + 12345;
+        for (int i=0; i<(int)sizeof(data); i++) {
+            data[i] = (unsigned char)(r >> (i & 15));
+        }
+        // A marker in one frame out of a million
+        if ((n % 1000000) == 999999) {
+            memcpy(data + 8, "NEEDLE", 6);
+        }
+        store.append((unsigned char)n, (unsigned char)((r >> 16) & 31), (unsigned char)((r >> 24) & 3),
+                     data, 16 + ((r >> 8) & 31), (r & 0xFF) != 0);
+    }
+    t = GetTickCount() - t;
+    printf("append            : %d frames, %d ms\n", frames, t);
+    printf("%s", store.getStatus().toLatin1().constData());
+
+    bench(store, "last 100",                    "");
+    bench(store, "id",                          "id=05");
+    bench(store, "id cmd crc",                  "id=05 cmd=2 crc=bad");
+    bench(store, "id n=100000",                 "id=05 n=100000");
+    bench(store, "time range",                  QString("from=%1 to=%2").arg(QDateTime::currentMSecsSinceEpoch() - 100)
+                                                                        .arg(QDateTime::currentMSecsSinceEpoch()));
+    bench(store, "id data, all frames",         "id=05 n=1000 data=\"NEEDLE\"");
+    bench(store, "data, all frames",            "n=1000 data=\"NEEDLE\"");
+
+    return 0;
+}
+#endif
@@ -0,0 +1,217 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_frames.h
+/// @brief          Frame store
+///                 Decoded MPIPE frames, searchable by ALP id, cmd, time and payload
+//
+/// =========================================================================
+///
+/// Every frame printed by the parser (single records and reassembled
+/// messages, good or bad CRC) is appended to the store. Frames are numbered
+/// in their order of arrival and kept in pages of columns: time, seq, id,
+/// cmd, flags, and the offset and length of the payload. The payloads are
+/// copied one after the other in an arena of large chunks.
+///
+/// Only the newest chunks of the arena stay in memory: older ones are moved
+/// to a temporary file, and mapped again when a search reads them. When the
+/// store holds too many frames, or the arena too many chunks, the oldest
+/// page of frames is dropped.
+///
+/// A search never scans more than it must:
+/// - the time is increasing with the frame number, a range of time is a
+///   range of frames found by bisection;
+/// - every ALP id has the list of its frames (posting list), a search on an
+///   id only visits them;
+/// - the cmd and flags columns are checked before any payload is read;
+/// - a pattern searched in all the ids is searched in whole chunks of the
+///   arena, each place found gives its frame by bisection of the offsets.
+/// Frames are visited from the newest, until the limit of the search.
+///
+/// A search does not hold the lock of the store while it scans: it takes a
+/// view of the pages and chunks, and the parser goes on appending frames
+/// beyond it. While a search runs, nothing is dropped or moved to the file;
+/// the limits are enforced again when the last search ends.
+///
+/// The numbers are not given again when the store is cleared, the log keeps
+/// them to show the frames (they wrap after 4G frames).
+///
+/// =========================================================================
+
+#ifndef __OTC_FRAMES_H__
+#define __OTC_FRAMES_H__
+
+#include <qstring.h>
+#include <qbytearray.h>
+#include <qlist.h>
+#include <qvector.h>
+#include <qmutex.h>
+#include <qtemporaryfile.h>
+#include <qelapsedtimer.h>
+#include <qwaitcondition.h>
+
+
+/// Frames per page of columns
+#define OTC_FRAMES_PAGE_BITS                16
+#define OTC_FRAMES_PAGE                     (1 << OTC_FRAMES_PAGE_BITS)
+
+/// Bytes per chunk of the payload arena, a payload is never split
+#define OTC_FRAMES_CHUNK_BITS               24
+#define OTC_FRAMES_CHUNK                    (1 << OTC_FRAMES_CHUNK_BITS)
+
+/// Default limits: frames kept, arena chunks in memory, arena chunks in all
+#define OTC_FRAMES_MAX                      (1 << 24)
+#define OTC_FRAMES_MEM_CHUNKS               4
+#define OTC_FRAMES_MAX_CHUNKS               64
+
+/// Default number of frames given by a search
+#define OTC_FRAMES_LIMIT                    100
+
+/// Longest payload pattern of a search
+#define OTC_FRAMES_PATTERN_MAX              256
+
+/// Frame flags
+#define OTC_FRAMES_FLAG_CRC_OK              0x01
+
+
+/// Columns of OTC_FRAMES_PAGE frames
+typedef struct {
+    quint32                         time[OTC_FRAMES_PAGE];      ///< ms since the epoch of the store
+    quint64                         offset[OTC_FRAMES_PAGE];    ///< payload in the arena
+    quint16                         length[OTC_FRAMES_PAGE];
+    quint8                          seq[OTC_FRAMES_PAGE];
+    quint8                          id[OTC_FRAMES_PAGE];
+    quint8                          cmd[OTC_FRAMES_PAGE];
+    quint8                          flags[OTC_FRAMES_PAGE];
+} otc_frames_page_t;
+
+/// Chunk of the arena
+typedef struct {
+    unsigned char*                  data;       ///< NULL when spilled and not mapped
+    int                             slot;       ///< slot in the spill file, -1 in memory
+} otc_frames_chunk_t;
+
+
+/// Pages and chunks seen by a search, read without the lock of the store
+typedef struct {
+    QList<otc_frames_page_t*>       pages;
+    QList<otc_frames_chunk_t>       chunks;
+    quint32                         first;
+    quint32                         next;
+    qint64                          chunkFirst;
+    qint64                          epoch;
+} otc_frames_view_t;
+
+
+/// Criteria of a search, -1 for any
+class otcFrameQuery
+{
+public :
+    otcFrameQuery();
+
+    int                             id;
+    int                             cmd;
+    int                             crc;        ///< 1 good CRC, 0 bad CRC
+    qint64                          from;       ///< ms since 1970
+    qint64                          to;
+    QByteArray                      pattern;    ///< bytes found in the payload
+    int                             limit;
+
+    bool                            parse(const QString& args);
+};
+
+/// Frame given by a search
+class otcFrame
+{
+public :
+    quint32                         number;
+    qint64                          time;       ///< ms since 1970
+    unsigned char                   seq;
+    unsigned char                   id;
+    unsigned char                   cmd;
+    bool                            crcok;
+    QByteArray                      data;
+
+    QString                         text() const;
+};
+
+
+class otcFrameStore
+{
+public :
+    otcFrameStore();
+    ~otcFrameStore();
+
+    quint32                         append(unsigned char seq, unsigned char id, unsigned char cmd,
+                                           const unsigned char* data, int len, bool crcok, qint64 stamp = -1);
+    bool                            frame(quint32 n, otcFrame& f);
+    int                             find(const otcFrameQuery& q, QList<otcFrame>& result, int& visited);
+    void                            clear(void);
+    QString                         getStatus();
+
+    static int                      maxFrames;
+    static int                      memChunks;
+    static int                      maxChunks;
+
+private :
+    QMutex                          m_mutex;
+    QWaitCondition                  m_idle;         ///< no search running
+    int                             m_readers;      ///< searches running
+    bool                            m_trim;         ///< limits held back by a search
+    QElapsedTimer                   m_clock;
+    qint64                          m_epoch;        ///< ms since 1970 at m_clock start
+    qint64                          m_lastTime;     ///< of the newest frame, ms since m_epoch
+    QList<otc_frames_page_t*>       m_pages;
+    quint32                         m_first;        ///< number of the oldest frame
+    quint32                         m_next;         ///< number of the next frame
+    QVector<quint32>                m_post[256];    ///< frames of each ALP id
+    int                             m_postFirst[256];   ///< first entry still in the store
+    QList<otc_frames_chunk_t>       m_chunks;
+    qint64                          m_chunkFirst;   ///< number of the oldest chunk
+    qint64                          m_arenaEnd;     ///< offset of the next payload
+    QTemporaryFile*                 m_spill;
+    QList<int>                      m_freeSlots;
+    int                             m_slots;
+    qint64                          m_dropped;
+
+    void                            reset(void);
+    void                            dropPage(void);
+    void                            trim(void);
+    void                            spill(void);
+    void                            freeChunk(otc_frames_chunk_t& c);
+    unsigned char*                  map(int c);
+    void                            snapshot(otc_frames_view_t& v);
+    void                            release(void);
+    const unsigned char*            payload(otc_frames_view_t& v, quint64 offset);
+    quint32                         bound(const otc_frames_view_t& v, qint64 time);
+    bool                            match(otc_frames_view_t& v, quint32 n, const otcFrameQuery& q);
+    quint32                         frameAt(const otc_frames_view_t& v, quint64 offset, quint32 lo, quint32 hi);
+    void                            scan(otc_frames_view_t& v, const otcFrameQuery& q, quint32 lo, quint32 hi,
+                                         QList<otcFrame>& result, int& visited);
+    void                            get(otc_frames_view_t& v, quint32 n, otcFrame& f);
+};
+
+
+#ifdef OTC_FRAMES_BENCH
+int     otc_frames_bench(void);
+#endif
+
+
+#endif // __OTC_FRAMES_H__
@@ -0,0 +1,251 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_hex.cpp
+/// @brief          Hex dump
+//
+/// =========================================================================
+
+#include "otc_mpipe.h"
+#include "otc_hex.h"
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+
+// Two digits per byte
+static const char hexPairs[] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+
+#if defined(__SSSE3__)
+
+static inline void store16(char* out, __m128i v)
+{
+    _mm_storeu_si128((__m128i*)out, v);
+}
+
+static inline void store16(ushort* out, __m128i v)
+{
+    _mm_storeu_si128((__m128i*)out,       _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+    _mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+}
+
+// 16 bytes give 48 characters: the digits are found by a shuffle of the
+// nibbles, then spread to their place, the spaces being OR-ed in.
+template <typename T>
+static inline void hex16(const unsigned char* in, T* out)
+{
+    const __m128i digits = _mm_setr_epi8('0','1','2','3','4','5','6','7','8','9','A','B','C','D','E','F');
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i v      = _mm_loadu_si128((const __m128i*)in);
+    const __m128i hi     = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    const __m128i lo     = _mm_shuffle_epi8(digits, _mm_and_si128(v, nibble));
+    const __m128i a      = _mm_unpacklo_epi8(hi, lo);      // digits of bytes 0..7
+    const __m128i b      = _mm_unpackhi_epi8(hi, lo);      // digits of bytes 8..15
+    const char    x      = (char)0x80;
+    const char    s      = ' ';
+
+    __m128i o0 = _mm_shuffle_epi8(a, _mm_setr_epi8(0, 1, x, 2, 3, x, 4, 5, x, 6, 7, x, 8, 9, x,10));
+    __m128i o1 = _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(11, x,12,13, x,14,15, x, x, x, x, x, x, x, x, x)),
+                              _mm_shuffle_epi8(b, _mm_setr_epi8( x, x, x, x, x, x, x, x, 0, 1, x, 2, 3, x, 4, 5)));
+    __m128i o2 = _mm_shuffle_epi8(b, _mm_setr_epi8( x, 6, 7, x, 8, 9, x,10,11, x,12,13, x,14,15, x));
+
+    o0 = _mm_or_si128(o0, _mm_setr_epi8(0, 0, s, 0, 0, s, 0, 0, s, 0, 0, s, 0, 0, s, 0));
+    o1 = _mm_or_si128(o1, _mm_setr_epi8(0, s, 0, 0, s, 0, 0, s, 0, 0, s, 0, 0, s, 0, 0));
+    o2 = _mm_or_si128(o2, _mm_setr_epi8(s, 0, 0, s, 0, 0, s, 0, 0, s, 0, 0, s, 0, 0, s));
+
+    store16(out,      o0);
+    store16(out + 16, o1);
+    store16(out + 32, o2);
+}
+
+// Sync words starting in the 16 bytes, one bit per byte. The byte after
+// the last one must be readable.
+static inline int sync16(const unsigned char* in)
+{
+    __m128i v0 = _mm_loadu_si128((const __m128i*)in);
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(in + 1));
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(v0, _mm_set1_epi8((char)OTC_MPIPE_SYNC_BYTE_0))) &
+           _mm_movemask_epi8(_mm_cmpeq_epi8(v1, _mm_set1_epi8((char)OTC_MPIPE_SYNC_BYTE_1)));
+}
+
+#endif
+
+
+template <typename T>
+static int hexFormat(const unsigned char* in, int len, T* out, int flags)
+{
+    T*  o       = out;
+    int i       = 0;
+#if defined(__SSSE3__)
+    int scalar  = 0;    // bytes left for the table because of a break inside
+#endif
+
+    while (i < len)
+    {
+#if defined(__SSSE3__)
+        if ((scalar == 0) && (i + 16 <= len) &&
+            (!(flags & OTC_HEX_BREAK_16) || ((i & 15) == 0)))
+        {
+            int sync = 0;
+
+            if (flags & OTC_HEX_BREAK_SYNC)
+                sync = (i + 17 <= len) ? sync16(in + i) : -1;
+
+            if ((sync & ~1) == 0)
+            {
+                if ((sync & 1) || ((flags & OTC_HEX_BREAK_16) && (i != 0)))
+                    *o++ = '\n';
+                hex16(in + i, o);
+                o += 48;
+                i += 16;
+                continue;
+            }
+            scalar = 16;
+        }
+        if (scalar > 0)
+            scalar--;
+#endif
+
+        if (((flags & OTC_HEX_BREAK_16) && (i != 0) && ((i & 15) == 0)) ||
+            ((flags & OTC_HEX_BREAK_SYNC) && (i + 1 < len) &&
+             (in[i] == OTC_MPIPE_SYNC_BYTE_0) && (in[i + 1] == OTC_MPIPE_SYNC_BYTE_1)))
+            *o++ = '\n';
+
+        o[0] = hexPairs[2 * in[i]];
+        o[1] = hexPairs[2 * in[i] + 1];
+        o[2] = ' ';
+        o += 3;
+        i++;
+    }
+
+    return (int)(o - out);
+}
+
+/** @brief  Writes the hex dump of bytes
+  * @param  data    (const unsigned char*) bytes
+  * @param  len     (int) number of bytes
+  * @param  out     (char* or ushort*) Latin-1 or UTF-16 output, at least OTC_HEX_SIZE(len)
+  * @param  flags   (int) OTC_HEX_BREAK_x
+  * @retval (int)   characters written
+  */
+int otcHexFormat(const unsigned char* data, int len, char* out, int flags)
+{
+    return hexFormat(data, len, out, flags);
+}
+
+int otcHexFormat(const unsigned char* data, int len, ushort* out, int flags)
+{
+    return hexFormat(data, len, out, flags);
+}
+
+/** @brief  Appends the hex dump of bytes to a string
+  * @param  str     (QString& or QByteArray&) string
+  * @param  data    (const unsigned char*) bytes
+  * @param  len     (int) number of bytes
+  * @param  flags   (int) OTC_HEX_BREAK_x
+  */
+void otcHexAppend(QString& str, const unsigned char* data, int len, int flags)
+{
+    int from = str.size();
+
+    if (len <= 0)
+        return;
+
+    str.resize(from + OTC_HEX_SIZE(len));
+    str.resize(from + hexFormat(data, len, (ushort*)str.data() + from, flags));
+}
+
+void otcHexAppend(QByteArray& str, const unsigned char* data, int len, int flags)
+{
+    int from = str.size();
+
+    if (len <= 0)
+        return;
+
+    str.resize(from + OTC_HEX_SIZE(len));
+    str.resize(from + hexFormat(data, len, str.data() + from, flags));
+}
+
+
+
+#ifdef OTC_HEX_BENCH
+// Hex dump benchmark: "otcom hexbench" in a build made with OTC_HEX_BENCH.
+// Compares with the QString("%1").arg() code the dumps used to be made with.
+#include <stdio.h>
+
+int GetTickCount(void);
+
+int otc_hex_bench(void) {
+    const int       size    = 1 << 20;
+    const int       rounds  = 100;
+    unsigned char*  data    = new unsigned char[size];
+    QString         ref;
+    QString         out;
+    int             t;
+
+    for (int i=0; i<size; ++i) {
+        data[i] = (unsigned char)(i * 7 + (i >> 8));
+    }
+    for (int i=0; i<size; i+=200) {
+        data[i]     = OTC_MPIPE_SYNC_BYTE_0;
+        data[i + 1] = OTC_MPIPE_SYNC_BYTE_1;
+    }
+
+    // reference, a single round
+    t = GetTickCount();
+    for (int cc=0; cc<size; cc++) {
+        if ((cc + 1 < size) && (data[cc] == OTC_MPIPE_SYNC_BYTE_0) && (data[cc + 1] == OTC_MPIPE_SYNC_BYTE_1))
+            ref += "\n";
+        ref += QString("%1 ").arg(QString("%1").arg(data[cc],2,16).upper().replace(' ','0'));
+    }
+    t = GetTickCount() - t;
+    printf("arg() (reference) : %d MB, %d ms\n", 1, t);
+
+    t = GetTickCount();
+    for (int r=0; r<rounds; ++r) {
+        out.truncate(0);
+        otcHexAppend(out, data, size, OTC_HEX_BREAK_SYNC);
+    }
+    t = GetTickCount() - t;
+    printf("otcHexAppend      : %d MB, %d ms, %s\n", rounds, t, (out == ref) ? "same output" : "DIFFERENT OUTPUT");
+
+    t = GetTickCount();
+    for (int r=0; r<rounds; ++r) {
+        out.truncate(0);
+        otcHexAppend(out, data, size, OTC_HEX_BREAK_16);
+    }
+    t = GetTickCount() - t;
+    printf("otcHexAppend (16) : %d MB, %d ms\n", rounds, t);
+
+    delete[] data;
+    return 0;
+}
+#endif
@@ -0,0 +1,62 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_hex.h
+/// @brief          Hex dump
+///                 "0A FF 55 " text of a byte stream, for the log
+//
+/// =========================================================================
+///
+/// Every byte gives its two digits and a space, as the QString("%1").arg()
+/// code used to. The digits are copied from a table straight into the
+/// output, which is sized once: no temporary string per byte. With SSSE3
+/// (build with -mssse3), 16 bytes are converted at once by a nibble
+/// shuffle when no line break falls inside them.
+///
+/// =========================================================================
+
+#ifndef __OTC_HEX_H__
+#define __OTC_HEX_H__
+
+#include <qstring.h>
+#include <qbytearray.h>
+
+
+/// New line every 16 bytes
+#define OTC_HEX_BREAK_16                    0x01
+
+/// New line before each MPIPE sync word
+#define OTC_HEX_BREAK_SYNC                  0x02
+
+
+/// Characters needed for len bytes, whatever the flags
+#define OTC_HEX_SIZE(len)                   (4 * (len))
+
+int     otcHexFormat(const unsigned char* data, int len, char* out, int flags);
+int     otcHexFormat(const unsigned char* data, int len, ushort* out, int flags);
+void    otcHexAppend(QString& str, const unsigned char* data, int len, int flags = 0);
+void    otcHexAppend(QByteArray& str, const unsigned char* data, int len, int flags = 0);
+
+#ifdef OTC_HEX_BENCH
+int     otc_hex_bench(void);
+#endif
+
+
+#endif // __OTC_HEX_H__
@@ -0,0 +1,191 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_hotplug.cpp
+/// @brief          Serial device hotplug
+//
+/// =========================================================================
+
+#include <string.h>
+#include <qstring.h>
+#include <qapplication.h>
+
+#include "otc_main.h"
+#include "otc_window.h"
+#include "otc_hotplug.h"
+
+#ifdef OTC_HOTPLUG_INOTIFY
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+
+/** @brief  Starts watching the port nodes, the thread is started by the caller
+  * @param  receiver    (QObject*) object given the hotplug events
+  */
+otcHotplugMonitor::otcHotplugMonitor(QObject* receiver)
+{
+    m_receiver      = receiver;
+    m_fd            = -1;
+    m_mapWatch      = -1;
+    m_running       = FALSE;
+    m_lostAt        = -1;
+    m_losses        = 0;
+    m_reconnections = 0;
+    m_downSum       = 0;
+    m_downLast      = 0;
+    m_downMax       = 0;
+    m_clock.start();
+
+#ifdef OTC_HOTPLUG_INOTIFY
+    m_fd = inotify_init();
+    if (m_fd < 0)
+        return;
+
+    // The port map may not exist, the tty nodes are watched anyway
+    m_mapWatch = inotify_add_watch(m_fd, OTC_COM_PORTS_MAP_PATH,
+                                   IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    if (inotify_add_watch(m_fd, OTC_HOTPLUG_DEV_PATH,
+                          IN_CREATE | IN_MOVED_TO | IN_ATTRIB) < 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+#endif
+}
+
+otcHotplugMonitor::~otcHotplugMonitor()
+{
+#ifdef OTC_HOTPLUG_INOTIFY
+    if (m_fd >= 0)
+        close(m_fd);
+#endif
+}
+
+void otcHotplugMonitor::stopRunning()
+{
+    m_running = FALSE;
+}
+
+bool otcHotplugMonitor::isLost()
+{
+    m_mutex.lock();
+    bool ret = (m_lostAt >= 0);
+    m_mutex.unlock();
+    return ret;
+}
+
+/** @brief  The link is down, from now until reconnected()
+  */
+void otcHotplugMonitor::lost()
+{
+    m_mutex.lock();
+    if (m_lostAt < 0)
+    {
+        m_lostAt = m_clock.elapsed();
+        m_losses++;
+    }
+    m_mutex.unlock();
+}
+
+/** @brief  The link is up again
+  * @retval qint64      time the link was down (ms), -1 if it was not lost
+  */
+qint64 otcHotplugMonitor::reconnected()
+{
+    qint64 down = -1;
+
+    m_mutex.lock();
+    if (m_lostAt >= 0)
+    {
+        down = m_clock.elapsed() - m_lostAt;
+        m_lostAt = -1;
+        m_reconnections++;
+        m_downSum += down;
+        m_downLast = down;
+        if (down > m_downMax)
+            m_downMax = down;
+    }
+    m_mutex.unlock();
+
+    return down;
+}
+
+// Waits for the port nodes, and wakes the main window while the link is lost
+void otcHotplugMonitor::run()
+{
+    m_running = TRUE;
+
+#ifdef OTC_HOTPLUG_INOTIFY
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (m_running && (m_fd >= 0))
+    {
+        struct pollfd   p;
+        bool            port = FALSE;
+        int             len;
+
+        p.fd      = m_fd;
+        p.events  = POLLIN;
+        p.revents = 0;
+
+        if (poll(&p, 1, OTC_HOTPLUG_POLL) <= 0)
+            continue;
+
+        len = read(m_fd, buffer, sizeof(buffer));
+
+        for (int i=0; i + (int)sizeof(struct inotify_event) <= len; )
+        {
+            struct inotify_event* ev = (struct inotify_event*)(buffer + i);
+
+            // Every node of the port map, only the ttys of /dev
+            if (ev->len && ((ev->wd == m_mapWatch) ||
+                            (strncmp(ev->name, OTC_HOTPLUG_DEV_PREFIX, strlen(OTC_HOTPLUG_DEV_PREFIX)) == 0)))
+            {
+                port = TRUE;
+            }
+
+            i += sizeof(struct inotify_event) + ev->len;
+        }
+
+        if (port && isLost())
+            QApplication::postEvent(m_receiver, new otcHotplugEvent(FALSE));
+    }
+#endif
+}
+
+QString otcHotplugMonitor::getStatus()
+{
+    QString ret;
+
+    m_mutex.lock();
+
+    ret = QString("Hotplug %1: link %2, lost %3 times, %4 reconnections.\n")
+                .arg(watching() ? "watching the port nodes" : "retrying every second")
+                .arg((m_lostAt >= 0) ? QString("down for %1 ms").arg(m_clock.elapsed() - m_lostAt) : QString("up"))
+                .arg(m_losses).arg(m_reconnections);
+    ret += QString("  Down time: %1 ms, last %2 ms, max %3 ms.\n")
+                .arg(m_downSum).arg(m_downLast).arg(m_downMax);
+
+    m_mutex.unlock();
+
+    return ret;
+}
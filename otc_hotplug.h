@@ -0,0 +1,97 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_hotplug.h
+/// @brief          Serial device hotplug
+///                 Watches the device nodes to reopen a lost link at once
+//
+/// =========================================================================
+///
+/// When a USB serial adapter is unplugged, its tty hangs up: the reads of
+/// the device see the hangup (POLLHUP, or an error of read or write), close
+/// the link and report it lost to the main window.
+///
+/// On Linux, the monitor thread watches OTC_COM_PORTS_MAP_PATH and /dev
+/// with inotify. While the link is lost, every port node created, moved or
+/// whose attributes change (udev sets the permissions after creating the
+/// node) wakes the main window, which reopens the link with the last baud
+/// rate and flow mode. Elsewhere, or when inotify is not available, the
+/// reconnection timer of the main window retries every second.
+///
+/// The monitor counts the losses and reconnections of the link, and the
+/// time it was down (total, last and longest).
+///
+/// =========================================================================
+
+#ifndef __OTC_HOTPLUG_H__
+#define __OTC_HOTPLUG_H__
+
+#include <qstring.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qelapsedtimer.h>
+
+#ifdef __linux__
+#define OTC_HOTPLUG_INOTIFY
+#endif
+
+
+/// Directory of the device nodes, watched with the port map
+#define OTC_HOTPLUG_DEV_PATH                "/dev"
+
+/// Prefix of the tty nodes in OTC_HOTPLUG_DEV_PATH
+#define OTC_HOTPLUG_DEV_PREFIX              "tty"
+
+/// Time the monitor thread waits for the nodes before checking it is stopped (ms)
+#define OTC_HOTPLUG_POLL                    100
+
+
+class otcHotplugMonitor : public QThread
+{
+public :
+    otcHotplugMonitor(QObject* receiver);
+    ~otcHotplugMonitor();
+
+    bool                    watching()      {return (m_fd >= 0);}
+    bool                    isLost();
+    void                    lost();
+    qint64                  reconnected();
+    QString                 getStatus();
+
+    void                    run();
+    void                    stopRunning();
+
+protected :
+    QObject*                m_receiver;
+    QMutex                  m_mutex;
+    QElapsedTimer           m_clock;
+    int                     m_fd;           ///< inotify, -1 if not watching
+    int                     m_mapWatch;     ///< watch of OTC_COM_PORTS_MAP_PATH
+    volatile bool           m_running;
+    qint64                  m_lostAt;       ///< ms, -1 while the link is up
+    unsigned int            m_losses;
+    unsigned int            m_reconnections;
+    qint64                  m_downSum;
+    qint64                  m_downLast;
+    qint64                  m_downMax;
+};
+
+
+#endif // __OTC_HOTPLUG_H__
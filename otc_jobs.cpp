@@ -0,0 +1,379 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_jobs.cpp
+/// @brief          Periodic command jobs
+//
+/// =========================================================================
+
+#include <stdlib.h>
+#include <qstring.h>
+#include <qtextdocument.h>
+
+#include "otc_main.h"
+#include "otc_serial.h"
+#include "otc_scheduler.h"
+#include "otc_jobs.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//           TIMER WHEEL                    //
+//                                          //
+// ---------------------------------------- //
+
+// Every slot is the head of a circular list
+otcTimerWheel::otcTimerWheel()
+{
+    m_now = 0;
+
+    for (int i=0; i<OTC_JOB_WHEEL_SLOTS_0; i++)
+        m_slot0[i].next = m_slot0[i].prev = &m_slot0[i];
+
+    for (int l=0; l<OTC_JOB_WHEEL_LEVELS-1; l++)
+        for (int i=0; i<OTC_JOB_WHEEL_SLOTS_N; i++)
+            m_slotN[l][i].next = m_slotN[l][i].prev = &m_slotN[l][i];
+
+    m_expired.next = m_expired.prev = &m_expired;
+}
+
+void otcTimerWheel::link(otcTimer* head, otcTimer* t)
+{
+    t->prev         = head->prev;
+    t->next         = head;
+    head->prev->next = t;
+    head->prev      = t;
+}
+
+// The level is chosen by the distance to the expiry, the slot by the bits
+// of the expiry for that level
+void otcTimerWheel::place(otcTimer* t)
+{
+    unsigned int delta = t->expires - m_now;
+
+    if ((int)delta < 0)
+    {
+        // Already late: next tick
+        link(&m_slot0[m_now & (OTC_JOB_WHEEL_SLOTS_0-1)], t);
+        return;
+    }
+
+    if (delta < OTC_JOB_WHEEL_SLOTS_0)
+    {
+        link(&m_slot0[t->expires & (OTC_JOB_WHEEL_SLOTS_0-1)], t);
+        return;
+    }
+
+    if (delta >= OTC_JOB_WHEEL_SPAN)
+        t->expires = m_now + OTC_JOB_WHEEL_SPAN - 1;
+
+    for (int l=0; l<OTC_JOB_WHEEL_LEVELS-1; l++)
+    {
+        int shift = OTC_JOB_WHEEL_BITS_0 + l * OTC_JOB_WHEEL_BITS_N;
+
+        if ((delta >> shift) < OTC_JOB_WHEEL_SLOTS_N)
+        {
+            link(&m_slotN[l][(t->expires >> shift) & (OTC_JOB_WHEEL_SLOTS_N-1)], t);
+            return;
+        }
+    }
+
+    link(&m_slotN[OTC_JOB_WHEEL_LEVELS-2][(t->expires >> (OTC_JOB_WHEEL_BITS_0 + (OTC_JOB_WHEEL_LEVELS-2) * OTC_JOB_WHEEL_BITS_N))
+                                          & (OTC_JOB_WHEEL_SLOTS_N-1)], t);
+}
+
+void otcTimerWheel::insert(otcTimer* t, unsigned int expires)
+{
+    t->expires = expires;
+    place(t);
+}
+
+void otcTimerWheel::remove(otcTimer* t)
+{
+    if (t->next == NULL)
+        return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+// Moves the time of an empty wheel
+void otcTimerWheel::reset(unsigned int now)
+{
+    m_now = now;
+}
+
+// Spreads one slot of an upper level over the levels below. Returns the slot
+// index, 0 meaning the level wrapped too.
+int otcTimerWheel::cascade(int level, int index)
+{
+    otcTimer* head = &m_slotN[level-1][index];
+
+    while (head->next != head)
+    {
+        otcTimer* t = head->next;
+        remove(t);
+        place(t);
+    }
+
+    return index;
+}
+
+// Advances one tick. The timers due are moved to the expired list.
+void otcTimerWheel::tick()
+{
+    int index = m_now & (OTC_JOB_WHEEL_SLOTS_0-1);
+
+    if (index == 0)
+    {
+        for (int l=1; l<OTC_JOB_WHEEL_LEVELS; l++)
+        {
+            int shift = OTC_JOB_WHEEL_BITS_0 + (l-1) * OTC_JOB_WHEEL_BITS_N;
+
+            if (cascade(l, (m_now >> shift) & (OTC_JOB_WHEEL_SLOTS_N-1)) != 0)
+                break;
+        }
+    }
+
+    otcTimer* head = &m_slot0[index];
+    while (head->next != head)
+    {
+        otcTimer* t = head->next;
+        remove(t);
+        link(&m_expired, t);
+    }
+
+    m_now++;
+}
+
+// Next expired timer, or NULL
+otcTimer* otcTimerWheel::expired()
+{
+    otcTimer* t = m_expired.next;
+
+    if (t == &m_expired)
+        return NULL;
+
+    remove(t);
+    return t;
+}
+
+
+// ---------------------------------------- //
+//                                          //
+//           JOB SCHEDULER                  //
+//                                          //
+// ---------------------------------------- //
+
+otcJobScheduler::otcJobScheduler(otcCommunicationLinkDevice* device)
+{
+    m_device    = device;
+    m_nextId    = 1;
+    m_running   = FALSE;
+    m_clock.start();
+}
+
+otcJobScheduler::~otcJobScheduler()
+{
+    clear();
+}
+
+/** @brief  Adds a job
+  * @param  command     (const QString&) command line, for the status
+  * @param  frame       (const unsigned char*) the single record frame of the command
+  * @param  len         (int) frame length
+  * @param  interval    (int) period (ms)
+  * @param  jitter      (int) maximum random delay of each run (ms)
+  * @return the job ID, or -1
+  */
+int otcJobScheduler::add(const QString& command, const unsigned char* frame, int len, int interval, int jitter)
+{
+    unsigned int ticks = (interval + OTC_JOB_TICK - 1) / OTC_JOB_TICK;
+
+    if ((ticks == 0) || (ticks >= OTC_JOB_WHEEL_SPAN) || (jitter < 0))
+        return -1;
+
+    otcJob* job = new otcJob;
+    if (!job->frame.set(frame, len))
+    {
+        delete job;
+        return -1;
+    }
+
+    job->command    = command;
+    job->interval   = ticks;
+    job->jitter     = jitter / OTC_JOB_TICK;
+    job->runs       = 0;
+    job->missed     = 0;
+    job->latencySum = 0;
+    job->latencyMax = 0;
+
+    m_mutex.lock();
+
+    if (m_jobs.count() >= OTC_JOB_MAX)
+    {
+        m_mutex.unlock();
+        delete job;
+        return -1;
+    }
+
+    // An empty wheel stands still: bring it to the current time
+    if (m_jobs.isEmpty())
+        m_wheel.reset(m_clock.elapsed() / OTC_JOB_TICK);
+
+    job->id  = m_nextId++;
+    job->due = m_wheel.now() + job->interval;
+    m_wheel.insert(job, job->due + (job->jitter ? (qrand() % (job->jitter + 1)) : 0));
+    m_jobs.append(job);
+
+    m_wait.wakeAll();
+    m_mutex.unlock();
+
+    return job->id;
+}
+
+bool otcJobScheduler::remove(int id)
+{
+    bool found = FALSE;
+
+    m_mutex.lock();
+    for (int i=0; i<m_jobs.count(); i++)
+    {
+        if (m_jobs[i]->id == id)
+        {
+            m_wheel.remove(m_jobs[i]);
+            delete m_jobs.takeAt(i);
+            found = TRUE;
+            break;
+        }
+    }
+    m_mutex.unlock();
+
+    return found;
+}
+
+void otcJobScheduler::clear()
+{
+    m_mutex.lock();
+    while (!m_jobs.isEmpty())
+    {
+        otcJob* job = m_jobs.takeFirst();
+        m_wheel.remove(job);
+        delete job;
+    }
+    m_mutex.unlock();
+}
+
+void otcJobScheduler::stopRunning()
+{
+    m_mutex.lock();
+    m_running = FALSE;
+    m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+// Sends the frame of a job and schedules its next run. Must be called with
+// m_mutex held.
+void otcJobScheduler::fire(otcJob* job, qint64 now)
+{
+    qint64          latency = now - (qint64)job->expires * OTC_JOB_TICK * 1000;
+    unsigned int    tick    = now / (OTC_JOB_TICK * 1000);
+
+    job->frame.write(OTC_MPIPE_TEMPLATE_SLOT_SEQ, otc_mpipe_builder::nextSeq());
+    m_device->queueBlock(OTC_WRITE_SOURCE_JOBS, OTC_WRITE_PRIO_CONTROL,
+                         (char*)job->frame.start(), job->frame.len());
+
+    if (latency < 0)
+        latency = 0;
+    job->runs++;
+    job->latencySum += latency;
+    if (latency > job->latencyMax)
+        job->latencyMax = latency;
+
+    // Runs whose time is already over are skipped, not sent in a burst
+    job->due += job->interval;
+    if ((int)(tick - job->due) > 0)
+    {
+        unsigned int lost = (tick - job->due + job->interval - 1) / job->interval;
+        job->due    += lost * job->interval;
+        job->missed += lost;
+    }
+
+    m_wheel.insert(job, job->due + (job->jitter ? (qrand() % (job->jitter + 1)) : 0));
+}
+
+void otcJobScheduler::run()
+{
+    m_mutex.lock();
+    m_running = TRUE;
+
+    while (m_running)
+    {
+        if (m_jobs.isEmpty())
+        {
+            m_wait.wait(&m_mutex);
+            continue;
+        }
+
+        // Catch up with the clock, one tick at a time
+        qint64       now    = m_clock.nsecsElapsed() / 1000;
+        unsigned int target = now / (OTC_JOB_TICK * 1000);
+
+        while ((int)(target - m_wheel.now()) >= 0)
+        {
+            otcTimer* t;
+
+            m_wheel.tick();
+            while ((t = m_wheel.expired()) != NULL)
+                fire((otcJob*)t, now);
+        }
+
+        m_wait.wait(&m_mutex, OTC_JOB_TICK);
+    }
+
+    m_mutex.unlock();
+}
+
+QString otcJobScheduler::getStatus()
+{
+    QString ret = "Jobs (interval/jitter ms, runs, missed, latency avg/max us):\n";
+
+    m_mutex.lock();
+    for (int i=0; i<m_jobs.count(); i++)
+    {
+        otcJob* job = m_jobs[i];
+
+        ret += QString("  %1: %2/%3, %4, %5, %6/%7  %8\n")
+                    .arg(job->id)
+                    .arg(job->interval * OTC_JOB_TICK)
+                    .arg(job->jitter * OTC_JOB_TICK)
+                    .arg(job->runs)
+                    .arg(job->missed)
+                    .arg(job->runs ? (job->latencySum / job->runs) : 0)
+                    .arg(job->latencyMax)
+                    .arg(Qt::escape(job->command));
+    }
+    if (m_jobs.isEmpty())
+        ret += "  none\n";
+    m_mutex.unlock();
+
+    return ret;
+}
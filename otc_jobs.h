@@ -0,0 +1,159 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_jobs.h
+/// @brief          Periodic command jobs
+///                 Timer wheel and the thread sending the recurring commands
+//
+/// =========================================================================
+///
+/// A job is a prompt command line which gives a single record, compiled once
+/// into a frame template, and re-issued every interval with a new seq. An
+/// optional jitter delays each run by a random amount, without drifting from
+/// the interval.
+///
+/// Jobs are kept in a hierarchical timer wheel: 256 slots of one tick, then
+/// three levels of 64 slots, each covering the whole previous level. Adding,
+/// removing and expiring a job are O(1); a job far in the future moves down
+/// one level each time the level below wraps (cascade).
+///
+/// The latency of a run is the time between its due date and the moment its
+/// frame is queued. When the thread falls so far behind that a whole interval
+/// is lost, the skipped runs are counted as missed instead of being sent in
+/// a burst.
+///
+/// =========================================================================
+
+#ifndef __OTC_JOBS_H__
+#define __OTC_JOBS_H__
+
+#include <qstring.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qlist.h>
+#include <qelapsedtimer.h>
+#include <QWaitCondition>
+
+#include "otc_mpipe.h"
+
+
+class otcCommunicationLinkDevice;
+
+
+/// Resolution of the job timers (ms)
+#define OTC_JOB_TICK                        10
+
+/// Timer wheel geometry: first level, then the cascading levels
+#define OTC_JOB_WHEEL_BITS_0                8
+#define OTC_JOB_WHEEL_BITS_N                6
+#define OTC_JOB_WHEEL_LEVELS                4
+#define OTC_JOB_WHEEL_SLOTS_0               (1 << OTC_JOB_WHEEL_BITS_0)
+#define OTC_JOB_WHEEL_SLOTS_N               (1 << OTC_JOB_WHEEL_BITS_N)
+
+/// Longest interval a job can have (ticks), the reach of the wheel
+#define OTC_JOB_WHEEL_SPAN                  (1 << (OTC_JOB_WHEEL_BITS_0 + 3 * OTC_JOB_WHEEL_BITS_N))
+
+/// Maximum number of jobs
+#define OTC_JOB_MAX                         4096
+
+
+/// Timer of the wheel, linked in its slot
+class otcTimer
+{
+public :
+    otcTimer() : expires(0), next(NULL), prev(NULL) {;}
+
+    unsigned int            expires;    ///< tick
+    otcTimer*               next;
+    otcTimer*               prev;
+};
+
+
+class otcTimerWheel
+{
+public :
+    otcTimerWheel();
+
+    void                    insert(otcTimer* t, unsigned int expires);
+    void                    remove(otcTimer* t);
+    void                    reset(unsigned int now);
+    void                    tick();
+    otcTimer*               expired();
+    unsigned int            now()           {return m_now;}
+
+protected :
+    unsigned int            m_now;
+    otcTimer                m_slot0[OTC_JOB_WHEEL_SLOTS_0];
+    otcTimer                m_slotN[OTC_JOB_WHEEL_LEVELS-1][OTC_JOB_WHEEL_SLOTS_N];
+    otcTimer                m_expired;
+
+    void                    link(otcTimer* head, otcTimer* t);
+    void                    place(otcTimer* t);
+    int                     cascade(int level, int index);
+};
+
+
+class otcJob : public otcTimer
+{
+public :
+    int                     id;
+    QString                 command;
+    unsigned int            interval;   ///< ticks
+    unsigned int            jitter;     ///< ticks
+    unsigned int            due;        ///< tick of the run without jitter
+    otc_mpipe_template      frame;
+
+    // Statistics
+    unsigned int            runs;
+    unsigned int            missed;
+    qint64                  latencySum; ///< us
+    qint64                  latencyMax;
+};
+
+
+class otcJobScheduler : public QThread
+{
+public :
+    otcJobScheduler(otcCommunicationLinkDevice* device);
+    ~otcJobScheduler();
+
+    int                     add(const QString& command, const unsigned char* frame, int len, int interval, int jitter);
+    bool                    remove(int id);
+    void                    clear();
+    QString                 getStatus();
+
+    void                    run();
+    void                    stopRunning();
+
+protected :
+    otcCommunicationLinkDevice* m_device;
+    QMutex                  m_mutex;
+    QWaitCondition          m_wait;
+    QElapsedTimer           m_clock;
+    otcTimerWheel           m_wheel;
+    QList<otcJob*>          m_jobs;
+    int                     m_nextId;
+    bool                    m_running;
+
+    void                    fire(otcJob* job, qint64 now);
+};
+
+
+#endif // __OTC_JOBS_H__
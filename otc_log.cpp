@@ -0,0 +1,712 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_log.cpp
+/// @brief          Log line queue, log model and log view
+//
+/// =========================================================================
+
+#include <string.h>
+#include <qdatetime.h>
+#include <qpainter.h>
+#include <qscrollbar.h>
+#include <qclipboard.h>
+#include <qapplication.h>
+#include <qevent.h>
+
+#include "otc_log.h"
+#include "otc_frames.h"
+#include "otc_mpipe.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//           LOG QUEUE                      //
+//                                          //
+// ---------------------------------------- //
+
+otcLogQueue::otcLogQueue()
+{
+    for (int i=0; i<OTC_LOG_QUEUE_SIZE; i++)
+        m_cells[i].seq = i;
+
+    m_tail      = 0;
+    m_head      = 0;
+    m_dropped   = 0;
+}
+
+// Claims the next cell, -1 when the queue is full and the line is dropped
+int otcLogQueue::claim()
+{
+    int pos = m_tail.fetchAndAddRelaxed(0);
+
+    for (;;)
+    {
+        cell&   c   = m_cells[pos & (OTC_LOG_QUEUE_SIZE-1)];
+        int     dif = c.seq.fetchAndAddAcquire(0) - pos;
+
+        if (dif == 0)
+        {
+            // The cell is free: claim the position
+            if (m_tail.testAndSetRelaxed(pos, pos+1))
+                break;
+            pos = m_tail.fetchAndAddRelaxed(0);
+        }
+        else if (dif < 0)
+        {
+            // The GUI has not read the line a full turn ago yet
+            m_dropped.fetchAndAddRelaxed(1);
+            return -1;
+        }
+        else
+        {
+            // Another thread took the position
+            pos = m_tail.fetchAndAddRelaxed(0);
+        }
+    }
+
+    return pos;
+}
+
+/** @brief  Queues a line for the GUI, from any thread
+  * @param  line    (const QString&) log line
+  * @return FALSE if the queue is full and the line is dropped
+  */
+bool otcLogQueue::push(const QString& line)
+{
+    int pos = claim();
+
+    if (pos < 0)
+        return FALSE;
+
+    cell& c = m_cells[pos & (OTC_LOG_QUEUE_SIZE-1)];
+    c.item.line     = line;
+    c.item.frame    = -1;
+    c.seq.fetchAndStoreRelease(pos+1);
+
+    return TRUE;
+}
+
+/** @brief  Queues the line of a frame of the store, from any thread
+  * @param  frame   (quint32) number of the frame in the store
+  * @param  colour  (otc_log_colour_t) colour of its line
+  * @param  length  (int) length of its body
+  * @return FALSE if the queue is full and the line is dropped
+  */
+bool otcLogQueue::push(quint32 frame, otc_log_colour_t colour, int length)
+{
+    int pos = claim();
+
+    if (pos < 0)
+        return FALSE;
+
+    cell& c = m_cells[pos & (OTC_LOG_QUEUE_SIZE-1)];
+    c.item.frame    = frame;
+    c.item.colour   = colour;
+    c.item.length   = length;
+    c.seq.fetchAndStoreRelease(pos+1);
+
+    return TRUE;
+}
+
+/** @brief  Takes the oldest line, from the GUI thread only
+  * @param  item    (otcLogItem&) the line
+  * @return FALSE if the queue is empty
+  */
+bool otcLogQueue::pop(otcLogItem& item)
+{
+    cell& c = m_cells[m_head & (OTC_LOG_QUEUE_SIZE-1)];
+
+    if (c.seq.fetchAndAddAcquire(0) != m_head+1)
+        return FALSE;
+
+    item = c.item;
+    c.item.line = QString();
+    c.seq.fetchAndStoreRelease(m_head + OTC_LOG_QUEUE_SIZE);
+    m_head++;
+
+    return TRUE;
+}
+
+/// Lines dropped since the last call
+int otcLogQueue::dropped()
+{
+    return m_dropped.fetchAndStoreRelaxed(0);
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           LOG GOVERNOR                   //
+//                                          //
+// ---------------------------------------- //
+
+otcLogGovernor::otcLogGovernor()
+{
+    m_keep = 1;
+
+    for (int i=0; i<OTC_LOG_CLASSES; i++)
+    {
+        m_seen[i]    = 0;
+        m_skipped[i] = 0;
+    }
+
+    m_changed.start();
+    m_calm.start();
+}
+
+/** @brief  Tells if the line of a frame is to be made, from any thread
+  * @param  frameClass  (int) ALP id of the frame, or OTC_LOG_CLASS_RAW
+  * @return FALSE if the frame is only counted for the summary
+  */
+bool otcLogGovernor::admit(int frameClass)
+{
+    int keep = m_keep.fetchAndAddRelaxed(0);
+
+    if (keep == 1)
+        return TRUE;
+
+    if ((keep > 1) && ((m_seen[frameClass].fetchAndAddRelaxed(1) % keep) == 0))
+        return TRUE;
+
+    m_skipped[frameClass].fetchAndAddRelaxed(1);
+    return FALSE;
+}
+
+/** @brief  Adapts the sampling, from the GUI thread after each drain
+  * @param  behind  (bool) the GUI did not keep up during the last period
+  * @return TRUE if the sampling changed
+  */
+bool otcLogGovernor::update(bool behind)
+{
+    int keep = m_keep.fetchAndAddRelaxed(0);
+    int next = keep;
+
+    if (behind)
+    {
+        m_calm.restart();
+        if ((keep != 0) && (m_changed.elapsed() >= OTC_LOG_GOVERNOR_STEP))
+            next = (keep >= OTC_LOG_SAMPLE_MAX) ? 0 : keep * 2;
+    }
+    else if ((keep != 1) &&
+             (m_calm.elapsed() >= OTC_LOG_GOVERNOR_CALM) &&
+             (m_changed.elapsed() >= OTC_LOG_GOVERNOR_CALM))
+    {
+        next = (keep == 0) ? OTC_LOG_SAMPLE_MAX : keep / 2;
+    }
+
+    if (next == keep)
+        return FALSE;
+
+    m_keep.fetchAndStoreRelaxed(next);
+    m_changed.restart();
+    return TRUE;
+}
+
+/// Frames not printed since the last call, an empty string if none
+QString otcLogGovernor::summary()
+{
+    QString ret;
+
+    for (int i=0; i<OTC_LOG_CLASSES; i++)
+    {
+        int n = m_skipped[i].fetchAndStoreRelaxed(0);
+
+        if (n == 0)
+            continue;
+        if (!ret.isEmpty())
+            ret += ", ";
+
+        if (i == OTC_LOG_CLASS_RAW)
+            ret += QString("%1 raw reads").arg(n);
+        else
+            ret += QString("%1 frames of ALP id %2").arg(n).arg(QString("%1").arg(i, 2, 16, QChar('0')).toUpper());
+    }
+
+    if (ret.isEmpty())
+        return ret;
+
+    return QString("<font color=gray>%1 suppressed in last second</font>").arg(ret);
+}
+
+QString otcLogGovernor::mode()
+{
+    int keep = m_keep.fetchAndAddRelaxed(0);
+
+    if (keep == 1)
+        return "<font color=gray>Display: all frames</font>";
+    if (keep == 0)
+        return "<font color=gray>Display behind: frames only counted</font>";
+
+    return QString("<font color=gray>Display behind: 1 frame in %1 per ALP id</font>").arg(keep);
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           LOG MODEL                      //
+//                                          //
+// ---------------------------------------- //
+
+otcLogModel::otcLogModel()
+{
+    m_store     = NULL;
+    m_first     = 0;
+    m_next      = 0;
+    m_textNext  = 0;
+    m_widest    = 0;
+    m_epoch     = QDateTime::currentMSecsSinceEpoch();
+}
+
+static otc_log_colour_t colourOf(QString name)
+{
+    name.remove('"');
+
+    if (name == "red")
+        return OTC_LOG_COLOUR_RED;
+    if (name == "blue")
+        return OTC_LOG_COLOUR_BLUE;
+    if (name == "darkgreen")
+        return OTC_LOG_COLOUR_DARKGREEN;
+    if ((name == "gray") || (name == "grey"))
+        return OTC_LOG_COLOUR_GRAY;
+
+    return OTC_LOG_COLOUR_DEFAULT;
+}
+
+/** @brief  Adds the lines of a log call
+  * @param  html    (const QString&) text given to otcConfig::logText()
+  *
+  * Only the font colours, <br> and the usual entities are understood. A line
+  * takes the colour of its first character.
+  */
+void otcLogModel::append(const QString& html)
+{
+    quint32             stamp   = (quint32)(QDateTime::currentMSecsSinceEpoch() - m_epoch);
+    otc_log_colour_t    current = OTC_LOG_COLOUR_DEFAULT;
+    int                 colour  = -1;
+    QString             line;
+
+    for (int i=0; i<html.length(); i++)
+    {
+        QChar c = html[i];
+
+        if (c == '<')
+        {
+            int end = html.indexOf('>', i);
+            if (end > i)
+            {
+                QString tag = html.mid(i+1, end-i-1).trimmed().toLower();
+
+                if (tag.startsWith("font color="))
+                    current = colourOf(tag.mid(11));
+                else if (tag == "/font")
+                    current = OTC_LOG_COLOUR_DEFAULT;
+                else if (tag.startsWith("br"))
+                {
+                    add(stamp, line, (colour < 0) ? current : (otc_log_colour_t)colour);
+                    line.clear();
+                    colour = -1;
+                }
+                i = end;
+                continue;
+            }
+        }
+        else if (c == '&')
+        {
+            int end = html.indexOf(';', i);
+            if ((end > i) && (end - i <= 6))
+            {
+                QString entity = html.mid(i+1, end-i-1);
+
+                if (entity == "gt")         c = '>';
+                else if (entity == "lt")    c = '<';
+                else if (entity == "amp")   c = '&';
+                else if (entity == "quot")  c = '"';
+                else if (entity == "nbsp")  c = ' ';
+                else                        end = i;
+                i = end;
+            }
+        }
+        else if (c == '\n')
+        {
+            add(stamp, line, (colour < 0) ? current : (otc_log_colour_t)colour);
+            line.clear();
+            colour = -1;
+            continue;
+        }
+
+        if (colour < 0)
+            colour = current;
+        line += c;
+    }
+
+    add(stamp, line, (colour < 0) ? current : (otc_log_colour_t)colour);
+}
+
+/** @brief  Adds the line of a frame of the store
+  * @param  frame   (quint32) number of the frame in the store
+  * @param  colour  (otc_log_colour_t) colour of its line
+  * @param  length  (int) length of its body
+  */
+void otcLogModel::append(quint32 frame, otc_log_colour_t colour, int length)
+{
+    otcLogLine& l = take(m_textNext, 0);
+
+    l.stamp     = (quint32)(QDateTime::currentMSecsSinceEpoch() - m_epoch);
+    l.text      = m_textNext;
+    l.number    = frame;
+    l.length    = (length > OTC_LOG_LINE_MAX) ? OTC_LOG_LINE_MAX : length;
+    l.colour    = colour;
+    l.frame     = 1;
+
+    m_next++;
+
+    // [ seq ]  [ id cmd ]  [ and 3 characters per byte
+    if (22 + 3 * length > m_widest)
+        m_widest = 22 + 3 * length;
+}
+
+// Record of the next line, whose text takes len bytes at pos. The oldest
+// lines are forgotten when a ring is full.
+otcLogLine& otcLogModel::take(quint32 pos, quint32 len)
+{
+    // Allocated with the first line
+    if (m_text.isEmpty())
+    {
+        m_text.resize(OTC_LOG_TEXT_SIZE);
+        m_lines.resize(OTC_LOG_LINES);
+    }
+
+    while (m_first < m_next)
+    {
+        otcLogLine& old = m_lines[m_first & (OTC_LOG_LINES-1)];
+
+        if (((m_next - m_first) < OTC_LOG_LINES) && ((quint32)(pos + len - old.text) <= OTC_LOG_TEXT_SIZE))
+            break;
+        m_first++;
+    }
+
+    return m_lines[m_next & (OTC_LOG_LINES-1)];
+}
+
+// Stores one line of text
+void otcLogModel::add(quint32 stamp, const QString& text, otc_log_colour_t colour)
+{
+    QByteArray  utf8    = text.toUtf8();
+    quint32     len     = (utf8.size() > OTC_LOG_LINE_MAX) ? OTC_LOG_LINE_MAX : utf8.size();
+    quint32     pos     = m_textNext;
+
+    // The text of a line is never split by the end of the ring
+    if ((pos & (OTC_LOG_TEXT_SIZE-1)) + len > OTC_LOG_TEXT_SIZE)
+        pos += OTC_LOG_TEXT_SIZE - (pos & (OTC_LOG_TEXT_SIZE-1));
+
+    otcLogLine& l = take(pos, len);
+
+    memcpy(m_text.data() + (pos & (OTC_LOG_TEXT_SIZE-1)), utf8.constData(), len);
+
+    l.stamp     = stamp;
+    l.text      = pos;
+    l.number    = 0;
+    l.length    = len;
+    l.colour    = colour;
+    l.frame     = 0;
+
+    m_next++;
+    m_textNext = pos + len;
+
+    if (text.length() > m_widest)
+        m_widest = text.length();
+}
+
+void otcLogModel::clear()
+{
+    m_first     = m_next;
+    m_widest    = 0;
+}
+
+QString otcLogModel::text(quint64 n)
+{
+    if ((n < m_first) || (n >= m_next))
+        return QString();
+
+    const otcLogLine& l = m_lines[n & (OTC_LOG_LINES-1)];
+
+    if (l.frame)
+    {
+        otcFrame f;
+
+        if ((m_store == NULL) || !m_store->frame(l.number, f))
+            return QString("[ frame %1 no longer in the store ]").arg(l.number);
+
+        return otc_mpipe_parser::text(f.seq, f.id, f.cmd, (const unsigned char*)f.data.constData(), f.data.size());
+    }
+
+    return QString::fromUtf8(m_text.constData() + (l.text & (OTC_LOG_TEXT_SIZE-1)), l.length);
+}
+
+qint64 otcLogModel::stamp(quint64 n)
+{
+    if ((n < m_first) || (n >= m_next))
+        return 0;
+
+    return m_epoch + m_lines[n & (OTC_LOG_LINES-1)].stamp;
+}
+
+otc_log_colour_t otcLogModel::colour(quint64 n)
+{
+    if ((n < m_first) || (n >= m_next))
+        return OTC_LOG_COLOUR_DEFAULT;
+
+    return (otc_log_colour_t)m_lines[n & (OTC_LOG_LINES-1)].colour;
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           LOG VIEW                       //
+//                                          //
+// ---------------------------------------- //
+
+otcLogWidget::otcLogWidget(QWidget* parent)
+    :QAbstractScrollArea(parent)
+{
+    m_follow    = TRUE;
+    m_top       = 0;
+    m_selFrom   = 0;
+    m_selTo     = 0;
+    m_selecting = FALSE;
+
+    m_tick.start();
+    m_summary.start();
+    startTimer(OTC_LOG_DRAIN_PERIOD);
+}
+
+// From the GUI thread only, other threads use otcConfig::logText()
+void otcLogWidget::append(const QString& str)
+{
+    m_model.append(str);
+    updateScrollBars();
+    viewport()->update();
+}
+
+void otcLogWidget::clear()
+{
+    m_model.clear();
+    m_selFrom = m_selTo = m_model.first();
+    updateScrollBars();
+    viewport()->update();
+}
+
+void otcLogWidget::scrollToBottom()
+{
+    verticalScrollBar()->setValue(verticalScrollBar()->maximum());
+    m_follow = TRUE;
+}
+
+// Adds the lines logged since the last period, then redraws once
+void otcLogWidget::timerEvent(QTimerEvent*)
+{
+    QString         line;
+    otcLogItem      item;
+    QElapsedTimer   drain;
+    bool            late    = (m_tick.restart() > 2 * OTC_LOG_DRAIN_PERIOD);
+    int             dropped = m_queue.dropped();
+    int             n;
+
+    drain.start();
+    for (n=0; (n < OTC_LOG_BATCH_MAX) && m_queue.pop(item); n++)
+    {
+        if (item.frame < 0)
+            m_model.append(item.line);
+        else
+            m_model.append((quint32)item.frame, item.colour, item.length);
+    }
+
+    if (dropped)
+    {
+        m_model.append(QString("<font color=red>**%1 log lines dropped</font>").arg(dropped));
+        n++;
+    }
+
+    // Behind: the event loop is late, the queue cannot be emptied, or
+    // emptying it takes most of the period
+    if (m_governor.update(late || dropped || (n >= OTC_LOG_BATCH_MAX) ||
+                          (drain.elapsed() > OTC_LOG_DRAIN_PERIOD / 2)))
+    {
+        m_model.append(m_governor.mode());
+        n++;
+    }
+
+    if (m_summary.elapsed() >= OTC_LOG_SUMMARY_PERIOD)
+    {
+        m_summary.restart();
+        line = m_governor.summary();
+        if (!line.isEmpty())
+        {
+            m_model.append(line);
+            n++;
+        }
+    }
+
+    if (n == 0)
+        return;
+
+    updateScrollBars();
+    viewport()->update();
+}
+
+// The vertical scroll bar counts lines from the oldest one kept. Unless the
+// view follows the end of the log, it stays on the same lines when the
+// oldest ones are forgotten.
+void otcLogWidget::updateScrollBars()
+{
+    QScrollBar* v       = verticalScrollBar();
+    QScrollBar* h       = horizontalScrollBar();
+    int         rowH    = fontMetrics().lineSpacing();
+    int         page    = viewport()->height() / rowH;
+    int         width   = fontMetrics().width(prefix(0)) + m_model.widest() * fontMetrics().width('0');
+    bool        follow  = m_follow;
+
+    if (page < 1)
+        page = 1;
+
+    v->setRange(0, qMax(0, m_model.count() - page));
+    v->setPageStep(page);
+    v->setSingleStep(1);
+
+    if (follow)
+        v->setValue(v->maximum());
+    else
+        v->setValue((m_top > m_model.first()) ? (int)(m_top - m_model.first()) : 0);
+
+    h->setRange(0, qMax(0, width - viewport()->width()));
+    h->setPageStep(viewport()->width());
+    h->setSingleStep(fontMetrics().width('0'));
+
+    m_top       = m_model.first() + v->value();
+    m_follow    = (v->value() == v->maximum());
+}
+
+void otcLogWidget::scrollContentsBy(int, int)
+{
+    m_top       = m_model.first() + verticalScrollBar()->value();
+    m_follow    = (verticalScrollBar()->value() == verticalScrollBar()->maximum());
+    viewport()->update();
+}
+
+void otcLogWidget::resizeEvent(QResizeEvent*)
+{
+    updateScrollBars();
+}
+
+QString otcLogWidget::prefix(quint64 n)
+{
+    return QDateTime::fromMSecsSinceEpoch(m_model.stamp(n)).toString("hh:mm:ss.zzz  ");
+}
+
+// Only the rows on screen are drawn
+void otcLogWidget::paintEvent(QPaintEvent*)
+{
+    QPainter        p(viewport());
+    QFontMetrics    fm      = fontMetrics();
+    int             rowH    = fm.lineSpacing();
+    int             x       = 2 - horizontalScrollBar()->value();
+    int             rows    = viewport()->height() / rowH + 1;
+    quint64         top     = m_model.first() + verticalScrollBar()->value();
+    quint64         selLo   = qMin(m_selFrom, m_selTo);
+    quint64         selHi   = qMax(m_selFrom, m_selTo);
+    bool            sel     = m_selecting || (m_selFrom != m_selTo);
+    QColor          colours[OTC_LOG_COLOUR_QTY] = {
+                        palette().color(QPalette::Text), Qt::red, Qt::blue, Qt::darkGreen, Qt::gray };
+
+    for (int r=0; r<rows; r++)
+    {
+        quint64 n = top + r;
+        int     y = r * rowH;
+
+        if (n >= m_model.next())
+            break;
+
+        QString pre = prefix(n);
+
+        if (sel && (n >= selLo) && (n <= selHi))
+            p.fillRect(0, y, viewport()->width(), rowH, palette().highlight());
+
+        p.setPen(Qt::gray);
+        p.drawText(x, y + fm.ascent(), pre);
+        p.setPen(colours[m_model.colour(n)]);
+        p.drawText(x + fm.width(pre), y + fm.ascent(), m_model.text(n));
+    }
+}
+
+quint64 otcLogWidget::lineAt(int y)
+{
+    quint64 n = m_model.first() + verticalScrollBar()->value() + qMax(0, y) / fontMetrics().lineSpacing();
+
+    if (n >= m_model.next())
+        n = m_model.next() ? m_model.next() - 1 : 0;
+
+    return n;
+}
+
+// Whole lines are selected with the mouse, and copied when it is released
+void otcLogWidget::mousePressEvent(QMouseEvent* e)
+{
+    if (e->button() != Qt::LeftButton)
+        return;
+
+    m_selFrom   = m_selTo = lineAt(e->y());
+    m_selecting = TRUE;
+    viewport()->update();
+}
+
+void otcLogWidget::mouseMoveEvent(QMouseEvent* e)
+{
+    if (!m_selecting)
+        return;
+
+    m_selTo = lineAt(e->y());
+    viewport()->update();
+}
+
+void otcLogWidget::mouseReleaseEvent(QMouseEvent* e)
+{
+    if (!m_selecting || (e->button() != Qt::LeftButton))
+        return;
+
+    QString text;
+    quint64 lo  = qMax(qMin(m_selFrom, m_selTo), m_model.first());
+    quint64 hi  = qMax(m_selFrom, m_selTo);
+
+    m_selecting = FALSE;
+
+    for (quint64 n=lo; (n <= hi) && (n < m_model.next()); n++)
+        text += prefix(n) + m_model.text(n) + '\n';
+
+    QApplication::clipboard()->setText(text, QClipboard::Clipboard);
+    if (QApplication::clipboard()->supportsSelection())
+        QApplication::clipboard()->setText(text, QClipboard::Selection);
+
+    viewport()->update();
+}
@@ -0,0 +1,265 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_log.h
+/// @brief          Log line queue, log model and log view
+///                 Hands the log lines of all the threads to the GUI and shows them
+//
+/// =========================================================================
+///
+/// otcConfig::logText() is called from every thread, often once per frame.
+/// Instead of posting one event per line to the GUI thread, the lines are
+/// pushed in a bounded lock-free queue (many producers, one consumer). The
+/// log widget drains it on a timer and appends a whole batch at once.
+///
+/// When the queue is full the line is dropped and counted. The count is
+/// shown in the log with the next batch, so a burst the GUI cannot follow
+/// costs a fixed amount of memory rather than an ever growing event queue.
+///
+/// The lines still have to be made by the threads that log them. When the
+/// GUI falls behind (the drain timer fires late, a drain hits the batch
+/// limit or takes too long, lines are dropped), the governor only lets 1
+/// frame in N be printed for each ALP id, N doubling until nothing is
+/// printed, and halving once the GUI keeps up again. The frames which are
+/// not printed are not formatted at all, and are counted in a summary line
+/// every second. Only the display is sampled: socket clients, listeners
+/// and the capture still get every byte.
+///
+/// The log itself is a ring of compact line records (time, place of the
+/// text, colour) over a ring of text. The HTML of the log calls is reduced
+/// to plain text and one colour per line when the line is added. A frame
+/// from the device takes no text: its record holds the number of the frame
+/// in the frame store, and its line is made again from the store when it is
+/// drawn or copied. Once one of the rings is full, the oldest lines are
+/// forgotten: memory is bounded and adding a line is O(1). The view only
+/// draws the rows on screen.
+///
+/// =========================================================================
+
+#ifndef __OTC_LOG_H__
+#define __OTC_LOG_H__
+
+#include <qstring.h>
+#include <qatomic.h>
+#include <qvector.h>
+#include <qbytearray.h>
+#include <qelapsedtimer.h>
+#include <qabstractscrollarea.h>
+
+
+/// Lines waiting for the GUI, must be a power of 2
+#define OTC_LOG_QUEUE_SIZE                  4096
+
+/// How often the GUI drains the queue (ms)
+#define OTC_LOG_DRAIN_PERIOD                40
+
+/// Most lines appended by one drain, the rest waits for the next one
+#define OTC_LOG_BATCH_MAX                   1024
+
+/// Most frames skipped for one printed, then none is printed
+#define OTC_LOG_SAMPLE_MAX                  64
+
+/// Sampling is increased at most this often while the GUI is behind (ms)
+#define OTC_LOG_GOVERNOR_STEP               250
+
+/// and decreased after this time without being behind (ms)
+#define OTC_LOG_GOVERNOR_CALM               1000
+
+/// Period of the summary of the frames not printed (ms)
+#define OTC_LOG_SUMMARY_PERIOD              1000
+
+/// Frame classes of the governor: one per ALP id, and the raw reads
+#define OTC_LOG_CLASS_RAW                   256
+#define OTC_LOG_CLASSES                     257
+
+/// Lines kept by the log, must be a power of 2
+#define OTC_LOG_LINES                       (1 << 20)
+
+/// Bytes of text (UTF-8) kept by the log, must be a power of 2. Only the
+/// lines which are not frames take text
+#define OTC_LOG_TEXT_SIZE                   (1 << 25)
+
+/// Longer lines are cut (bytes)
+#define OTC_LOG_LINE_MAX                    0xFFFF
+
+
+typedef enum {
+    OTC_LOG_COLOUR_DEFAULT = 0,
+    OTC_LOG_COLOUR_RED,
+    OTC_LOG_COLOUR_BLUE,
+    OTC_LOG_COLOUR_DARKGREEN,
+    OTC_LOG_COLOUR_GRAY,
+    OTC_LOG_COLOUR_QTY
+} otc_log_colour_t;
+
+
+class otcFrameStore;
+
+
+/// Line handed to the GUI: a text, or a frame of the store
+class otcLogItem
+{
+public :
+    QString                 line;
+    qint64                  frame;      ///< number in the frame store, -1 for a text
+    int                     length;     ///< of the frame body
+    otc_log_colour_t        colour;     ///< of the frame
+};
+
+
+class otcLogQueue
+{
+public :
+    otcLogQueue();
+
+    bool                    push(const QString& line);
+    bool                    push(quint32 frame, otc_log_colour_t colour, int length);
+    bool                    pop(otcLogItem& item);
+    int                     dropped();
+
+protected :
+    /// A cell is free for position p when seq == p, and holds the line of
+    /// position p when seq == p+1
+    struct cell
+    {
+        QAtomicInt          seq;
+        otcLogItem          item;
+    };
+
+    cell                    m_cells[OTC_LOG_QUEUE_SIZE];
+    QAtomicInt              m_tail;     ///< next position to write (producers)
+    int                     m_head;     ///< next position to read (GUI only)
+    QAtomicInt              m_dropped;
+
+    int                     claim();
+};
+
+
+/// Any thread asks before making the line of a frame, the GUI tells it
+/// how it keeps up
+class otcLogGovernor
+{
+public :
+    otcLogGovernor();
+
+    bool                    admit(int frameClass);
+    bool                    update(bool behind);
+    QString                 summary();
+    QString                 mode();
+
+protected :
+    QAtomicInt              m_keep;     ///< 1 frame in m_keep is printed, 0: none
+    QAtomicInt              m_seen[OTC_LOG_CLASSES];
+    QAtomicInt              m_skipped[OTC_LOG_CLASSES];
+    QElapsedTimer           m_changed;  ///< GUI only
+    QElapsedTimer           m_calm;     ///< GUI only, since the GUI was last behind
+};
+
+
+/// 16 bytes per line
+class otcLogLine
+{
+public :
+    quint32                 stamp;      ///< ms since the log was created
+    quint32                 text;       ///< position of the text in the text ring
+    quint32                 number;     ///< of the frame in the store
+    quint16                 length;     ///< bytes, or length of the frame body
+    quint8                  colour;
+    quint8                  frame;      ///< a frame of the store, without text
+};
+
+
+/// Lines are numbered from the creation of the log: a number stays valid
+/// until the line is forgotten. Not thread safe, used by the GUI only.
+class otcLogModel
+{
+public :
+    otcLogModel();
+
+    void                    append(const QString& html);
+    void                    append(quint32 frame, otc_log_colour_t colour, int length);
+    void                    clear();
+    void                    setStore(otcFrameStore* store)  {m_store = store;}
+
+    quint64                 first()         {return m_first;}
+    quint64                 next()          {return m_next;}
+    int                     count()         {return (int)(m_next - m_first);}
+    int                     widest()        {return m_widest;}
+
+    QString                 text(quint64 n);
+    qint64                  stamp(quint64 n);
+    otc_log_colour_t        colour(quint64 n);
+
+protected :
+    otcFrameStore*          m_store;
+    QVector<otcLogLine>     m_lines;
+    QByteArray              m_text;
+    quint64                 m_first;
+    quint64                 m_next;
+    quint32                 m_textNext;
+    qint64                  m_epoch;    ///< ms since 1970 of stamp 0
+    int                     m_widest;   ///< characters
+
+    void                    add(quint32 stamp, const QString& text, otc_log_colour_t colour);
+    otcLogLine&             take(quint32 pos, quint32 len);
+};
+
+
+class otcLogWidget : public QAbstractScrollArea
+{
+public :
+    otcLogWidget(QWidget* parent);
+
+    void                    push(const QString& str)    {m_queue.push(str);}
+    void                    push(quint32 frame, otc_log_colour_t colour, int length)
+                                                        {m_queue.push(frame, colour, length);}
+    void                    setStore(otcFrameStore* store)  {m_model.setStore(store);}
+    bool                    admit(int frameClass)       {return m_governor.admit(frameClass);}
+    void                    append(const QString& str);
+    void                    clear();
+    void                    scrollToBottom();
+
+protected :
+    otcLogQueue             m_queue;
+    otcLogGovernor          m_governor;
+    otcLogModel             m_model;
+    QElapsedTimer           m_tick;     ///< since the last drain
+    QElapsedTimer           m_summary;
+    bool                    m_follow;
+    quint64                 m_top;      ///< first line shown
+    quint64                 m_selFrom;
+    quint64                 m_selTo;
+    bool                    m_selecting;
+
+    void                    timerEvent(QTimerEvent* e);
+    void                    paintEvent(QPaintEvent* e);
+    void                    resizeEvent(QResizeEvent* e);
+    void                    scrollContentsBy(int dx, int dy);
+    void                    mousePressEvent(QMouseEvent* e);
+    void                    mouseMoveEvent(QMouseEvent* e);
+    void                    mouseReleaseEvent(QMouseEvent* e);
+
+    void                    updateScrollBars();
+    quint64                 lineAt(int y);
+    QString                 prefix(quint64 n);
+};
+
+
+#endif // __OTC_LOG_H__
@@ -54,6 +54,7 @@
 int              otcConfig::argComPort = 0;
 OTC_LINK_T       otcConfig::communicationLink = OTC_LINK_COM;
 int              otcConfig::argBaudRate = 115200;
+bool             otcConfig::argAutobaud = FALSE;
 OTC_PRINT_MODE_T otcConfig::argPrintMode = OTC_PRINT_MODE_NDEF_PLUS_OT;
 OTC_FLOW_T       otcConfig::argFlowMode = OTC_FLOW_NONE;
 otcLogWidget*    otcConfig::logWidget = NULL;
@@ -61,12 +62,74 @@ otcMainWindow*   otcConfig::mainWindow = NULL;
 int              otcConfig::argSocketPort = 1515;
 
 
+#ifdef OTC_MPIPE_BENCH
+int otc_mpipe_bench(void);
+#endif
+#ifdef OTC_HEX_BENCH
+#include "otc_hex.h"
+#endif
+#ifdef OTC_FRAMES_BENCH
+#include "otc_frames.h"
+#endif
+#ifdef OTC_SERIAL_BENCH
+#include "otc_serial.h"
+#endif
+
 int main( int argc, char *argv[] )
 {
 	const char title[] = "OTCOM " OTC_VERSION;
 
+#ifdef OTC_MPIPE_BENCH
+	if ((argc > 1) && (QString(argv[1]) == "bench"))
+		return otc_mpipe_bench();
+#endif
+#ifdef OTC_HEX_BENCH
+	if ((argc > 1) && (QString(argv[1]) == "hexbench"))
+		return otc_hex_bench();
+#endif
+#ifdef OTC_FRAMES_BENCH
+	if ((argc > 1) && (QString(argv[1]) == "framebench"))
+		return otc_frames_bench();
+#endif
+#ifdef OTC_SERIAL_BENCH
+	if ((argc > 1) && (QString(argv[1]) == "serialbench"))
+		return otc_serial_bench();
+#endif
+
     QApplication a( argc, argv );
 
+    // Script options can be anywhere, the positional arguments are kept in argv:
+    // -s <file> runs a command script, -w <window> and -t <timeout_ms> tune it,
+    // and -q quits once the script is finished
+    QString scriptFile;
+    int     scriptWindow    = OTC_SCRIPT_WINDOW;
+    int     scriptTimeout   = OTC_SCRIPT_TIMEOUT;
+    bool    scriptQuit      = FALSE;
+    int     positional      = 1;
+
+    for (int i=1; i<argc; i++)
+    {
+        QString arg(argv[i]);
+
+        if ((arg == "-s") && (i+1 < argc))
+            scriptFile = argv[++i];
+        else if ((arg == "-w") && (i+1 < argc))
+            scriptWindow = QString(argv[++i]).toInt();
+        else if ((arg == "-t") && (i+1 < argc))
+            scriptTimeout = QString(argv[++i]).toInt();
+        else if (arg == "-q")
+            scriptQuit = TRUE;
+        else
+            argv[positional++] = argv[i];
+    }
+    argc = positional;
+
+    if ((scriptWindow < 0) || (scriptTimeout < 1))
+    {
+        QMessageBox::critical(NULL, title, "Invalid script window or timeout!");
+        return 1;
+    }
+
 	switch(argc)
 	{
 	    case 4 :
@@ -82,12 +145,12 @@ int main( int argc, char *argv[] )
         // no break here
 	    case 3 :
 	    {
-            otcConfig::argBaudRate = QString(argv[2]).toUInt();
-			if(otcConfig::argBaudRate!= 9600
-                    && otcConfig::argBaudRate!= 57600
-                    && otcConfig::argBaudRate!= 115200
-                    && otcConfig::argBaudRate!= 460800
-                    && otcConfig::argBaudRate!= 921600)
+            // auto: the rate is looked for once the link is open
+            if(QString(argv[2]).lower()=="auto")
+                otcConfig::argAutobaud = TRUE;
+            else
+                otcConfig::argBaudRate = QString(argv[2]).toUInt();
+			if(!otc_serial::validBaudrate(otcConfig::argBaudRate))
                 {
                     QMessageBox::critical(NULL, title, "Invalid baudrate!");
                     return 1;
@@ -145,6 +208,9 @@ int main( int argc, char *argv[] )
 		//return 0;
 	}
 
+    if (!scriptFile.isEmpty())
+        mw->runScript(scriptFile, scriptWindow, scriptTimeout, scriptQuit);
+
     int result = a.exec();
     delete mw;
     return result;
@@ -28,6 +28,41 @@
 
 #include <qstring.h>
 
+#ifndef WIN32
+#include <sys/uio.h>
+#else
+/// Buffer of a gather write, as the POSIX one
+struct iovec {
+    void*   iov_base;
+    size_t  iov_len;
+};
+#endif
+
+/// Buffers given to one writev() or sendmsg(), IOV_MAX is 1024 on Linux but
+/// may be as low as 16
+#define OTC_IOV_MAX             16
+
+/// Skips done bytes of a gather write, the buffers written are removed.
+/// Returns the number of buffers left in iov.
+inline int otcIovecSkip(struct iovec* iov, int iovcnt, size_t done)
+{
+    int i = 0;
+
+    while ((i < iovcnt) && (done >= iov[i].iov_len))
+        done -= iov[i++].iov_len;
+
+    if (i < iovcnt)
+    {
+        iov[i].iov_base  = (char*)iov[i].iov_base + done;
+        iov[i].iov_len  -= done;
+    }
+
+    for (int j=i; j<iovcnt; j++)
+        iov[j - i] = iov[j];
+
+    return iovcnt - i;
+}
+
 #define OTC_COM_PORTS_MAX_NB    8
 #define OTC_COM_PORTS_MAP_PATH  "/usr/commap"
 
@@ -79,6 +114,7 @@ public :
 //    char                    argTtyFile[128];
 //#   endif
     static int              argBaudRate;
+    static bool             argAutobaud;
     static OTC_PRINT_MODE_T argPrintMode;
     static OTC_FLOW_T       argFlowMode;
     static int              argSocketPort;
@@ -86,6 +122,8 @@ public :
 	static otcLogWidget*    logWidget;
 	static otcMainWindow*   mainWindow;
 	static void             logText(const QString& str);
+	static bool             logFrame(int frameClass);
+	static void             logStored(unsigned int frame, int colour, int length);
 };
 
 
@@ -31,6 +31,16 @@
 #include "otc_main.h"
 #include "otc_alp.h"
 #include "otc_mpipe.h"
+#include "otc_hex.h"
+#include "otc_frames.h"
+#include "otc_trace.h"
+#include "otc_log.h"
+
+#ifndef WIN32
+int GetTickCount(void);
+#else
+#include <windows.h>
+#endif
 
 // ---------------------------------------- //
 //                                          //
@@ -38,22 +48,92 @@
 //                                          //
 // ---------------------------------------- //
 
-// Constructor
+QAtomicInt   otc_mpipe_builder::statFrames    = 0;
+QAtomicInt   otc_mpipe_builder::statCaller    = 0;
+QAtomicInt   otc_mpipe_builder::statRejected  = 0;
+QAtomicInt   otc_mpipe_builder::seqCounter    = 0;
+
+
+/** @brief  Allocates the seq of a frame sent to the device
+  * @retval (unsigned char) next MPIPE seq
+  *
+  * The command parser, the scripts, the jobs and the bulk reader all take
+  * their seqs here: the ACK window and the tracer match the responses on the
+  * seq, so two frames on the link must not carry the same one.
+  */
+unsigned char otc_mpipe_builder::nextSeq(void) {
+    return (unsigned char)seqCounter.fetchAndAddOrdered(1);
+}
+
+
+// Constructor: frame of known body length, in the inline buffer
 otc_mpipe_builder::otc_mpipe_builder(unsigned char bodylen) {
-    // allocate msg outbuf
-    size = OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + bodylen;
-    outbuf  = new unsigned char[size];
+    outbuf      = inlinebuf;
+    capacity    = OTC_MPIPE_BUILDER_INLINE;
+    size        = OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + bodylen;
 }
 
 
-// Destructor
-otc_mpipe_builder::~otc_mpipe_builder() {
-    // delete msg outbuf
-    delete outbuf;
-    outbuf = NULL;
+// Constructor: frame serialized in caller storage, by build()
+otc_mpipe_builder::otc_mpipe_builder(unsigned char* storage, int capacity) {
+    outbuf          = storage;
+    this->capacity  = capacity;
+    size            = 0;
+    statCaller.ref();
 }
 
-void otc_mpipe_builder::header(unsigned char id, unsigned char cmd){
+
+// Header, body and CRC in a single pass over the output
+bool otc_mpipe_builder::build(unsigned char id, unsigned char cmd, unsigned char seq,
+                              otc_mpipe_superstate_t chunk,
+                              const unsigned char* data, int bodylen) {
+    unsigned short  crc;
+    unsigned char*  out;
+    int             payload_len;
+
+    if ((bodylen > OTC_MPIPE_RECORD_MAX)
+    ||  ((OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + bodylen) > capacity)) {
+        statRejected.ref();
+        return false;
+    }
+
+    size        = OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + bodylen;
+    payload_len = OTC_MPIPE_ALP_SIZE + bodylen;
+
+    outbuf[0]   = OTC_MPIPE_SYNC_BYTE_0;
+    outbuf[1]   = OTC_MPIPE_SYNC_BYTE_1;
+    outbuf[4]   = (payload_len >> 8) & 0xFF;
+    outbuf[5]   = (payload_len & 0xFF);
+    outbuf[6]   = seq;
+    outbuf[7]   = 0;
+    outbuf[8]   = (unsigned char)(chunk << 5);
+    outbuf[9]   = (unsigned char)bodylen;
+    outbuf[10]  = id;
+    outbuf[11]  = cmd;
+
+    crc = (unsigned short)0xFFFF;
+    for (int i=4; i<12; ++i) {
+        crc = (crc << 8) ^ crcLut[((crc >> 8) & 0xff) ^ outbuf[i]];
+    }
+
+    // body copied and CRC'ed in the same loop
+    out = &outbuf[12];
+    for (int i=0; i<bodylen; ++i) {
+        unsigned char byte = data[i];
+        out[i]  = byte;
+        crc     = (crc << 8) ^ crcLut[((crc >> 8) & 0xff) ^ byte];
+    }
+
+    outbuf[2]   = (crc >> 8);       // CRC hi
+    outbuf[3]   = crc & 0xff;       // CRC lo
+
+    statFrames.ref();
+    return true;
+}
+
+
+void otc_mpipe_builder::header(unsigned char id, unsigned char cmd, unsigned char seq,
+                               otc_mpipe_superstate_t chunk) {
     int payload_len;
     
     // Sync Word
@@ -77,8 +157,8 @@ void otc_mpipe_builder::header(unsigned char id, unsigned char cmd){
     ///           other values.
     outbuf[7]   = 0;
     
-    // ALP Record/Message
-    outbuf[8]   = OTC_MPIPE_SYNC_WORD_CHUNK_NO; 
+    // ALP Record/Message: chunk state in the 3 MSBs of the flags
+    outbuf[8]   = (unsigned char)(chunk << 5);
     
     // ALP Payload Length
     payload_len-= OTC_MPIPE_ALP_SIZE;
@@ -94,27 +174,474 @@ void otc_mpipe_builder::header(unsigned char id, unsigned char cmd){
 
 void otc_mpipe_builder::body(unsigned char * data) {
     memcpy(&outbuf[12], data, outbuf[9]);
-    
-//    DEBUGGING
-//    int i;
-//    for (i=0; i<len(); i++) {
-//        printf("%02X ", outbuf[i]);
-//        if ((i & 15) == 0) {
-//            printf("\n");
-//        }
-//    } printf("\n");
 }
 
 
+// CRC over everything after the CRC field, as checked by the parser
 void otc_mpipe_builder::footer() {
     unsigned short crc = (unsigned short)0xFFFF;
 
-    // CRC
-    for (int i=4; i<(size-4); ++i) {
+    for (int i=4; i<size; ++i) {
         crc = (crc << 8) ^ crcLut[((crc >> 8) & 0xff) ^ outbuf[i]];
     }
-    outbuf[2] = crc & 0xff;  // CRC lo
-    outbuf[3] = (crc >> 8);  // CRC hi
+    outbuf[2] = (crc >> 8);  // CRC hi
+    outbuf[3] = crc & 0xff;  // CRC lo
+
+    statFrames.ref();
+}
+
+
+QString otc_mpipe_builder::getStatus() {
+    return QString("Builder: %1 frames (%2 in caller storage), %3 rejected, no heap allocation.\n")
+                .arg((unsigned int)(int)statFrames).arg((unsigned int)(int)statCaller)
+                .arg((unsigned int)(int)statRejected);
+}
+
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           MPIPE FRAME TEMPLATE           //
+//                                          //
+// ---------------------------------------- //
+
+otc_mpipe_template::otc_mpipe_template() {
+    size    = 0;
+    slots   = 0;
+}
+
+
+// Keeps a copy of a frame made by the builder, seq and ALP CMD become slots
+bool otc_mpipe_template::set(const unsigned char* frame, int len) {
+    if ((len < OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE) || (len > OTC_MPIPE_FRAME_MAX)) {
+        return false;
+    }
+
+    memcpy(outbuf, frame, len);
+    size    = len;
+    slots   = 0;
+    addSlot(6);     // MPIPE seq
+    addSlot(11);    // ALP CMD
+    return true;
+}
+
+
+// CRC change caused by each bit of the byte at offset, as seen at the end
+// of the frame. Returns the slot number, or -1.
+int otc_mpipe_template::addSlot(int pos) {
+    if ((slots >= OTC_MPIPE_TEMPLATE_SLOTS) || (pos < 4) || (pos >= size)) {
+        return -1;
+    }
+
+    for (int bit=0; bit<8; ++bit) {
+        unsigned short crc = crcLut[1 << bit];
+        for (int i=pos+1; i<size; ++i) {
+            crc = (crc << 8) ^ crcLut[(crc >> 8) & 0xff];
+        }
+        flip[slots][bit] = crc;
+    }
+
+    offset[slots] = pos;
+    return slots++;
+}
+
+
+void otc_mpipe_template::write(int slot, unsigned char value) {
+    unsigned char   diff    = outbuf[offset[slot]] ^ value;
+    unsigned short  crc     = (outbuf[2] << 8) | outbuf[3];
+
+    for (int bit=0; diff; ++bit, diff >>= 1) {
+        if (diff & 1) {
+            crc ^= flip[slot][bit];
+        }
+    }
+
+    outbuf[offset[slot]] = value;
+    outbuf[2] = (crc >> 8);  // CRC hi
+    outbuf[3] = crc & 0xff;  // CRC lo
+}
+
+
+
+#ifdef OTC_MPIPE_BENCH
+// Builder benchmark: "otcom bench" in a build made with OTC_MPIPE_BENCH.
+// Heap allocations are counted by replacing the global operators.
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+
+#if __cplusplus >= 201103L
+#   define BENCH_THROW
+#   define BENCH_NOTHROW    noexcept
+#else
+#   define BENCH_THROW      throw(std::bad_alloc)
+#   define BENCH_NOTHROW    throw()
+#endif
+
+static unsigned long bench_allocs = 0;
+
+void* operator new(size_t n) BENCH_THROW {
+    bench_allocs++;
+    void* p = malloc(n ? n : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n) BENCH_THROW {
+    return operator new(n);
+}
+void operator delete(void* p) BENCH_NOTHROW {
+    free(p);
+}
+void operator delete[](void* p) BENCH_NOTHROW {
+    free(p);
+}
+
+
+int otc_mpipe_bench(void) {
+    const int       count = 1000000;
+    unsigned char   body[OTC_MPIPE_RECORD_MAX];
+    unsigned char   storage[OTC_MPIPE_FRAME_MAX];
+    unsigned long   allocs;
+    volatile unsigned long check = 0;   // keeps the frames alive
+    int             t;
+
+    for (int i=0; i<OTC_MPIPE_RECORD_MAX; ++i) {
+        body[i] = (unsigned char)i;
+    }
+
+    // header/body/footer in the inline buffer
+    allocs  = bench_allocs;
+    t       = GetTickCount();
+    for (int i=0; i<count; ++i) {
+        otc_mpipe_builder msg((unsigned char)(i & 0xFF));
+        msg.header(0x11, 0x22, i, OTC_MPIPE_SYNC_WORD_CHUNK_NO);
+        msg.body(body);
+        msg.footer();
+        check += msg.start()[2];
+    }
+    printf("inline, 3 passes : %d frames, %d ms, %lu allocations\n",
+           count, GetTickCount() - t, bench_allocs - allocs);
+
+    // single pass in caller storage
+    allocs  = bench_allocs;
+    t       = GetTickCount();
+    for (int i=0; i<count; ++i) {
+        otc_mpipe_builder msg(storage, sizeof(storage));
+        msg.build(0x11, 0x22, i, OTC_MPIPE_SYNC_WORD_CHUNK_NO, body, i & 0xFF);
+        check += msg.start()[2];
+    }
+    printf("storage, 1 pass  : %d frames, %d ms, %lu allocations\n",
+           count, GetTickCount() - t, bench_allocs - allocs);
+
+    // reference: one heap buffer per frame, as the builder used to do
+    allocs  = bench_allocs;
+    t       = GetTickCount();
+    for (int i=0; i<count; ++i) {
+        int            size  = OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + (i & 0xFF);
+        unsigned char* frame = new unsigned char[size];
+        otc_mpipe_builder msg(frame, size);
+        msg.build(0x11, 0x22, i, OTC_MPIPE_SYNC_WORD_CHUNK_NO, body, i & 0xFF);
+        check += frame[2];
+        delete[] frame;
+    }
+    printf("heap (reference) : %d frames, %d ms, %lu allocations\n",
+           count, GetTickCount() - t, bench_allocs - allocs);
+
+    // template re-issued with a new seq, full length body
+    otc_mpipe_builder   ref(storage, sizeof(storage));
+    otc_mpipe_template  tpl;
+    ref.build(0x11, 0x22, 0, OTC_MPIPE_SYNC_WORD_CHUNK_NO, body, OTC_MPIPE_RECORD_MAX);
+    tpl.set(ref.start(), ref.len());
+
+    allocs  = bench_allocs;
+    t       = GetTickCount();
+    for (int i=0; i<count; ++i) {
+        tpl.write(OTC_MPIPE_TEMPLATE_SLOT_SEQ, (unsigned char)i);
+        check += tpl.start()[2];
+    }
+    printf("template, patched: %d frames, %d ms, %lu allocations\n",
+           count, GetTickCount() - t, bench_allocs - allocs);
+
+    // the patched CRC must be the one the builder computes
+    for (int i=0; i<256; ++i) {
+        tpl.write(OTC_MPIPE_TEMPLATE_SLOT_SEQ, (unsigned char)i);
+        ref.build(0x11, 0x22, i, OTC_MPIPE_SYNC_WORD_CHUNK_NO, body, OTC_MPIPE_RECORD_MAX);
+        if (memcmp(tpl.start(), ref.start(), ref.len()) != 0) {
+            printf("template CRC mismatch at seq %d\n", i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           REASSEMBLY BUFFER POOL         //
+//                                          //
+// ---------------------------------------- //
+
+otc_mpipe_pool::otc_mpipe_pool() {
+    for (int i=0; i<OTC_MPIPE_POOL_CLASSES; ++i) {
+        m_free[i] = NULL;
+    }
+    m_cap       = OTC_MPIPE_REASSEMBLY_CAP;
+    m_used      = 0;
+    m_peak      = 0;
+    m_cached    = 0;
+}
+
+
+otc_mpipe_pool::~otc_mpipe_pool() {
+    for (int i=0; i<OTC_MPIPE_POOL_CLASSES; ++i) {
+        while (m_free[i] != NULL) {
+            otc_mpipe_block_t* block = m_free[i];
+            m_free[i] = block->next;
+            delete[] (unsigned char*)block;
+        }
+    }
+}
+
+
+// Index of the smallest block class holding size bytes
+int otc_mpipe_pool::sizeClass(int size) {
+    int c       = 0;
+    int block   = OTC_MPIPE_POOL_BLOCK_MIN;
+
+    while (block < size) {
+        block <<= 1;
+        c++;
+    }
+    return c;
+}
+
+
+// Get a block of at least size bytes, NULL if the cap would be exceeded
+unsigned char* otc_mpipe_pool::get(int size, int* alloc) {
+    unsigned char* block;
+    int c = sizeClass(size);
+
+    if (c >= OTC_MPIPE_POOL_CLASSES) {
+        return NULL;
+    }
+
+    *alloc = OTC_MPIPE_POOL_BLOCK_MIN << c;
+    if ((m_used + *alloc) > m_cap) {
+        return NULL;
+    }
+
+    if (m_free[c] != NULL) {
+        block       = (unsigned char*)m_free[c];
+        m_free[c]   = m_free[c]->next;
+        m_cached   -= *alloc;
+    }
+    else {
+        block       = new unsigned char[*alloc];
+    }
+
+    m_used += *alloc;
+    if (m_used > m_peak) {
+        m_peak = m_used;
+    }
+    return block;
+}
+
+
+// Give a block back. Free blocks are kept for reuse as long as the cache
+// stays under the cap.
+void otc_mpipe_pool::put(unsigned char* block, int alloc) {
+    if (block == NULL) {
+        return;
+    }
+
+    m_used -= alloc;
+
+    if ((m_cached + alloc) > m_cap) {
+        delete[] block;
+    }
+    else {
+        int c = sizeClass(alloc);
+        ((otc_mpipe_block_t*)block)->next = m_free[c];
+        m_free[c]   = (otc_mpipe_block_t*)block;
+        m_cached   += alloc;
+    }
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//           CHUNK REASSEMBLY               //
+//                                          //
+// ---------------------------------------- //
+
+int otc_mpipe_reassembler::memCap    = OTC_MPIPE_REASSEMBLY_CAP;
+int otc_mpipe_reassembler::timeout   = OTC_MPIPE_REASSEMBLY_TIMEOUT;
+
+
+otc_mpipe_reassembler::otc_mpipe_reassembler() {
+    memset(m_slot, 0, sizeof(m_slot));
+    m_completed = 0;
+    m_evicted   = 0;
+    m_overflows = 0;
+    m_orphans   = 0;
+}
+
+
+otc_mpipe_reassembler::~otc_mpipe_reassembler() {
+    for (int i=0; i<OTC_MPIPE_REASSEMBLY_SLOTS; ++i) {
+        if (m_slot[i].used) {
+            release(&m_slot[i]);
+        }
+    }
+}
+
+
+// Open a new message on CHUNK_FIRST. A previous message with the same id/cmd
+// can not complete anymore, and when all slots are busy the oldest goes.
+otc_mpipe_message_t* otc_mpipe_reassembler::begin(unsigned char id, unsigned char cmd, unsigned char seq) {
+    otc_mpipe_message_t* m = find(id, cmd);
+
+    if (m != NULL) {
+        m->overflow = true;     // not accounted as completed
+        release(m);
+        m_evicted++;
+        m = NULL;
+    }
+
+    for (int i=0; i<OTC_MPIPE_REASSEMBLY_SLOTS; ++i) {
+        if (!m_slot[i].used) {
+            m = &m_slot[i];
+            break;
+        }
+        if ((m == NULL) || (m_slot[i].stamp - m->stamp < 0)) {
+            m = &m_slot[i];
+        }
+    }
+
+    if (m->used) {
+        m->overflow = true;
+        release(m);
+        m_evicted++;
+    }
+
+    m->used         = true;
+    m->overflow     = false;
+    m->crcStatus    = true;
+    m->id           = id;
+    m->cmd          = cmd;
+    m->seq          = seq;
+    m->stamp        = GetTickCount();
+    m->size         = 0;
+    m->alloc        = 0;
+    m->data         = NULL;
+    return m;
+}
+
+
+otc_mpipe_message_t* otc_mpipe_reassembler::find(unsigned char id, unsigned char cmd) {
+    for (int i=0; i<OTC_MPIPE_REASSEMBLY_SLOTS; ++i) {
+        if (m_slot[i].used && (m_slot[i].id == id) && (m_slot[i].cmd == cmd)) {
+            return &m_slot[i];
+        }
+    }
+    return NULL;
+}
+
+
+// Append one chunk. The message buffer grows by doubling, drawing from the
+// pool. Returns false once the message could not be kept (size or memory cap).
+bool otc_mpipe_reassembler::append(otc_mpipe_message_t* m, unsigned char* data, int len, bool crcok) {
+    m->stamp        = GetTickCount();
+    m->crcStatus   &= crcok;
+
+    if (m->overflow) {
+        return false;
+    }
+
+    if ((m->size + len) > OTC_MPIPE_PAYLOAD_MAX) {
+        m->overflow = true;
+    }
+    else if ((m->size + len) > m->alloc) {
+        int             alloc;
+        unsigned char*  block;
+
+        m_pool.setCap(memCap);
+        block = m_pool.get((m->size + len) * 2, &alloc);
+        if (block == NULL) {
+            block = m_pool.get(m->size + len, &alloc);
+        }
+
+        if (block == NULL) {
+            m->overflow = true;
+        }
+        else {
+            if (m->size) {
+                memcpy(block, m->data, m->size);
+            }
+            m_pool.put(m->data, m->alloc);
+            m->data     = block;
+            m->alloc    = alloc;
+        }
+    }
+
+    if (m->overflow) {
+        m_pool.put(m->data, m->alloc);
+        m->data     = NULL;
+        m->alloc    = 0;
+        m_overflows++;
+        return false;
+    }
+
+    memcpy(m->data + m->size, data, len);
+    m->size += len;
+    return true;
+}
+
+
+void otc_mpipe_reassembler::release(otc_mpipe_message_t* m) {
+    if (!m->overflow && (m->data != NULL)) {
+        m_completed++;
+    }
+    m_pool.put(m->data, m->alloc);
+    m->data     = NULL;
+    m->alloc    = 0;
+    m->size     = 0;
+    m->used     = false;
+}
+
+
+// Evict messages that did not receive a chunk for too long
+int otc_mpipe_reassembler::expire(void) {
+    int now     = GetTickCount();
+    int count   = 0;
+
+    for (int i=0; i<OTC_MPIPE_REASSEMBLY_SLOTS; ++i) {
+        if (m_slot[i].used && ((now - m_slot[i].stamp) > timeout)) {
+            m_slot[i].overflow = true;  // not accounted as completed
+            release(&m_slot[i]);
+            m_evicted++;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+QString otc_mpipe_reassembler::getStatus() {
+    int open = 0;
+    for (int i=0; i<OTC_MPIPE_REASSEMBLY_SLOTS; ++i) {
+        open += m_slot[i].used;
+    }
+
+    return QString("Reassembly: %1 open, %2 completed, %3 evicted, %4 over cap, %5 orphan chunks. "
+                   "Memory %6/%7 bytes (peak %8), timeout %9 ms.\n")
+                .arg(open).arg(m_completed).arg(m_evicted).arg(m_overflows).arg(m_orphans)
+                .arg(m_pool.used()).arg(memCap).arg(m_pool.peak()).arg(timeout);
 }
 
 
@@ -129,10 +656,18 @@ void otc_mpipe_builder::footer() {
 otc_mpipe_parser::otc_mpipe_parser() {
     state           = OTC_MPIPE_PARSER_STATE_SYNC;
     superstate      = OTC_MPIPE_SYNC_WORD_CHUNK_NO;
+    id              = 0;
+    cmd             = 0;
+    crcStatus       = false;
+    store           = NULL;
+    tracer          = NULL;
+    readStamps      = NULL;
+    deliveredStamp  = -1;
+    syncStamp       = -1;
+    frameStamp      = -1;
     
-    // Allocate Buffers
-    ///@note JPN: this is new code, but it seems bad to allocate packet buffers
-    ///           every time a packet is detected.
+    // Allocate Buffers once, they are rewound for each packet. DATA is sized
+    // for the largest payload the MPIPE header can announce.
     buffer[OTC_MPIPE_BUFFER_INDEX_CRC].size     = 2;
     alloc( &buffer[OTC_MPIPE_BUFFER_INDEX_CRC] );
     
@@ -142,28 +677,23 @@ otc_mpipe_parser::otc_mpipe_parser() {
     buffer[OTC_MPIPE_BUFFER_INDEX_ALP].size  = 4;
     alloc( &buffer[OTC_MPIPE_BUFFER_INDEX_ALP] );
     
-    buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size = 256;
+    buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size = OTC_MPIPE_PAYLOAD_MAX;
     alloc( &buffer[OTC_MPIPE_BUFFER_INDEX_DATA] );
 }
 
 
 // Destructor
 otc_mpipe_parser::~otc_mpipe_parser() {
-    buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size = 256;
-
     for (int i=0; i<OTC_MPIPE_BUFFER_INDEX_QTY; ++i) {
-        if (buffer[i].size) {
-            delete buffer[i].payload;
-            buffer[i].payload = NULL;
-        }
+        free( &buffer[i] );
     }
 }
 
 
 // Free a buffer (not used anymore)
 void otc_mpipe_parser::free(otc_mpipe_buffer_t* buffer) {
-    if (buffer->size) {
-        delete buffer->payload;
+    if (buffer->payload != NULL) {
+        delete[] buffer->payload;
         buffer->payload = NULL;
     }
     buffer->size    = 0;
@@ -174,26 +704,28 @@ void otc_mpipe_parser::free(otc_mpipe_buffer_t* buffer) {
 
 // Allocate new buffer
 void otc_mpipe_parser::alloc(otc_mpipe_buffer_t* buffer) {
-    if (buffer->size) {
-        buffer->offset  = 0;
-        buffer->remain  = buffer->size;
-        buffer->payload = new unsigned char[buffer->size];
-    }
+    buffer->offset  = 0;
+    buffer->remain  = buffer->size;
+    buffer->payload = (buffer->size) ? new unsigned char[buffer->size] : NULL;
 }
 
 
-// Append new data to buffer
+// Prepare an allocated buffer to receive size bytes
+void otc_mpipe_parser::rewind(otc_mpipe_buffer_t* buffer, int size) {
+    buffer->size    = size;
+    buffer->offset  = 0;
+    buffer->remain  = size;
+}
+
+
+// Append new data to buffer, returns the number of bytes consumed
 int otc_mpipe_parser::append(otc_mpipe_buffer_t* buffer, unsigned char* data, int available) {
-    if (buffer->remain >= available) {
-        memcpy(buffer->payload+buffer->offset, data, available);
-        buffer->offset += available;
-        buffer->remain -= available;
-        return 0;
-    }
-    else {
-        memcpy(buffer->payload+buffer->offset, data, buffer->remain);
-        return (available - buffer->remain);
-    }
+    int len = (available < buffer->remain) ? available : buffer->remain;
+
+    memcpy(buffer->payload+buffer->offset, data, len);
+    buffer->offset += len;
+    buffer->remain -= len;
+    return len;
 }
 
 
@@ -221,112 +753,151 @@ void otc_mpipe_parser::crccheck() {
 }
 
 
+// Check for the MPIPE sync word
+bool otc_mpipe_parser::sync(unsigned char* buffer) {
+    return ((buffer[0] == OTC_MPIPE_SYNC_BYTE_0) && (buffer[1] == OTC_MPIPE_SYNC_BYTE_1));
+}
+
+
 
 
 // Parse an NDEF/OT packet (this is a subset of NDEF)
+// Fields may be split across calls: every state consumes what is available
+// and resumes on the next call.
+// Arrival of each byte given to the next parse() (ns, see otc_clock.h), and
+// their delivery to the socket clients for the latency tracer
+void otc_mpipe_parser::setStamps(const qint64* received, qint64 delivered) {
+    readStamps      = received;
+    deliveredStamp  = delivered;
+}
+
+
 bool otc_mpipe_parser::parse(unsigned char* in, int toread) {
-    while (toread != 0) {
+    bool            complete    = FALSE;
+    unsigned char*  start       = in;
+
+    while (toread > 0) {
         switch (state) {
             case OTC_MPIPE_PARSER_STATE_SYNC:
-                state += (*in++ == 0xFF);
+                if (*in == OTC_MPIPE_SYNC_BYTE_0) {
+                    syncStamp = readStamps ? readStamps[in - start] : -1;
+                    state = OTC_MPIPE_PARSER_STATE_SYNC2;
+                }
+                in++;
                 toread--;
                 break;
                 
             case OTC_MPIPE_PARSER_STATE_SYNC2: 
-                state += (((*in++ == 0x55) << 1) - 1);
+                if (*in == OTC_MPIPE_SYNC_BYTE_1) {
+                    rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_CRC], 2 );
+                    rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_HEADER], 4 );
+                    frameStamp = syncStamp;
+                    state = OTC_MPIPE_PARSER_STATE_HEADER;
+                }
+                else if (*in == OTC_MPIPE_SYNC_BYTE_0) {
+                    syncStamp = readStamps ? readStamps[in - start] : -1;
+                }
+                else {
+                    state = OTC_MPIPE_PARSER_STATE_SYNC;
+                }
+                in++;
                 toread--;
                 break;
                 
             case OTC_MPIPE_PARSER_STATE_HEADER: {
                 int payload_len;
-                toread -= 6;
-                if (toread < 0) {
-                    return FALSE;
+                int n;
+
+                n       = append(&buffer[OTC_MPIPE_BUFFER_INDEX_CRC], in, toread);
+                in     += n;
+                toread -= n;
+                n       = append(&buffer[OTC_MPIPE_BUFFER_INDEX_HEADER], in, toread);
+                in     += n;
+                toread -= n;
+                if (buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].remain != 0) {
+                    break;
                 }
-                buffer[OTC_MPIPE_BUFFER_INDEX_CRC].payload[0]   = *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_CRC].payload[1]   = *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[0]= *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[1]= *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[2]= *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[3]= *in++;
                 
                 // State progression based on payload size
                 payload_len = (int)buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[0] << 8;
                 payload_len+= (int)buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[1];
                 if (payload_len == 0) {
-                    buffer[OTC_MPIPE_BUFFER_INDEX_ALP].size     = 0;
-                    buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size    = 0;
-                    state = OTC_MPIPE_PARSER_STATE_DONE;
+                    rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_ALP], 0 );
+                    rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_DATA], 0 );
+                    superstate  = OTC_MPIPE_SYNC_WORD_CHUNK_NO;
+                    state       = OTC_MPIPE_PARSER_STATE_DONE;
+                }
+                else if (payload_len < OTC_MPIPE_ALP_SIZE) {
+                    state = OTC_MPIPE_PARSER_STATE_ERROR;
                 }
                 else {
+                    rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_ALP], 4 );
                     state = OTC_MPIPE_PARSER_STATE_ALP;
                 }
             } break;
                 
             case OTC_MPIPE_PARSER_STATE_ALP: {
                 int payload_len;
+                int data_len;
                 int chunkstate;
+                int n;
                 
-                toread -= 4;
-                if (toread < 0) {
-                    return FALSE;
+                n       = append(&buffer[OTC_MPIPE_BUFFER_INDEX_ALP], in, toread);
+                in     += n;
+                toread -= n;
+                if (buffer[OTC_MPIPE_BUFFER_INDEX_ALP].remain != 0) {
+                    break;
                 }
-                
-                buffer[OTC_MPIPE_BUFFER_INDEX_ALP].size         = 4;
-                buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[0]   = *in++;
-                payload_len                                     = *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[1]   = (unsigned char)payload_len;
-                buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[2]   = *in++;
-                buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[3]   = *in++;
-                
-                buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size        = payload_len;
-                buffer[OTC_MPIPE_BUFFER_INDEX_DATA].remain      = payload_len;
+
+                // The ALP length field is one byte, the MPIPE one is 16 bits.
+                // When the ALP length is the low byte of the MPIPE payload
+                // length, the record is a long one and MPIPE gives its size.
+                payload_len = (int)buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[0] << 8;
+                payload_len+= (int)buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[1];
+                data_len    = payload_len - OTC_MPIPE_ALP_SIZE;
+                if ((data_len & 0xFF) != buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[1]) {
+                    data_len = buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[1];
+                }
+                rewind( &buffer[OTC_MPIPE_BUFFER_INDEX_DATA], data_len );
                 
                 // default state progression
-                state = (payload_len == 0) ? \
+                state = (data_len == 0) ? \
                             OTC_MPIPE_PARSER_STATE_DONE : \
                             OTC_MPIPE_PARSER_STATE_DATA;
                             
-                // check superstate
+                // Chunk state of this record. Whether it fits in a message
+                // under reassembly is decided when the record is done.
                 chunkstate = buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[0] >> 5;
-                switch (superstate) {
-                    case OTC_MPIPE_SYNC_WORD_CHUNK_FIRST:
+                switch (chunkstate) {
                     case OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT:
                     case OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE: 
-                        if ((chunkstate == OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT) \
-                        ||  (chunkstate == OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE) \
-                        ||  (chunkstate == OTC_MPIPE_SYNC_WORD_CHUNK_LAST) ) {
-                            superstate = (otc_mpipe_superstate_t)chunkstate;
-                        }
-                        else {
-                            state = OTC_MPIPE_PARSER_STATE_ERROR;
-                        }
-                        break;
-                    
                     case OTC_MPIPE_SYNC_WORD_CHUNK_LAST:
+                    case OTC_MPIPE_SYNC_WORD_CHUNK_FIRST:
                     case OTC_MPIPE_SYNC_WORD_CHUNK_NO:
+                        superstate = (otc_mpipe_superstate_t)chunkstate;
+                        break;
+                    
                     default: 
-                        if ((chunkstate == OTC_MPIPE_SYNC_WORD_CHUNK_NO) \
-                        ||  (chunkstate == OTC_MPIPE_SYNC_WORD_CHUNK_FIRST) ) {
-                            superstate = (otc_mpipe_superstate_t)chunkstate;
-                        }
-                        else {
-                            state = OTC_MPIPE_PARSER_STATE_ERROR;
-                        }
+                        state = OTC_MPIPE_PARSER_STATE_ERROR;
                         break;
                 }
             } break;
 
-            case OTC_MPIPE_PARSER_STATE_DATA:
-                toread = append(&buffer[OTC_MPIPE_BUFFER_INDEX_DATA], in, toread);
+            case OTC_MPIPE_PARSER_STATE_DATA: {
+                int n;
+
+                n       = append(&buffer[OTC_MPIPE_BUFFER_INDEX_DATA], in, toread);
+                in     += n;
+                toread -= n;
                 if (buffer[OTC_MPIPE_BUFFER_INDEX_DATA].remain == 0) {
                     state = OTC_MPIPE_PARSER_STATE_DONE;
                 }
-                break;
+            } break;
 
             case OTC_MPIPE_PARSER_STATE_DONE :
                 // enter here only if toread > 0
-                print();
+                done();
+                complete = TRUE;
                 state = OTC_MPIPE_PARSER_STATE_SYNC;        
                 break;
             
@@ -346,17 +917,30 @@ bool otc_mpipe_parser::parse(unsigned char* in, int toread) {
             
     if (state == OTC_MPIPE_PARSER_STATE_DONE) {
         // clean finish
-        print();
+        done();
+        complete = TRUE;
         state = OTC_MPIPE_PARSER_STATE_SYNC;
-        return TRUE;
     }
+    else if (state == OTC_MPIPE_PARSER_STATE_ERROR) {
+        state       = OTC_MPIPE_PARSER_STATE_SYNC;
+        superstate  = OTC_MPIPE_SYNC_WORD_CHUNK_NO;
+    }
+
+    // The stamps are those of this buffer only
+    readStamps = NULL;
 
-    return FALSE;
+    return complete;
 }
 
 
 
-void otc_mpipe_parser::print(void) {
+// A record is complete: print it, or feed it to the reassembly
+void otc_mpipe_parser::done(void) {
+    otc_mpipe_message_t* m;
+    unsigned char*  data    = buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload;
+    int             len     = buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size;
+    unsigned char   seq     = buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[2];
+
     crccheck();
     
     // update msg type variables
@@ -365,28 +949,131 @@ void otc_mpipe_parser::print(void) {
         cmd = buffer[OTC_MPIPE_BUFFER_INDEX_ALP].payload[3];
     }
 
-    // start message
-    if ((superstate == OTC_MPIPE_SYNC_WORD_CHUNK_NO) || (superstate == OTC_MPIPE_SYNC_WORD_CHUNK_FIRST)) {
-        msg =   (!crcStatus) ?                  "<font color=red>" : 
-                (OTC_ALP_CMD_LOG_ECHO == cmd) ? "<font color=gray>" : 
-                                                "<font color=blue>";
-
-        msg += QString("[ %1 ]  [ ").arg(buffer[OTC_MPIPE_BUFFER_INDEX_HEADER].payload[2]);
-
-        ///@todo Make more internal ID writeouts, not only for LOG
-        if (OTC_ALP_ID_LOG != id) {
-            // print id
-            msg += QString("%1 ").arg(QString("%1").arg(id,2,16).upper().replace(' ','0'));
-            msg += QString("%1 ").arg(QString("%1").arg(cmd,2,16).upper().replace(' ','0'));
+    if (crcStatus) {
+        for (int i=0; i<listeners.count(); i++) {
+            listeners[i]->received(seq, id, cmd, data, len);
         }
-        else {
-            // Interpret as OT internal message (string or raw)
-            msg += (OTC_ALP_CMD_LOG_ECHO == cmd)? "ECHO " : "LOG ";
+        if (tracer && tracer->enabled()) {
+            tracer->received(seq, (frameStamp < 0) ? -1 : frameStamp / 1000, tracer->now(), deliveredStamp);
         }
+    }
 
-        msg += "]  [ ";
+    if (reassembly.expire()) {
+        otcConfig::logText("<font color=red>Incomplete chunked message evicted (timeout)</font>");
     }
 
+    switch (superstate) {
+        case OTC_MPIPE_SYNC_WORD_CHUNK_FIRST:
+            m = reassembly.begin(id, cmd, seq);
+            m->start = frameStamp;
+            reassembly.append(m, data, len, crcStatus);
+            break;
+
+        case OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT:
+        case OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE:
+            m = reassembly.find(id, cmd);
+            if (m == NULL) {
+                reassembly.orphan();
+                otcConfig::logText(QString("<font color=red>[ %1 ]  Chunk dropped (no message open, first chunk lost or evicted)</font>")
+                                        .arg(seq));
+                break;
+            }
+            reassembly.append(m, data, len, crcStatus);
+            break;
+
+        case OTC_MPIPE_SYNC_WORD_CHUNK_LAST:
+            m = reassembly.find(id, cmd);
+            if (m == NULL) {
+                reassembly.orphan();
+                otcConfig::logText(QString("<font color=red>[ %1 ]  Last chunk dropped (no message open, first chunk lost or evicted)</font>")
+                                        .arg(seq));
+                break;
+            }
+            if (reassembly.append(m, data, len, crcStatus)) {
+                print(m->seq, m->data, m->size, m->crcStatus, m->start);
+            }
+            else {
+                otcConfig::logText(QString("<font color=red>[ %1 ]  Chunked message dropped (reassembly memory cap)</font>")
+                                        .arg(m->seq));
+            }
+            reassembly.release(m);
+            break;
+
+        case OTC_MPIPE_SYNC_WORD_CHUNK_NO:
+        default:
+            print(seq, data, len, crcStatus, frameStamp);
+            break;
+    }
+}
+
+
+
+void otc_mpipe_parser::print(unsigned char seq, unsigned char* data, int len, bool crcok, qint64 start) {
+    qint64 number = -1;
+
+    // Every frame is stored, even when its display is skipped
+    if (store != NULL) {
+        number = store->append(seq, id, cmd, data, len, crcok, start);
+    }
+
+    // In raw mode the bytes read are shown instead
+    if (otcConfig::argPrintMode == OTC_PRINT_MODE_RAW) {
+        return;
+    }
+
+    // Listeners already have the frame, only the display is sampled
+    if (!otcConfig::logFrame(id)) {
+        return;
+    }
+
+    int colour =    (!crcok) ?                      OTC_LOG_COLOUR_RED :
+                    (OTC_ALP_CMD_LOG_ECHO == cmd) ? OTC_LOG_COLOUR_GRAY :
+                                                    OTC_LOG_COLOUR_BLUE;
+
+    // The log keeps the number of the frame, its line is made when shown
+    if (number >= 0) {
+        otcConfig::logStored((unsigned int)number, colour, len);
+        return;
+    }
+
+    // start message
+    msg =   (!crcok) ?                      "<font color=red>" : 
+            (OTC_ALP_CMD_LOG_ECHO == cmd) ? "<font color=gray>" : 
+                                            "<font color=blue>";
+
+    msg += text(seq, id, cmd, data, len);
+
+    // end message
+    msg += "</font>";
+    otcConfig::logText(msg);
+}
+
+
+
+/** @brief  Line of a frame in the log, without colour
+  * @param  seq     (unsigned char) MPIPE sequence number
+  * @param  id      (unsigned char) ALP id
+  * @param  cmd     (unsigned char) ALP cmd
+  * @param  data    (const unsigned char*) ALP body
+  * @param  len     (int) length of the body
+  * @retval (QString) [ seq ]  [ id cmd ]  [ body ], the logger records as text
+  */
+QString otc_mpipe_parser::text(unsigned char seq, unsigned char id, unsigned char cmd, const unsigned char* data, int len) {
+    QString msg = QString("[ %1 ]  [ ").arg(seq);
+
+    ///@todo Make more internal ID writeouts, not only for LOG
+    if (OTC_ALP_ID_LOG != id) {
+        // print id
+        otcHexAppend(msg, &id, 1);
+        otcHexAppend(msg, &cmd, 1);
+    }
+    else {
+        // Interpret as OT internal message (string or raw)
+        msg += (OTC_ALP_CMD_LOG_ECHO == cmd)? "ECHO " : "LOG ";
+    }
+
+    msg += "]  [ ";
+
     //message cursor
     int i = 0;  
 
@@ -396,26 +1083,24 @@ void otc_mpipe_parser::print(void) {
         // Special case: handle "Message" part of Logger payload (UTF8)
         if (cmd & 4) {
             // count through space terminator
-            while ( (i < buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size) && \
-                    (buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i++] != ' ') ) { }
+            while ( (i < len) && (data[i++] != ' ') ) { }
 
             // Load UTF8 message label into beginning
             for (int j=0; j<i; j++) {
-                msg += QString(buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[j]).replace('\n',' ');
+                msg += QString(data[j]).replace('\n',' ');
             }
         }
 
         // loop through main data payload
-        for (; i<buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size; i++) {
+        for (; i<len; i++) {
             switch (cmd & 3) {
             case OTC_ALP_CMD_LOG_RAW:
-                msg += QString("%1 ").arg(QString("%1")
-                                        .arg(buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i],2,16)
-                                            .upper().replace(' ','0'));
+                otcHexAppend(msg, data + i, len - i);
+                i = len;
                 break;
 
             case OTC_ALP_CMD_LOG_UTF8:
-                msg += QString( buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i]).replace('\n',' ');
+                msg += QString(data[i]).replace('\n',' ');
                 break;
 
             case OTC_ALP_CMD_LOG_UTF16:
@@ -425,8 +1110,9 @@ void otc_mpipe_parser::print(void) {
 
             case OTC_ALP_CMD_LOG_UTF8HEX:
                 // Add some spaces between the numbers
-                msg += QString("%1%2 ").arg(QString(buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i]),
-                                        QString(buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i+1]));
+                if ((i+1) < len) {
+                    msg += QString("%1%2 ").arg(QString(data[i]), QString(data[i+1]));
+                }
                 i++;
                 break;
             }
@@ -435,18 +1121,10 @@ void otc_mpipe_parser::print(void) {
     
     // Not Logger: print raw data.... 
     else {
-        for (; i<buffer[OTC_MPIPE_BUFFER_INDEX_DATA].size; i++) {
-                msg += QString("%1 ").arg(QString("%1")
-                                        .arg(buffer[OTC_MPIPE_BUFFER_INDEX_DATA].payload[i],2,16)
-                                            .upper().replace(' ','0'));
-        }
+        otcHexAppend(msg, data, len);
     }
     
-    // end message
-    if ((superstate == OTC_MPIPE_SYNC_WORD_CHUNK_NO) || (superstate == OTC_MPIPE_SYNC_WORD_CHUNK_LAST)) {
-        msg += "]</font>";
-        otcConfig::logText(msg);
-    }
-}
-
+    msg += "]";
 
+    return msg;
+}
@@ -80,6 +80,10 @@
 #ifndef __OTC_MPIPE_H__
 #define __OTC_MPIPE_H__
 
+#include <qstring.h>
+#include <qlist.h>
+#include <qatomic.h>
+
 // ----------------------------------
 //
 // CRC table (CRC16 value)
@@ -181,6 +185,21 @@ typedef union  {
 //
 // ----------------------------------
 
+/// ALP record chunk state (3 MSBs of the ALP flags byte)
+typedef enum {
+    OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT   = 0,
+    OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE   = 1,
+    OTC_MPIPE_SYNC_WORD_CHUNK_LAST       = 2,
+    OTC_MPIPE_SYNC_WORD_CHUNK_FIRST      = 5,
+    OTC_MPIPE_SYNC_WORD_CHUNK_NO         = 6
+} otc_mpipe_superstate_t;
+
+/// Largest body of a single ALP record (ALP length field is one byte)
+#define OTC_MPIPE_RECORD_MAX        255
+
+/// Largest message that can be sent in chunks (limit of the reassembly)
+#define OTC_MPIPE_MESSAGE_MAX       0xFFFF
+
 /// MPIPE Header size
 #define OTC_MPIPE_HEADER_SIZE       8
 
@@ -188,24 +207,83 @@ typedef union  {
 #define OTC_MPIPE_ALP_SIZE          4
 
 
+/// Largest frame: MPIPE header, ALP header and the longest record body
+#define OTC_MPIPE_FRAME_MAX         (OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + OTC_MPIPE_RECORD_MAX)
+
+/// Inline storage of the builder, any single record frame fits in it
+#define OTC_MPIPE_BUILDER_INLINE    268
+
+
 /// MPIPE Builder Object Class
+/// The frame is serialized in the builder's own inline buffer (no heap
+/// allocation), or in storage supplied by the caller. build() writes header,
+/// body and CRC in a single pass; header()/body()/footer() remain available
+/// for callers filling the body themselves.
 class otc_mpipe_builder {
 public :
     
-    otc_mpipe_builder(unsigned char bodylen);
-    ~otc_mpipe_builder();
-
-    void                                header(unsigned char id, unsigned char cmd, unsigned char seq);
+    otc_mpipe_builder(unsigned char bodylen = 0);
+    otc_mpipe_builder(unsigned char* storage, int capacity);
+    ~otc_mpipe_builder() {;};
+
+    bool                                build(unsigned char id, unsigned char cmd, unsigned char seq,
+                                              otc_mpipe_superstate_t chunk,
+                                              const unsigned char* data, int bodylen);
+    void                                header(unsigned char id, unsigned char cmd, unsigned char seq,
+                                               otc_mpipe_superstate_t chunk = OTC_MPIPE_SYNC_WORD_CHUNK_NO);
     void                                body(unsigned char * data);
     void                                footer();
     int                                 len(void)	{return size;};
-    unsigned char *                     start(void)	{return buffer;};
+    unsigned char *                     start(void)	{return outbuf;};
+
+    static QString                      getStatus();
+    static unsigned char                nextSeq(void);
 
 private :   
 
     unsigned char *                     outbuf;
     int                                 size;
-    //otc_mpipe_superstate_t              superstate;
+    int                                 capacity;
+    unsigned char                       inlinebuf[OTC_MPIPE_BUILDER_INLINE];
+
+    // Counted by the GUI and the bulk reader threads
+    static QAtomicInt                   statFrames;
+    static QAtomicInt                   statCaller;
+    static QAtomicInt                   statRejected;
+    static QAtomicInt                   seqCounter;
+};
+
+
+/// Template slots: the bytes which change each time a frame is re-issued
+#define OTC_MPIPE_TEMPLATE_SLOT_SEQ     0
+#define OTC_MPIPE_TEMPLATE_SLOT_CMD     1
+#define OTC_MPIPE_TEMPLATE_SLOTS        4
+
+/// MPIPE Template Object Class
+/// Copy of a complete single record frame, re-issued by changing a few bytes.
+/// The CRC is linear: flipping bits of a byte flips a fixed set of CRC bits,
+/// which only depends on the distance to the end of the frame. That set is
+/// computed once per bit and slot, so writing a slot updates the CRC with a
+/// few XORs instead of a pass over the whole frame. The seq and ALP CMD
+/// bytes are always slots; more can be added for variable body fields.
+class otc_mpipe_template {
+public :
+    otc_mpipe_template();
+    ~otc_mpipe_template() {;};
+
+    bool                                set(const unsigned char* frame, int len);
+    int                                 addSlot(int offset);
+    void                                write(int slot, unsigned char value);
+    unsigned char                       read(int slot)  {return outbuf[offset[slot]];};
+    int                                 len(void)       {return size;};
+    unsigned char *                     start(void)     {return outbuf;};
+
+private :
+    unsigned char                       outbuf[OTC_MPIPE_FRAME_MAX];
+    int                                 size;
+    int                                 slots;
+    int                                 offset[OTC_MPIPE_TEMPLATE_SLOTS];
+    unsigned short                      flip[OTC_MPIPE_TEMPLATE_SLOTS][8];
 };
 
 
@@ -218,15 +296,6 @@ private :
 //
 // ----------------------------------
 
-typedef enum {
-    OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT   = 0,
-    OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE   = 1,
-    OTC_MPIPE_SYNC_WORD_CHUNK_LAST       = 2,
-    OTC_MPIPE_SYNC_WORD_CHUNK_FIRST      = 5,
-    OTC_MPIPE_SYNC_WORD_CHUNK_NO         = 6
-} otc_mpipe_superstate_t;
-
-
 /// Parser state
 typedef enum {
     OTC_MPIPE_PARSER_STATE_SYNC          = 0,
@@ -250,15 +319,130 @@ typedef enum {
 } otc_mpipe_buffer_index_t;
 
 
+/// Largest payload an MPIPE header can announce (16 bit length field)
+#define OTC_MPIPE_PAYLOAD_MAX       0xFFFF
+
 /// Buffer class
 typedef struct {
-    unsigned char  size;
-    unsigned char  offset;
-    unsigned char  remain;
+    unsigned short size;
+    unsigned short offset;
+    unsigned short remain;
     unsigned char* payload;
 } otc_mpipe_buffer_t;
 
 
+
+// ----------------------------------
+//
+// MPIPE Reassembly Specific
+//
+// ----------------------------------
+
+/// Default memory cap for messages under reassembly, and default time after
+/// which an incomplete message is evicted (ms)
+#define OTC_MPIPE_REASSEMBLY_CAP        0x100000
+#define OTC_MPIPE_REASSEMBLY_TIMEOUT    2000
+
+/// Smallest pool block, and number of messages that can be rebuilt at once
+#define OTC_MPIPE_POOL_BLOCK_MIN        256
+#define OTC_MPIPE_POOL_CLASSES          9
+#define OTC_MPIPE_REASSEMBLY_SLOTS      4
+
+
+/// Bounded pool of message buffers. Blocks are powers of two between 256 bytes
+/// and 64 KB, released blocks are kept on a free list per size, and the total
+/// size of the blocks handed out never exceeds the cap.
+class otc_mpipe_pool {
+public :
+    otc_mpipe_pool();
+    ~otc_mpipe_pool();
+
+    unsigned char*                  get(int size, int* alloc);
+    void                            put(unsigned char* block, int alloc);
+    void                            setCap(int cap)     {m_cap = cap;};
+    int                             cap(void)           {return m_cap;};
+    int                             used(void)          {return m_used;};
+    int                             peak(void)          {return m_peak;};
+
+private :
+    typedef struct otc_mpipe_block {
+        struct otc_mpipe_block*     next;
+    } otc_mpipe_block_t;
+
+    otc_mpipe_block_t*              m_free[OTC_MPIPE_POOL_CLASSES];
+    int                             m_cap;
+    int                             m_used;
+    int                             m_peak;
+    int                             m_cached;
+    int                             sizeClass(int size);
+};
+
+
+/// Chunked message under reassembly
+typedef struct {
+    bool                            used;
+    bool                            overflow;
+    bool                            crcStatus;
+    unsigned char                   id;
+    unsigned char                   cmd;
+    unsigned char                   seq;
+    int                             stamp;
+    qint64                          start;          ///< arrival of the first chunk (ns)
+    int                             size;
+    int                             alloc;
+    unsigned char*                  data;
+} otc_mpipe_message_t;
+
+
+/// Rebuilds CHUNK_FIRST / CONTINUE / LAST records into a single message.
+/// Messages are matched on ALP id and cmd, so a chunked transfer survives
+/// unrelated records (logs...) sent in between.
+class otc_mpipe_reassembler {
+public :
+    otc_mpipe_reassembler();
+    ~otc_mpipe_reassembler();
+
+    otc_mpipe_message_t*            begin(unsigned char id, unsigned char cmd, unsigned char seq);
+    otc_mpipe_message_t*            find(unsigned char id, unsigned char cmd);
+    bool                            append(otc_mpipe_message_t* m, unsigned char* data, int len, bool crcok);
+    void                            release(otc_mpipe_message_t* m);
+    int                             expire(void);
+    void                            orphan(void)        {m_orphans++;};
+    QString                         getStatus();
+
+    static int                      memCap;
+    static int                      timeout;
+
+private :
+    otc_mpipe_pool                  m_pool;
+    otc_mpipe_message_t             m_slot[OTC_MPIPE_REASSEMBLY_SLOTS];
+    unsigned int                    m_completed;
+    unsigned int                    m_evicted;
+    unsigned int                    m_overflows;
+    unsigned int                    m_orphans;      ///< chunks without an open message
+};
+
+
+
+// ----------------------------------
+//
+// MPIPE Parser Specific
+//
+// ----------------------------------
+
+/// Notified of every record decoded with a valid CRC. data is the ALP body
+/// of the record, chunks are notified one by one before reassembly.
+class otc_mpipe_listener {
+public :
+    virtual ~otc_mpipe_listener() {;}
+    virtual void                    received(unsigned char seq, unsigned char id, unsigned char cmd,
+                                             const unsigned char* data, int len) = 0;
+};
+
+
+class otcFrameStore;
+class otcTracer;
+
 /// MPIPE Parser Object Class
 class otc_mpipe_parser {
 
@@ -267,6 +451,15 @@ public :
     ~otc_mpipe_parser();
     bool                            parse(unsigned char* buffer, int toread);
     bool                            sync(unsigned char* buffer);
+    QString                         getStatus()         {return reassembly.getStatus();};
+    void                            addListener(otc_mpipe_listener* l)      {listeners.append(l);};
+    void                            removeListener(otc_mpipe_listener* l)   {listeners.removeAll(l);};
+    void                            setStore(otcFrameStore* s)              {store = s;};
+    void                            setTracer(otcTracer* t)                 {tracer = t;};
+    void                            setStamps(const qint64* received, qint64 delivered);
+
+    static QString                  text(unsigned char seq, unsigned char id, unsigned char cmd,
+                                         const unsigned char* data, int len);
 
 private :   
     otc_mpipe_parser_state_t        state;
@@ -274,6 +467,14 @@ private :
     //otc_mpipe_header_flags_t        header;
     otc_mpipe_buffer_t              buffer[OTC_MPIPE_BUFFER_INDEX_QTY];
     //unsigned int                    currentBuffer;
+    otc_mpipe_reassembler           reassembly;
+    QList<otc_mpipe_listener*>      listeners;
+    otcFrameStore*                  store;
+    otcTracer*                      tracer;
+    const qint64*                   readStamps;     ///< arrival of each byte being parsed (ns)
+    qint64                          deliveredStamp; ///< their delivery to the socket clients (us)
+    qint64                          syncStamp;      ///< arrival of the last sync byte seen
+    qint64                          frameStamp;     ///< arrival of the first byte of the current frame
     unsigned short                  crc;
     bool                            crcStatus;
     QString                         msg;
@@ -281,10 +482,12 @@ private :
     unsigned char                   id;
     void                            free(otc_mpipe_buffer_t* buffer);
     void                            alloc(otc_mpipe_buffer_t* buffer);
+    void                            rewind(otc_mpipe_buffer_t* buffer, int size);
     int                             append(otc_mpipe_buffer_t* buffer, unsigned char* data, int available);
     void                            crcbyte(unsigned char byte);
     void                            crccheck(void); 
-    void                            print(void);
+    void                            done(void);
+    void                            print(unsigned char seq, unsigned char* data, int len, bool crcok, qint64 start);
 };
 
 
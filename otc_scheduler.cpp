@@ -0,0 +1,489 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_scheduler.cpp
+/// @brief          Device write scheduler
+//
+/// =========================================================================
+
+#include <qstring.h>
+#include "otc_main.h"
+#include "otc_serial.h"
+#include "otc_scheduler.h"
+#include "otc_trace.h"
+
+
+static const int otcWriteWeight[OTC_WRITE_PRIO_QTY] = {
+    OTC_WRITE_WEIGHT_INTERACTIVE,
+    OTC_WRITE_WEIGHT_CONTROL,
+    OTC_WRITE_WEIGHT_BULK
+};
+
+
+// ---------------------------------------- //
+//                                          //
+//           WRITE SOURCE                   //
+//                                          //
+// ---------------------------------------- //
+
+otcWriteSource::otcWriteSource(int sourceid)
+{
+    id          = sourceid;
+    closing     = false;
+    pending     = 0;
+    frames      = 0;
+    bytes       = 0;
+    rejected    = 0;
+    latencySum  = 0;
+    latencyMax  = 0;
+}
+
+bool otcWriteSource::isEmpty()
+{
+    for (int i=0; i<OTC_WRITE_PRIO_QTY; i++)
+    {
+        if (!queue[i].isEmpty())
+            return false;
+    }
+    return true;
+}
+
+
+// ---------------------------------------- //
+//                                          //
+//           WRITE SCHEDULER                //
+//                                          //
+// ---------------------------------------- //
+
+otcWriteScheduler::otcWriteScheduler(otcCommunicationLinkDevice* device)
+{
+    m_device      = device;
+    m_class       = OTC_WRITE_PRIO_INTERACTIVE;
+    m_window      = 0;
+    m_ackTimeout  = OTC_WRITE_ACK_TIMEOUT;
+    m_acked       = 0;
+    m_ackTimeouts = 0;
+    m_tracer      = NULL;
+    m_paused      = false;
+    m_writing     = false;
+    m_written     = 0;
+    m_batches     = 0;
+    m_stalls      = 0;
+    m_dropped     = 0;
+    m_calls       = 0;
+
+    for (int i=0; i<OTC_WRITE_PRIO_QTY; i++)
+    {
+        m_credit[i] = otcWriteWeight[i];
+        m_cursor[i] = 0;
+    }
+
+    m_clock.start();
+}
+
+otcWriteScheduler::~otcWriteScheduler()
+{
+    while (!m_sources.isEmpty())
+        delete m_sources.takeFirst();
+}
+
+// Must be called with m_mutex held
+otcWriteSource* otcWriteScheduler::source(int id, bool create)
+{
+    for (int i=0; i<m_sources.count(); i++)
+    {
+        if (m_sources[i]->id == id)
+            return m_sources[i];
+    }
+
+    if (!create)
+        return NULL;
+
+    otcWriteSource* s = new otcWriteSource(id);
+    m_sources.append(s);
+    return s;
+}
+
+// Queue a complete frame. The frame is copied, the caller keeps its buffer.
+bool otcWriteScheduler::enqueue(int sourceid, otc_write_prio_t prio, const char* buffer, unsigned int len, int ackseq)
+{
+    if ((len == 0) || (prio < 0) || (prio >= OTC_WRITE_PRIO_QTY))
+        return false;
+
+    m_mutex.lock();
+
+    otcWriteSource* s = source(sourceid, true);
+    s->closing = false;
+
+    if (s->pending + (int)len > OTC_WRITE_SOURCE_MAX_PENDING)
+    {
+        s->rejected++;
+        m_mutex.unlock();
+        return false;
+    }
+
+    otcWriteFrame frame;
+    frame.stamp  = m_clock.nsecsElapsed() / 1000;
+    frame.ackseq = ackseq;
+    frame.data   = QByteArray(buffer, len);
+
+    s->queue[prio].enqueue(frame);
+    s->pending += len;
+
+    // Stamped before the writer thread can take the frame
+    if (m_tracer && m_tracer->enabled())
+        m_tracer->enqueued(sourceid, buffer, len);
+
+    m_wait.wakeOne();
+    m_mutex.unlock();
+
+    return true;
+}
+
+// The source will be forgotten once all its frames are written
+void otcWriteScheduler::removeSource(int sourceid)
+{
+    m_mutex.lock();
+    otcWriteSource* s = source(sourceid, false);
+    if (s && s->isEmpty())
+    {
+        m_sources.removeAll(s);
+        delete s;
+    }
+    else if (s)
+        s->closing = true;
+    m_mutex.unlock();
+}
+
+// Drop everything that is still waiting (used when the device is reset)
+void otcWriteScheduler::flush()
+{
+    m_mutex.lock();
+    for (int i=0; i<m_sources.count(); i++)
+    {
+        for (int j=0; j<OTC_WRITE_PRIO_QTY; j++)
+            m_sources[i]->queue[j].clear();
+        m_sources[i]->pending = 0;
+    }
+    m_inflight.clear();
+    m_mutex.unlock();
+}
+
+void otcWriteScheduler::wakeUp()
+{
+    m_mutex.lock();
+    m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+/** @brief  Pauses or resumes the writes
+  * @param  paused  (bool) true to pause
+  *
+  * A pause returns once the batch being written, if any, is on the line.
+  */
+void otcWriteScheduler::setPaused(bool paused)
+{
+    m_mutex.lock();
+    m_paused = paused;
+    if (paused)
+    {
+        while (m_writing)
+            m_idle.wait(&m_mutex);
+    }
+    else
+        m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+// Round robin over the sources of one class. Must be called with m_mutex held.
+bool otcWriteScheduler::pick(int prio, otcWriteFrame& frame, otcWriteSource*& from)
+{
+    int count = m_sources.count();
+
+    for (int n=0; n<count; n++)
+    {
+        int i = (m_cursor[prio] + n) % count;
+        otcWriteSource* s = m_sources[i];
+
+        if (s->queue[prio].isEmpty())
+            continue;
+
+        // Flow controlled frames wait for a free slot in the window
+        if ((m_window > 0) && (s->queue[prio].head().ackseq >= 0)
+        &&  (m_inflight.count() >= m_window))
+            continue;
+
+        frame = s->queue[prio].dequeue();
+        from  = s;
+        m_cursor[prio] = (i + 1) % count;
+
+        if ((m_window > 0) && (frame.ackseq >= 0))
+        {
+            otcWriteFrame pending;
+            pending.stamp  = m_clock.nsecsElapsed() / 1000;
+            pending.ackseq = frame.ackseq;
+            m_inflight.append(pending);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+// Weighted round robin over the classes. A class with nothing to send gives
+// its turn away, so an idle class never delays the others. Must be called
+// with m_mutex held.
+bool otcWriteScheduler::dequeue(otcWriteFrame& frame, otcWriteSource*& from)
+{
+    for (int n=0; n<=OTC_WRITE_PRIO_QTY; n++)
+    {
+        if ((m_credit[m_class] > 0) && pick(m_class, frame, from))
+        {
+            m_credit[m_class]--;
+            return true;
+        }
+
+        m_credit[m_class] = otcWriteWeight[m_class];
+        m_class = (m_class + 1) % OTC_WRITE_PRIO_QTY;
+    }
+
+    return false;
+}
+
+// Queueing latency is accounted when the frame leaves its queue. Must be
+// called with m_mutex held.
+void otcWriteScheduler::account(otcWriteFrame& frame, otcWriteSource* from)
+{
+    qint64 latency = (m_clock.nsecsElapsed() / 1000) - frame.stamp;
+    from->frames++;
+    from->bytes      += frame.data.size();
+    from->pending    -= frame.data.size();
+    from->latencySum += latency;
+    if (latency > from->latencyMax)
+        from->latencyMax = latency;
+
+    // Forget sources of disconnected clients once they are drained
+    if (from->closing && from->isEmpty())
+    {
+        m_sources.removeAll(from);
+        delete from;
+    }
+}
+
+// Write the whole batch in one gather write, even if the serial driver takes
+// it in several parts. The device lock is released while the driver is full.
+void otcWriteScheduler::write(otcWriteFrame* frames, int count)
+{
+    struct iovec v[OTC_WRITE_BATCH];
+    int          left  = count;
+    unsigned int calls = m_device->writes();
+
+    for (int i=0; i<count; i++)
+    {
+        v[i].iov_base = (void*)frames[i].data.constData();
+        v[i].iov_len  = frames[i].data.size();
+    }
+
+    while (left > 0)
+    {
+        m_device->lock();
+        int ret = m_device->writeVectorUnprotected(v, left);
+        m_device->unlock();
+
+        if (ret < 0)
+            break;
+
+        left = otcIovecSkip(v, left, ret);
+
+        if (left > 0)
+        {
+            m_stalls++;
+            if (!m_device->waitWritable(OTC_WRITE_STALL_TIMEOUT))
+                break;
+        }
+    }
+
+    m_written += count - left;
+    m_dropped += left;
+    m_calls   += m_device->writes() - calls;
+    m_batches++;
+}
+
+// One iteration of the writer thread: wait for frames and write them
+bool otcWriteScheduler::writeStep(unsigned long timeout)
+{
+    otcWriteFrame   frames[OTC_WRITE_BATCH];
+    otcWriteSource* from = NULL;
+    int             count = 0;
+    int             bytes;
+
+    m_mutex.lock();
+
+    expire();
+
+    // Paused: checked again after the wait, the pause may come during it
+    if (m_paused || !dequeue(frames[0], from))
+    {
+        m_wait.wait(&m_mutex, timeout);
+        expire();
+
+        if (m_paused || !dequeue(frames[0], from))
+        {
+            m_mutex.unlock();
+            return false;
+        }
+    }
+
+    account(frames[0], from);
+    bytes = frames[0].data.size();
+    count = 1;
+
+    // The frames ready to go follow in the same write
+    while ((count < OTC_WRITE_BATCH) && (bytes < OTC_WRITE_BATCH_BYTES)
+    &&     dequeue(frames[count], from))
+    {
+        account(frames[count], from);
+        bytes += frames[count].data.size();
+        count++;
+    }
+
+    m_writing = true;
+    m_mutex.unlock();
+
+    write(frames, count);
+
+    // The writer waits for the line only while commands are traced
+    if (m_tracer && m_tracer->enabled())
+    {
+        qint64 written = m_tracer->now();
+
+        for (int i=0; i<count; i++)
+            m_tracer->written(frames[i].data.constData(), frames[i].data.size(), written);
+
+        m_device->drain();
+
+        qint64 drained = m_tracer->now();
+
+        for (int i=0; i<count; i++)
+            m_tracer->drained(frames[i].data.constData(), frames[i].data.size(), drained);
+    }
+
+    m_mutex.lock();
+    m_writing = false;
+    m_idle.wakeAll();
+    m_mutex.unlock();
+
+    return true;
+}
+
+// Frames which were not acknowledged in time give their slot back.
+// Must be called with m_mutex held.
+void otcWriteScheduler::expire()
+{
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    while (!m_inflight.isEmpty()
+    &&     ((now - m_inflight.first().stamp) > (qint64)m_ackTimeout * 1000))
+    {
+        m_inflight.removeFirst();
+        m_ackTimeouts++;
+    }
+}
+
+// Flow control window in frames (0 disables it), and ACK timeout in ms
+void otcWriteScheduler::setWindow(int window, int timeout)
+{
+    m_mutex.lock();
+    m_window     = window;
+    m_ackTimeout = timeout;
+    if (m_window == 0)
+        m_inflight.clear();
+    m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+// Called by the MPIPE parser for every valid record from the device
+void otcWriteScheduler::received(unsigned char seq, unsigned char, unsigned char, const unsigned char*, int)
+{
+    m_mutex.lock();
+    for (int i=0; i<m_inflight.count(); i++)
+    {
+        if (m_inflight[i].ackseq == seq)
+        {
+            m_inflight.removeAt(i);
+            m_acked++;
+            m_wait.wakeOne();
+            break;
+        }
+    }
+    m_mutex.unlock();
+}
+
+QString otcWriteScheduler::getStatus()
+{
+    QString ret = "Write scheduler (queued int/ctl/blk, frames, bytes, latency avg/max us):\n";
+
+    m_mutex.lock();
+    ret += QString("  %1 frames in %2 batches, %3 system calls (%4 per frame), %5 waits for the driver, %6 dropped\n")
+                .arg(m_written).arg(m_batches).arg(m_calls)
+                .arg(m_written ? (double)m_calls / m_written : 0, 0, 'f', 2)
+                .arg(m_stalls).arg(m_dropped);
+
+    if (m_window > 0)
+        ret += QString("  Window %1, %2 in flight, %3 acked, %4 ACK timeouts (%5 ms)\n")
+                    .arg(m_window).arg(m_inflight.count())
+                    .arg(m_acked).arg(m_ackTimeouts).arg(m_ackTimeout);
+
+    for (int i=0; i<m_sources.count(); i++)
+    {
+        otcWriteSource* s = m_sources[i];
+        QString queued;
+
+        for (int j=0; j<OTC_WRITE_PRIO_QTY; j++)
+            queued += QString("%1%2").arg(j ? "/" : "").arg(s->queue[j].count());
+
+        QString name = "Client";
+        if (s->id == OTC_WRITE_SOURCE_GUI)
+            name = "GUI   ";
+        else if (s->id == OTC_WRITE_SOURCE_SCRIPT)
+            name = "Script";
+        else if (s->id == OTC_WRITE_SOURCE_BULK)
+            name = "Dump  ";
+        else if (s->id == OTC_WRITE_SOURCE_JOBS)
+            name = "Jobs  ";
+
+        ret += QString("  %1 %2: %3, %4, %5, %6/%7")
+                    .arg(name)
+                    .arg(s->id)
+                    .arg(queued)
+                    .arg(s->frames)
+                    .arg(s->bytes)
+                    .arg(s->frames ? (s->latencySum / s->frames) : 0)
+                    .arg(s->latencyMax);
+
+        if (s->rejected)
+            ret += QString(", %1 rejected").arg(s->rejected);
+
+        ret += "\n";
+    }
+    m_mutex.unlock();
+
+    return ret;
+}
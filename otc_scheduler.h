@@ -0,0 +1,199 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_scheduler.h
+/// @brief          Device write scheduler
+///                 Queues frames per source and feeds the device from a
+///                 single writer thread.
+//
+/// =========================================================================
+///
+/// Every producer of device traffic (the command prompt, each socket client)
+/// owns a source. A source has one FIFO per priority class. The writer thread
+/// picks the next frame with a weighted round robin over the classes, and a
+/// plain round robin over the sources inside a class, so that a bulk transfer
+/// from one client cannot starve the interactive commands.
+///
+/// The frames ready to go are taken together, up to OTC_WRITE_BATCH frames
+/// and OTC_WRITE_BATCH_BYTES, in the order of the round robin, and written
+/// with one gather write (writev) instead of one system call per frame. The
+/// writer thread is the only one to write: when the driver is full, it waits
+/// without the device lock and goes on from the byte where the write stopped,
+/// so two frames never interleave on the wire.
+///
+/// Frames queued with an MPIPE sequence number can be flow controlled: when a
+/// window is set, no more than that many of them are outstanding on the link.
+/// A frame is acknowledged by the first valid record received from the device
+/// with the same sequence number, or released after the ACK timeout.
+///
+/// The writes can be paused, while the rate of the link is searched: the
+/// frames stay queued, and the pause waits for the batch being written.
+///
+/// =========================================================================
+
+#ifndef __OTC_SCHEDULER_H__
+#define __OTC_SCHEDULER_H__
+
+#include <qstring.h>
+#include <qmutex.h>
+#include <qbytearray.h>
+#include <qqueue.h>
+#include <qlist.h>
+#include <qelapsedtimer.h>
+#include <QWaitCondition>
+
+#include "otc_mpipe.h"
+
+
+class otcCommunicationLinkDevice;
+class otcTracer;
+
+
+/// Priority classes, highest first
+typedef enum {
+    OTC_WRITE_PRIO_INTERACTIVE = 0,
+    OTC_WRITE_PRIO_CONTROL,
+    OTC_WRITE_PRIO_BULK,
+    OTC_WRITE_PRIO_QTY
+} otc_write_prio_t;
+
+
+/// Client ID 0 is used for the OTCOM GUI itself (see otcHostServer)
+#define OTC_WRITE_SOURCE_GUI                0
+
+/// Source of the command script runner
+#define OTC_WRITE_SOURCE_SCRIPT             -1
+
+/// Source of the bulk file reader
+#define OTC_WRITE_SOURCE_BULK               -2
+
+/// Source of the periodic command jobs
+#define OTC_WRITE_SOURCE_JOBS               -3
+
+/// Number of frames a class may send before handing over to the next one
+#define OTC_WRITE_WEIGHT_INTERACTIVE        8
+#define OTC_WRITE_WEIGHT_CONTROL            4
+#define OTC_WRITE_WEIGHT_BULK               1
+
+/// Socket packets bigger than this are scheduled in the bulk class
+#define OTC_WRITE_BULK_THRESHOLD            512
+
+/// Maximum amount of data a source may have pending
+#define OTC_WRITE_SOURCE_MAX_PENDING        0x100000
+
+/// How long the writer thread sleeps when there is nothing to write (ms)
+#define OTC_WRITE_IDLE_WAIT                 100
+
+/// Default time after which an unacknowledged frame leaves the window (ms)
+#define OTC_WRITE_ACK_TIMEOUT               1000
+
+/// Frames and bytes of one gather write (a first frame is always taken).
+/// OTC_WRITE_BATCH is at most OTC_IOV_MAX, one buffer per frame.
+#define OTC_WRITE_BATCH                     OTC_IOV_MAX
+#define OTC_WRITE_BATCH_BYTES               4096
+
+/// Longest wait for the driver to take more bytes, the rest of the batch is
+/// dropped after it (ms)
+#define OTC_WRITE_STALL_TIMEOUT             3000
+
+
+class otcWriteFrame
+{
+public :
+    qint64          stamp;      ///< enqueue time (us), write time once in flight
+    int             ackseq;     ///< MPIPE seq acknowledging the frame, -1 if none
+    QByteArray      data;
+};
+
+
+class otcWriteSource
+{
+public :
+    otcWriteSource(int id);
+
+    int                     id;
+    bool                    closing;
+    int                     pending;
+    QQueue<otcWriteFrame>   queue[OTC_WRITE_PRIO_QTY];
+
+    // Statistics
+    unsigned int            frames;
+    qint64                  bytes;
+    unsigned int            rejected;
+    qint64                  latencySum;
+    qint64                  latencyMax;
+
+    bool                    isEmpty();
+};
+
+
+class otcWriteScheduler : public otc_mpipe_listener
+{
+public :
+    otcWriteScheduler(otcCommunicationLinkDevice* device);
+    ~otcWriteScheduler();
+
+    bool                    enqueue(int source, otc_write_prio_t prio, const char* buffer, unsigned int len, int ackseq = -1);
+    void                    removeSource(int source);
+    void                    flush();
+    bool                    writeStep(unsigned long timeout);
+    void                    wakeUp();
+    void                    setPaused(bool paused);
+    QString                 getStatus();
+    void                    setWindow(int window, int timeout);
+    int                     window()            {return m_window;}
+    int                     ackTimeout()        {return m_ackTimeout;}
+    void                    received(unsigned char seq, unsigned char id, unsigned char cmd, const unsigned char* data, int len);
+    void                    setTracer(otcTracer* tracer)    {m_tracer = tracer;}
+
+protected :
+    otcCommunicationLinkDevice* m_device;
+    QMutex                  m_mutex;
+    QWaitCondition          m_wait;
+    QWaitCondition          m_idle;         ///< no batch being written
+    bool                    m_paused;
+    bool                    m_writing;      ///< batch taken, not written yet
+    QElapsedTimer           m_clock;
+    QList<otcWriteSource*>  m_sources;
+    int                     m_class;
+    int                     m_credit[OTC_WRITE_PRIO_QTY];
+    int                     m_cursor[OTC_WRITE_PRIO_QTY];
+    int                     m_window;
+    int                     m_ackTimeout;
+    QList<otcWriteFrame>    m_inflight;
+    unsigned int            m_acked;
+    unsigned int            m_ackTimeouts;
+    otcTracer*              m_tracer;
+    unsigned int            m_written;      ///< frames
+    unsigned int            m_batches;
+    unsigned int            m_stalls;       ///< waits for the driver
+    unsigned int            m_dropped;      ///< frames not written whole
+    unsigned int            m_calls;        ///< system calls of the writes
+
+    otcWriteSource*         source(int id, bool create);
+    bool                    dequeue(otcWriteFrame& frame, otcWriteSource*& from);
+    bool                    pick(int prio, otcWriteFrame& frame, otcWriteSource*& from);
+    void                    account(otcWriteFrame& frame, otcWriteSource* from);
+    void                    write(otcWriteFrame* frames, int count);
+    void                    expire();
+};
+
+
+#endif // __OTC_SCHEDULER_H__
@@ -0,0 +1,287 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_script.cpp
+/// @brief          Command script runner
+//
+/// =========================================================================
+
+#include <qfile.h>
+#include <qtextstream.h>
+#include <qapplication.h>
+
+#include "otc_main.h"
+#include "otc_alp.h"
+#include "otc_serial.h"
+#include "otc_command.h"
+#include "otc_window.h"
+#include "otc_script.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//           SCRIPT RUNNER                  //
+//                                          //
+// ---------------------------------------- //
+
+otcScriptRunner::otcScriptRunner(otcCommunicationLinkDevice* device)
+{
+    m_device    = device;
+    m_window    = OTC_SCRIPT_WINDOW;
+    m_timeout   = OTC_SCRIPT_TIMEOUT;
+    m_timeouts  = 0;
+    m_quit      = FALSE;
+    m_running   = FALSE;
+}
+
+otcScriptRunner::~otcScriptRunner()
+{
+}
+
+// Reads and compiles the whole script. Must be called from the GUI thread,
+// before the runner is started.
+bool otcScriptRunner::load(const QString& file, otc_command_parser* parser)
+{
+    QFile f(file);
+
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        otcConfig::logText(QString("<font color=red>**Cannot open script %1</font>").arg(file));
+        return FALSE;
+    }
+
+    m_file = file;
+    m_commands.clear();
+
+    QTextStream in(&f);
+    int         line = 0;
+
+    while (!in.atEnd())
+    {
+        otcScriptCommand command;
+
+        command.text = in.readLine().trimmed();
+        command.line = ++line;
+
+        if (command.text.isEmpty() || command.text.startsWith("#"))
+            continue;
+
+        // Internal commands would run now, at the compilation. A script
+        // cannot start another one either.
+        if (command.text.startsWith(":"))
+        {
+            otcConfig::logText(QString("<font color=red>**%1 line %2: %3 is not allowed in a script</font>")
+                                    .arg(file).arg(line)
+                                    .arg(command.text.section(' ', 0, 0)));
+            return FALSE;
+        }
+
+        if (parser->compile(command.text, command.frames, command.seq) != OTC_ERROR_NONE)
+        {
+            otcConfig::logText(QString("<font color=red>**%1 line %2: %3</font>")
+                                    .arg(file).arg(line).arg(command.text));
+            return FALSE;
+        }
+
+        // A command which gives no frame
+        if (command.frames.isEmpty())
+            continue;
+
+        // The ALP CMD of the last record tells if a response will come
+        const QByteArray& last = command.frames.last().data;
+        command.response = (last.size() >= OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE)
+                        && (last[OTC_MPIPE_HEADER_SIZE + 3] & (OTC_ALP_RESP_REQ | OTC_ALP_RESP_ECHO));
+        command.sent     = 0;
+        command.rtt      = -1;
+
+        m_commands.append(command);
+    }
+
+    otcConfig::logText(QString("Script %1: %2 commands loaded").arg(file).arg(m_commands.count()));
+    return TRUE;
+}
+
+// Responses awaited at the same time (0 does not wait), and response timeout in ms
+void otcScriptRunner::setWindow(int window, int timeout)
+{
+    m_mutex.lock();
+    m_window  = window;
+    m_timeout = timeout;
+    m_mutex.unlock();
+}
+
+void otcScriptRunner::stopRunning()
+{
+    m_mutex.lock();
+    m_running = FALSE;
+    m_wait.wakeAll();
+    m_mutex.unlock();
+}
+
+// Hands all the frames of a command to the scheduler. Must be called with
+// m_mutex held.
+bool otcScriptRunner::queue(otcScriptCommand& command)
+{
+    for (int i=0; i<command.frames.count(); i++)
+    {
+        otcWriteFrame& frame = command.frames[i];
+
+        // The source is full: let the writer drain it
+        while (m_device->queueBlock(OTC_WRITE_SOURCE_SCRIPT, OTC_WRITE_PRIO_CONTROL,
+                                    frame.data.constData(), frame.data.size(), frame.ackseq) <= 0)
+        {
+            if (!m_running)
+                return FALSE;
+
+            m_wait.wait(&m_mutex, OTC_SCRIPT_POLL);
+        }
+    }
+
+    command.sent = m_clock.nsecsElapsed() / 1000;
+    return TRUE;
+}
+
+// Commands without response in time leave the window. Must be called with
+// m_mutex held.
+void otcScriptRunner::expire()
+{
+    qint64 now = m_clock.nsecsElapsed() / 1000;
+
+    while (!m_inflight.isEmpty()
+    &&     ((now - m_commands[m_inflight.first()].sent) > (qint64)m_timeout * 1000))
+    {
+        m_inflight.removeFirst();
+        m_timeouts++;
+    }
+}
+
+void otcScriptRunner::run()
+{
+    int next = 0;
+
+    m_mutex.lock();
+    m_running  = TRUE;
+    m_timeouts = 0;
+    m_inflight.clear();
+    m_clock.start();
+
+    otcConfig::logText(QString("Script %1 started").arg(m_file));
+
+    while (m_running)
+    {
+        // Fill the window
+        while (m_running && (next < m_commands.count())
+        &&     ((m_window == 0) || (m_inflight.count() < m_window)))
+        {
+            if (!queue(m_commands[next]))
+                break;
+
+            if ((m_window > 0) && m_commands[next].response)
+                m_inflight.append(next);
+
+            next++;
+        }
+
+        if ((next >= m_commands.count()) && m_inflight.isEmpty())
+            break;
+
+        m_wait.wait(&m_mutex, OTC_SCRIPT_POLL);
+        expire();
+    }
+
+    qint64 total = m_clock.nsecsElapsed() / 1000;
+    bool   done  = m_running;
+
+    m_running = FALSE;
+    m_inflight.clear();
+    m_mutex.unlock();
+
+    if (!done)
+        otcConfig::logText(QString("<font color=red>Script %1 stopped after %2 of %3 commands</font>")
+                                .arg(m_file).arg(next).arg(m_commands.count()));
+
+    report(total);
+
+    if (m_quit)
+        QApplication::postEvent(otcConfig::mainWindow, new otcKillEvent());
+}
+
+// Called by the MPIPE parser for every valid record from the device
+void otcScriptRunner::received(unsigned char seq, unsigned char, unsigned char, const unsigned char*, int)
+{
+    m_mutex.lock();
+    for (int i=0; i<m_inflight.count(); i++)
+    {
+        otcScriptCommand& command = m_commands[m_inflight[i]];
+
+        if (command.seq == seq)
+        {
+            command.rtt = (m_clock.nsecsElapsed() / 1000) - command.sent;
+            m_inflight.removeAt(i);
+            m_wait.wakeOne();
+            break;
+        }
+    }
+    m_mutex.unlock();
+}
+
+void otcScriptRunner::report(qint64 total)
+{
+    QString ret = QString("Script %1 (line, RTT ms):\n").arg(m_file);
+    qint64  sum = 0;
+    qint64  min = -1;
+    qint64  max = 0;
+    int     answered = 0;
+
+    for (int i=0; i<m_commands.count(); i++)
+    {
+        const otcScriptCommand& command = m_commands[i];
+
+        if (!command.response || (m_window == 0))
+            continue;
+
+        if (command.rtt < 0)
+        {
+            ret += QString("  %1: %2, <font color=red>no response</font>\n").arg(command.line).arg(command.text);
+            continue;
+        }
+
+        ret += QString("  %1: %2, %3\n").arg(command.line).arg(command.text)
+                                        .arg(command.rtt / 1000.0, 0, 'f', 2);
+        sum += command.rtt;
+        if ((min < 0) || (command.rtt < min))
+            min = command.rtt;
+        if (command.rtt > max)
+            max = command.rtt;
+        answered++;
+    }
+
+    if (answered)
+        ret += QString("  RTT avg/min/max %1/%2/%3 ms\n")
+                    .arg(sum / answered / 1000.0, 0, 'f', 2)
+                    .arg(min / 1000.0, 0, 'f', 2)
+                    .arg(max / 1000.0, 0, 'f', 2);
+
+    ret += QString("  %1 commands in %2 ms, %3 responses, %4 timeouts")
+                .arg(m_commands.count()).arg(total / 1000.0, 0, 'f', 1)
+                .arg(answered).arg(m_timeouts);
+
+    otcConfig::logText(ret);
+}
@@ -0,0 +1,121 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_script.h
+/// @brief          Command script runner
+///                 Encodes a file of OTCOM commands and streams it to the device
+//
+/// =========================================================================
+///
+/// A script is a text file with one prompt command per line. Blank lines and
+/// lines starting with '#' are ignored. The whole file is compiled when it is
+/// loaded, so a syntax error stops the script before anything is sent, and
+/// the runner thread only has to queue ready made frames.
+///
+/// Internal commands (:PROF, :DUMP, :JOB, ...) are not allowed in a script:
+/// they would run when the file is compiled, before the first frame is sent
+/// and not at their place in the script. The line is reported and the script
+/// is not loaded.
+///
+/// Commands which ask for a response (ALP?, OT+R, OT+W?, ...) are pipelined:
+/// up to "window" of them wait for their response at the same time. The
+/// response is the first valid record from the device carrying the MPIPE seq
+/// of the last record of the command. With a window of 0 the runner does not
+/// wait at all and streams the frames as fast as the scheduler takes them.
+///
+/// =========================================================================
+
+#ifndef __OTC_SCRIPT_H__
+#define __OTC_SCRIPT_H__
+
+#include <qstring.h>
+#include <qthread.h>
+#include <qmutex.h>
+#include <qlist.h>
+#include <qelapsedtimer.h>
+#include <QWaitCondition>
+
+#include "otc_mpipe.h"
+#include "otc_scheduler.h"
+
+
+class otcCommunicationLinkDevice;
+class otc_command_parser;
+
+
+/// Commands waiting for a response at the same time
+#define OTC_SCRIPT_WINDOW                   1
+
+/// Time after which a command is reported without response (ms)
+#define OTC_SCRIPT_TIMEOUT                  2000
+
+/// How often the runner checks for timeouts and retries a full queue (ms)
+#define OTC_SCRIPT_POLL                     20
+
+
+class otcScriptCommand
+{
+public :
+    int                     line;
+    QString                 text;
+    QList<otcWriteFrame>    frames;
+    int                     seq;        ///< MPIPE seq of the last record, -1 if none
+    bool                    response;   ///< the device is asked to respond
+    qint64                  sent;       ///< queue time (us)
+    qint64                  rtt;        ///< round trip time (us), -1 if no response
+};
+
+
+class otcScriptRunner : public QThread, public otc_mpipe_listener
+{
+public :
+    otcScriptRunner(otcCommunicationLinkDevice* device);
+    ~otcScriptRunner();
+
+    bool                    load(const QString& file, otc_command_parser* parser);
+    void                    setWindow(int window, int timeout);
+    void                    setQuitWhenDone(bool quit)  {m_quit = quit;}
+    const QString&          file()                      {return m_file;}
+
+    void                    run();
+    void                    stopRunning();
+    void                    received(unsigned char seq, unsigned char id, unsigned char cmd, const unsigned char* data, int len);
+
+protected :
+    otcCommunicationLinkDevice* m_device;
+    QMutex                  m_mutex;
+    QWaitCondition          m_wait;
+    QElapsedTimer           m_clock;
+    QString                 m_file;
+    QList<otcScriptCommand> m_commands;
+    QList<int>              m_inflight;
+    int                     m_window;
+    int                     m_timeout;
+    unsigned int            m_timeouts;
+    bool                    m_quit;
+    bool                    m_running;
+
+    bool                    queue(otcScriptCommand& command);
+    void                    expire();
+    void                    report(qint64 total);
+};
+
+
+#endif // __OTC_SCRIPT_H__
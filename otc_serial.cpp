@@ -35,6 +35,9 @@
 #include <fcntl.h>   /* File control definitions */
 #include <errno.h>   /* Error number definitions */
 #include <termios.h> /* POSIX terminal control definitions */
+#include <poll.h>    /* Hangup of the tty, wait for bytes */
+#include <stdlib.h>
+#include <sys/ioctl.h>
 
 #else
 
@@ -46,13 +49,50 @@
 #include <qstring.h>
 #include "otc_main.h"
 #include "otc_serial.h"
+#include "otc_hex.h"
+#include "otc_log.h"
+#include "otc_trace.h"
+
+#if defined(OTC_SERIAL_LOW_LATENCY) || defined(OTC_SERIAL_ICOUNT)
+#include <linux/serial.h>   /* TIOCSSERIAL flags, serial_icounter_struct */
+#endif
+
+#ifdef OTC_SERIAL_TERMIOS2
+/* termios2 of the kernel: <asm/termbits.h> cannot be included with <termios.h> */
+struct otc_termios2 {
+    tcflag_t    c_iflag;
+    tcflag_t    c_oflag;
+    tcflag_t    c_cflag;
+    tcflag_t    c_lflag;
+    cc_t        c_line;
+    cc_t        c_cc[19];
+    speed_t     c_ispeed;
+    speed_t     c_ospeed;
+};
+
+#define OTC_TCGETS2     _IOR('T', 0x2A, struct otc_termios2)
+#define OTC_TCSETS2     _IOW('T', 0x2B, struct otc_termios2)
+
+#ifndef BOTHER
+#define BOTHER          0010000
+#endif
+#endif // OTC_SERIAL_TERMIOS2
 
 
 // Constructor... ok, this comment might not be very useful.
 otc_serial::otc_serial()
 {
 	m_bOpened =  false;
+	m_bLost = false;
     m_nBaud = 0;
+    m_nActualBaud = 0;
+    m_profile = OTC_SERIAL_PROFILE_DEFAULT;
+    m_lowLatency = -1;
+    m_batch = OTC_SERIAL_BATCH_MIN;
+    m_reads = 0;
+    m_readBytes = 0;
+    m_writes = 0;
+    m_writeBytes = 0;
 
     dbgprint("Hello, I'm the serial context.\n");
 
@@ -136,6 +176,7 @@ bool otc_serial::sopen(char *szPort, int nBaud, OTC_FLOW_T mode, bool timeoutblo
 {
     if (m_bOpened) return true;
     m_nBaud = nBaud;
+    m_bLost = false;
 
 #ifndef WIN32
 
@@ -217,6 +258,8 @@ bool otc_serial::sopen(char *szPort, int nBaud, OTC_FLOW_T mode, bool timeoutblo
         return false;
     }
 
+    applyProfile();
+
 #else // WIN32
 
     hComDev = CreateFileA( szPort, GENERIC_READ | GENERIC_WRITE, 0,
@@ -339,131 +382,203 @@ void otc_serial::sclose(void)
 
     m_bOpened = false;
     m_nBaud = 0;
+    m_nActualBaud = 0;
 }
 
 
 // Change the baude rate of the serial interface.
-bool otc_serial::baudrate(int nBaud)
+#if !defined(WIN32) && !defined(__APPLE__)
+/* convert nBaud to POSIX speed_t, false if there is no Bxxx for it */
+static bool otcSpeed(int nBaud, speed_t* speed)
 {
-    /* Check if the port is opened. */
-    if (!m_bOpened) return false;
-
-#ifndef WIN32
-
-    struct termios options;
-
-    speed_t speed;
-
-#ifdef __APPLE__
-    speed = (speed_t) nBaud;
-#else // ! __APPLE__
-    /* convert nBaud to POSIX speed_t*/
     switch (nBaud) 
     {
     case 0:
-        speed = B0;
+        *speed = B0;
         break;
     case 50:
-        speed = B50;
+        *speed = B50;
         break;
     case 75:
-        speed = B75;
+        *speed = B75;
         break;
     case 110:
-        speed = B110;
+        *speed = B110;
         break;
     case 134:
-        speed = B134;
+        *speed = B134;
         break;
     case 150:
-        speed = B150;
+        *speed = B150;
         break;
     case 200:
-        speed = B200;
+        *speed = B200;
         break;
     case 300:
-        speed = B300;
+        *speed = B300;
         break;
     case 600:
-        speed = B600;
+        *speed = B600;
         break;
     case 1200:
-        speed = B1200;
+        *speed = B1200;
         break;
     case 1800:
-        speed = B1800;
+        *speed = B1800;
         break;
     case 2400:
-        speed = B2400;
+        *speed = B2400;
         break;
     case 4800:
-        speed = B4800;
+        *speed = B4800;
         break;
     case 9600:
-        speed = B9600;
+        *speed = B9600;
         break;
     case 19200:
-        speed = B19200;
+        *speed = B19200;
         break;
     case 38400:
-        speed = B38400;
+        *speed = B38400;
         break;
     case 57600:
-        speed = B57600;
+        *speed = B57600;
         break;
     case 115200:
-        speed = B115200;
+        *speed = B115200;
         break;
     case 230400:
-        speed = B230400;
+        *speed = B230400;
         break;
     case 460800:
-        speed = B460800;
+        *speed = B460800;
         break;  
     case 500000:
-        speed = B500000;
+        *speed = B500000;
         break;  
     case 576000:
-        speed = B576000;
+        *speed = B576000;
         break;  
     case 921600:
-        speed = B921600;
+        *speed = B921600;
         break;  
     case 1000000:
-        speed = B1000000;
+        *speed = B1000000;
         break; 
     case 1152000:
-        speed = B1152000;
+        *speed = B1152000;
         break; 
     case 1500000:
-        speed = B1500000;
+        *speed = B1500000;
         break; 
     case 2000000:
-        speed = B2000000;
+        *speed = B2000000;
         break; 
     case 2500000:
-        speed = B2500000;
+        *speed = B2500000;
         break; 
     case 3000000:
-        speed = B3000000;
+        *speed = B3000000;
         break; 
     case 3500000:
-        speed = B3500000;
+        *speed = B3500000;
         break; 
     case 4000000:
-        speed = B4000000;
+        *speed = B4000000;
         break;
     default:
-        // raise?
-        speed = B921600;
+        return false;
     }
+    return true;
+}
+#endif
+
+// Rates which can be asked: any one with termios2, on Mac OS or Windows, the
+// Bxxx constants otherwise. The driver may still refuse them.
+bool otc_serial::validBaudrate(int nBaud)
+{
+    if ((nBaud < OTC_SERIAL_BAUD_MIN) || (nBaud > OTC_SERIAL_BAUD_MAX))
+        return false;
+
+#if defined(WIN32) || defined(__APPLE__) || defined(OTC_SERIAL_TERMIOS2)
+    return true;
+#else
+    speed_t speed;
+    return otcSpeed(nBaud, &speed);
+#endif
+}
+
+bool otc_serial::baudrate(int nBaud)
+{
+    int actual = nBaud;
+
+    /* Check if the port is opened. */
+    if (!m_bOpened) return false;
+
+#ifndef WIN32
+
+    struct termios options;
+
+    speed_t speed;
+
+#ifdef __APPLE__
+    speed = (speed_t) nBaud;
+#else // ! __APPLE__
+    bool custom = !otcSpeed(nBaud, &speed);
+
+#ifndef OTC_SERIAL_TERMIOS2
+    if (custom)
+    {
+        ioprint1("Unsupported baudrate %d.\n", nBaud);
+        return false;
+    }
+#endif
 #endif // ! __APPLE__
 
-    // Get the current options for the port, change the baudrate and set them.
-    tcgetattr(m_serialHandle, &options);
-    cfsetispeed(&options, speed);
-    cfsetospeed(&options, speed);
-    tcsetattr(m_serialHandle, TCSANOW, &options);
+#ifdef OTC_SERIAL_TERMIOS2
+    struct otc_termios2 previous;
+    struct otc_termios2 options2;
+
+    if (ioctl(m_serialHandle, OTC_TCGETS2, &previous) < 0)
+        return false;
+
+    if (custom)
+    {
+        // Any other rate is given as is to the driver
+        options2 = previous;
+        options2.c_cflag &= ~CBAUD;
+        options2.c_cflag |= BOTHER;
+        options2.c_ispeed = nBaud;
+        options2.c_ospeed = nBaud;
+        if (ioctl(m_serialHandle, OTC_TCSETS2, &options2) < 0)
+        {
+            ioprint1("Failed to set baudrate %d.\n", nBaud);
+            return false;
+        }
+    }
+    else
+#endif // OTC_SERIAL_TERMIOS2
+    {
+        // Get the current options for the port, change the baudrate and set them.
+        tcgetattr(m_serialHandle, &options);
+        cfsetispeed(&options, speed);
+        cfsetospeed(&options, speed);
+        tcsetattr(m_serialHandle, TCSANOW, &options);
+    }
+
+#ifdef OTC_SERIAL_TERMIOS2
+    // The driver takes the closest rate its divisors can make, read it back
+    if (ioctl(m_serialHandle, OTC_TCGETS2, &options2) < 0)
+        return false;
+    actual = options2.c_ospeed;
+
+    if ((qint64)abs(actual - nBaud) * 100 > (qint64)nBaud * OTC_SERIAL_BAUD_TOLERANCE)
+    {
+        ioprint2("Baudrate %d not supported, the driver gives %d.\n", nBaud, actual);
+        ioctl(m_serialHandle, OTC_TCSETS2, &previous);
+        return false;
+    }
+#endif // OTC_SERIAL_TERMIOS2
 
 #else // WIN32
 
@@ -479,9 +594,15 @@ bool otc_serial::baudrate(int nBaud)
         return false;
     }
 
+    DCB check;
+    check.DCBlength = sizeof(DCB);
+    if (GetCommState(hComDev, &check))
+        actual = check.BaudRate;
+
 #endif // WIN32
 
     m_nBaud = nBaud;
+    m_nActualBaud = actual;
 
     return true;
 }
@@ -580,12 +701,30 @@ int otc_serial::sread(void *buffer, unsigned int len)
                                     (char*)buffer + nbRead,
                                     len - nbRead)) )
         {
+            // Reads never wait (VMIN and VTIME are 0): nothing to read,
+            // unless the tty is hung up (device unplugged)
+            if ((tmpNbRead < 0) && (errno != EAGAIN) && (errno != EINTR))
+            {
+                m_bLost = true;
+            }
+            else if (tmpNbRead == 0)
+            {
+                struct pollfd p;
+                p.fd      = m_serialHandle;
+                p.events  = POLLIN;
+                p.revents = 0;
+                if ((poll(&p, 1, 0) > 0) && (p.revents & (POLLHUP | POLLERR | POLLNVAL)))
+                    m_bLost = true;
+            }
             return nbRead;
         }
 
         nbRead += tmpNbRead;
     }
 
+    m_reads++;
+    m_readBytes += nbRead;
+
 #else // WIN32
 
     if (hComDev == NULL) return 0;
@@ -595,7 +734,12 @@ int otc_serial::sread(void *buffer, unsigned int len)
     COMSTAT ComStat;
     unsigned int dwError;
 
-    ClearCommError( hComDev, &dwErrorFlags, &ComStat );
+    // Fails once the device is removed
+    if (!ClearCommError( hComDev, &dwErrorFlags, &ComStat ))
+    {
+        m_bLost = true;
+        return -1;
+    }
 
     if (dwErrorFlags!=0)
     {
@@ -648,17 +792,15 @@ int otc_serial::swrite(const char *buffer, unsigned int len)
 
 #ifndef WIN32
 
-    int nbWritten;
+    struct iovec v;
 
-    nbWritten = write(m_serialHandle, buffer, len);
+    v.iov_base = (void*)buffer;
+    v.iov_len  = len;
 
     // The method does not support error returns.
-    if (nbWritten < 0)
-    {
-        nbWritten = 0;
-    }
+    int nbWritten = swritev(&v, 1);
 
-    return nbWritten;
+    return (nbWritten < 0) ? 0 : nbWritten;
 
 #else // WIN32
 
@@ -666,6 +808,8 @@ int otc_serial::swrite(const char *buffer, unsigned int len)
 
     BOOL bWriteStat=false;
 
+    m_writes++;
+
 
     bWriteStat = WriteFile( hComDev, buffer, len,
                            (DWORD*)&len, &osWriter );
@@ -710,11 +854,115 @@ int otc_serial::swrite(const char *buffer, unsigned int len)
         }
     }
 
+    m_writeBytes += len;
     return len;
 
 #endif // WIN32
 }
 
+// Gather write of iovcnt buffers, OTC_IOV_MAX at a time. Never waits: stops
+// at the first short write (the driver buffer is full), the caller skips
+// what was written (otcIovecSkip) and waits with waitWritable().
+// Returns the bytes written, -1 on an error before any byte went.
+int otc_serial::swritev(const struct iovec* iov, int iovcnt)
+{
+    /* Check if the port is opened. */
+    if (!m_bOpened) return 0;
+
+    int total = 0;
+
+#ifndef WIN32
+
+    struct iovec    v[OTC_IOV_MAX];
+    int             n    = 0;   // buffers of v left to write
+    int             next = 0;   // next buffer of iov
+
+    for (;;)
+    {
+        while ((n < OTC_IOV_MAX) && (next < iovcnt))
+        {
+            if (iov[next].iov_len)
+                v[n++] = iov[next];
+            next++;
+        }
+
+        if (n == 0)
+            break;
+
+        size_t want = 0;
+        for (int i=0; i<n; i++)
+            want += v[i].iov_len;
+
+        ssize_t ret = writev(m_serialHandle, v, n);
+        m_writes++;
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            if ((errno == EIO) || (errno == ENXIO) || (errno == ENODEV))
+                m_bLost = true;
+
+            // EAGAIN: the driver buffer is full
+            if ((errno != EAGAIN) && (total == 0))
+                total = -1;
+            break;
+        }
+
+        total        += ret;
+        m_writeBytes += ret;
+
+        // Short write: the driver buffer is full
+        if ((size_t)ret < want)
+            break;
+
+        n = 0;
+    }
+
+#else // WIN32
+
+    // WriteFile waits for each buffer
+    for (int i=0; i<iovcnt; i++)
+    {
+        int ret = swrite((const char*)iov[i].iov_base, iov[i].iov_len);
+
+        total += ret;
+        if (ret < (int)iov[i].iov_len)
+            break;
+    }
+
+#endif // WIN32
+
+    return total;
+}
+
+// Wait until the driver takes more bytes, at most timeout ms.
+bool otc_serial::waitWritable(int timeout)
+{
+	if (!m_bOpened) return false;
+
+#ifndef WIN32
+
+    struct pollfd p;
+    p.fd      = m_serialHandle;
+    p.events  = POLLOUT;
+    p.revents = 0;
+
+    if (poll(&p, 1, timeout) <= 0)
+        return false;
+
+    // The next write sees the hangup
+    return true;
+
+#else // WIN32
+
+	// Writes wait for their completion
+	return true;
+
+#endif // WIN32
+}
+
 
 
 // Send a break on the serial interface.
@@ -766,6 +1014,142 @@ void otc_serial::flush()
 }
 
 
+// Low latency flag of the driver, as the profile asks. Drivers without
+// serial_struct (PTY, CDC ACM) refuse TIOCGSERIAL: -1, nothing to change.
+void otc_serial::applyProfile()
+{
+    m_lowLatency = -1;
+    m_batch = OTC_SERIAL_BATCH_MIN;
+    if (!m_bOpened) return;
+
+#ifdef OTC_SERIAL_LOW_LATENCY
+
+    struct serial_struct ss;
+
+    if (ioctl(m_serialHandle, TIOCGSERIAL, &ss) < 0)
+        return;
+
+    if (m_profile != OTC_SERIAL_PROFILE_DEFAULT)
+    {
+        if (m_profile == OTC_SERIAL_PROFILE_LATENCY)
+            ss.flags |= ASYNC_LOW_LATENCY;
+        else
+            ss.flags &= ~ASYNC_LOW_LATENCY;
+
+        if (ioctl(m_serialHandle, TIOCSSERIAL, &ss) < 0)
+            ioprint("Failed to set the low latency flag.\n");
+
+        // Effective setting
+        if (ioctl(m_serialHandle, TIOCGSERIAL, &ss) < 0)
+            return;
+    }
+
+    m_lowLatency = (ss.flags & ASYNC_LOW_LATENCY) ? 1 : 0;
+
+#endif // OTC_SERIAL_LOW_LATENCY
+}
+
+// Applied now if the port is open, and each time it is opened.
+void otc_serial::setProfile(otc_serial_profile_t profile)
+{
+    m_profile = profile;
+    m_reads = 0;
+    m_readBytes = 0;
+    applyProfile();
+}
+
+// Receive errors counted by the driver. false when it does not count them.
+bool otc_serial::icount(otc_serial_icount& c)
+{
+    if (!m_bOpened) return false;
+
+#ifdef OTC_SERIAL_ICOUNT
+
+    struct serial_icounter_struct ic;
+
+    if (ioctl(m_serialHandle, TIOCGICOUNT, &ic) < 0)
+        return false;
+
+    c.overrun       = ic.overrun;
+    c.bufOverrun    = ic.buf_overrun;
+    c.frame         = ic.frame;
+    c.parity        = ic.parity;
+    return true;
+
+#else
+
+    (void)c;
+    return false;
+
+#endif // OTC_SERIAL_ICOUNT
+}
+
+// Wait for bytes to read, at most timeout ms. false when there is none.
+bool otc_serial::wait(int timeout)
+{
+	if (!m_bOpened) return false;
+
+#ifndef WIN32
+
+    struct pollfd p;
+    p.fd      = m_serialHandle;
+    p.events  = POLLIN;
+    p.revents = 0;
+
+    if (poll(&p, 1, timeout) <= 0)
+        return false;
+
+    // The next read sees the hangup
+    if (p.revents & (POLLHUP | POLLERR | POLLNVAL))
+        return true;
+
+    if (m_profile == OTC_SERIAL_PROFILE_THROUGHPUT)
+    {
+        // Let a batch build up. A batch made in time is doubled, a late one
+        // halved: it follows the rate of the link.
+        int pending = 0;
+        int waited  = 0;
+
+        while ((ioctl(m_serialHandle, FIONREAD, &pending) == 0) && (pending < m_batch))
+        {
+            if (waited++ == OTC_SERIAL_BATCH_DELAY)
+                break;
+            usleep(1000);
+        }
+
+        if (pending >= m_batch)
+            m_batch = (m_batch * 2 > OTC_SERIAL_BATCH_MAX) ? OTC_SERIAL_BATCH_MAX : m_batch * 2;
+        else
+            m_batch = (m_batch / 2 < OTC_SERIAL_BATCH_MIN) ? OTC_SERIAL_BATCH_MIN : m_batch / 2;
+    }
+
+    return true;
+
+#else // WIN32
+
+	// Reads are polled
+	return false;
+
+#endif // WIN32
+}
+
+// Wait until the written bytes are sent on the line.
+bool otc_serial::drain()
+{
+	if (!m_bOpened) return false;
+
+#ifndef WIN32
+
+    return (tcdrain(m_serialHandle) == 0);
+
+#else // WIN32
+
+	return (FlushFileBuffers(hComDev) != 0);
+
+#endif // WIN32
+}
+
+
 #ifndef WIN32
 #include "sys/time.h"
 int GetTickCount(void)
@@ -777,6 +1161,212 @@ int GetTickCount(void)
 #endif
 
 
+#if defined(OTC_SERIAL_BENCH) && !defined(WIN32)
+// Serial benchmark: "otcom serialbench" in a build made with OTC_SERIAL_BENCH.
+// Sets each baud rate on the slave of a PTY and reads it back, then moves
+// 64 MB each way through swrite/sread. A PTY does not pace the bytes at the
+// baud rate: this times the I/O path of OTCom, not the line.
+// Then 16 MB of frames (12 byte MPIPE header and a payload) are written one
+// swrite per buffer, then gathered with swritev.
+// Then, for each read profile, a thread writes stamped frames at the pace of
+// 921600 baud and the round trip histogram of the tracer gives the time
+// until they are read.
+#include <pthread.h>
+
+#define OTC_BENCH_FRAME         32
+#define OTC_BENCH_FRAMES        5000
+#define OTC_BENCH_INTERVAL      350     // us, 32 bytes at 921600 baud
+
+static const char* otcBenchProfile[OTC_SERIAL_PROFILE_QTY] = {
+    "default", "latency", "throughput"
+};
+
+static qint64 otcBenchNow(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (qint64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void* otcBenchWriter(void* arg)
+{
+    int             master = *(int*)arg;
+    unsigned char   frame[OTC_BENCH_FRAME];
+
+    memset(frame, 0x55, sizeof(frame));
+    for (int i=0; i<OTC_BENCH_FRAMES; i++)
+    {
+        qint64 now = otcBenchNow();
+        memcpy(frame, &now, sizeof(now));
+        for (int done=0; done < OTC_BENCH_FRAME; )
+        {
+            int n = write(master, frame + done, OTC_BENCH_FRAME - done);
+            if (n > 0)
+                done += n;
+        }
+        usleep(OTC_BENCH_INTERVAL);
+    }
+    return NULL;
+}
+
+static const int otcBenchRates[] = {
+    115200, 921600, 1000000, 1500000, 1843200, 2000000, 3000000, 3686400, 4000000, 12000000
+};
+
+int otc_serial_bench(void)
+{
+    const int   total   = 64 << 20;
+    char        buffer[4096];
+    int         master  = posix_openpt(O_RDWR | O_NOCTTY);
+    otc_serial  serial;
+
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        printf("no PTY\n");
+        return 1;
+    }
+    if (!serial.sopen(ptsname(master), 115200, OTC_FLOW_NONE, false))
+    {
+        printf("cannot open %s\n", ptsname(master));
+        return 1;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+    memset(buffer, 0x55, sizeof(buffer));
+
+    for (unsigned int i=0; i<sizeof(otcBenchRates)/sizeof(int); i++)
+    {
+        bool ok = serial.baudrate(otcBenchRates[i]);
+        printf("baudrate %8d: %s, actual %d\n", otcBenchRates[i], ok ? "set" : "refused", serial.actualBaudrate());
+    }
+
+    for (int dir=0; dir<2; dir++)
+    {
+        int t       = GetTickCount();
+        int sent    = 0;
+        int got     = 0;
+        int calls   = 0;
+
+        while (got < total)
+        {
+            int n;
+
+            if (sent < total)
+            {
+                n = dir ? write(master, buffer, sizeof(buffer)) : serial.swrite(buffer, sizeof(buffer));
+                if (n > 0)
+                    sent += n;
+            }
+
+            n = dir ? serial.sread(buffer, sizeof(buffer)) : read(master, buffer, sizeof(buffer));
+            if (n > 0)
+                got += n;
+            calls++;
+        }
+
+        t = GetTickCount() - t;
+        printf("%s: %d MB in %d ms, %d MB/s, %d bytes per read\n",
+               dir ? "sread " : "swrite", total >> 20, t, t ? (int)((qint64)total * 1000 / t >> 20) : 0, got / calls);
+    }
+
+    for (int gather=0; gather<2; gather++)
+    {
+        const int       frames  = (16 << 20) / OTC_BENCH_FRAME;
+        struct iovec    v[OTC_IOV_MAX];
+        unsigned int    calls   = serial.writes();
+        int             t       = GetTickCount();
+        qint64          got     = 0;
+
+        for (int f=0; f<frames; f+=OTC_IOV_MAX/2)
+        {
+            int left = OTC_IOV_MAX;
+
+            for (int i=0; i<OTC_IOV_MAX; i+=2)
+            {
+                v[i].iov_base   = buffer;
+                v[i].iov_len    = 12;
+                v[i+1].iov_base = buffer + 12;
+                v[i+1].iov_len  = OTC_BENCH_FRAME - 12;
+            }
+
+            while (left > 0)
+            {
+                int n = gather ? serial.swritev(v, left) : serial.swrite((char*)v[0].iov_base, v[0].iov_len);
+
+                if (n > 0)
+                    left = otcIovecSkip(v, left, n);
+
+                // The PTY is full
+                if (left > 0)
+                {
+                    while ((n = read(master, buffer + 2048, 2048)) > 0)
+                        got += n;
+                }
+            }
+        }
+        while (got < (qint64)frames * OTC_BENCH_FRAME)
+        {
+            int n = read(master, buffer + 2048, 2048);
+            if (n > 0)
+                got += n;
+        }
+
+        t = GetTickCount() - t;
+        calls = serial.writes() - calls;
+        printf("%s: %d frames in %d ms, %d MB/s, %d writes, %.2f writes per frame\n",
+               gather ? "swritev" : "swrite ", frames, t, t ? (int)((qint64)got * 1000 / t >> 20) : 0,
+               calls, (double)calls / frames);
+    }
+
+    for (int p=0; p<OTC_SERIAL_PROFILE_QTY; p++)
+    {
+        otcTraceHistogram   h;
+        unsigned char       frame[OTC_BENCH_FRAME];
+        int                 have    = 0;
+        pthread_t           writer;
+
+        serial.setProfile((otc_serial_profile_t)p);
+        serial.flush();
+        pthread_create(&writer, NULL, otcBenchWriter, &master);
+
+        while ((int)h.count < OTC_BENCH_FRAMES)
+        {
+            if (!serial.wait(OTC_SERIAL_POLL))
+                continue;
+
+            int     n   = serial.sread(buffer, sizeof(buffer));
+            qint64  now = otcBenchNow();
+
+            // Arrival of the whole frames
+            for (int i=0; i<n; )
+            {
+                int k = (n - i < OTC_BENCH_FRAME - have) ? n - i : OTC_BENCH_FRAME - have;
+
+                memcpy(frame + have, buffer + i, k);
+                have += k;
+                i    += k;
+                if (have == OTC_BENCH_FRAME)
+                {
+                    qint64 sent;
+                    memcpy(&sent, frame, sizeof(sent));
+                    h.add(now - sent);
+                    have = 0;
+                }
+            }
+        }
+        pthread_join(writer, NULL);
+
+        printf("%-10s: low latency %d, %u reads, %d bytes per read, round trip avg/p50/p99/max %d/%d/%d/%d us\n",
+               otcBenchProfile[p], serial.lowLatency(), serial.reads(), (int)(serial.readBytes() / serial.reads()),
+               (int)(h.sum / h.count), (int)h.percentile(50), (int)h.percentile(99), (int)h.max);
+    }
+
+    serial.sclose();
+    close(master);
+    return 0;
+}
+#endif
+
+
 // ---------------------------------------- //
 //                                          //
 //           SERIAL READ ENGINE             //
@@ -795,10 +1385,52 @@ void otcDataParser::unlock()
 
 otcDataParser::otcDataParser()
 {
-	m_size			= 4*0x10000; 
+	m_size			= OTC_RING_SIZE;
 	m_buffer		= new unsigned char[m_size];
 	C_feed = 0;
 	C_untreated = 0;
+	m_stamps		= new qint64[m_size];
+	m_tracer = NULL;
+	m_deliveries = 0;
+	m_sendCalls = 0;
+	m_max = m_size;
+	m_highWater = 0;
+	m_grown = 0;
+	m_full = 0;
+	m_fullSince = FALSE;
+	m_icountOk = FALSE;
+	m_overflows = 0;
+	m_lost = 0;
+}
+
+// Listeners are called from the data treatment thread, under the buffer lock
+void otcDataParser::setFrameStore(otcFrameStore* s)
+{
+    lock();
+    m_ndef.setStore(s);
+    unlock();
+}
+
+void otcDataParser::setTracer(otcTracer* t)
+{
+    lock();
+    m_tracer = t;
+    m_ndef.setTracer(t);
+    unlock();
+}
+
+void otcDataParser::addListener(otc_mpipe_listener* l)
+{
+    lock();
+    m_ndef.addListener(l);
+    unlock();
+}
+
+void otcDataParser::removeListener(otc_mpipe_listener* l)
+{
+    lock();
+    m_ndef.removeListener(l);
+    unlock();
 }
 
 void otcDataParser::reinit()
@@ -811,8 +1443,10 @@ void otcDataParser::reinit()
 
 otcDataParser::~otcDataParser()
 {
-	delete m_buffer;
+	delete[] m_buffer;
 	m_buffer = NULL;
+	delete[] m_stamps;
+	m_stamps = NULL;
 }
 
 int otcDataParser::wrap(int i)
@@ -862,6 +1496,120 @@ int otcDataParser::uneatenBytesFrom(int i)
 		return C_feed + m_size - i;
 }
 
+// Bytes which can be read, 1 cell is kept empty between both ends
+int otcDataParser::freeSpace()
+{
+    return m_size - 1 - uneatenBytesFrom(C_untreated);
+}
+
+// Moves the bytes waiting to the start of a new ring. FALSE if they do not
+// fit in it. Must be called with the buffer lock held.
+bool otcDataParser::resize(unsigned int size)
+{
+    int used = uneatenBytesFrom(C_untreated);
+
+    if ((int)size <= used)
+        return FALSE;
+
+    unsigned char*  buffer  = new unsigned char[size];
+    qint64*         stamps  = new qint64[size];
+
+    for(int i=0;i<used;i++)
+    {
+        int j = wrap(C_untreated+i);
+        buffer[i] = m_buffer[j];
+        stamps[i] = m_stamps[j];
+    }
+
+    delete[] m_buffer;
+    delete[] m_stamps;
+    m_buffer    = buffer;
+    m_stamps    = stamps;
+    m_size      = size;
+    C_untreated = 0;
+    C_feed      = used;
+
+    return TRUE;
+}
+
+/** @brief  Sets the size of the ring, and the size it may grow to
+  * @param  size    (unsigned int) bytes, at least OTC_RING_SIZE_MIN
+  * @param  max     (unsigned int) bytes, at least size, OTC_RING_SIZE_MAX at most
+  * @retval (bool)  FALSE if the sizes are out of range, or the bytes waiting do not fit
+  */
+bool otcDataParser::setCapacity(unsigned int size, unsigned int max)
+{
+    if ((size < OTC_RING_SIZE_MIN) || (max < size) || (max > OTC_RING_SIZE_MAX))
+        return FALSE;
+
+    lock();
+    bool ret = (size == m_size) || resize(size);
+    if (ret)
+    {
+        m_max       = max;
+        m_highWater = 0;
+    }
+    unlock();
+
+    return ret;
+}
+
+// Bytes dropped by the driver since the last check. The counters start
+// again from 0 when the device is plugged again. Must be called with the
+// buffer lock held.
+void otcDataParser::checkDriver(otcCommunicationLinkDevice& device)
+{
+    otc_serial_icount c;
+
+    if (m_icountClock.isValid() && (m_icountClock.elapsed() < OTC_RING_ICOUNT_PERIOD))
+        return;
+    m_icountClock.start();
+
+    if (!device.icount(c))
+    {
+        m_icountOk = FALSE;
+        return;
+    }
+
+    if (m_icountOk && (c.overrun >= m_icount.overrun) && (c.bufOverrun >= m_icount.bufOverrun))
+    {
+        unsigned int overrun    = c.overrun - m_icount.overrun;
+        unsigned int bufOverrun = c.bufOverrun - m_icount.bufOverrun;
+
+        if (overrun + bufOverrun)
+        {
+            m_overflows++;
+            m_lost += overrun + bufOverrun;
+            otcConfig::logText(QString("<font color=red>**%1 bytes lost by the driver (%2 UART overruns, %3 buffer overruns), "
+                                       "ring %4 of %5 bytes used%6</font>")
+                                    .arg(overrun + bufOverrun).arg(overrun).arg(bufOverrun)
+                                    .arg(uneatenBytesFrom(C_untreated)).arg(m_size)
+                                    .arg(m_fullSince ? ", it was full" : ""));
+        }
+    }
+
+    m_icount    = c;
+    m_icountOk  = TRUE;
+    m_fullSince = FALSE;
+}
+
+// Reads at C_feed, the time of every byte read goes in the side-band array
+int otcDataParser::feed(otcCommunicationLinkDevice& device, int avail)
+{
+    otcReadStamp st;
+
+    int read = device.readBlock(m_buffer+C_feed,avail,&st);
+    if(read<=0)
+        return 0;
+
+    for(int i=0;i<read;i++)
+        m_stamps[C_feed+i] = st.first + (qint64)i*st.byteTime;
+
+    C_feed += read; //advance
+    C_feed =  wrap(C_feed);
+    return read;
+}
+
 int otcDataParser::eatAsMuchAsPossibleFromSerial(otcCommunicationLinkDevice& device)
 {
 	if(C_feed < C_untreated)
@@ -870,11 +1618,7 @@ int otcDataParser::eatAsMuchAsPossibleFromSerial(otcCommunicationLinkDevice& dev
 
 		if(bytesavail<0) bytesavail = 0;
 
-		int read = device.readBlock(m_buffer+C_feed,bytesavail);
-		if(read<=0)	read = 0;
-		C_feed += read; //advance
-		C_feed =  wrap(C_feed);
-		return read;
+		return feed(device,bytesavail);
 	}
 	else
 	{
@@ -889,19 +1633,10 @@ int otcDataParser::eatAsMuchAsPossibleFromSerial(otcCommunicationLinkDevice& dev
 
 		int read1=0,read2=0;
 
-		read1 = device.readBlock(m_buffer+C_feed,avail1);
-
-        if(read1<=0) read1 = 0;
-        C_feed +=read1;
-        C_feed = wrap(C_feed);
+		read1 = feed(device,avail1);
 
         if(avail1==read1) //need to continue reading
-        {
-            read2 = device.readBlock(m_buffer+C_feed,avail2);
-            if(read2<=0) read2 = 0;
-            C_feed+=read2;
-            C_feed =  wrap(C_feed);
-        }
+            read2 = feed(device,avail2);
 
         return read1+read2;
 	}
@@ -910,6 +1645,8 @@ int otcDataParser::eatAsMuchAsPossibleFromSerial(otcCommunicationLinkDevice& dev
 
 QString otcDataParser::getStatus()
 {
+    // The ring may be moved by a resize
+    lock();
     QString ret =QString("Feed: %1, Treated: %2.\n").arg(C_feed).arg(C_untreated);
     ret += "Not treated content:\n";
     ret += "<font color=blue>\n";
@@ -920,14 +1657,37 @@ QString otcDataParser::getStatus()
     else
         notTreated = C_feed + m_size - C_untreated;
 
+    QByteArray bytes(notTreated, 0);
     for(int uu=0;uu<notTreated;uu++)
-    {
-        if(uu%16==0 && uu!=0)
-            ret+="\n";
+        bytes[uu] = at(C_untreated+uu);
+    unlock();
 
-        ret += QString("%1 ").arg(QString("%1").arg(at(C_untreated+uu),2,16).upper().replace(' ','0'));
-    }
-    ret += "</font>";
+    otcHexAppend(ret, (const unsigned char*)bytes.constData(), notTreated, OTC_HEX_BREAK_16);
+    ret += "</font>\n";
+    ret += QString("Sent %1 times to the clients in %2 system calls.\n").arg(m_deliveries).arg(m_sendCalls);
+    ret += getRingStatus();
+    ret += m_ndef.getStatus();
+
+    return ret;
+}
+
+QString otcDataParser::getRingStatus()
+{
+    lock();
+
+    QString ret = QString("Ring: %1 KB (grows up to %2 KB, grown %3 times), high water %4 bytes, full %5 times.\n")
+                        .arg(m_size / 1024).arg(m_max / 1024).arg(m_grown).arg(m_highWater).arg(m_full);
+
+    if (m_icountOk)
+        ret += QString("  Driver: %1 bytes lost in %2 checks (%3 UART overruns, %4 buffer overruns), "
+                       "%5 framing and %6 parity errors.\n")
+                    .arg(m_lost).arg(m_overflows).arg(m_icount.overrun).arg(m_icount.bufOverrun)
+                    .arg(m_icount.frame).arg(m_icount.parity);
+    else
+        ret += QString("  Driver: %1 bytes lost in %2 checks, errors not counted by this driver.\n")
+                    .arg(m_lost).arg(m_overflows);
+
+    unlock();
 
     return ret;
 }
@@ -936,24 +1696,105 @@ int otcDataParser::readDataFromDevice(otcCommunicationLinkDevice& device)
 {
     lock();
     int ret = eatAsMuchAsPossibleFromSerial(device);
+
+    // The ring cut the read: more bytes may wait in the driver
+    if ((ret > 0) && (freeSpace() == 0))
+    {
+        if ((m_size < m_max) && resize(qMin(2 * m_size, m_max)))
+        {
+            m_grown++;
+            ret += eatAsMuchAsPossibleFromSerial(device);
+        }
+        else
+        {
+            m_full++;
+            m_fullSince = TRUE;
+        }
+    }
+
+    int used = uneatenBytesFrom(C_untreated);
+    if (used > m_highWater)
+        m_highWater = used;
+
+    checkDriver(device);
     unlock();
 
     return ret;
 }
 
+// Packets of the tosend bytes at C_untreated for the socket clients, as
+// header and data buffers for writeBlockv. A packet holds 64 KB at most, a
+// stamped one only bytes evenly spaced in time (one read or more).
+void otcDataParser::packets(int tosend, bool stamped, QByteArray& headers, QVector<struct iovec>& v)
+{
+    const qint64*   t       = m_stamps + C_untreated;
+    int             hlen    = 4 + (stamped ? OTC_PROTOCOL_STAMP_HEADER : 0);
+    int             max     = 0xFFFF - (hlen - 4);
+    QList<int>      lens;
+
+    for(int i=0;i<tosend;)
+    {
+        int n = 1;
+
+        if(stamped)
+        {
+            while((i+n < tosend) && (n < max) &&
+                  ((n == 1) || (t[i+n] - t[i+n-1] == t[i+1] - t[i])))
+                n++;
+        }
+        else
+            n = qMin(tosend - i, max);
+
+        lens.append(n);
+        i += n;
+    }
+
+    headers.resize(lens.count() * hlen);
+    v.resize(lens.count() * 2);
+
+    for(int k=0,i=0;k<lens.count();k++)
+    {
+        unsigned char*  h       = (unsigned char*)headers.data() + k * hlen;
+        int             size    = hlen - 4 + lens[k];
+
+        h[0] = OTC_PROTOCOL_SYNC;
+        h[1] = ((size&0xFF00)>>8);
+        h[2] = ((size&0x00FF));
+        h[3] = stamped ? OTC_PROTOCOL_RAW_DATA_STAMPED : OTC_PROTOCOL_RAW_DATA;
+
+        if(stamped)
+        {
+            qint64  first   = otcClockRealtime(t[i]);
+            quint32 step    = (lens[k] > 1) ? (quint32)(t[i+1] - t[i]) : 0;
+
+            for(int b=0;b<8;b++)
+                h[4+b] = (unsigned char)(first >> (56 - 8*b));
+            for(int b=0;b<4;b++)
+                h[12+b] = (unsigned char)(step >> (24 - 8*b));
+        }
+
+        v[2*k].iov_base   = h;
+        v[2*k].iov_len    = hlen;
+        v[2*k+1].iov_base = m_buffer+C_untreated+i;
+        v[2*k+1].iov_len  = lens[k];
+
+        i += lens[k];
+    }
+}
+
 void otcDataParser::treatSendData(otcHostServer& hostserver)
 {
-    static unsigned char m_customHeader[4];
+    QByteArray              headers[2];
+    QVector<struct iovec>   v[2];
 
     int tosend = 0;
+    bool sent = FALSE;
 
     if(C_feed < C_untreated)
         tosend = m_size - C_untreated; 
     else
         tosend = C_feed - C_untreated;
 
-    int plen = tosend+4;
-
     if(tosend==0)
         return;
 
@@ -967,35 +1808,37 @@ void otcDataParser::treatSendData(otcHostServer& hostserver)
 
         if(client)
         {
-			// TODO : remove this header
-            m_customHeader[0] = OTC_PROTOCOL_SYNC;
-            m_customHeader[1] = ((tosend&0xFF00)>>8);
-            m_customHeader[2] = ((tosend&0x00FF));
-            m_customHeader[3] = OTC_PROTOCOL_RAW_DATA;
-
-            client->writeBlock((char*)m_customHeader,4);
-            client->writeBlock(((char*)m_buffer)+C_untreated,plen);
+            int stamped = client->stamps() ? 1 : 0;
+
+            // Headers and data in one send, packets made once for all clients
+            if(v[stamped].isEmpty())
+                packets(tosend,stamped,headers[stamped],v[stamped]);
+
+            unsigned int calls = client->sendCalls();
+            client->writeBlockv(v[stamped].constData(),v[stamped].count());
+            m_sendCalls += client->sendCalls() - calls;
+            m_deliveries++;
+            sent = TRUE;
         }
         c = c->next;
     }
 
+    // Frames are parsed in every print mode: the frame store, the listeners
+    // and the tracer need them. Only the display depends on the mode.
+    m_ndef.setStamps(m_stamps+C_untreated,
+                     (sent && m_tracer && m_tracer->enabled()) ? m_tracer->now() : -1);
+    m_ndef.parse(m_buffer+C_untreated,tosend);
+
 	if (otcConfig::argPrintMode == OTC_PRINT_MODE_RAW)
 	{
-        QString msg="<font color=blue>";
-        for(int cc=0;cc<tosend;cc++)
+        // Clients already have the bytes, only the display is sampled
+        if (otcConfig::logFrame(OTC_LOG_CLASS_RAW))
         {
-            if (m_ndef.sync(m_buffer+C_untreated+cc))
-            {
-                msg+="\n";
-            }
-            msg+=QString("%1 ").arg(QString("%1").arg(m_buffer[C_untreated+cc],2,16).upper().replace(' ','0'));
+            QString msg="<font color=blue>";
+            otcHexAppend(msg, m_buffer+C_untreated, tosend, OTC_HEX_BREAK_SYNC);
+            msg+="</font>";
+            otcConfig::logText(msg);
         }
-        msg+="</font>";
-        otcConfig::logText(msg);
-	}
-	else // if (otcConfig::argPrintMode == OTC_PRINT_MODE_NDEF_PLUS_OT)
-	{
-		m_ndef.parse(m_buffer+C_untreated,tosend);
 	}
 
     // Update buffer markers
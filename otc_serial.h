@@ -27,6 +27,8 @@
 #define OTC_SERIAL_H
 
 #include <qmutex.h>
+#include <qvector.h>
+#include <qelapsedtimer.h>
 #include <qtextedit.h>
 #include <qtcpsocket.h>
 #include <q3socket.h>
@@ -34,6 +36,8 @@
 #include "otc_main.h"
 #include "otc_socket.h"
 #include "otc_mpipe.h"
+#include "otc_scheduler.h"
+#include "otc_clock.h"
 
 
 
@@ -49,6 +53,47 @@
 
 #define SERIALWAIT_TIMEOUT		3000 // 2s
 
+/* Baud rates: range accepted, and deviation allowed between the rate
+   asked and the one the driver could make (percent). */
+#define OTC_SERIAL_BAUD_MIN         50
+#define OTC_SERIAL_BAUD_MAX         12000000
+#define OTC_SERIAL_BAUD_TOLERANCE   2
+
+/* Read profiles. Bytes are waited for with poll() in all of them.
+   - default:       driver settings kept, bytes read as they come
+   - latency:       ASYNC_LOW_LATENCY set (FTDI latency timer at 1 ms), bytes
+                    read as they come
+   - throughput:    ASYNC_LOW_LATENCY cleared, the bytes are left to build up
+                    in the driver for up to OTC_SERIAL_BATCH_DELAY, until a
+                    batch which adapts to the rate of the link */
+typedef enum {
+    OTC_SERIAL_PROFILE_DEFAULT = 0,
+    OTC_SERIAL_PROFILE_LATENCY,
+    OTC_SERIAL_PROFILE_THROUGHPUT,
+    OTC_SERIAL_PROFILE_QTY
+} otc_serial_profile_t;
+
+#define OTC_SERIAL_POLL             10      // longest wait for bytes (ms)
+#define OTC_SERIAL_BATCH_DELAY      4       // longest wait for a batch (ms)
+#define OTC_SERIAL_BATCH_MIN        64
+#define OTC_SERIAL_BATCH_MAX        0x8000
+
+#ifdef __linux__
+#define OTC_SERIAL_LOW_LATENCY
+#endif
+
+/* Linux: receive errors counted by the driver (TIOCGICOUNT). PTYs and some
+   USB drivers do not count them. */
+#ifdef __linux__
+#define OTC_SERIAL_ICOUNT
+#endif
+
+/* Linux: any baud rate through termios2 (BOTHER). The struct has the
+   kernel NCCS, checked for these architectures only. */
+#if defined(__linux__) && (defined(__i386__) || defined(__x86_64__) || defined(__arm__) || defined(__aarch64__) || defined(__riscv))
+#define OTC_SERIAL_TERMIOS2
+#endif
+
 /* IO functions. */
 #define ioprint(x)				printf(x);
 #define ioprint1(x,y1)			printf(x,y1);
@@ -68,6 +113,17 @@
 #endif
 
 
+/* Receive errors counted by the driver since it was loaded */
+class otc_serial_icount
+{
+public :
+        unsigned int            overrun;        ///< bytes lost by the UART, its FIFO was full
+        unsigned int            bufOverrun;     ///< bytes lost by the tty layer, its buffer was full
+        unsigned int            frame;          ///< framing errors: often a wrong baud rate
+        unsigned int            parity;
+};
+
+
 class otc_serial
 {
 
@@ -77,16 +133,43 @@ public :
         bool                    sopen(char *szPort, int nBaud,OTC_FLOW_T mode,bool timeoutblock);
         void                    sclose(void);
         bool                    baudrate(int nBaud);
+        int                     actualBaudrate() {return m_nActualBaud;}
+        static bool             validBaudrate(int nBaud);
         bool                    flowmode(OTC_FLOW_T mode);
         int                     sread(void *buffer, unsigned int len);
         int                     swrite(const char *buffer, unsigned int len);
+        int                     swritev(const struct iovec* iov, int iovcnt);
+        bool                    waitWritable(int timeout);
         void                    flush(void);
+        bool                    drain(void);
+        bool                    wait(int timeout);
+        bool                    icount(otc_serial_icount& c);
+        void                    setProfile(otc_serial_profile_t profile);
+        otc_serial_profile_t    profile()       {return m_profile;}
+        int                     lowLatency()    {return m_lowLatency;}
+        int                     batch()         {return m_batch;}
+        unsigned int            reads()         {return m_reads;}
+        qint64                  readBytes()     {return m_readBytes;}
+        unsigned int            writes()        {return m_writes;}
+        qint64                  writeBytes()    {return m_writeBytes;}
         void                    dbgbreak(void);
         bool                    hasComOpened() {return m_bOpened;}
+        bool                    lost() {return m_bLost;}
 
 protected :
         bool                    m_bOpened;
+        bool                    m_bLost;    ///< hung up, the device is gone
         int	                    m_nBaud;
+        int                     m_nActualBaud;  ///< rate made by the driver
+        otc_serial_profile_t    m_profile;
+        int                     m_lowLatency;   ///< ASYNC_LOW_LATENCY read back, -1 if not supported
+        int                     m_batch;        ///< bytes waited for by the throughput profile
+        unsigned int            m_reads;
+        qint64                  m_readBytes;
+        unsigned int            m_writes;       ///< system calls
+        qint64                  m_writeBytes;
+
+        void                    applyProfile(void);
 
 #ifndef WIN32
 
@@ -117,14 +200,27 @@ protected :
 class otcCommunicationLinkDevice
 {
     public :
-        otcCommunicationLinkDevice(){};
+        otcCommunicationLinkDevice() {m_scheduler = NULL; m_lost = FALSE; m_lastByte = 0;};
         bool isOpen();
+        bool takeLost();
         void flush();
+        bool drain();
+        bool waitData(int timeout);
+        bool waitWritable(int timeout);
+        bool icount(otc_serial_icount& c);
+        unsigned int writes() {return m_serialContext.writes();}
+        void setProfile(otc_serial_profile_t profile);
+        QString getStatus();
         void dbgBreak();
         bool changeBaudRate(int nBaud);
+        int  actualBaudRate();
         bool changeFlowMode(OTC_FLOW_T mode);
-        int  readBlock (unsigned char *buffer, unsigned int len);
+        int  readBlock (unsigned char *buffer, unsigned int len, otcReadStamp* stamp = NULL);
         int  writeBlock(const char *buffer, unsigned int len);
+        int  writeBlockUnprotected(const char *buffer, unsigned int len);
+        int  writeVectorUnprotected(const struct iovec* iov, int iovcnt);
+        int  queueBlock(int source, otc_write_prio_t prio, const char *buffer, unsigned int len, int ackseq = -1);
+        void setScheduler(otcWriteScheduler* scheduler) {m_scheduler = scheduler;}
         bool socketOpen(int port);
         bool serialOpen(char *szPort, int nBaud, OTC_FLOW_T mode, bool timeoutblock);
         void close();
@@ -136,17 +232,39 @@ class otcCommunicationLinkDevice
         Q3SocketDevice          m_socketServer;
         Q3SocketDevice          m_socketContext;
         QMutex                  m_deviceMutex;
+        otcWriteScheduler*      m_scheduler;
+        bool                    m_lost;
+        QByteArray              m_escaped;  ///< XON/XOFF escaped bytes of a write
+        qint64                  m_lastByte; ///< ns, arrival of the last byte read
     private :
-        int  writeBlockXonXoff(unsigned char* buffer,unsigned int len);
+        int  writeVectorXonXoff(const struct iovec* iov, int iovcnt);
+        void checkLost();
+        void stampRead(int len, otcReadStamp& stamp);
 
 };
 
+#ifdef OTC_SERIAL_BENCH
+int     otc_serial_bench(void);
+#endif
+
 void dop();
 void dcl();
 bool dIsOpen();
+QString dStatus();
 
 class otcHostServer;
 
+/* Ring of the bytes read from the device. The reads are cut to the free
+   space of the ring: when it is full, the bytes wait in the driver, which
+   drops them once its own buffer is full. The ring may grow up to its cap
+   when a read fills it. The bytes dropped by the driver (TIOCGICOUNT) are
+   checked every OTC_RING_ICOUNT_PERIOD, each loss is logged with the state
+   of the ring. */
+#define OTC_RING_SIZE               (4*0x10000)     // default size (bytes)
+#define OTC_RING_SIZE_MIN           0x1000
+#define OTC_RING_SIZE_MAX           (64*0x100000)   // largest cap (bytes)
+#define OTC_RING_ICOUNT_PERIOD      100             // ms
+
 class otcDataParser
 {
 protected :
@@ -158,12 +276,33 @@ protected :
 	otc_mpipe_parser    m_ndef;
 	int                 C_feed;
 	int                 C_untreated;
+	otcTracer*          m_tracer;
+	qint64*             m_stamps;       ///< ns, arrival of each byte of the ring
+	unsigned int        m_deliveries;   ///< chunks of data sent to a client
+	unsigned int        m_sendCalls;
+
+	// Ring accounting
+	unsigned int        m_max;          ///< size the ring may grow to
+	int                 m_highWater;    ///< most bytes waiting in the ring
+	unsigned int        m_grown;
+	unsigned int        m_full;         ///< reads cut by the full ring, at its cap
+	bool                m_fullSince;    ///< full since the last check of the driver
+	QElapsedTimer       m_icountClock;
+	bool                m_icountOk;     ///< the driver counts its errors
+	otc_serial_icount   m_icount;       ///< last counters of the driver
+	unsigned int        m_overflows;    ///< checks which found bytes lost
+	qint64              m_lost;         ///< bytes lost by the driver
 	
 	int                 wrap(int i);
 	unsigned char       at(int i);
 	bool                isInValidRange(int i);
 	int                 uneatenBytesFrom(int i);
+	int                 freeSpace();
+	bool                resize(unsigned int size);
+	void                checkDriver(otcCommunicationLinkDevice& device);
+	int                 feed(otcCommunicationLinkDevice& device, int avail);
 	int                 eatAsMuchAsPossibleFromSerial(otcCommunicationLinkDevice& device);
+    void                packets(int tosend, bool stamped, QByteArray& headers, QVector<struct iovec>& v);
     void                treatSendData(otcHostServer& hostserver);
 
 public :
@@ -177,6 +316,12 @@ public :
     void                lock();
     void                unlock();
     QString             getStatus();
+    QString             getRingStatus();
+    bool                setCapacity(unsigned int size, unsigned int max);
+    void                addListener(otc_mpipe_listener* l);
+    void                removeListener(otc_mpipe_listener* l);
+    void                setFrameStore(otcFrameStore* s);
+    void                setTracer(otcTracer* t);
 
 };
 
@@ -27,11 +27,26 @@
 #include <qevent.h>
 #include <qmutex.h>
 #include <qstring.h>
+#include <qvector.h>
+#include <qtextdocument.h>
+#include <string.h>
 #include "otc_socket.h"
 #include "otc_main.h"
 #include "otc_serial.h"
 #include "otc_window.h"
 #include "otc_mpipe.h"
+#include "otc_hex.h"
+
+#ifndef WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+// No SIGPIPE on a client gone, the error is returned
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL    0
+#endif
+#endif
 
 // ---------------------------------------- //
 //                                          //
@@ -44,6 +59,9 @@ otcHostClient::otcHostClient(otcHostServer* parentServer,int socket,int clientid
 {
     m_parentServer = parentServer;
 	m_netID = clientid;
+	m_sendCalls = 0;
+	m_stamps = false;
+	m_dropping = false;
 
 	setSocket(socket,Q3SocketDevice::Stream);
 	setBlocking(false);
@@ -59,6 +77,10 @@ void otcHostClient::closeConnection()
  	close();
     m_isUp = false;
 
+    m_rbMutex.lock();
+    m_pending.clear();
+    m_rbMutex.unlock();
+
 	otcDyingSocketEvent* e = new otcDyingSocketEvent(m_netID);
 	QApplication::postEvent(m_parentServer,e);
 }
@@ -101,6 +123,16 @@ qint64 otcHostClient::readBlock ( char * data, Q_ULONG maxlen )
 
 Q_LONG otcHostClient::writeBlock ( const char * data, Q_ULONG len )
 {
+#ifndef WIN32
+
+    // After the bytes waiting for the socket, if any
+    struct iovec v;
+    v.iov_base = (void*)data;
+    v.iov_len  = len;
+    return writeBlockv(&v, 1);
+
+#else // WIN32
+
     Q_LONG res;
     m_rbMutex.lock();
     res = Q3SocketDevice::writeBlock(data,len);
@@ -113,6 +145,176 @@ Q_LONG otcHostClient::writeBlock ( const char * data, Q_ULONG len )
     }
     m_rbMutex.unlock();
 
+    return res;
+
+#endif // WIN32
+}
+
+void otcHostClient::writeFailed(Q_LONG sent, int err)
+{
+    otcConfig::logText("URGH! Write failed on client socket... maybe it's full or the client is going down.");
+    otcConfig::logText(QString("Sent %1 bytes, error code is : %2").arg(sent).arg(err));
+}
+
+#ifndef WIN32
+
+// Sends the bytes left by the previous writes, as much as the socket takes.
+// Must be called with m_rbMutex held. FALSE on an error of the socket.
+bool otcHostClient::sendPending()
+{
+    while (!m_pending.isEmpty())
+    {
+        ssize_t ret = send(socket(), m_pending.constData(), m_pending.size(), MSG_NOSIGNAL);
+        m_sendCalls++;
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return true;
+
+            writeFailed(0, errno);
+            m_pending.clear();
+            return false;
+        }
+
+        m_pending.remove(0, ret);
+    }
+
+    m_dropping = false;
+    return true;
+}
+
+#endif // WIN32
+
+/** @brief  Sends the bytes waiting for the socket, when it takes them again
+  *
+  * Called by the client reader thread, the writes do not wait for the socket.
+  */
+void otcHostClient::flushPending()
+{
+#ifndef WIN32
+    m_rbMutex.lock();
+    if (!m_pending.isEmpty())
+        sendPending();
+    m_rbMutex.unlock();
+#endif // WIN32
+}
+
+// Gather write of iovcnt buffers with sendmsg(), OTC_IOV_MAX at a time. The
+// socket is never waited for: the bytes it does not take are kept, up to
+// OTC_SOCKET_PENDING_MAX, and sent before the next ones (flushPending()).
+// When they do not fit, the whole write is dropped, so that a client never
+// gets part of a packet.
+// Returns the bytes sent or kept, 0 if dropped, -1 on an error before any
+// byte went.
+Q_LONG otcHostClient::writeBlockv ( const struct iovec * iov, int iovcnt )
+{
+    Q_LONG res = 0;
+
+    m_rbMutex.lock();
+
+#ifndef WIN32
+
+    struct iovec    v[OTC_IOV_MAX];
+    int             n     = 0;  // buffers of v left to send
+    int             next  = 0;  // next buffer of iov
+    Q_LONG          total = 0;
+
+    for (int i=0; i<iovcnt; i++)
+        total += iov[i].iov_len;
+
+    if (!m_pending.isEmpty() && !sendPending())
+    {
+        m_rbMutex.unlock();
+        return -1;
+    }
+
+    // The client is behind: after its bytes, or not at all
+    if (!m_pending.isEmpty())
+    {
+        if (m_pending.size() + total > OTC_SOCKET_PENDING_MAX)
+        {
+            if (!m_dropping)
+                otcConfig::logText(QString("<font color=red>**Client %1 does not read fast enough, packets to it are dropped</font>")
+                                        .arg(m_netID));
+            m_dropping = true;
+            total = 0;
+        }
+        else
+        {
+            for (int i=0; i<iovcnt; i++)
+                m_pending.append((const char*)iov[i].iov_base, iov[i].iov_len);
+        }
+
+        m_rbMutex.unlock();
+        return total;
+    }
+
+    for (;;)
+    {
+        while ((n < OTC_IOV_MAX) && (next < iovcnt))
+        {
+            if (iov[next].iov_len)
+                v[n++] = iov[next];
+            next++;
+        }
+
+        if (n == 0)
+            break;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = v;
+        msg.msg_iovlen = n;
+
+        ssize_t ret = sendmsg(socket(), &msg, MSG_NOSIGNAL);
+        m_sendCalls++;
+
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+
+            writeFailed(res, errno);
+            m_rbMutex.unlock();
+            return (res == 0) ? -1 : res;
+        }
+
+        res += ret;
+        n = otcIovecSkip(v, n, ret);
+    }
+
+    // Kept from the byte where the send stopped
+    for (int i=0; i<n; i++)
+        m_pending.append((const char*)v[i].iov_base, v[i].iov_len);
+    for (int i=next; i<iovcnt; i++)
+        m_pending.append((const char*)iov[i].iov_base, iov[i].iov_len);
+
+    m_rbMutex.unlock();
+
+    res = total;
+
+#else // WIN32
+
+    m_rbMutex.unlock();
+
+    for (int i=0; i<iovcnt; i++)
+    {
+        Q_LONG ret = writeBlock((const char*)iov[i].iov_base, iov[i].iov_len);
+        m_sendCalls++;
+
+        if (ret > 0)
+            res += ret;
+        if (ret < (Q_LONG)iov[i].iov_len)
+            break;
+    }
+
+#endif // WIN32
+
     return res;
 }
 
@@ -193,6 +395,8 @@ void otcHostServer::destroyClient(int clientId)
             delete c->client;
             delete c;
 
+            otcConfig::mainWindow->writeScheduler()->removeSource(clientId);
+
             break;
         }
 
@@ -215,6 +419,7 @@ int otcHostServer::readClients()
         while(c)
         {
             total += c->client->readData();
+            c->client->flushPending();
             c = c->next;
         }
 	}
@@ -248,6 +453,18 @@ void otcHostServer::unlock()
     m_mutex.unlock();
 };
 
+// Sends a packet to every client
+void otcHostServer::broadcast(const char* packet, int len)
+{
+    lock();
+    for (otcHostClientLink* c = m_clients; c; c = c->next)
+    {
+        if (c->client)
+            c->client->writeBlock(packet, len);
+    }
+    unlock();
+}
+
 
 // ---------------------------------------- //
 //                                          //
@@ -354,6 +571,10 @@ int otcSocketParser::headerStatusAtPosition(int i)
 		case OTC_PROTOCOL_KILL_OTCOM :
 		case OTC_PROTOCOL_RECONNECT_COM_PORT :
 		case OTC_PROTOCOL_SEND_AS_IS :
+		case OTC_PROTOCOL_COMMAND :
+		case OTC_PROTOCOL_FIND :
+		case OTC_PROTOCOL_STAMPS :
+		case OTC_PROTOCOL_AUTOBAUD :
 			return HEADER_OK;
 		default :
 			return HEADER_BAD;
@@ -447,7 +668,11 @@ int otcSocketParser::treatChangeBaudrateCommandPacket(otcHostClient&)
 		|(at(C_untreated+6)<<16)
 		|(at(C_untreated+7)<<24);
 
-	if(baudrateReq!=otcConfig::argBaudRate)
+	if(!otc_serial::validBaudrate(baudrateReq))
+	{
+        otcConfig::logText(QString("<font color=red>**Invalid baudrate %1 requested</font>").arg(baudrateReq));
+	}
+	else if(baudrateReq!=otcConfig::argBaudRate)
 	{
         QApplication::postEvent(otcConfig::mainWindow,new otcBaudrateChangeEvent(baudrateReq));
 	}
@@ -513,17 +738,16 @@ int otcSocketParser::treatSendAsIsPacket(otcHostClient& client,otcCommunicationL
     for(int i=0;i<packetlen;i++)
         m_packet[i] = at(C_untreated+4+i);
 
-    device.writeBlock((char*)m_packet,packetlen);
+    // A SEND_AS_IS packet is one frame for the scheduler: it is never split
+    device.queueBlock(client.getNetID(),
+                      (packetlen > OTC_WRITE_BULK_THRESHOLD) ? OTC_WRITE_PRIO_BULK : OTC_WRITE_PRIO_CONTROL,
+                      (char*)m_packet,packetlen);
 
 	if (OTC_PRINT_MODE_RAW == otcConfig::argPrintMode)
 	{
         otcConfig::logText(QString("(BPS) CID : %1, SIZE: %2").arg(client.getNetID()).arg(packetlen));
 		QString msg="<font color=blue>";
-        for(int cc=0;cc<packetlen;cc++)
-        {
-            if(cc%16==0 && cc!=0) msg+="\n";
-            msg+=QString("%1 ").arg(QString("%1").arg(m_packet[cc],2,16).upper().replace(' ','0'));
-        }
+        otcHexAppend(msg, m_packet, packetlen, OTC_HEX_BREAK_16);
         msg+="</font>";
         otcConfig::logText(msg);
 	}
@@ -535,6 +759,108 @@ int otcSocketParser::treatSendAsIsPacket(otcHostClient& client,otcCommunicationL
     return packetlen+4;
 }
 
+// The data is a prompt command line, run by the GUI thread as if typed
+int otcSocketParser::treatCommandPacket(otcHostClient&)
+{
+    int packetlen = 256 * at(C_untreated+1) + at(C_untreated+2);
+    QByteArray cmd(packetlen, 0);
+
+    for(int i=0;i<packetlen;i++)
+        cmd[i] = at(C_untreated+4+i);
+
+    QString line = QString::fromLatin1(cmd).trimmed();
+
+    if(!otc_command_parser::remoteAllowed(line))
+    {
+        otcConfig::logText("<font color=red>**Command refused from a socket client: "+Qt::escape(line)+"</font>");
+        return packetlen+4;
+    }
+
+    QApplication::postEvent(otcConfig::mainWindow,new otcCommandEvent(line));
+
+    return packetlen+4;
+}
+
+// The data is 1 to get the raw data with the time of its bytes, 0 to stop
+int otcSocketParser::treatStampsPacket(otcHostClient& client)
+{
+    int packetlen = 256 * at(C_untreated+1) + at(C_untreated+2);
+
+    if(packetlen>0)
+        client.setStamps(at(C_untreated+4) != 0);
+
+    return packetlen+4;
+}
+
+// The result is sent to every client once the detection is done
+int otcSocketParser::treatAutobaudPacket(otcHostClient&)
+{
+    int packetlen = 256 * at(C_untreated+1) + at(C_untreated+2);
+
+    otcConfig::mainWindow->startAutobaud();
+
+    return packetlen+4;
+}
+
+// The data is a search of the frame store, as the arguments of :FIND. Every
+// frame found is sent back in a FIND_RESULT packet, oldest first, then an
+// empty FIND_RESULT ends the answer (it is the only one on a syntax error).
+int otcSocketParser::treatFindPacket(otcHostClient& client)
+{
+    int             packetlen = 256 * at(C_untreated+1) + at(C_untreated+2);
+    QByteArray      args(packetlen, 0);
+    otcFrameQuery   query;
+    QList<otcFrame> result;
+    QList<QByteArray> packets;
+    int             visited;
+    unsigned char   end[4] = {OTC_PROTOCOL_SYNC, 0x00, 0x00, OTC_PROTOCOL_FIND_RESULT};
+
+    for(int i=0;i<packetlen;i++)
+        args[i] = at(C_untreated+4+i);
+
+    if (query.parse(QString::fromLatin1(args)))
+        otcConfig::mainWindow->frameStore()->find(query, result, visited);
+
+    for (int i=0; i<result.count(); i++)
+    {
+        const otcFrame& f       = result[i];
+        int             len     = qMin(f.data.size(), 0xFFFF - OTC_PROTOCOL_FIND_HEADER);
+        int             size    = OTC_PROTOCOL_FIND_HEADER + len;
+        QByteArray      packet(4 + size, 0);
+
+        packet[0]   = OTC_PROTOCOL_SYNC;
+        packet[1]   = (char)(size >> 8);
+        packet[2]   = (char)size;
+        packet[3]   = OTC_PROTOCOL_FIND_RESULT;
+        for (int b=0; b<4; b++)
+            packet[4 + b] = (char)(f.number >> (24 - 8 * b));
+        for (int b=0; b<8; b++)
+            packet[8 + b] = (char)(f.time >> (56 - 8 * b));
+        packet[16]  = f.seq;
+        packet[17]  = f.id;
+        packet[18]  = f.cmd;
+        packet[19]  = f.crcok ? 1 : 0;
+        memcpy(packet.data() + 4 + OTC_PROTOCOL_FIND_HEADER, f.data.constData(), len);
+
+        packets.append(packet);
+    }
+
+    // All the packets in as few sends as possible
+    QVector<struct iovec> v(packets.count() + 1);
+
+    for (int i=0; i<packets.count(); i++)
+    {
+        v[i].iov_base = (void*)packets[i].constData();
+        v[i].iov_len  = packets[i].size();
+    }
+    v[packets.count()].iov_base = end;
+    v[packets.count()].iov_len  = 4;
+
+    client.writeBlockv(v.constData(), v.count());
+
+    return packetlen+4;
+}
+
 int otcSocketParser::readDataFromClient(otcHostClient& inputClient)
 {
     lock();
@@ -577,6 +903,18 @@ void otcSocketParser::dataTreatmentLoop(otcHostClient& client,otcCommunicationLi
 					case OTC_PROTOCOL_SEND_AS_IS :
 						plen = treatSendAsIsPacket(client,device);
 						break;
+					case OTC_PROTOCOL_COMMAND :
+						plen = treatCommandPacket(client);
+						break;
+					case OTC_PROTOCOL_FIND :
+						plen = treatFindPacket(client);
+						break;
+					case OTC_PROTOCOL_STAMPS :
+						plen = treatStampsPacket(client);
+						break;
+					case OTC_PROTOCOL_AUTOBAUD :
+						plen = treatAutobaudPacket(client);
+						break;
 					default:
 						plen = 1;
 						break;
@@ -32,11 +32,13 @@
 #include <qmutex.h>
 #include <q3intdict.h>
 #include <qglobal.h>
+#include <qbytearray.h>
 #include <q3socketdevice.h>
 #include <q3serversocket.h>
 #include <q3valuelist.h>
 
 #include "otc_socket.h"
+#include "otc_main.h"
 
 // OTCOM Socket Protocol is a simple 4 byte header. For data transit on the
 // serial it is appended to the raw data. Its purpose is to allow controlling 
@@ -61,8 +63,33 @@
 #define OTC_PROTOCOL_STATUS                              0xB3
 #define OTC_PROTOCOL_SEND_AS_IS                          0xB5
 #define OTC_PROTOCOL_RAW_DATA                            0xB6
+#define OTC_PROTOCOL_COMMAND                             0xB7
+#define OTC_PROTOCOL_FIND                                0xB8
+#define OTC_PROTOCOL_STAMPS                              0xB9
+#define OTC_PROTOCOL_AUTOBAUD                            0xBA
 #define OTC_PROTOCOL_SYNC                                0xBB
 #define OTC_PROTOCOL_STATUS_RESULT                       0x02
+#define OTC_PROTOCOL_FIND_RESULT                         0x03
+#define OTC_PROTOCOL_RAW_DATA_STAMPED                    0x04
+#define OTC_PROTOCOL_AUTOBAUD_RESULT                     0x05
+
+/// Bytes kept for a client socket which is full, sent when it takes bytes
+/// again. The packets which do not fit are dropped whole.
+#define OTC_SOCKET_PENDING_MAX                           0x100000
+
+/// OTC_PROTOCOL_RAW_DATA_STAMPED payload before the bytes: time of the first
+/// byte (u64, ns since 1970), ns from one byte to the next (u32). Sent
+/// instead of OTC_PROTOCOL_RAW_DATA to the clients which asked for it with
+/// OTC_PROTOCOL_STAMPS (payload 1: on, 0: off).
+#define OTC_PROTOCOL_STAMP_HEADER                        12
+
+/// OTC_PROTOCOL_AUTOBAUD starts a detection of the baud rate of the device.
+/// Every client gets its OTC_PROTOCOL_AUTOBAUD_RESULT: the rate found (u32,
+/// same byte order as OTC_PROTOCOL_BAUDRATE_CHANGE_REQUEST), 0 if none.
+
+/// OTC_PROTOCOL_FIND_RESULT payload before the ALP body of the frame:
+/// frame number (u32), time in ms since 1970 (u64), seq, id, cmd, CRC ok (u8)
+#define OTC_PROTOCOL_FIND_HEADER                         16
 
 
 class otcHostServer;
@@ -97,6 +124,10 @@ protected :
     int             treatKillOtcomPacket(otcHostClient& client);
     int             treatSendAsIsPacket(otcHostClient& client,otcCommunicationLinkDevice& device);
     int             treatStatusPacket(otcHostClient& client);
+    int             treatCommandPacket(otcHostClient& client);
+    int             treatFindPacket(otcHostClient& client);
+    int             treatStampsPacket(otcHostClient& client);
+    int             treatAutobaudPacket(otcHostClient& client);
 
 public :
 
@@ -125,13 +156,25 @@ public :
     int               getNetID() {return m_netID;}
     qint64            readBlock ( char * data, Q_ULONG maxlen );
     Q_LONG            writeBlock ( const char * data, Q_ULONG len );
+    Q_LONG            writeBlockv ( const struct iovec * iov, int iovcnt );
+    void              flushPending();
+    unsigned int      sendCalls() {return m_sendCalls;}
+    bool              stamps() {return m_stamps;}
+    void              setStamps(bool on) {m_stamps = on;}
 
 protected :
 	int m_netID;
+	unsigned int      m_sendCalls;
+	volatile bool     m_stamps;     ///< raw data sent with the time of the bytes
 	otcSocketParser	  m_parser;
     otcHostServer*    m_parentServer;
 	bool              m_isUp;
 	QMutex            m_rbMutex;
+    QByteArray        m_pending;    ///< bytes the socket did not take yet
+    bool              m_dropping;   ///< packets dropped since m_pending was empty
+
+    bool              sendPending();
+    void              writeFailed(Q_LONG sent, int err);
 
 };
 
@@ -187,6 +230,7 @@ public:
 	int               readClients();
 	void              treatClients(otcCommunicationLinkDevice& device);
     otcHostClientList* getClientListUnprotected() {return m_clients;}
+    void              broadcast(const char* packet, int len);
     void              lock();
     void              unlock();
 
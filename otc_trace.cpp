@@ -0,0 +1,401 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_trace.cpp
+/// @brief          Command latency tracer
+//
+/// =========================================================================
+
+#include <qfile.h>
+#include <qtextstream.h>
+
+#include "otc_trace.h"
+#include "otc_mpipe.h"
+
+
+/// Bytes of an MPIPE frame up to the ALP cmd
+#define OTC_TRACE_FRAME_MIN                 (4 + OTC_MPIPE_HEADER_SIZE)
+
+
+static const char* stageName[OTC_TRACE_QTY] = {
+    "", "queue", "line", "device", "decode", "delivery"
+};
+
+
+// ---------------------------------------- //
+//                                          //
+//              HISTOGRAM                   //
+//                                          //
+// ---------------------------------------- //
+
+otcTraceHistogram::otcTraceHistogram()
+{
+    for (int i=0; i<OTC_TRACE_BUCKETS; i++)
+        bucket[i] = 0;
+    count   = 0;
+    sum     = 0;
+    max     = 0;
+}
+
+// Bucket of a time: the time itself below 4 us, then 4 buckets per power of 2
+static int bucketOf(qint64 us)
+{
+    int octave = 0;
+
+    if (us < 4)
+        return (us < 0) ? 0 : (int)us;
+    if (us > 0xFFFFFFFFLL)
+        return OTC_TRACE_BUCKETS - 1;
+
+    while ((us >> octave) >= 8)
+        octave++;
+
+    return 4 * (octave + 1) + (int)((us >> octave) & 3);
+}
+
+// Lowest time of a bucket
+static qint64 bucketBase(int b)
+{
+    if (b < 4)
+        return b;
+
+    return (qint64)(4 + (b & 3)) << ((b >> 2) - 1);
+}
+
+void otcTraceHistogram::add(qint64 us)
+{
+    bucket[bucketOf(us)]++;
+    count++;
+    sum += us;
+    if (us > max)
+        max = us;
+}
+
+/** @brief  Time under which p % of the round trips are, within a bucket
+  * @param  p       (int) percentile, 1 to 100
+  * @retval (qint64) us, the upper bound of the bucket
+  */
+qint64 otcTraceHistogram::percentile(int p)
+{
+    unsigned int rank = (unsigned int)(((qint64)count * p + 99) / 100);
+    unsigned int seen = 0;
+
+    for (int b=0; b<OTC_TRACE_BUCKETS; b++)
+    {
+        seen += bucket[b];
+        if ((seen >= rank) && (seen > 0))
+            return qMin(bucketBase(b + 1) - 1, max);
+    }
+
+    return max;
+}
+
+
+
+// ---------------------------------------- //
+//                                          //
+//              TRACER                      //
+//                                          //
+// ---------------------------------------- //
+
+otcTracer::otcTracer()
+{
+    m_enabled = FALSE;
+    clear();
+}
+
+void otcTracer::setEnabled(bool on)
+{
+    m_mutex.lock();
+    m_enabled = on;
+    for (int i=0; i<256; i++)
+        m_isOpen[i] = FALSE;
+    m_mutex.unlock();
+}
+
+/** @brief  Forgets all the traces and statistics
+  */
+void otcTracer::clear()
+{
+    m_mutex.lock();
+
+    for (int i=0; i<256; i++)
+        m_isOpen[i] = FALSE;
+    for (int i=0; i<OTC_TRACE_QTY; i++)
+    {
+        m_stageSum[i]   = 0;
+        m_stageCount[i] = 0;
+    }
+
+    m_types.clear();
+    m_top.clear();
+    m_kept.clear();
+    m_keptNext  = 0;
+    m_completed = 0;
+    m_reused    = 0;
+    m_timeouts  = 0;
+
+    m_mutex.unlock();
+}
+
+/** @brief  Stamps a frame queued for the device, from the write scheduler
+  * @param  source  (int) write source
+  * @param  frame   (const char*) MPIPE frame, anything else is not traced
+  * @param  len     (int) bytes of the frame
+  */
+void otcTracer::enqueued(int source, const char* frame, int len)
+{
+    const unsigned char*    f       = (const unsigned char*)frame;
+    qint64                  t       = now();
+    unsigned char           seq;
+
+    if ((len < OTC_TRACE_FRAME_MIN) || (f[0] != OTC_MPIPE_SYNC_BYTE_0) || (f[1] != OTC_MPIPE_SYNC_BYTE_1))
+        return;
+
+    seq = f[6];
+
+    m_mutex.lock();
+
+    expire(t);
+    if (m_isOpen[seq])
+        m_reused++;
+
+    otcTrace& trace = m_open[seq];
+    trace.source    = source;
+    trace.seq       = seq;
+    trace.id        = f[10];
+    trace.cmd       = f[11];
+    for (int i=0; i<OTC_TRACE_QTY; i++)
+        trace.stamp[i] = -1;
+    trace.stamp[OTC_TRACE_ENQUEUE] = t;
+    m_isOpen[seq]   = TRUE;
+
+    m_mutex.unlock();
+}
+
+// Open trace of a frame written, NULL if none. Must be called with m_mutex held.
+otcTrace* otcTracer::writing(const char* frame, int len)
+{
+    const unsigned char* f = (const unsigned char*)frame;
+
+    if ((len < OTC_TRACE_FRAME_MIN) || (f[0] != OTC_MPIPE_SYNC_BYTE_0) || (f[1] != OTC_MPIPE_SYNC_BYTE_1))
+        return NULL;
+
+    return m_isOpen[f[6]] ? &m_open[f[6]] : NULL;
+}
+
+/** @brief  Stamps a frame written to the device, from the writer thread
+  * @param  frame   (const char*) MPIPE frame
+  * @param  len     (int) bytes of the frame
+  * @param  write   (qint64) time the driver took the frame
+  */
+void otcTracer::written(const char* frame, int len, qint64 write)
+{
+    otcTrace* trace;
+
+    m_mutex.lock();
+    trace = writing(frame, len);
+    if ((trace != NULL) && (trace->stamp[OTC_TRACE_WRITE] < 0))
+        trace->stamp[OTC_TRACE_WRITE] = write;
+    m_mutex.unlock();
+}
+
+/** @brief  Stamps a frame sent on the line, from the writer thread
+  * @param  frame   (const char*) MPIPE frame
+  * @param  len     (int) bytes of the frame
+  * @param  drain   (qint64) time the output queue of the driver was empty
+  */
+void otcTracer::drained(const char* frame, int len, qint64 drain)
+{
+    otcTrace* trace;
+
+    m_mutex.lock();
+    trace = writing(frame, len);
+    if ((trace != NULL) && (trace->stamp[OTC_TRACE_WRITE] >= 0) && (trace->stamp[OTC_TRACE_DRAIN] < 0))
+        trace->stamp[OTC_TRACE_DRAIN] = drain;
+    m_mutex.unlock();
+}
+
+/** @brief  Stamps a valid record received, from the parser
+  * @param  seq         (unsigned char) MPIPE seq of the record
+  * @param  firstByte   (qint64) arrival of its first byte
+  * @param  decoded     (qint64) end of its parsing
+  * @param  delivered   (qint64) write of its last bytes to the clients, -1 if none
+  */
+void otcTracer::received(unsigned char seq, qint64 firstByte, qint64 decoded, qint64 delivered)
+{
+    m_mutex.lock();
+
+    // A response comes after the frame of the command is written
+    if (m_isOpen[seq] && (m_open[seq].stamp[OTC_TRACE_WRITE] >= 0))
+    {
+        otcTrace& trace = m_open[seq];
+
+        trace.stamp[OTC_TRACE_FIRST_BYTE]   = firstByte;
+        trace.stamp[OTC_TRACE_DECODED]      = decoded;
+        trace.stamp[OTC_TRACE_DELIVERED]    = delivered;
+        m_isOpen[seq] = FALSE;
+
+        complete(trace);
+    }
+
+    m_mutex.unlock();
+}
+
+// Commands without response in time are forgotten. Must be called with
+// m_mutex held.
+void otcTracer::expire(qint64 now)
+{
+    for (int i=0; i<256; i++)
+    {
+        if (m_isOpen[i] && (now - m_open[i].stamp[OTC_TRACE_ENQUEUE] > (qint64)OTC_TRACE_TIMEOUT * 1000))
+        {
+            m_isOpen[i] = FALSE;
+            m_timeouts++;
+        }
+    }
+}
+
+// Must be called with m_mutex held
+void otcTracer::complete(const otcTrace& t)
+{
+    qint64  total   = t.total();
+    int     i;
+
+    m_completed++;
+    m_types[(t.id << 8) | t.cmd].add(total);
+
+    // Stages, each from the stamp before it (delivery from the first byte)
+    for (int s=OTC_TRACE_WRITE; s<OTC_TRACE_QTY; s++)
+    {
+        int from = (s == OTC_TRACE_DELIVERED) ? OTC_TRACE_FIRST_BYTE : s - 1;
+
+        if ((t.stamp[s] >= 0) && (t.stamp[from] >= 0))
+        {
+            m_stageSum[s] += t.stamp[s] - t.stamp[from];
+            m_stageCount[s]++;
+        }
+    }
+
+    // Slowest first
+    for (i=0; (i < m_top.count()) && (m_top[i].total() >= total); i++)
+        ;
+    if (i < OTC_TRACE_TOP)
+    {
+        m_top.insert(i, t);
+        if (m_top.count() > OTC_TRACE_TOP)
+            m_top.removeLast();
+    }
+
+    if (m_kept.count() < OTC_TRACE_KEEP)
+        m_kept.append(t);
+    else
+        m_kept[m_keptNext] = t;
+    m_keptNext = (m_keptNext + 1) % OTC_TRACE_KEEP;
+}
+
+/** @brief  Writes the kept traces in a CSV file, oldest first
+  * @param  file    (const QString&) file name
+  * @retval (bool)  FALSE if the file cannot be written
+  */
+bool otcTracer::save(const QString& file)
+{
+    QFile f(file);
+
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return FALSE;
+
+    QTextStream out(&f);
+
+    out << "source,seq,id,cmd,enqueue_us,write_us,drain_us,first_byte_us,decoded_us,delivered_us,total_us\n";
+
+    m_mutex.lock();
+    int count = m_kept.count();
+    int first = (count < OTC_TRACE_KEEP) ? 0 : m_keptNext;
+
+    for (int i=0; i<count; i++)
+    {
+        const otcTrace& t = m_kept[(first + i) % OTC_TRACE_KEEP];
+
+        out << t.source << ',' << (int)t.seq << ',' << (int)t.id << ',' << (int)t.cmd;
+        for (int s=0; s<OTC_TRACE_QTY; s++)
+            out << ',' << t.stamp[s];
+        out << ',' << t.total() << '\n';
+    }
+    m_mutex.unlock();
+
+    return (out.status() == QTextStream::Ok);
+}
+
+QString otcTracer::getStatus()
+{
+    QString ret;
+
+    m_mutex.lock();
+
+    expire(now());
+
+    ret = QString("Latency tracer %1: %2 traces, %3 seq reused before the response, %4 without response.\n")
+                .arg(m_enabled ? "on" : "off").arg(m_completed).arg(m_reused).arg(m_timeouts);
+
+    ret += "  Stages (avg us):";
+    for (int s=OTC_TRACE_WRITE; s<OTC_TRACE_QTY; s++)
+    {
+        ret += QString(" %1 %2").arg(stageName[s])
+                    .arg(m_stageCount[s] ? (m_stageSum[s] / m_stageCount[s]) : 0);
+    }
+    ret += "\n";
+
+    ret += "  id cmd: count, round trip avg/p50/p99/max us\n";
+    for (QMap<int, otcTraceHistogram>::iterator it = m_types.begin(); it != m_types.end(); ++it)
+    {
+        otcTraceHistogram& h = it.value();
+
+        ret += QString("  %1 %2: %3, %4/%5/%6/%7\n")
+                    .arg(it.key() >> 8, 2, 16, QChar('0')).arg(it.key() & 0xFF, 2, 16, QChar('0'))
+                    .arg(h.count).arg(h.sum / h.count)
+                    .arg(h.percentile(50)).arg(h.percentile(99)).arg(h.max);
+    }
+
+    ret += "  Slowest (seq, id cmd, round trip us, stages):\n";
+    for (int i=0; i<m_top.count(); i++)
+    {
+        const otcTrace& t = m_top[i];
+        QString         stages;
+
+        for (int s=OTC_TRACE_WRITE; s<=OTC_TRACE_DECODED; s++)
+        {
+            if (s != OTC_TRACE_WRITE)
+                stages += "/";
+            if ((t.stamp[s] >= 0) && (t.stamp[s - 1] >= 0))
+                stages += QString::number(t.stamp[s] - t.stamp[s - 1]);
+            else
+                stages += "-";
+        }
+
+        ret += QString("  [ %1 ]  %2 %3: %4 (%5)\n")
+                    .arg(t.seq).arg(t.id, 2, 16, QChar('0')).arg(t.cmd, 2, 16, QChar('0'))
+                    .arg(t.total()).arg(stages);
+    }
+
+    m_mutex.unlock();
+
+    return ret;
+}
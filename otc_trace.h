@@ -0,0 +1,158 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otc_trace.h
+/// @brief          Command latency tracer
+///                 Round trip of the commands, from their queueing to their response
+//
+/// =========================================================================
+///
+/// A command is traced from the MPIPE frame handed to the write scheduler,
+/// and matched with its response on the MPIPE sequence number: the first
+/// valid record received with the seq of the command, as for the ACK window.
+/// Six times are stamped on a trace (us, monotonic clock of otc_clock.h):
+/// - enqueue:      frame queued in the write scheduler
+/// - write:        frame accepted by the serial driver
+/// - drain:        frame sent on the line (tcdrain)
+/// - first byte:   arrival of the first byte of the response (otc_clock.h)
+/// - decoded:      response parsed, its CRC checked
+/// - delivered:    bytes of the response written to the socket clients,
+///                 which get them before they are parsed (-1 without client)
+///
+/// Tracing is off by default: the writer thread waits for the drain of
+/// every frame while it is on. A response received before the drain
+/// returns leaves the drain of its trace unstamped.
+///
+/// The round trip (enqueue to decoded) of every completed trace goes in the
+/// histogram of its ALP id and cmd, and in the list of the slowest ones. The
+/// last traces are kept whole for an export in CSV. A command without
+/// response in OTC_TRACE_TIMEOUT, or whose seq is reused before its
+/// response, is counted and forgotten.
+///
+/// The histograms have 4 buckets per power of 2: a percentile is given
+/// within 25 %.
+///
+/// =========================================================================
+
+#ifndef __OTC_TRACE_H__
+#define __OTC_TRACE_H__
+
+#include <qstring.h>
+#include <qmutex.h>
+#include <qmap.h>
+#include <qlist.h>
+#include <qvector.h>
+
+#include "otc_clock.h"
+
+
+/// Buckets of a histogram: 4 per power of 2, up to 2^32 us
+#define OTC_TRACE_BUCKETS                   128
+
+/// Slowest traces listed
+#define OTC_TRACE_TOP                       10
+
+/// Traces kept for the export
+#define OTC_TRACE_KEEP                      65536
+
+/// Time after which a command has no response (ms)
+#define OTC_TRACE_TIMEOUT                   10000
+
+
+/// Stamps of a trace
+typedef enum {
+    OTC_TRACE_ENQUEUE = 0,
+    OTC_TRACE_WRITE,
+    OTC_TRACE_DRAIN,
+    OTC_TRACE_FIRST_BYTE,
+    OTC_TRACE_DECODED,
+    OTC_TRACE_DELIVERED,
+    OTC_TRACE_QTY
+} otc_trace_stamp_t;
+
+
+class otcTrace
+{
+public :
+    int                     source;
+    unsigned char           seq;
+    unsigned char           id;
+    unsigned char           cmd;
+    qint64                  stamp[OTC_TRACE_QTY];   ///< us, -1 if not stamped
+
+    qint64                  total() const   {return stamp[OTC_TRACE_DECODED] - stamp[OTC_TRACE_ENQUEUE];}
+};
+
+/// Round trips of one ALP id and cmd
+class otcTraceHistogram
+{
+public :
+    otcTraceHistogram();
+
+    unsigned int            bucket[OTC_TRACE_BUCKETS];
+    unsigned int            count;
+    qint64                  sum;
+    qint64                  max;
+
+    void                    add(qint64 us);
+    qint64                  percentile(int p);
+};
+
+
+class otcTracer
+{
+public :
+    otcTracer();
+
+    qint64                  now()           {return otcClockNow() / 1000;}
+    bool                    enabled()       {return m_enabled;}
+    void                    setEnabled(bool on);
+
+    void                    enqueued(int source, const char* frame, int len);
+    void                    written(const char* frame, int len, qint64 write);
+    void                    drained(const char* frame, int len, qint64 drain);
+    void                    received(unsigned char seq, qint64 firstByte, qint64 decoded, qint64 delivered);
+
+    void                    clear();
+    bool                    save(const QString& file);
+    QString                 getStatus();
+
+private :
+    QMutex                  m_mutex;
+    volatile bool           m_enabled;
+    otcTrace                m_open[256];    ///< commands waiting for a response, by seq
+    bool                    m_isOpen[256];
+    QMap<int, otcTraceHistogram> m_types;   ///< by (id << 8) | cmd
+    QList<otcTrace>         m_top;          ///< slowest first
+    QVector<otcTrace>       m_kept;         ///< ring of the last traces
+    int                     m_keptNext;
+    qint64                  m_stageSum[OTC_TRACE_QTY];
+    unsigned int            m_stageCount[OTC_TRACE_QTY];
+    unsigned int            m_completed;
+    unsigned int            m_reused;
+    unsigned int            m_timeouts;
+
+    otcTrace*               writing(const char* frame, int len);
+    void                    expire(qint64 now);
+    void                    complete(const otcTrace& t);
+};
+
+
+#endif // __OTC_TRACE_H__
@@ -41,6 +41,8 @@
 #include <qshortcut.h>
 #include <qpainter.h>
 #include <qstatusbar.h>
+#include <qfile.h>
+#include <qtextdocument.h>
 
 
 #ifndef WIN32
@@ -57,7 +59,7 @@ int GetTickCount(void);
 
 
 otcMainWindow::otcMainWindow(QWidget* parent)
-:QMainWindow(parent)
+:QMainWindow(parent), m_scheduler(&m_device)
 {
 	m_hostServer     = NULL;
 	m_deviceblinker  = new otcBlinker(this);
@@ -88,12 +90,17 @@ otcMainWindow::otcMainWindow(QWidget* parent)
 	QLabel*	labelBaudRate = new QLabel("Baudrate",combox);
 	labelBaudRate->setAlignment(Qt::AlignVCenter | Qt::AlignRight);
 	m_baudRateComboBox = new QComboBox(combox);
-	m_baudRateComboBox->setEditable(FALSE);
+	m_baudRateComboBox->setEditable(TRUE);    // other rates are typed, and added to the list
 	m_baudRateComboBox->insertItem("9600");
 	m_baudRateComboBox->insertItem("57600");
 	m_baudRateComboBox->insertItem("115200");
 	m_baudRateComboBox->insertItem("460800");
 	m_baudRateComboBox->insertItem("921600");
+	m_baudRateComboBox->insertItem("1000000");
+	m_baudRateComboBox->insertItem("1500000");
+	m_baudRateComboBox->insertItem("2000000");
+	m_baudRateComboBox->insertItem("3000000");
+	m_baudRateComboBox->insertItem("auto");
 	m_baudRateComboBox->setCurrentText(QString("%1").arg(otcConfig::argBaudRate));
 
 	// Flow mode menu
@@ -136,7 +143,6 @@ otcMainWindow::otcMainWindow(QWidget* parent)
 	// Set parameters for the logbox
 	setCentralWidget(vbox);
 	m_logWidget->setFocusPolicy(Qt::NoFocus);
-	m_logWidget->setTextFormat( Qt::LogText );
 	m_logWidget->setFont(QFont("Courier New"));
 	m_logWidget->scrollToBottom();
 	
@@ -168,13 +174,63 @@ otcMainWindow::otcMainWindow(QWidget* parent)
 	m_clientsDataTreatmentThread = new otcClientsDataTreatmentThread(this);
 	m_clientsDataTreatmentThread->start();
 
+	// every write to the device goes through the scheduler from now on,
+	// and records from the device acknowledge flow controlled frames
+	m_device.setScheduler(&m_scheduler);
+	m_parser.addListener(&m_scheduler);
+	m_parser.setFrameStore(&m_frames);
+	m_logWidget->setStore(&m_frames);
+	m_scheduler.setTracer(&m_tracer);
+	m_parser.setTracer(&m_tracer);
+	m_writerThread = new otcDeviceWriterThread(this);
+	m_writerThread->start();
+	m_scriptRunner = NULL;
+	m_bulkReader = NULL;
+	m_jobs = new otcJobScheduler(&m_device);
+	m_jobs->start();
+	m_hotplug = new otcHotplugMonitor(this);
+	m_hotplug->start();
+
 	reconnectDevice();
+
+	if (otcConfig::argAutobaud)
+	    startAutobaud();
 }
 
 
 // Destructor
 otcMainWindow::~otcMainWindow()
 {
+    if (m_scriptRunner)
+    {
+        m_scriptRunner->stopRunning();
+        m_scriptRunner->wait(1000);
+        m_parser.removeListener(m_scriptRunner);
+        delete m_scriptRunner;
+    }
+
+    if (m_bulkReader)
+    {
+        m_bulkReader->stopRunning();
+        m_bulkReader->wait(1000);
+        m_parser.removeListener(m_bulkReader);
+        delete m_bulkReader;
+    }
+
+    m_jobs->stopRunning();
+    m_jobs->wait(1000);
+    delete m_jobs;
+
+    m_hotplug->stopRunning();
+    m_hotplug->wait(1000);
+    delete m_hotplug;
+
+    m_writerThread->stopRunning();
+    m_scheduler.wakeUp();
+    m_writerThread->wait(1000);
+    delete m_writerThread;
+    m_device.setScheduler(NULL);
+
     m_dataTreatmentThread->stopRunning();
     m_dataTreatmentThread->wait(1000);
     delete m_dataTreatmentThread;
@@ -328,10 +384,29 @@ void otcMainWindow::treatDeviceDataStep()
         return;
     }
 
+    // The samples of a baud rate detection do not reach the parser, and the
+    // frames wait for the rate of the device
+    if (m_autobaud.running())
+    {
+        m_scheduler.setPaused(TRUE);
+        if (m_autobaud.step(m_device))
+        {
+            m_scheduler.setPaused(FALSE);
+            autobaudDone();
+        }
+        else if (!m_device.waitData(OTC_SERIAL_POLL))
+            Sleep(1);
+        return;
+    }
+
     if (m_parser.readDataFromDevice(m_device) <= 0 )
     {
-	    // sleep to calm down OTCOM
-        Sleep(1);
+        if (m_device.takeLost())
+            QApplication::postEvent(this, new otcHotplugEvent(TRUE));
+
+        // wait for the next bytes, or sleep to calm down OTCOM
+        if (!m_device.waitData(OTC_SERIAL_POLL))
+            Sleep(1);
 	}
 
     m_parser.dataTreatmentLoop(*m_hostServer);
@@ -440,6 +515,40 @@ void otcMainWindow::treatClientsDataStep()
     Sleep(1);
 }
 
+// -----------
+// Device Write
+// -----------
+
+otcDeviceWriterThread::otcDeviceWriterThread(otcMainWindow* mw)
+{
+    m_mainWindow = mw;
+    m_running = FALSE;
+}
+
+otcDeviceWriterThread::~otcDeviceWriterThread() {};
+
+void otcDeviceWriterThread::stopRunning()
+{
+	m_running = FALSE;
+}
+
+void otcDeviceWriterThread::run()
+{
+	m_running = TRUE;
+
+	while(m_running)
+	{
+	    m_mainWindow->writeDeviceDataStep();
+	}
+}
+
+void otcMainWindow::writeDeviceDataStep()
+{
+    // Blocks until a frame is queued (or the idle timeout expires), paused
+    // during a baud rate detection
+    m_scheduler.writeStep(OTC_WRITE_IDLE_WAIT);
+}
+
 // ---------------------------------------- //
 //                                          //
 //           ACTIONS                        //
@@ -483,38 +592,78 @@ bool otcMainWindow::reconnectDevice()
 	closeDevice();
 	bool success = connectToDevice();
 
+    if (success)
+        m_hotplug->reconnected();
+
     m_reconnectionTimer->start(1000);
 	return success;
 }
 
+// Fallback of the hotplug monitor: retry a lost link every second
 void otcMainWindow::reconnectionTimer()
 {
     if(!m_hostServer)
         return;
+
+    retryDevice();
+}
+
+// The device hung up: its link is closed until the port node comes back
+void otcMainWindow::deviceLost()
+{
+    if (!m_hotplug->isLost())
+    {
+        m_hotplug->lost();
+        m_logWidget->append(QString("Lost %1, waiting for it...").arg(portName()));
+    }
+
+    closeDevice();
+    retryDevice();
+}
+
+// Reopens a lost link with the last baud rate and flow mode
+void otcMainWindow::retryDevice()
+{
+    if (!m_hotplug->isLost())
+        return;
+
+#ifndef WIN32
+    // Not yet plugged back
+    if (!QFile::exists(portName()))
+        return;
+#endif
+
+    if (connectToDevice())
+    {
+        qint64 down = m_hotplug->reconnected();
+        m_logWidget->append(QString("Link down for %1 ms").arg(down));
+    }
+}
+
+// Serial port file to use, depending on the OS
+QString otcMainWindow::portName()
+{
+#ifdef WIN32
+    if(otcConfig::argComPort<10)
+        return QString("COM%1").arg(otcConfig::argComPort);
+    return QString("\\\\.\\COM%1").arg(otcConfig::argComPort);
+#else
+    return QString(OTC_COM_PORTS_MAP_PATH"/com%1").arg(otcConfig::argComPort);
+#endif
 }
 
 bool otcMainWindow::connectToDevice()
 {
     if(OTC_LINK_COM == otcConfig::communicationLink)
     {
-        char pname[128];
-
-        // Build the string of the serial port file to use, depending on the OS.
-    #ifdef WIN32
-        if(otcConfig::argComPort<10)
-            sprintf(pname,"COM%d",otcConfig::argComPort);
-        else
-            sprintf(pname,"\\\\.\\COM%d",otcConfig::argComPort);
-    #else
-        sprintf(pname,OTC_COM_PORTS_MAP_PATH"/com%d",otcConfig::argComPort);
-    #endif
+        QByteArray pname = portName().toLatin1();
 
         m_device.close();
         m_parser.reinit();
 
-        if (!m_device.serialOpen(pname,otcConfig::argBaudRate,otcConfig::argFlowMode,TRUE))
+        if (!m_device.serialOpen(pname.data(),otcConfig::argBaudRate,otcConfig::argFlowMode,TRUE))
         {
-            m_logWidget->append( QString("Could not connect to %1 !").arg(pname));
+            m_logWidget->append( QString("Could not connect to %1 !").arg(pname.constData()));
             return FALSE;
         }
 
@@ -529,6 +678,7 @@ bool otcMainWindow::connectToDevice()
 
 void otcMainWindow::closeDevice()
 {
+    m_autobaud.stop(otcConfig::argBaudRate);
 	m_device.close();
 }
 
@@ -587,6 +737,15 @@ OTC_PRINT_MODE_T otcMainWindow::printModeFromString(const QString& mode)
 
 void otcMainWindow::changeBaudRate(const QString& s)
 {
+    if (s == "auto")
+    {
+        startAutobaud();
+        m_baudRateComboBox->blockSignals(TRUE);
+        m_baudRateComboBox->setCurrentText(QString("%1").arg(otcConfig::argBaudRate));
+        m_baudRateComboBox->blockSignals(FALSE);
+        return;
+    }
+
 	int baudrate = s.toInt();
 	changeBaudrateAndUpdate(baudrate);
 }
@@ -595,18 +754,75 @@ void otcMainWindow::changeBaudrateAndUpdate(int baudrate)
 {
     changeBaudRate(baudrate);
     m_baudRateComboBox->blockSignals(TRUE);
-    m_baudRateComboBox->setCurrentText(QString("%1").arg(baudrate));
+    m_baudRateComboBox->setCurrentText(QString("%1").arg(otcConfig::argBaudRate));
     m_baudRateComboBox->blockSignals(FALSE);
 }
 
 void otcMainWindow::changeBaudRate(int newbdr)
 {
+    if (!otc_serial::validBaudrate(newbdr))
+    {
+        m_logWidget->append(QString("Invalid baudrate %1!").arg(newbdr));
+        return;
+    }
+
+    // A detection running would set its own rate after this one
+    m_autobaud.stop(newbdr);
+
+    int previous = otcConfig::argBaudRate;
 	otcConfig::argBaudRate = newbdr;
 
 	if(m_device.changeBaudRate(newbdr))
-		m_logWidget->append("Baudrate changed to : "+QString("%1").arg(newbdr) );
+    {
+        int actual = m_device.actualBaudRate();
+		m_logWidget->append("Baudrate changed to : "+QString("%1").arg(newbdr) +
+                            ((actual != newbdr) ? QString(" (%1 on the line)").arg(actual) : QString("")));
+    }
 	else
+    {
 		m_logWidget->append("Could not change baudrate!");
+
+        // An open link keeps its rate, a closed one takes the new rate when opened
+        if (m_device.isOpen())
+            otcConfig::argBaudRate = previous;
+    }
+}
+
+/** @brief  Looks for the baud rate of the device, see otc_autobaud.h
+  * @retval (bool)  FALSE if the link is closed or a detection is running
+  *
+  * Can be called from any thread.
+  */
+bool otcMainWindow::startAutobaud()
+{
+    if (!m_device.isOpen())
+    {
+        otcConfig::logText("<font color=red>**Cannot look for the baud rate, the link is closed</font>");
+        return FALSE;
+    }
+
+    return m_autobaud.start(otcConfig::argBaudRate);
+}
+
+// From the device treatment thread: the window takes the rate, and the
+// socket clients are told
+void otcMainWindow::autobaudDone()
+{
+    int             rate = m_autobaud.result();
+    unsigned char   packet[8];
+
+    if (rate > 0)
+        QApplication::postEvent(this, new otcBaudrateChangeEvent(rate));
+
+    packet[0] = OTC_PROTOCOL_SYNC;
+    packet[1] = 0x00;
+    packet[2] = 0x04;
+    packet[3] = OTC_PROTOCOL_AUTOBAUD_RESULT;
+    for (int i=0; i<4; i++)
+        packet[4+i] = (unsigned char)(rate >> (8*i));
+
+    if (m_hostServer)
+        m_hostServer->broadcast((const char*)packet, sizeof(packet));
 }
 
 // -----------
@@ -690,20 +906,119 @@ void otcMainWindow::startStopLogging()
 }
 
 
+// Thread safe: the line waits in the queue of the log widget
 void otcConfig::logText(const QString& str)
 {
-    otcLogMessageEvent* e = new otcLogMessageEvent(str);
-    QApplication::postEvent(logWidget,e);
+    if (logWidget)
+        logWidget->push(str);
+}
+
+// Thread safe: line of a frame of the store, made by the log when shown
+void otcConfig::logStored(unsigned int frame, int colour, int length)
+{
+    if (logWidget)
+        logWidget->push(frame, (otc_log_colour_t)colour, length);
+}
+
+// Thread safe: FALSE when the GUI is behind and the frame is not to be printed
+bool otcConfig::logFrame(int frameClass)
+{
+    return (logWidget == NULL) || logWidget->admit(frameClass);
 }
 
 
 void otcMainWindow::printStatus()
 {
     otcConfig::logText(m_parser.getStatus());
+    otcConfig::logText(m_scheduler.getStatus());
+    otcConfig::logText(otc_mpipe_builder::getStatus());
+    otcConfig::logText(m_commandParser->getStatus());
+    otcConfig::logText(m_jobs->getStatus());
+    otcConfig::logText(m_frames.getStatus());
+    otcConfig::logText(m_tracer.getStatus());
+    otcConfig::logText(m_hotplug->getStatus());
+    otcConfig::logText(m_autobaud.getStatus());
+    otcConfig::logText(m_device.getStatus());
+    otcConfig::logText(dStatus());
+}
+
+// Loads a command script and starts streaming it. The previous runner is
+// only replaced once it is finished.
+bool otcMainWindow::runScript(const QString& file, int window, int timeout, bool quit)
+{
+    if (m_scriptRunner && m_scriptRunner->isRunning())
+    {
+        otcConfig::logText(QString("<font color=red>**Script %1 is still running</font>")
+                                .arg(m_scriptRunner->file()));
+        return FALSE;
+    }
+
+    if (m_scriptRunner)
+    {
+        m_parser.removeListener(m_scriptRunner);
+        delete m_scriptRunner;
+    }
+
+    m_scriptRunner = new otcScriptRunner(&m_device);
+    if (!m_scriptRunner->load(file, m_commandParser))
+    {
+        delete m_scriptRunner;
+        m_scriptRunner = NULL;
+        if (quit)
+            QApplication::postEvent(this, new otcKillEvent());
+        return FALSE;
+    }
+
+    m_scriptRunner->setWindow(window, timeout);
+    m_scriptRunner->setQuitWhenDone(quit);
+    m_parser.addListener(m_scriptRunner);
+    m_scriptRunner->start();
+    return TRUE;
+}
+
+void otcMainWindow::stopScript()
+{
+    if (m_scriptRunner && m_scriptRunner->isRunning())
+        m_scriptRunner->stopRunning();
+    else
+        otcConfig::logText("No script running");
+}
+
+// Starts a bulk file read, once the previous one is finished
+bool otcMainWindow::runDump(unsigned char block, unsigned char id, int offset, int length, const QString& output, int window)
+{
+    if (m_bulkReader && m_bulkReader->isRunning())
+    {
+        otcConfig::logText(QString("<font color=red>**Dump %1 is still running</font>")
+                                .arg(m_bulkReader->name()));
+        return FALSE;
+    }
+
+    if (m_bulkReader)
+    {
+        m_parser.removeListener(m_bulkReader);
+        delete m_bulkReader;
+    }
+
+    m_bulkReader = new otcBulkReader(&m_device);
+    m_bulkReader->setFile(block, id, offset, length, output);
+    m_bulkReader->setWindow(window, OTC_BULK_PAGE);
+    m_parser.addListener(m_bulkReader);
+    m_bulkReader->start();
+    return TRUE;
+}
+
+void otcMainWindow::stopDump()
+{
+    if (m_bulkReader && m_bulkReader->isRunning())
+        m_bulkReader->stopRunning();
+    else
+        otcConfig::logText("No dump running");
 }
 
 void otcMainWindow::flushFifos()
 {
+    m_scheduler.flush();
     m_device.flush();
     m_parser.reinit();
 }
@@ -804,6 +1119,14 @@ void otcMainWindow::customEvent(QEvent* e)
             reconnectDevice();
         }
         break;
+        case OTC_EVENT_HOTPLUG :
+        {
+            if (((otcHotplugEvent*)e)->lost())
+                deviceLost();
+            else
+                retryDevice();
+        }
+        break;
         case OTC_EVENT_KILL:
         {
             qApp->quit();
@@ -819,6 +1142,14 @@ void otcMainWindow::customEvent(QEvent* e)
             flushFifos();
         }
         break;
+        case OTC_EVENT_COMMAND:
+        {
+            QString cmd = ((otcCommandEvent*)e)->command();
+            // From a socket client too: no markup of its own in the log
+            otcConfig::logText("<font color=blue>&gt; "+Qt::escape(cmd)+"</font>");
+            m_commandParser->exec(cmd);
+        }
+        break;
         default :
             QMainWindow::customEvent(e);
     }
@@ -832,22 +1163,6 @@ void otcMainWindow::closeEvent(QCloseEvent*e)
 		e->ignore();
 }
 
-void otcLogWidget::customEvent(QEvent* e)
-{
-    if((int)e->type() == OTC_EVENT_LOG)
-    {
-        append(((otcLogMessageEvent*)e)->getMessage());
-        if(length()>500000)
-        {
-            clear();
-            append("OTCOM secure clean...");
-        }
-    }
-    else
-        Q3TextEdit::customEvent(e);
-}
-
-
 void otcMainWindow::slotShowOrMinimize()
 {
 	if(isVisible())
@@ -41,6 +41,15 @@
 #include "otc_command.h"
 #include "otc_socket.h"
 #include "otc_serial.h"
+#include "otc_scheduler.h"
+#include "otc_script.h"
+#include "otc_bulk.h"
+#include "otc_jobs.h"
+#include "otc_log.h"
+#include "otc_frames.h"
+#include "otc_trace.h"
+#include "otc_hotplug.h"
+#include "otc_autobaud.h"
 
 
 class otcMainWindow;
@@ -63,23 +72,12 @@ typedef enum
     OTC_EVENT_CLEAN,
     OTC_EVENT_CHANGE_FLOW,
     OTC_EVENT_FLUSH_FIFOS,
+    OTC_EVENT_COMMAND,
+    OTC_EVENT_HOTPLUG,
 
 } OTC_EVENT_T;
 
 
-class otcLogMessageEvent : public QEvent
-{
-   public:
-	otcLogMessageEvent( const QString& s )
-		: QEvent( (QEvent::Type) OTC_EVENT_LOG ), message(s)
-		{}
-
-	const QString& getMessage() const { return message; }
-private:
-	QString message;
-};
-
-
 class otcDeviceReadEvent : public QEvent
 {
 public:
@@ -159,6 +157,23 @@ class otcReconnectComPortEvent : public QEvent
 };
 
 
+// The link was lost, or a port node appeared while it is lost
+class otcHotplugEvent : public QEvent
+{
+ public:
+	otcHotplugEvent(bool lost)
+		: QEvent( (QEvent::Type) OTC_EVENT_HOTPLUG )
+	{
+		m_lost = lost;
+	}
+
+    bool lost() {return m_lost;}
+
+private:
+    bool m_lost;
+};
+
+
 class otcKillEvent : public QEvent
 {
  public:
@@ -188,6 +203,22 @@ class otcFlushFifosEvent: public QEvent
     }
 };
 
+
+class otcCommandEvent : public QEvent
+{
+public:
+    otcCommandEvent(const QString& command)
+        : QEvent( (QEvent::Type) OTC_EVENT_COMMAND )
+    {
+        m_command = command;
+    }
+
+    const QString& command() {return m_command;}
+
+private:
+    QString m_command;
+};
+
 #define OTC_BLINK_PERIOD 5
 #define OTC_BLINK_TIMEOUT_FACTOR 5
 
@@ -249,16 +280,6 @@ protected :
 };
 
 
-class otcLogWidget : public Q3TextEdit
-{
-public :
-    otcLogWidget(QWidget* parent)
-        :Q3TextEdit(parent) {};
-
-    void customEvent(QEvent* e);
-};
-
-
 class otcDeviceReaderThread : public QThread
 {
 public : //Methods
@@ -323,6 +344,22 @@ protected : //Attributes
 };
 
 
+class otcDeviceWriterThread : public QThread
+{
+ public : //Methods
+
+	otcDeviceWriterThread(otcMainWindow* mw);
+	~otcDeviceWriterThread();
+
+	void run();
+	void stopRunning();
+
+protected : //Attributes
+    otcMainWindow*     m_mainWindow;
+	bool    	       m_running;
+};
+
+
 class otcMainWindow : public QMainWindow
 {
 	Q_OBJECT
@@ -331,12 +368,14 @@ class otcMainWindow : public QMainWindow
 	friend class otcClientReaderThread;
 	friend class otcDeviceDataTreatmentThread;
 	friend class otcClientsDataTreatmentThread;
+	friend class otcDeviceWriterThread;
 
 protected :
     void readDataStep();
     void readClientsDataStep();
     void treatDeviceDataStep();
     void treatClientsDataStep();
+    void writeDeviceDataStep();
 
 public :
 	otcMainWindow(QWidget* parent = NULL);
@@ -344,10 +383,20 @@ public :
 
     bool isDeviceConnected()	{return m_device.isOpen();}
     bool isHostServerOk()		{return (m_hostServer!=NULL && m_hostServer->ok());}
+    otcWriteScheduler* writeScheduler() {return &m_scheduler;}
+    otcJobScheduler* jobScheduler() {return m_jobs;}
+    otcFrameStore* frameStore() {return &m_frames;}
+    otcTracer* tracer() {return &m_tracer;}
+    otcDataParser* dataParser() {return &m_parser;}
+    bool startAutobaud();
 
 	void changeBaudrateAndUpdate(int baudrate);
     void changeFlowModeAndUpdate(OTC_FLOW_T mode);
     void printStatus();
+    bool runScript(const QString& file, int window, int timeout, bool quit);
+    void stopScript();
+    bool runDump(unsigned char block, unsigned char id, int offset, int length, const QString& output, int window);
+    void stopDump();
 
 protected :
     otcBlinker*                   m_deviceblinker;
@@ -362,14 +411,27 @@ protected :
 	otc_command_parser*           m_commandParser;
 	otcHostServer*	              m_hostServer;
 	otcCommunicationLinkDevice	  m_device;
+	otcWriteScheduler             m_scheduler;
 	otcDataParser			      m_parser;
+    otcFrameStore                 m_frames;
+    otcTracer                     m_tracer;
 	otcDeviceReaderThread*        m_readerThread;
 	otcClientReaderThread*        m_clientReaderThread;
     otcDeviceDataTreatmentThread* m_dataTreatmentThread;
     otcClientsDataTreatmentThread* m_clientsDataTreatmentThread;
+    otcDeviceWriterThread*        m_writerThread;
+    otcScriptRunner*              m_scriptRunner;
+    otcBulkReader*                m_bulkReader;
+    otcJobScheduler*              m_jobs;
+    otcHotplugMonitor*            m_hotplug;
+    otcAutobaud                   m_autobaud;
 
 	bool                          connectToDevice();
+	QString                       portName();
 	void                          closeDevice();
+	void                          deviceLost();
+	void                          autobaudDone();
+	void                          retryDevice();
 	void                          customEvent( QEvent * e );
     void                          hideEvent(QHideEvent * e);
 	void                          closeEvent(QCloseEvent*e);
@@ -0,0 +1,749 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otcd_decode.cpp
+/// @brief          Offline decoder: inputs, segments and record scanner
+//
+/// =========================================================================
+
+#include <string.h>
+#include <zlib.h>
+#include <qdatetime.h>
+
+#include "otc_mpipe.h"
+#include "otc_alp.h"
+#include "otc_capture.h"
+#include "otc_hex.h"
+#include "bintex.h"
+#include "otcd_decode.h"
+
+
+static quint32 get32(const uchar* p)
+{
+    return (quint32)p[0] | ((quint32)p[1] << 8) | ((quint32)p[2] << 16) | ((quint32)p[3] << 24);
+}
+
+static quint64 get64(const uchar* p)
+{
+    return (quint64)get32(p) | ((quint64)get32(p + 4) << 32);
+}
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static void appendHex(QByteArray& out, quint8 byte)
+{
+    out.append(hexDigits[byte >> 4]);
+    out.append(hexDigits[byte & 0xF]);
+}
+
+otcdOptions::otcdOptions()
+{
+    format  = OTCD_FORMAT_TEXT;
+    id      = -1;
+    cmd     = -1;
+    from    = -1;
+    to      = -1;
+    ok      = TRUE;
+    bad     = TRUE;
+}
+
+
+// ---------------------------------------- //
+//                                          //
+//              SEGMENT                     //
+//                                          //
+// ---------------------------------------- //
+
+otcdSegment::otcdSegment()
+{
+    start       = 0;
+    end         = 0;
+    streamEnd   = 0;
+    contiguous  = FALSE;
+    raw         = NULL;
+    data        = NULL;
+    size        = 0;
+    first       = 0;
+    scanEnd     = 0;
+    cut         = -1;
+    badBlocks   = 0;
+    done        = FALSE;
+}
+
+// Decompresses the blocks one after the other. A block which cannot be
+// decompressed ends the data: the records after it are lost, as they
+// would be for a parser reading the file. The stamps following the raw
+// data of a block are moved to the stamp table, the next block overwrites
+// them.
+void otcdSegment::inflate()
+{
+    int total   = 0;
+    int most    = 0;
+
+    for (int i=0; i<blocks.count(); i++)
+    {
+        total += blocks[i].rawLen;
+        most   = qMax(most, blocks[i].stamps);
+    }
+    total += most * OTC_CAPTURE_STAMP_SIZE;
+
+    buffer.resize(total);
+    size = 0;
+
+    for (int i=0; i<blocks.count(); i++)
+    {
+        const otcdBlock& b = blocks[i];
+        uLongf full = b.rawLen + b.stamps * OTC_CAPTURE_STAMP_SIZE;
+        uLongf len  = full;
+
+        if ((uncompress((Bytef*)buffer.data() + size, &len,
+                        b.file + b.fileOffset + b.headerSize, b.compressedLen) != Z_OK) ||
+            (len != full) ||
+            (crc32(0, (const Bytef*)buffer.constData() + size, b.rawLen) != b.crc))
+        {
+            badBlocks++;
+            break;
+        }
+
+        for (int j=0; j<b.stamps; j++)
+        {
+            const uchar*    e = (const uchar*)buffer.constData() + size + b.rawLen + j * OTC_CAPTURE_STAMP_SIZE;
+            otcdStamp       st;
+
+            st.offset   = b.offset + get32(e);
+            st.byteTime = get32(e + 4);
+            st.time     = get64(e + 8);
+            stamps.append(st);
+        }
+        size += b.rawLen;
+    }
+
+    data = (const uchar*)buffer.constData();
+}
+
+/** @brief  Decodes the segment, from a worker thread
+  * @param  opt     (const otcdOptions&) filters and output format
+  */
+void otcdSegment::decode(const otcdOptions& opt)
+{
+    otcdRecord  r;
+    otcd_next_t res;
+    qint64      p;
+
+    if (blocks.isEmpty())
+        data = raw;
+    else
+        inflate();
+
+    // Start at the first record with a good CRC
+    first = start;
+    for (p = start; ; p = r.start + 1)
+    {
+        res = next(p, r);
+        if ((res != OTCD_NEXT_RECORD) || (r.start >= end))
+            break;
+        if (r.kind == OTCD_RECORD_OK)
+        {
+            first = r.start;
+            break;
+        }
+    }
+
+    p = first;
+    while (p < end)
+    {
+        res = next(p, r);
+        if ((res == OTCD_NEXT_NONE) || (r.start >= end))
+        {
+            p = end;
+            break;
+        }
+        if (res == OTCD_NEXT_CUT)
+        {
+            cut = r.start;
+            p   = start + size;
+            break;
+        }
+
+        r.textFrom = text.size();
+        format(r, opt, text);
+        r.textLen = text.size() - r.textFrom;
+        records.append(r);
+        p = r.end;
+    }
+    scanEnd = p;
+}
+
+// The merge is done with the segment: only the counters are kept
+void otcdSegment::release()
+{
+    buffer  = QByteArray();
+    stamps  = QVector<otcdStamp>();
+    text    = QByteArray();
+    records = QVector<otcdRecord>();
+    blocks.clear();
+    data    = NULL;
+    raw     = NULL;
+}
+
+/** @brief  Finds the next record from a position, like otc_mpipe_parser::parse()
+  * @param  pos     (qint64) raw offset, the parser is looking for a sync word there
+  * @param  r       (otcdRecord&) record, r.start is also set with OTCD_NEXT_CUT
+  * @retval (otcd_next_t) record found, no sync word, or record cut by the end of the data
+  */
+otcd_next_t otcdSegment::next(qint64 pos, otcdRecord& r)
+{
+    const uchar*    d = data + (pos - start);
+    const uchar*    e = data + size;
+    const uchar*    h;
+    int             payloadLen;
+    int             dataLen;
+    unsigned short  crc;
+
+    // Sync word: a 0xFF followed by a 0x55
+    for (;;)
+    {
+        if (e - d < 2)
+            return OTCD_NEXT_NONE;
+        h = (const uchar*)memchr(d, OTC_MPIPE_SYNC_BYTE_0, e - d - 1);
+        if (h == NULL)
+            return OTCD_NEXT_NONE;
+        if (h[1] == OTC_MPIPE_SYNC_BYTE_1)
+            break;
+        d = h + 1;
+    }
+
+    r.start     = start + (h - data);
+    r.alp       = FALSE;
+    r.dataLen   = 0;
+    r.chunk     = OTC_MPIPE_SYNC_WORD_CHUNK_NO;
+    r.textFrom  = 0;
+    r.textLen   = 0;
+
+    if (e - h < OTC_MPIPE_HEADER_SIZE)
+        return OTCD_NEXT_CUT;
+
+    r.seq       = h[6];
+    payloadLen  = ((int)h[4] << 8) | h[5];
+
+    if (payloadLen == 0)
+    {
+        r.end = r.start + OTC_MPIPE_HEADER_SIZE;
+    }
+    else if (payloadLen < OTC_MPIPE_ALP_SIZE)
+    {
+        r.end  = r.start + OTC_MPIPE_HEADER_SIZE;
+        r.kind = OTCD_RECORD_ERROR;
+        return OTCD_NEXT_RECORD;
+    }
+    else
+    {
+        if (e - h < OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE)
+            return OTCD_NEXT_CUT;
+
+        // Same length rule as the parser, for long records
+        dataLen = payloadLen - OTC_MPIPE_ALP_SIZE;
+        if ((dataLen & 0xFF) != h[9])
+            dataLen = h[9];
+
+        r.chunk = h[8] >> 5;
+        switch (r.chunk)
+        {
+            case OTC_MPIPE_SYNC_WORD_CHUNK_IMPLICIT:
+            case OTC_MPIPE_SYNC_WORD_CHUNK_CONTINUE:
+            case OTC_MPIPE_SYNC_WORD_CHUNK_LAST:
+            case OTC_MPIPE_SYNC_WORD_CHUNK_FIRST:
+            case OTC_MPIPE_SYNC_WORD_CHUNK_NO:
+                break;
+
+            default:
+                r.end  = r.start + OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE;
+                r.kind = OTCD_RECORD_ERROR;
+                return OTCD_NEXT_RECORD;
+        }
+
+        if (e - h < OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + dataLen)
+            return OTCD_NEXT_CUT;
+
+        r.alp       = TRUE;
+        r.id        = h[10];
+        r.cmd       = h[11];
+        r.dataLen   = dataLen;
+        r.end       = r.start + OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE + dataLen;
+    }
+
+    // CRC of everything after the CRC field
+    crc = 0xFFFF;
+    for (const uchar* c = h + 4; c < h + (r.end - r.start); c++)
+        crc = (crc << 8) ^ crcLut[((crc >> 8) & 0xff) ^ *c];
+
+    r.kind = (crc == (((unsigned short)h[2] << 8) | h[3])) ? OTCD_RECORD_OK : OTCD_RECORD_BAD;
+    return OTCD_NEXT_RECORD;
+}
+
+/** @brief  Tells if the parser of this segment was looking for a sync word at a position
+  * @param  pos     (qint64) raw offset where a parser of the whole stream is
+  * @param  index   (int&) first record of the segment from there
+  * @retval (bool)  TRUE when both parsers give the same records from there
+  */
+bool otcdSegment::aligned(qint64 pos, int& index)
+{
+    int lo = 0;
+    int hi = records.count();
+
+    // Before the first record, or inside the record cut by the end
+    if ((pos < first) || ((cut >= 0) && (pos > cut)))
+        return FALSE;
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (records[mid].start < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    index = lo;
+    return (lo == 0) || (records[lo - 1].end <= pos);
+}
+
+/** @brief  Time of a byte: from the stamp of the read it came in, else the
+  *         time of the capture block it was read in
+  * @param  pos     (qint64) raw offset
+  * @retval (qint64) ms since 1970, -1 for a raw file
+  */
+qint64 otcdSegment::stamp(qint64 pos)
+{
+    int lo = 0;
+    int hi = blocks.count();
+
+    if (hi == 0)
+        return -1;
+
+    while (hi - lo > 1)
+    {
+        int mid = (lo + hi) / 2;
+        if (blocks[mid].offset <= pos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const otcdBlock& b = blocks[lo];
+
+    // Last stamp at or before the byte, in the same block
+    int s = 0;
+    hi = stamps.count();
+    while (s < hi)
+    {
+        int mid = (s + hi) / 2;
+        if (stamps[mid].offset <= pos)
+            s = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if ((s == 0) || (stamps[s - 1].offset < b.offset))
+        return b.stamp;
+
+    const otcdStamp& st = stamps[s - 1];
+    return (st.time + (pos - st.offset) * st.byteTime) / 1000000;
+}
+
+/** @brief  Appends the output of a record, if it passes the filters
+  * @param  r       (const otcdRecord&) record of this segment
+  * @param  opt     (const otcdOptions&) filters and output format
+  * @param  out     (QByteArray&) output
+  */
+void otcdSegment::format(const otcdRecord& r, const otcdOptions& opt, QByteArray& out)
+{
+    const uchar*    d       = data + (r.start - start) + OTC_MPIPE_HEADER_SIZE + OTC_MPIPE_ALP_SIZE;
+    qint64          time    = stamp(r.start);
+
+    if ((r.kind == OTCD_RECORD_ERROR) ||
+        ((r.kind == OTCD_RECORD_OK)  && !opt.ok) ||
+        ((r.kind == OTCD_RECORD_BAD) && !opt.bad))
+        return;
+
+    if (((opt.id  >= 0) && (!r.alp || (r.id  != opt.id))) ||
+        ((opt.cmd >= 0) && (!r.alp || (r.cmd != opt.cmd))))
+        return;
+
+    if ((time >= 0) &&
+        (((opt.from >= 0) && (time < opt.from)) ||
+         ((opt.to   >= 0) && (time > opt.to))))
+        return;
+
+    switch (opt.format)
+    {
+        case OTCD_FORMAT_CSV:
+        {
+            // offset,time,seq,id,cmd,chunk,crc,length,data
+            out += QByteArray::number(r.start);
+            out += ',';
+            if (time >= 0)
+                out += QByteArray::number(time);
+            out += ',';
+            out += QByteArray::number(r.seq);
+            out += ',';
+            if (r.alp)
+                appendHex(out, r.id);
+            out += ',';
+            if (r.alp)
+                appendHex(out, r.cmd);
+            out += ',';
+            out += QByteArray::number(r.chunk);
+            out += (r.kind == OTCD_RECORD_OK) ? ",ok," : ",bad,";
+            out += QByteArray::number(r.dataLen);
+            out += ',';
+            for (int i=0; i<r.dataLen; i++)
+                appendHex(out, d[i]);
+            out += '\n';
+        } break;
+
+        case OTCD_FORMAT_BINTEX:
+        {
+            // A comment line, then the data: the output can be read back by bintex_ss()
+            int n = bintex_encode_size(r.dataLen);
+            int from;
+
+            out += "# ";
+            out += QByteArray::number(r.start);
+            out += " seq ";
+            out += QByteArray::number(r.seq);
+            if (r.alp)
+            {
+                out += " id ";
+                appendHex(out, r.id);
+                out += " cmd ";
+                appendHex(out, r.cmd);
+            }
+            if (time >= 0)
+                out += ' ' + QDateTime::fromMSecsSinceEpoch(time).toString("yyyy-MM-dd hh:mm:ss.zzz").toAscii();
+            if (r.kind == OTCD_RECORD_BAD)
+                out += " bad CRC";
+            out += '\n';
+
+            from = out.size();
+            out.resize(from + n);
+            out.resize(from + bintex_encode(d, r.dataLen, out.data() + from, n, 0));
+            out += '\n';
+        } break;
+
+        case OTCD_FORMAT_TEXT:
+        default:
+        {
+            // Same line as the GUI: [ seq ]  [ ID CMD ]  [ data ]
+            int i = 0;
+
+            if (time >= 0)
+                out += QDateTime::fromMSecsSinceEpoch(time).toString("hh:mm:ss.zzz  ").toAscii();
+
+            out += "[ ";
+            out += QByteArray::number(r.seq);
+            out += " ]  [ ";
+
+            if (!r.alp)
+            {
+            }
+            else if (r.id != OTC_ALP_ID_LOG)
+            {
+                appendHex(out, r.id);
+                out += ' ';
+                appendHex(out, r.cmd);
+                out += ' ';
+            }
+            else
+            {
+                out += (r.cmd == OTC_ALP_CMD_LOG_ECHO) ? "ECHO " : "LOG ";
+            }
+
+            out += "]  [ ";
+
+            if (r.alp && (r.id == OTC_ALP_ID_LOG))
+            {
+                // Message label, up to the first space
+                if (r.cmd & 4)
+                {
+                    while ((i < r.dataLen) && (d[i++] != ' ')) { }
+                    for (int j=0; j<i; j++)
+                        out += (d[j] == '\n') ? ' ' : (char)d[j];
+                }
+
+                for (; i<r.dataLen; i++)
+                {
+                    switch (r.cmd & 3)
+                    {
+                        case OTC_ALP_CMD_LOG_RAW:
+                            otcHexAppend(out, d + i, r.dataLen - i);
+                            i = r.dataLen;
+                            break;
+
+                        case OTC_ALP_CMD_LOG_UTF8:
+                            out += (d[i] == '\n') ? ' ' : (char)d[i];
+                            break;
+
+                        case OTC_ALP_CMD_LOG_UTF16:
+                            i++;
+                            break;
+
+                        case OTC_ALP_CMD_LOG_UTF8HEX:
+                            if ((i+1) < r.dataLen)
+                            {
+                                out += (char)d[i];
+                                out += (char)d[i+1];
+                                out += ' ';
+                            }
+                            i++;
+                            break;
+                    }
+                }
+            }
+            else
+            {
+                otcHexAppend(out, d, r.dataLen);
+            }
+
+            out += "]";
+            if (r.kind == OTCD_RECORD_BAD)
+                out += "  bad CRC";
+            out += '\n';
+        } break;
+    }
+}
+
+
+// ---------------------------------------- //
+//                                          //
+//              INPUT                       //
+//                                          //
+// ---------------------------------------- //
+
+otcdInput::otcdInput()
+{
+    bytes = 0;
+}
+
+otcdInput::~otcdInput()
+{
+    for (int i=0; i<segments.count(); i++)
+        delete segments[i];
+    for (int i=0; i<m_files.count(); i++)
+        delete m_files[i].file;
+}
+
+// Lists the blocks of a capture file. The index at the end is not needed:
+// the block headers are walked from the file header, which also works for
+// a file cut short.
+bool otcdInput::walk(otcdFile& f)
+{
+    qint64  pos     = OTC_CAPTURE_HEADER_SIZE;
+    int     header  = (f.version == 1) ? OTC_CAPTURE_BLOCK_HEADER_SIZE_V1 : OTC_CAPTURE_BLOCK_HEADER_SIZE;
+
+    while (pos + header <= f.size)
+    {
+        const uchar*    h = f.map + pos;
+        otcdBlock       b;
+
+        if (memcmp(h, "OTCB", 4) != 0)
+            break;
+
+        b.file          = f.map;
+        b.fileOffset    = pos;
+        b.rawLen        = get32(h + 4);
+        b.compressedLen = get32(h + 8);
+        b.crc           = get32(h + 12);
+        b.offset        = get64(h + 16);
+        b.stamp         = get64(h + 24);
+        b.headerSize    = header;
+        b.stamps        = (f.version == 1) ? 0 : get32(h + 32);
+
+        if ((b.rawLen <= 0) || (b.rawLen > OTC_CAPTURE_BLOCK) ||
+            (b.compressedLen <= 0) || (b.stamps < 0) || (b.stamps > b.rawLen) ||
+            (pos + header + b.compressedLen > f.size))
+            break;
+
+        f.blocks.append(b);
+        pos += header + b.compressedLen;
+    }
+
+    return !f.blocks.isEmpty();
+}
+
+/** @brief  Maps a file given on the command line
+  * @param  name    (const QString&) raw file, or .otc capture file
+  * @param  error   (QString&) why the file cannot be used
+  * @retval (bool)  FALSE if the file cannot be used
+  */
+bool otcdInput::add(const QString& name, QString& error)
+{
+    otcdFile f;
+
+    f.file      = new QFile(name);
+    f.map       = NULL;
+    f.size      = f.file->size();
+    f.capture   = FALSE;
+    f.version   = 0;
+
+    if (!f.file->open(QIODevice::ReadOnly))
+    {
+        error = QString("cannot open %1").arg(name);
+        delete f.file;
+        return FALSE;
+    }
+
+    if (f.size > 0)
+        f.map = f.file->map(0, f.size);
+
+    if ((f.size > 0) && (f.map == NULL))
+    {
+        error = QString("cannot map %1").arg(name);
+        delete f.file;
+        return FALSE;
+    }
+
+    if ((f.size >= OTC_CAPTURE_HEADER_SIZE) && (memcmp(f.map, "OTCAP", 6) == 0))
+    {
+        f.capture = TRUE;
+        f.version = f.map[6] | (f.map[7] << 8);
+        if ((f.version < 1) || (f.version > OTC_CAPTURE_VERSION))
+        {
+            error = QString("%1: unknown capture version").arg(name);
+            delete f.file;
+            return FALSE;
+        }
+        walk(f);
+    }
+
+    m_files.append(f);
+    return TRUE;
+}
+
+void otcdInput::cutRaw(const otcdFile& f)
+{
+    for (qint64 pos = 0; pos < f.size; pos += OTCD_SEGMENT_SIZE)
+    {
+        otcdSegment* s = new otcdSegment();
+
+        s->start        = pos;
+        s->end          = qMin(pos + OTCD_SEGMENT_SIZE, f.size);
+        s->streamEnd    = f.size;
+        s->contiguous   = (pos != 0);
+        s->raw          = f.map + pos;
+        s->size         = qMin(s->end + OTCD_SEGMENT_OVERLAP, f.size) - pos;
+
+        segments.append(s);
+        bytes += s->end - s->start;
+    }
+}
+
+// The blocks of consecutive capture files make one stream, as long as the
+// raw offsets follow each other. Dropped blocks leave a gap: the parser
+// starts again after it.
+void otcdInput::cutBlocks(const QList<otcdBlock>& blocks, const otcdOptions& opt)
+{
+    otcdSegment*    s       = NULL;
+    qint64          last    = -1;
+    int             added   = segments.count();
+
+    for (int i=0; i<blocks.count(); i++)
+    {
+        const otcdBlock& b = blocks[i];
+
+        // Blocks entirely out of the time range are not decoded. One block
+        // is kept before the range, so that the parser is in sync when the
+        // range starts.
+        if ((opt.from >= 0) && (i + 2 < blocks.count()) && (blocks[i + 2].stamp < opt.from))
+            continue;
+        if ((opt.to >= 0) && (b.stamp > opt.to))
+            break;
+
+        if ((s != NULL) && (b.offset == last) && (s->end - s->start < OTCD_SEGMENT_SIZE))
+        {
+            s->blocks.append(b);
+            s->end += b.rawLen;
+        }
+        else
+        {
+            bool contiguous = (b.offset == last);
+
+            s = new otcdSegment();
+            s->start        = b.offset;
+            s->end          = b.offset + b.rawLen;
+            s->contiguous   = contiguous;
+            s->blocks.append(b);
+            segments.append(s);
+        }
+
+        bytes  += b.rawLen;
+        last    = b.offset + b.rawLen;
+    }
+
+    // Overlap: the blocks that follow each segment without a gap. Going
+    // backwards, the next segment already holds its own overlap.
+    for (int k=segments.count()-1; k>=added; k--)
+    {
+        otcdSegment* seg  = segments[k];
+        otcdSegment* next = (k + 1 < segments.count()) ? segments[k + 1] : NULL;
+
+        if ((next == NULL) || !next->contiguous)
+        {
+            seg->streamEnd = seg->end;
+            continue;
+        }
+
+        seg->streamEnd = next->streamEnd;
+        for (int i=0; i<next->blocks.count(); i++)
+        {
+            const otcdBlock& b = seg->blocks.last();
+            if (b.offset + b.rawLen >= seg->end + OTCD_SEGMENT_OVERLAP)
+                break;
+            seg->blocks.append(next->blocks[i]);
+        }
+    }
+}
+
+/** @brief  Cuts the files in segments, in the order they were added
+  * @param  opt     (const otcdOptions&) the time range skips capture blocks
+  */
+void otcdInput::cut(const otcdOptions& opt)
+{
+    QList<otcdBlock> blocks;
+
+    for (int i=0; i<m_files.count(); i++)
+    {
+        if (m_files[i].capture)
+        {
+            blocks += m_files[i].blocks;
+            continue;
+        }
+
+        if (!blocks.isEmpty())
+        {
+            cutBlocks(blocks, opt);
+            blocks.clear();
+        }
+        cutRaw(m_files[i]);
+    }
+
+    if (!blocks.isEmpty())
+        cutBlocks(blocks, opt);
+}
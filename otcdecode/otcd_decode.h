@@ -0,0 +1,217 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otcd_decode.h
+/// @brief          Offline decoder: inputs, segments and record scanner
+//
+/// =========================================================================
+///
+/// The bytes read from the device (a raw debug.bin, or the blocks of one or
+/// more .otc capture files) are a stream cut in segments of a few MB. Every
+/// segment is decoded alone, by any thread: it starts at the first sync word
+/// of the segment whose record has a good CRC, and records are taken until
+/// the end of the segment. A segment also holds the bytes following it, so
+/// that its last record is complete.
+///
+/// The segments are then merged in order, which gives exactly what a single
+/// parser reading the whole stream would give. The parser of the previous
+/// segment stops at some position of this one (after its last record): when
+/// the parser of this segment was between two records there, both agree and
+/// its records are kept from there. Else (a bad CRC record hiding the start,
+/// or a record of the previous segment ending inside one of this segment)
+/// the stream is parsed again from that position until both agree, which is
+/// a few records at most.
+///
+/// The scanner follows otc_mpipe_parser::parse() byte for byte: sync word,
+/// CRC, header, ALP header and data, with the same length rules and the same
+/// error cases.
+///
+/// =========================================================================
+
+#ifndef __OTCD_DECODE_H__
+#define __OTCD_DECODE_H__
+
+#include <qstring.h>
+#include <qlist.h>
+#include <qvector.h>
+#include <qbytearray.h>
+#include <qfile.h>
+
+
+/// Raw bytes per segment
+#define OTCD_SEGMENT_SIZE                   (4 * 1024 * 1024)
+
+/// Bytes after a segment that its last record may use: longest record
+#define OTCD_SEGMENT_OVERLAP                (0xFFFF + 12)
+
+
+typedef enum {
+    OTCD_RECORD_OK = 0,         ///< good CRC
+    OTCD_RECORD_BAD,            ///< bad CRC, shown like the GUI does
+    OTCD_RECORD_ERROR           ///< bad header, skipped by the parser
+} otcd_record_t;
+
+typedef enum {
+    OTCD_NEXT_RECORD = 0,
+    OTCD_NEXT_NONE,             ///< no sync word left
+    OTCD_NEXT_CUT               ///< the last record is cut by the end of the data
+} otcd_next_t;
+
+typedef enum {
+    OTCD_FORMAT_TEXT = 0,
+    OTCD_FORMAT_CSV,
+    OTCD_FORMAT_BINTEX
+} otcd_format_t;
+
+
+/// Command line options, read only once the decoding starts
+class otcdOptions
+{
+public :
+    otcdOptions();
+
+    otcd_format_t           format;
+    int                     id;         ///< -1: all
+    int                     cmd;        ///< -1: all
+    qint64                  from;       ///< ms since 1970, -1: no limit
+    qint64                  to;         ///< ms since 1970, -1: no limit
+    bool                    ok;         ///< show good CRC records
+    bool                    bad;        ///< show bad CRC records
+};
+
+
+class otcdRecord
+{
+public :
+    qint64                  start;      ///< raw offset of the sync word
+    qint64                  end;        ///< raw offset after the record
+    quint8                  kind;       ///< otcd_record_t
+    quint8                  seq;
+    quint8                  chunk;
+    bool                    alp;        ///< FALSE: empty record, no id/cmd
+    quint8                  id;
+    quint8                  cmd;
+    int                     dataLen;    ///< data follows the 12 bytes of headers
+    int                     textFrom;   ///< output of the record in the segment text
+    int                     textLen;
+};
+
+
+/// A capture block, as found in an .otc file
+class otcdBlock
+{
+public :
+    const uchar*            file;       ///< mapped .otc file
+    qint64                  fileOffset; ///< of the block header
+    qint64                  offset;     ///< raw offset of the first byte
+    int                     rawLen;
+    int                     compressedLen;
+    quint32                 crc;
+    qint64                  stamp;      ///< ms since 1970
+    int                     headerSize; ///< OTC_CAPTURE_BLOCK_HEADER_SIZE of the file version
+    int                     stamps;     ///< stamps after the raw data, 0 before version 2
+};
+
+
+/// Arrival of the bytes of a read, from the stamps of a capture block
+class otcdStamp
+{
+public :
+    qint64                  offset;     ///< raw offset of the first byte
+    qint64                  time;       ///< ns since 1970 of that byte
+    int                     byteTime;   ///< ns from one byte to the next
+};
+
+
+class otcdSegment
+{
+public :
+    otcdSegment();
+
+    // Set when the input is cut
+    qint64                  start;      ///< raw offset where records may start
+    qint64                  end;        ///< raw offset where they may not any more
+    qint64                  streamEnd;  ///< end of the bytes that follow without a gap
+    bool                    contiguous; ///< the previous segment ends at start
+    const uchar*            raw;        ///< raw file: bytes from start
+    QList<otcdBlock>        blocks;     ///< capture: blocks from start, overlap included
+
+    // Set by the worker
+    const uchar*            data;       ///< bytes from start
+    qint64                  size;
+    QByteArray              buffer;     ///< capture: decompressed blocks
+    QVector<otcdStamp>      stamps;     ///< capture: stamps of the decompressed blocks
+    qint64                  first;      ///< raw offset where the scan started
+    qint64                  scanEnd;    ///< raw offset where the parser stopped
+    qint64                  cut;        ///< raw offset of a record cut by the end of the data, or -1
+    QVector<otcdRecord>     records;
+    QByteArray              text;
+    int                     badBlocks;  ///< capture blocks which could not be decompressed
+    bool                    done;
+
+    void                    decode(const otcdOptions& opt);
+    void                    release();
+
+    otcd_next_t             next(qint64 pos, otcdRecord& r);
+    bool                    aligned(qint64 pos, int& index);
+    qint64                  stamp(qint64 pos);
+    void                    format(const otcdRecord& r, const otcdOptions& opt, QByteArray& out);
+
+protected :
+    void                    inflate();
+};
+
+
+/// A file given on the command line
+class otcdFile
+{
+public :
+    QFile*                  file;
+    const uchar*            map;
+    qint64                  size;
+    bool                    capture;
+    int                     version;    ///< of a capture file
+    QList<otcdBlock>        blocks;
+};
+
+
+/// Files given on the command line, cut in segments
+class otcdInput
+{
+public :
+    otcdInput();
+    ~otcdInput();
+
+    bool                    add(const QString& name, QString& error);
+    void                    cut(const otcdOptions& opt);
+
+    QList<otcdSegment*>     segments;
+    qint64                  bytes;      ///< raw bytes in the segments
+
+protected :
+    QList<otcdFile>         m_files;
+
+    bool                    walk(otcdFile& f);
+    void                    cutRaw(const otcdFile& f);
+    void                    cutBlocks(const QList<otcdBlock>& blocks, const otcdOptions& opt);
+};
+
+
+#endif // __OTCD_DECODE_H__
@@ -0,0 +1,288 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otcd_main.cpp
+/// @brief          Offline decoder: command line and merge
+///                 otcdecode [options] file...
+//
+/// =========================================================================
+
+#include <stdio.h>
+#include <qcoreapplication.h>
+#include <qstringlist.h>
+#include <qdatetime.h>
+#include <qelapsedtimer.h>
+
+#include "otcd_decode.h"
+#include "otcd_pool.h"
+
+
+/// Segments decoded ahead of the merge, per thread
+#define OTCD_WINDOW                         4
+
+
+static const char usage[] =
+    "usage: otcdecode [options] file...\n"
+    "  Decodes the records of a raw capture (debug.bin) or of .otc capture files.\n"
+    "  Consecutive .otc files of a capture are decoded as one stream.\n"
+    "  -f, --format text|csv|bintex     output format (text)\n"
+    "  --id <id>                        only this ALP id (0x04, 4)\n"
+    "  --cmd <cmd>                      only this ALP command\n"
+    "  --from <time>, --to <time>       time range, ms since 1970 or yyyy-MM-ddThh:mm:ss\n"
+    "                                   (.otc files only)\n"
+    "  --crc ok|bad|all                 records with a good, a bad or any CRC (all)\n"
+    "  -j, --threads <n>                decoding threads (one per core)\n"
+    "  -v                               statistics on stderr\n";
+
+
+class otcdStats
+{
+public :
+    otcdStats()                     {ok = 0; bad = 0; errors = 0; rescans = 0; badBlocks = 0;}
+
+    qint64                  ok;
+    qint64                  bad;
+    qint64                  errors;
+    qint64                  rescans;    ///< records parsed again by the merge
+    int                     badBlocks;
+
+    void count(const otcdRecord& r)
+    {
+        if (r.kind == OTCD_RECORD_OK)
+            ok++;
+        else if (r.kind == OTCD_RECORD_BAD)
+            bad++;
+        else
+            errors++;
+    }
+};
+
+static bool parseTime(const QString& s, qint64& t)
+{
+    bool        ok;
+    QDateTime   d;
+
+    t = s.toLongLong(&ok);
+    if (ok)
+        return TRUE;
+
+    d = QDateTime::fromString(s, Qt::ISODate);
+    if (!d.isValid())
+        return FALSE;
+
+    t = d.toMSecsSinceEpoch();
+    return TRUE;
+}
+
+static bool parseByte(const QString& s, int& v)
+{
+    bool ok;
+
+    v = s.toInt(&ok, 0);
+    return ok && (v >= 0) && (v <= 0xFF);
+}
+
+static void output(const char* data, int len)
+{
+    if (len > 0)
+        fwrite(data, 1, len, stdout);
+}
+
+// Merges one decoded segment. pos is where the parser of the whole stream
+// is: the records of the segment are used once its parser agrees, the
+// records before that are found again here.
+static void merge(otcdSegment* s, const otcdOptions& opt, qint64& pos, otcdStats& stats)
+{
+    if (!s->contiguous)
+        pos = s->start;
+
+    while (pos < s->scanEnd)
+    {
+        otcdRecord  r;
+        otcd_next_t res;
+        int         index;
+
+        if (s->aligned(pos, index))
+        {
+            const otcdRecord* rec = s->records.constData();
+
+            for (int i=index; i<s->records.count(); i++)
+            {
+                output(s->text.constData() + rec[i].textFrom, rec[i].textLen);
+                stats.count(rec[i]);
+            }
+            pos = s->scanEnd;
+            break;
+        }
+
+        res = s->next(pos, r);
+        if ((res == OTCD_NEXT_NONE) || (r.start >= s->end))
+        {
+            pos = qMax(pos, s->end);
+            break;
+        }
+        if (res == OTCD_NEXT_CUT)
+        {
+            pos = s->start + s->size;
+            break;
+        }
+
+        QByteArray out;
+        s->format(r, opt, out);
+        output(out.constData(), out.size());
+        stats.count(r);
+        stats.rescans++;
+        pos = r.end;
+    }
+
+    stats.badBlocks += s->badBlocks;
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication    app(argc, argv);
+    QStringList         args = app.arguments();
+    otcdOptions         opt;
+    otcdInput           input;
+    otcdStats           stats;
+    QElapsedTimer       timer;
+    int                 threads = QThread::idealThreadCount();
+    bool                verbose = FALSE;
+    QString             error;
+    qint64              pos = 0;
+
+    for (int i=1; i<args.count(); i++)
+    {
+        QString a       = args[i];
+        QString value   = (i + 1 < args.count()) ? args[i + 1] : QString();
+        bool    ok      = TRUE;
+
+        if ((a == "-f") || (a == "--format"))
+        {
+            if (value == "text")            opt.format = OTCD_FORMAT_TEXT;
+            else if (value == "csv")        opt.format = OTCD_FORMAT_CSV;
+            else if (value == "bintex")     opt.format = OTCD_FORMAT_BINTEX;
+            else                            ok = FALSE;
+            i++;
+        }
+        else if (a == "--id")
+        {
+            ok = parseByte(value, opt.id);
+            i++;
+        }
+        else if (a == "--cmd")
+        {
+            ok = parseByte(value, opt.cmd);
+            i++;
+        }
+        else if (a == "--from")
+        {
+            ok = parseTime(value, opt.from);
+            i++;
+        }
+        else if (a == "--to")
+        {
+            ok = parseTime(value, opt.to);
+            i++;
+        }
+        else if (a == "--crc")
+        {
+            opt.ok  = (value == "ok")  || (value == "all");
+            opt.bad = (value == "bad") || (value == "all");
+            ok      = opt.ok || opt.bad;
+            i++;
+        }
+        else if ((a == "-j") || (a == "--threads"))
+        {
+            threads = value.toInt(&ok);
+            ok      = ok && (threads > 0);
+            i++;
+        }
+        else if (a == "-v")
+        {
+            verbose = TRUE;
+        }
+        else if (a.startsWith("-"))
+        {
+            ok = FALSE;
+        }
+        else if (!input.add(a, error))
+        {
+            fprintf(stderr, "otcdecode: %s\n", error.toLocal8Bit().constData());
+            return 1;
+        }
+
+        if (!ok)
+        {
+            fprintf(stderr, "otcdecode: bad option %s %s\n%s",
+                    a.toLocal8Bit().constData(), value.toLocal8Bit().constData(), usage);
+            return 1;
+        }
+    }
+
+    input.cut(opt);
+    if (input.segments.isEmpty())
+    {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    static char outbuf[1 << 20];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    if (opt.format == OTCD_FORMAT_CSV)
+        printf("offset,time,seq,id,cmd,chunk,crc,length,data\n");
+
+    timer.start();
+    {
+        otcdPool    pool(threads, opt);
+        int         window  = threads * OTCD_WINDOW;
+        int         count   = input.segments.count();
+        int         sent    = 0;
+
+        // Segments are decoded ahead of the merge, up to the window: the
+        // memory used does not depend on the size of the input.
+        for (int i=0; i<count; i++)
+        {
+            for (; (sent < count) && (sent < i + window); sent++)
+                pool.submit(input.segments[sent]);
+
+            pool.wait(input.segments[i]);
+            merge(input.segments[i], opt, pos, stats);
+            input.segments[i]->release();
+        }
+
+        if (verbose)
+            fprintf(stderr, "%s", pool.getStatus().toLocal8Bit().constData());
+    }
+    fflush(stdout);
+
+    if (verbose)
+    {
+        qint64 ms = qMax(timer.elapsed(), (qint64)1);
+
+        fprintf(stderr, "%lld records, %lld bad CRC, %lld bad headers, %lld parsed again, %d bad blocks.\n",
+                stats.ok + stats.bad, stats.bad, stats.errors, stats.rescans, stats.badBlocks);
+        fprintf(stderr, "%lld bytes in %lld ms (%.1f MB/s) with %d threads.\n",
+                input.bytes, ms, (double)input.bytes / 1000.0 / ms, threads);
+    }
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otcd_pool.cpp
+/// @brief          Offline decoder: work stealing thread pool
+//
+/// =========================================================================
+
+#include "otcd_pool.h"
+
+
+// ---------------------------------------- //
+//                                          //
+//              WORKER                      //
+//                                          //
+// ---------------------------------------- //
+
+otcdWorker::otcdWorker(otcdPool* pool, int index)
+{
+    m_pool      = pool;
+    m_index     = index;
+    m_decoded   = 0;
+    m_stolen    = 0;
+}
+
+void otcdWorker::run()
+{
+    otcdSegment* s;
+
+    while ((s = m_pool->take(m_index)) != NULL)
+    {
+        s->decode(m_pool->m_opt);
+        m_decoded++;
+        m_pool->finished(s);
+    }
+}
+
+
+// ---------------------------------------- //
+//                                          //
+//              POOL                        //
+//                                          //
+// ---------------------------------------- //
+
+otcdPool::otcdPool(int threads, const otcdOptions& opt) : m_opt(opt)
+{
+    m_pending   = 0;
+    m_next      = 0;
+    m_running   = TRUE;
+
+    for (int i=0; i<threads; i++)
+        m_workers.append(new otcdWorker(this, i));
+    for (int i=0; i<threads; i++)
+        m_workers[i]->start();
+}
+
+otcdPool::~otcdPool()
+{
+    m_mutex.lock();
+    m_running = FALSE;
+    m_work.wakeAll();
+    m_mutex.unlock();
+
+    for (int i=0; i<m_workers.count(); i++)
+    {
+        m_workers[i]->wait();
+        delete m_workers[i];
+    }
+}
+
+/** @brief  Gives a segment to the workers, from the main thread
+  * @param  s       (otcdSegment*) segment, decoded by one of the workers
+  */
+void otcdPool::submit(otcdSegment* s)
+{
+    otcdWorker* w = m_workers[m_next];
+
+    m_next = (m_next + 1) % m_workers.count();
+
+    // Counted before it is seen in a queue: take() never makes it negative
+    m_mutex.lock();
+    m_pending++;
+    w->m_mutex.lock();
+    w->m_queue.append(s);
+    w->m_mutex.unlock();
+    m_work.wakeOne();
+    m_mutex.unlock();
+}
+
+/** @brief  Waits until a segment is decoded
+  * @param  s       (otcdSegment*) segment given to submit()
+  */
+void otcdPool::wait(otcdSegment* s)
+{
+    m_mutex.lock();
+    while (!s->done)
+        m_done.wait(&m_mutex);
+    m_mutex.unlock();
+}
+
+// Next segment for a worker, NULL when the pool is deleted
+otcdSegment* otcdPool::take(int index)
+{
+    int n = m_workers.count();
+
+    for (;;)
+    {
+        otcdSegment* s = NULL;
+
+        // Own queue, oldest first
+        otcdWorker* w = m_workers[index];
+        w->m_mutex.lock();
+        if (!w->m_queue.isEmpty())
+            s = w->m_queue.takeFirst();
+        w->m_mutex.unlock();
+
+        // Other queues, newest first
+        for (int i=1; (s == NULL) && (i<n); i++)
+        {
+            otcdWorker* v = m_workers[(index + i) % n];
+            v->m_mutex.lock();
+            if (!v->m_queue.isEmpty())
+            {
+                s = v->m_queue.takeLast();
+                w->m_stolen++;
+            }
+            v->m_mutex.unlock();
+        }
+
+        m_mutex.lock();
+        if (s != NULL)
+        {
+            m_pending--;
+            m_mutex.unlock();
+            return s;
+        }
+
+        // A segment submitted after the queues were seen empty is counted
+        // in m_pending before the wake up: it is not missed.
+        if (m_pending == 0)
+        {
+            if (!m_running)
+            {
+                m_mutex.unlock();
+                return NULL;
+            }
+            m_work.wait(&m_mutex);
+        }
+        m_mutex.unlock();
+    }
+}
+
+void otcdPool::finished(otcdSegment* s)
+{
+    m_mutex.lock();
+    s->done = TRUE;
+    m_done.wakeAll();
+    m_mutex.unlock();
+}
+
+QString otcdPool::getStatus()
+{
+    QString ret;
+
+    for (int i=0; i<m_workers.count(); i++)
+    {
+        ret += QString("Worker %1: %2 segments, %3 stolen.\n")
+                    .arg(i).arg(m_workers[i]->m_decoded).arg(m_workers[i]->m_stolen);
+    }
+
+    return ret;
+}
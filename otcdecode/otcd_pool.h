@@ -0,0 +1,94 @@
+/// @copyright
+//
+/// =========================================================================
+/// Copyright 2012 WizziLab
+///
+/// Licensed under the Apache License, Version 2.0 (the License);
+/// you may not use this file except in compliance with the License.
+/// You may obtain a copy of the License at
+///
+/// http://www.apache.org/licenses/LICENSE-2.0
+///
+/// Unless required by applicable law or agreed to in writing, software
+/// distributed under the License is distributed on an AS IS BASIS,
+/// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+/// See the License for the specific language governing permissions and
+/// limitations under the License.
+/// =========================================================================
+//
+/// @endcopyright
+//
+/// @file           otcd_pool.h
+/// @brief          Offline decoder: work stealing thread pool
+//
+/// =========================================================================
+///
+/// Every worker has its own queue of segments, filled in turn by the main
+/// thread. A worker takes the oldest segment of its own queue, the one the
+/// merge will need first. When its queue is empty, it takes the newest
+/// segment of another queue, the one the merge needs last. Segments do not
+/// cost the same (a compressed block, a bad part of the file), so without
+/// stealing the merge would wait for the slowest queue.
+///
+/// =========================================================================
+
+#ifndef __OTCD_POOL_H__
+#define __OTCD_POOL_H__
+
+#include <qthread.h>
+#include <qmutex.h>
+#include <qlist.h>
+#include <QWaitCondition>
+
+#include "otcd_decode.h"
+
+
+class otcdPool;
+
+class otcdWorker : public QThread
+{
+public :
+    otcdWorker(otcdPool* pool, int index);
+
+    QMutex                  m_mutex;
+    QList<otcdSegment*>     m_queue;
+    unsigned int            m_decoded;
+    unsigned int            m_stolen;
+
+    void                    run();
+
+protected :
+    otcdPool*               m_pool;
+    int                     m_index;
+};
+
+
+class otcdPool
+{
+public :
+    otcdPool(int threads, const otcdOptions& opt);
+    ~otcdPool();
+
+    void                    submit(otcdSegment* s);
+    void                    wait(otcdSegment* s);
+    int                     threads()       {return m_workers.count();}
+    QString                 getStatus();
+
+protected :
+    friend class otcdWorker;
+
+    const otcdOptions&      m_opt;
+    QList<otcdWorker*>      m_workers;
+    QMutex                  m_mutex;
+    QWaitCondition          m_work;
+    QWaitCondition          m_done;
+    int                     m_pending;  ///< segments in the queues
+    int                     m_next;     ///< queue of the next segment
+    bool                    m_running;
+
+    otcdSegment*            take(int index);
+    void                    finished(otcdSegment* s);
+};
+
+
+#endif // __OTCD_POOL_H__
@@ -0,0 +1,21 @@
+TARGET = otcdecode
+DEPENDPATH += . .. ../bintex/
+INCLUDEPATH += . .. ../bintex/
+unix:DESTDIR = ../../bin
+QT -= gui
+CONFIG += console
+CONFIG -= app_bundle
+LIBS += -lz
+
+# Input
+HEADERS += otcd_decode.h \
+    otcd_pool.h \
+    ../otc_mpipe.h \
+    ../otc_capture.h \
+    ../otc_hex.h \
+    ../bintex/bintex.h
+SOURCES += otcd_main.cpp \
+    otcd_decode.cpp \
+    otcd_pool.cpp \
+    ../otc_hex.cpp \
+    ../bintex/bintex.c